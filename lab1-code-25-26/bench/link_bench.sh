@@ -0,0 +1,168 @@
+#!/bin/bash
+# Link throughput/efficiency benchmark.
+# Sends a file through the virtual cable for a sweep of configurations, driving
+# the cable through its command interface, and writes one CSV row per run: the
+# measured efficiency S next to the frame error rate, the propagation ratio a,
+# and the theoretical stop-and-wait, Go-Back-N and Selective Repeat values.
+#
+# Usage: bench/link_bench.sh [results.csv]   (from the project folder, after make)
+#
+# Every list below is swept with the other settings at their BASE_ value, for
+# each ARQ mode. Override any of them from the environment, e.g.
+#   MODES="saw sr" BERS="0 1e-4" bench/link_bench.sh
+#
+# S counts payload bytes per byte time of the line (the start and stop bits of
+# 8-N-1 are left out), so it is comparable with the textbook formulas:
+#   a = Tprop / Tframe, p = 1 - (1 - BER)^(frame bits)
+#   stop-and-wait: (1 - p) / (1 + 2a)
+#   Go-Back-N:     (1 - p) / (1 + 2ap)                 if W >= 1 + 2a
+#                  W(1 - p) / ((1 + 2a)(1 - p + Wp))   otherwise
+#   Sel. Repeat:   1 - p                               if W >= 1 + 2a
+#                  W(1 - p) / (1 + 2a)                 otherwise
+#
+# BASELINE=<earlier results.csv> lists the runs whose S dropped by more than
+# REGRESSION (default 10%) and exits with status 1 if there are any.
+
+set -u
+cd "$(dirname "$0")/.." || exit 1
+
+RESULTS=${1:-bench/results.csv}
+FILE=${FILE:-penguin.gif}
+CHECK=${CHECK:-crc32}
+MODES=${MODES:-saw gbn sr}
+BASE_BAUD=${BASE_BAUD:-38400}
+BAUDS=${BAUDS:-9600 19200 38400 57600 115200}
+BASE_BER=${BASE_BER:-0}
+BERS=${BERS:-0 1e-5 3e-5 1e-4 3e-4}
+BASE_PROP=${BASE_PROP:-0}
+PROPS=${PROPS:-0 20000 50000 100000 200000}
+BASE_SIZE=${BASE_SIZE:-1000}
+SIZES=${SIZES:-300 500 1000 2000 4096}
+RUN_TIMEOUT=${RUN_TIMEOUT:-180}
+REGRESSION=${REGRESSION:-0.10}
+CABLE=${CABLE:-sudo ./bin/cable}
+TX_PORT=${TX_PORT:-/dev/ttyS10}
+RX_PORT=${RX_PORT:-/dev/ttyS11}
+
+if [ ! -x bin/main ] || [ ! -x bin/cable ] || [ ! -f "$FILE" ]; then
+    echo "Error: build with make first; $FILE must exist" >&2
+    exit 1
+fi
+
+WORK=$(mktemp -d)
+mkfifo "$WORK/cable.in"
+$CABLE < "$WORK/cable.in" > "$WORK/cable.log" 2>&1 &
+exec 3> "$WORK/cable.in"
+
+# The cable reads each command with a single read(), so leave a gap between them
+cable() {
+    echo "$1" >&3
+    sleep 0.3
+}
+
+cleanup() {
+    cable quit
+    exec 3>&-
+    wait
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+for _ in $(seq 50); do
+    grep -q "Cable ready" "$WORK/cable.log" && break
+    sleep 0.2
+done
+if ! grep -q "Cable ready" "$WORK/cable.log"; then
+    echo "Error: the cable did not start:" >&2
+    cat "$WORK/cable.log" >&2
+    exit 1
+fi
+
+# Value of column "$2" in the data row of the --stats CSV file "$1"
+field() {
+    awk -F, -v name="$2" 'NR == 1 { for (i = 1; i <= NF; i++) if ($i == name) c = i } NR == 2 { print $c }' "$1"
+}
+
+echo "mode,window,baud,ber,prop_us,payload,result,elapsed_s,frames_sent,retransmissions,fer,a,s_measured,s_saw,s_gbn,s_sr" > "$RESULTS"
+
+# run MODE BAUD BER PROP_US PAYLOAD (the base configuration is part of every sweep; run it once)
+declare -A measured
+run() {
+    local mode=$1 baud=$2 ber=$3 prop=$4 size=$5
+    [ -n "${measured[$*]:-}" ] && return
+    measured[$*]=1
+    cable "baud $baud"
+    cable "prop $prop"
+    cable "ber $ber"
+    rm -f "$WORK/tx.csv" "$WORK/received"
+
+    timeout "$RUN_TIMEOUT" ./bin/main "$RX_PORT" "$baud" rx "$WORK/received" --log error > "$WORK/rx.log" 2>&1 &
+    local rxPid=$!
+    sleep 0.5
+    timeout "$RUN_TIMEOUT" ./bin/main "$TX_PORT" "$baud" tx "$FILE" --arq "$mode" --check "$CHECK" \
+        --payload "$size" --fixed --stats "$WORK/tx.csv" --log error > "$WORK/tx.log" 2>&1
+    wait $rxPid
+
+    local result=ok
+    cmp -s "$FILE" "$WORK/received" || result=failed
+    if [ ! -f "$WORK/tx.csv" ]; then
+        echo "$mode,,$baud,$ber,$prop,$size,failed,,,,,,,,," >> "$RESULTS"
+        echo "  $mode baud=$baud ber=$ber prop=${prop}us payload=$size: failed"
+        return
+    fi
+
+    awk -v mode="$mode" -v baud="$baud" -v ber="$ber" -v prop="$prop" -v size="$size" -v result="$result" \
+        -v window="$(field "$WORK/tx.csv" windowSize)" \
+        -v elapsed="$(field "$WORK/tx.csv" elapsedSeconds)" \
+        -v sent="$(field "$WORK/tx.csv" framesSent)" \
+        -v retx="$(field "$WORK/tx.csv" retransmissions)" \
+        -v failed="$(( $(field "$WORK/tx.csv" rejReceived) + $(field "$WORK/tx.csv" timeouts) ))" \
+        -v payload="$(field "$WORK/tx.csv" payloadBytes)" \
+        -v stuffed="$(field "$WORK/tx.csv" stuffedBytes)" '
+    function min(x, y) { return x < y ? x : y }
+    BEGIN {
+        frameBytes = (sent > 0 ? stuffed / sent : size) + 6   # header, BCC1 and flags
+        frameTime = frameBytes * 10 / baud
+        a = prop / 1e6 / frameTime
+        p = 1 - (1 - ber) ^ (8 * frameBytes)
+        w = window > 0 ? window : 1
+
+        saw = (1 - p) / (1 + 2 * a)
+        gbn = (w >= 1 + 2 * a) ? (1 - p) / (1 + 2 * a * p) : w * (1 - p) / ((1 + 2 * a) * (1 - p + w * p))
+        sr = (w >= 1 + 2 * a) ? 1 - p : min(1 - p, w * (1 - p) / (1 + 2 * a))
+        s = elapsed > 0 ? payload * 10 / (elapsed * baud) : 0
+        fer = sent > 0 ? failed / sent : 0
+
+        printf "%s,%d,%d,%s,%d,%d,%s,%.3f,%d,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+               mode, window, baud, ber, prop, size, result, elapsed, sent, retx, fer, a, s, saw, gbn, sr
+    }' >> "$RESULTS"
+    echo "  $(tail -n 1 "$RESULTS")"
+}
+
+for mode in $MODES; do
+    echo "== $mode: BER =="
+    for ber in $BERS; do run "$mode" "$BASE_BAUD" "$ber" "$BASE_PROP" "$BASE_SIZE"; done
+    echo "== $mode: propagation delay =="
+    for prop in $PROPS; do run "$mode" "$BASE_BAUD" "$BASE_BER" "$prop" "$BASE_SIZE"; done
+    echo "== $mode: frame size =="
+    for size in $SIZES; do run "$mode" "$BASE_BAUD" "$BASE_BER" "$BASE_PROP" "$size"; done
+    echo "== $mode: baud rate =="
+    for baud in $BAUDS; do run "$mode" "$baud" "$BASE_BER" "$BASE_PROP" "$BASE_SIZE"; done
+done
+echo "Results written to $RESULTS"
+
+if [ -n "${BASELINE:-}" ]; then
+    # Match runs on mode, baud, BER, delay and payload; compare s_measured
+    awk -F, -v limit="$REGRESSION" '
+    FNR == 1 { next }
+    NR == FNR { old[$1 "," $3 "," $4 "," $5 "," $6] = $13; next }
+    {
+        key = $1 "," $3 "," $4 "," $5 "," $6
+        if ((key in old) && old[key] > 0 && ($7 != "ok" || $13 < old[key] * (1 - limit))) {
+            printf "Regression: %s S %.4f -> %s (%s)\n", key, old[key], $13 == "" ? "-" : $13, $7
+            bad++
+        }
+    }
+    END { if (bad) exit 1; print "No regressions against the baseline" }' "$BASELINE" "$RESULTS"
+    exit $?
+fi
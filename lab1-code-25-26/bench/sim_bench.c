@@ -0,0 +1,314 @@
+// Link sweep on the simulated channel.
+// The same sweep as link_bench.sh, but every transfer runs through the
+// in-process simulated channel in virtual time instead of the cable, so no
+// socat, sudo or real-time pacing is needed and a configuration takes
+// milliseconds. Each run forks a receiver and a transmitter, which sends the
+// file with the link layer directly (fixed payload, like the cable sweep), and
+// checks what arrived.
+// One CSV row per run, with the same columns as link_bench.sh.
+//
+// Usage: ./bin/bench_sim [file] [results.csv]
+//
+// Unlike link_bench.sh, the lists below are swept as a full grid (every
+// combination), SEEDS times each with different bit errors. Override any of
+// them from the environment, e.g.
+//   MODES="saw sr" BERS="0 1e-4" SEEDS=10 ./bin/bench_sim
+// Exits with status 1 if any transfer delivered different data.
+
+#include "../src/link_layer.h"
+#include "../src/sim_channel.h"
+#include "../src/trace.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_VALUES 32
+#define N_TRIES 3 // as main.c
+#define TIMEOUT 4
+
+typedef struct
+{
+    const char *name;
+    double values[MAX_VALUES];
+    int count;
+} Sweep;
+
+// Fill "sweep" from the environment variable of its name, or "fallback".
+// Returns 0 on success or -1 if a value is not a number.
+static int parseSweep(Sweep *sweep, const char *name, const char *fallback)
+{
+    const char *text = getenv(name);
+    char copy[512];
+    snprintf(copy, sizeof(copy), "%s", text != NULL ? text : fallback);
+
+    sweep->name = name;
+    sweep->count = 0;
+    for (char *word = strtok(copy, " ,"); word != NULL && sweep->count < MAX_VALUES; word = strtok(NULL, " ,"))
+    {
+        if (strcmp(name, "MODES") == 0) {
+            if (strcmp(word, "saw") == 0) sweep->values[sweep->count++] = LlStopAndWait;
+            else if (strcmp(word, "gbn") == 0) sweep->values[sweep->count++] = LlGoBackN;
+            else if (strcmp(word, "sr") == 0) sweep->values[sweep->count++] = LlSelectiveRepeat;
+            else return -1;
+            continue;
+        }
+        char *end;
+        sweep->values[sweep->count++] = strtod(word, &end);
+        if (*end != '\0') return -1;
+    }
+    return sweep->count > 0 ? 0 : -1;
+}
+
+// Load the whole file into memory.
+// Returns the buffer (to be freed) and its size in *size, or NULL on error.
+static unsigned char *loadFile(const char *path, long *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    rewind(f);
+
+    unsigned char *data = malloc(*size > 0 ? *size : 1);
+    if (data != NULL && fread(data, 1, *size, f) != (size_t)*size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+static LinkLayer linkSettings(const char *port, LinkLayerRole role, int baud)
+{
+    LinkLayer ll;
+    memset(&ll, 0, sizeof(ll));
+    snprintf(ll.serialPort, sizeof(ll.serialPort), "%s", port);
+    ll.role = role;
+    ll.baudRate = baud;
+    ll.nRetransmissions = N_TRIES;
+    ll.timeout = TIMEOUT;
+    return ll;
+}
+
+// Receiver end: accept any mode, copy the data into "received" (shared with
+// the parent) and exit with 0 if all "size" bytes arrived
+static void receive(int baud, unsigned char *received, long size)
+{
+    LinkLayer ll = linkSettings("sim:1", LlRx, baud);
+    ll.arqMode = LlSelectiveRepeat;
+    if (llopen(ll) < 0) _exit(1);
+
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    long got = 0;
+    while (got < size)
+    {
+        int n = llread(packet);
+        if (n < 0 && simChannelStalled()) break;
+        if (n <= 0) continue;
+        if (got + n > size) break;
+        memcpy(received + got, packet, n);
+        got += n;
+    }
+
+    if (got == size) llclose(LlRx);
+    else llabort();
+    _exit(got == size ? 0 : 1);
+}
+
+// Transmitter end, in a process of its own so every run starts from fresh
+// link-layer state (after llabort the statistics keep counting, for a
+// reconnection). Leaves the statistics in "stats" (shared with the parent)
+// and exits with 0 if every byte was sent and acknowledged and the connection
+// closed.
+static void transmit(LinkLayerArqMode mode, LinkLayerFrameCheck check, int baud, int payload,
+                    const unsigned char *data, long size, LinkLayerStatistics *stats)
+{
+    LinkLayer ll = linkSettings("sim:0", LlTx, baud);
+    ll.arqMode = mode;
+    ll.frameCheck = check;
+    ll.maxPayload = payload;
+    ll.fixedPayload = 1;
+
+    if (llopen(ll) < 0) {
+        llstatistics(stats);
+        _exit(1);
+    }
+
+    long sent = 0;
+    while (sent < size)
+    {
+        int n = llpayloadSize();
+        if (n > size - sent) n = size - sent;
+        if (llwrite(data + sent, n) < 0) break;
+        sent += n;
+    }
+
+    int result;
+    if (sent < size) {
+        llabort();
+        result = -1;
+    }
+    else result = llclose(LlTx) == 0 ? 0 : -1;
+    llstatistics(stats);
+    _exit(result == 0 ? 0 : 1);
+}
+
+static double min(double x, double y)
+{
+    return x < y ? x : y;
+}
+
+// One transfer. Returns 1 if the data arrived intact, 0 if the link gave up,
+// -1 if it delivered different data (or the run could not be set up).
+static int run(FILE *out, LinkLayerArqMode mode, LinkLayerFrameCheck check, int baud, double ber,
+               long propUs, int payload, unsigned long long seed, const unsigned char *data,
+               unsigned char *received, long size, LinkLayerStatistics *stats)
+{
+    static const char *modeNames[] = {"saw", "gbn", "sr"};
+
+    SimChannelConfig config = {.baudRate = baud, .delayUs = propUs, .ber = ber, .seed = seed};
+    if (simChannelCreate(&config) < 0) return -1;
+    memset(received, 0, size);
+
+    // Both ends print their progress; keep it out of the results
+    fflush(stdout);
+    fflush(stderr);
+    int savedOut = dup(STDOUT_FILENO);
+    int savedErr = dup(STDERR_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+    close(devNull);
+
+    memset(stats, 0, sizeof(*stats));
+    pid_t rx = fork();
+    if (rx == 0) receive(baud, received, size);
+    pid_t tx = (rx > 0) ? fork() : -1;
+    if (tx == 0) transmit(mode, check, baud, payload, data, size, stats);
+    if (rx > 0 && tx < 0) kill(rx, SIGKILL);
+
+    int status = 0, txStatus = 0;
+    if (rx > 0) waitpid(rx, &status, 0);
+    if (tx > 0) waitpid(tx, &txStatus, 0);
+    int sent = (WIFEXITED(txStatus) && WEXITSTATUS(txStatus) == 0) ? 0 : -1;
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(savedOut, STDOUT_FILENO);
+    dup2(savedErr, STDERR_FILENO);
+    close(savedOut);
+    close(savedErr);
+    if (rx < 0 || tx < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    int delivered = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    int intact = delivered && memcmp(data, received, size) == 0;
+    const char *result = intact ? (sent == 0 ? "ok" : "unclosed") : (delivered ? "corrupt" : "failed");
+
+    // Theoretical efficiencies, as in link_bench.sh
+    double frameBytes = (stats->framesSent > 0 ? (double)stats->stuffedBytes / stats->framesSent : payload) + 6;
+    double frameTime = frameBytes * 10 / baud;
+    double a = propUs / 1e6 / frameTime;
+    double p = 1 - pow(1 - ber, 8 * frameBytes);
+    int w = stats->windowSize > 0 ? stats->windowSize : 1;
+    double saw = (1 - p) / (1 + 2 * a);
+    double gbn = (w >= 1 + 2 * a) ? (1 - p) / (1 + 2 * a * p) : w * (1 - p) / ((1 + 2 * a) * (1 - p + w * p));
+    double sr = (w >= 1 + 2 * a) ? 1 - p : min(1 - p, w * (1 - p) / (1 + 2 * a));
+    double s = stats->elapsedSeconds > 0 ? stats->payloadBytes * 10 / (stats->elapsedSeconds * baud) : 0;
+    double fer = stats->framesSent > 0 ? (double)(stats->rejReceived + stats->timeouts) / stats->framesSent : 0;
+
+    fprintf(out, "%s,%d,%d,%g,%ld,%d,%s,%.3f,%ld,%ld,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+            modeNames[mode], stats->windowSize, baud, ber, propUs, payload, result, stats->elapsedSeconds,
+            stats->framesSent, stats->retransmissions, fer, a, s, saw, gbn, sr);
+
+    if (!intact && delivered) return -1;
+    return intact;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : "penguin.gif";
+    const char *resultsPath = argc > 2 ? argv[2] : "bench/sim_results.csv";
+
+    Sweep modes, bauds, bers, props, sizes;
+    if (parseSweep(&modes, "MODES", "saw gbn sr") < 0 ||
+        parseSweep(&bauds, "BAUDS", "9600 19200 38400 57600 115200") < 0 ||
+        parseSweep(&bers, "BERS", "0 1e-5 3e-5 1e-4 3e-4") < 0 ||
+        parseSweep(&props, "PROPS", "0 20000 50000 100000 200000") < 0 ||
+        parseSweep(&sizes, "SIZES", "300 500 1000 2000 4096") < 0)
+    {
+        fprintf(stderr, "Error: MODES takes saw, gbn and sr; BAUDS, BERS, PROPS and SIZES take numbers\n");
+        return 1;
+    }
+    int seeds = getenv("SEEDS") != NULL ? atoi(getenv("SEEDS")) : 1;
+    const char *checkName = getenv("CHECK") != NULL ? getenv("CHECK") : "crc32";
+    LinkLayerFrameCheck check = strcmp(checkName, "xor") == 0 ? LlCheckXor
+                              : strcmp(checkName, "crc16") == 0 ? LlCheckCrc16 : LlCheckCrc32;
+
+    long size;
+    unsigned char *data = loadFile(path, &size);
+    if (data == NULL) {
+        perror(path);
+        return 1;
+    }
+    // The receiver and transmitter write here from their own processes
+    unsigned char *received = mmap(NULL, size > 0 ? size : 1, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    LinkLayerStatistics *stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    FILE *out = fopen(resultsPath, "w");
+    if (received == MAP_FAILED || stats == MAP_FAILED || out == NULL) {
+        perror(out == NULL ? resultsPath : "mmap");
+        return 1;
+    }
+    fprintf(out, "mode,window,baud,ber,prop_us,payload,result,elapsed_s,frames_sent,retransmissions,fer,a,s_measured,s_saw,s_gbn,s_sr\n");
+
+    // Only errors get to the console
+    traceSetLevel(TRACE_ERROR);
+
+    int runs = 0, intact = 0, corrupt = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int m = 0; m < modes.count; m++)
+    for (int b = 0; b < bauds.count; b++)
+    for (int e = 0; e < bers.count; e++)
+    for (int d = 0; d < props.count; d++)
+    for (int z = 0; z < sizes.count; z++)
+    for (int seed = 1; seed <= seeds; seed++)
+    {
+        int result = run(out, (LinkLayerArqMode)modes.values[m], check, (int)bauds.values[b],
+                         bers.values[e], (long)props.values[d], (int)sizes.values[z], seed,
+                         data, received, size, stats);
+        runs++;
+        if (result > 0) intact++;
+        if (result < 0) corrupt++;
+        if (runs % 100 == 0) {
+            printf("\r%d runs", runs);
+            fflush(stdout);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("\r%d runs in %.1f s: %d delivered intact, %d gave up, %d delivered corrupt data\n",
+           runs, seconds, intact, runs - intact - corrupt, corrupt);
+    printf("Results written to %s\n", resultsPath);
+
+    fclose(out);
+    simChannelDestroy();
+    munmap(received, size > 0 ? size : 1);
+    munmap(stats, sizeof(*stats));
+    free(data);
+    return corrupt > 0 ? 1 : 0;
+}
@@ -0,0 +1,186 @@
+// Byte-stuffing micro-benchmark.
+// Compares the stuffing kernels against the original byte-at-a-time loops on
+// frame-sized blocks of a file (default: penguin.gif) or of random bytes, and
+// checks that every kernel produces the same output.
+//
+// Usage: ./bin/bench_stuffing [file] [iterations]
+
+#include "../src/stuffing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SIZE 1000 // MAX_PAYLOAD_SIZE
+#define DEFAULT_ITERATIONS 2000
+
+// -------------------- REFERENCE --------------------
+
+// The loops link_layer.c used before the vector kernels
+static int stuffReference(const unsigned char *data, int size, unsigned char *dest)
+{
+    int j = 0;
+    for (int i = 0; i < size; i++)
+    {
+        if (data[i] == 0x7E) {
+            dest[j++] = 0x7D;
+            dest[j++] = 0x5E;
+        }
+        else if (data[i] == 0x7D) {
+            dest[j++] = 0x7D;
+            dest[j++] = 0x5D;
+        }
+        else {
+            dest[j++] = data[i];
+        }
+    }
+    return j;
+}
+
+static int destuffReference(const unsigned char *data, int size, unsigned char *dest)
+{
+    int j = 0;
+    for (int i = 0; i < size; i++)
+    {
+        if (data[i] == 0x7D)
+        {
+            i++;
+            if (i < size) {
+                dest[j++] = (data[i] == 0x5E) ? 0x7E : 0x7D;
+            }
+        }
+        else {
+            dest[j++] = data[i];
+        }
+    }
+    return j;
+}
+
+// -------------------- HELPERS --------------------
+
+typedef int (*Codec)(const unsigned char *data, int size, unsigned char *dest);
+
+static double nowSeconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Run "codec" over every block of "input" "iterations" times.
+// Returns the throughput in MB/s of input consumed.
+static double measure(Codec codec, const unsigned char *input, const int *sizes, int nBlocks,
+                      int blockStride, unsigned char *output, int iterations)
+{
+    long long total = 0;
+    double start = nowSeconds();
+    for (int it = 0; it < iterations; it++)
+    {
+        for (int b = 0; b < nBlocks; b++) {
+            codec(input + b * blockStride, sizes[b], output);
+            total += sizes[b];
+        }
+    }
+    double elapsed = nowSeconds() - start;
+    return total / elapsed / 1e6;
+}
+
+static unsigned char *loadInput(const char *path, long *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file != NULL)
+    {
+        fseek(file, 0, SEEK_END);
+        *size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        unsigned char *data = malloc(*size);
+        if (data != NULL && fread(data, 1, *size, file) == (size_t)*size) {
+            fclose(file);
+            printf("Input: %s (%ld bytes)\n", path, *size);
+            return data;
+        }
+        free(data);
+        fclose(file);
+    }
+
+    // No file: uniformly random bytes, like compressed data
+    *size = 64 * BLOCK_SIZE;
+    unsigned char *data = malloc(*size);
+    srand(1);
+    for (long i = 0; i < *size; i++) data[i] = rand() & 0xFF;
+    printf("Input: %ld random bytes\n", *size);
+    return data;
+}
+
+// -------------------- MAIN --------------------
+
+int main(int argc, char *argv[])
+{
+    const char *path = (argc > 1) ? argv[1] : "penguin.gif";
+    int iterations = (argc > 2) ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+    if (iterations <= 0) iterations = DEFAULT_ITERATIONS;
+
+    long inputSize;
+    unsigned char *input = loadInput(path, &inputSize);
+    if (input == NULL) {
+        printf("Error: Out of memory\n");
+        return 1;
+    }
+
+    // Split the input into payload-sized blocks and prepare their stuffed form
+    int nBlocks = (inputSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int *sizes = malloc(nBlocks * sizeof(int));
+    int *stuffedSizes = malloc(nBlocks * sizeof(int));
+    unsigned char *stuffed = malloc(nBlocks * 2 * BLOCK_SIZE);
+    unsigned char *expected = malloc(2 * BLOCK_SIZE);
+    unsigned char *output = malloc(2 * BLOCK_SIZE);
+    long escapes = 0;
+    for (int b = 0; b < nBlocks; b++) {
+        sizes[b] = (b == nBlocks - 1) ? inputSize - b * BLOCK_SIZE : BLOCK_SIZE;
+        stuffedSizes[b] = stuffReference(input + b * BLOCK_SIZE, sizes[b], stuffed + b * 2 * BLOCK_SIZE);
+        escapes += stuffedSizes[b] - sizes[b];
+    }
+    printf("Blocks: %d x %d bytes, %ld bytes escaped, %d iterations\n\n", nBlocks, BLOCK_SIZE, escapes, iterations);
+
+    printf("%-10s %12s %12s\n", "kernel", "stuff MB/s", "destuff MB/s");
+    printf("%-10s %12.1f %12.1f\n", "reference",
+           measure(stuffReference, input, sizes, nBlocks, BLOCK_SIZE, output, iterations),
+           measure(destuffReference, stuffed, stuffedSizes, nBlocks, 2 * BLOCK_SIZE, output, iterations));
+
+    const StuffKernel kernels[] = {StuffScalar, StuffSse2, StuffAvx2, StuffNeon};
+    int failures = 0;
+    for (int k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++)
+    {
+        if (stuffingSelect(kernels[k]) < 0) continue;
+
+        // Every kernel must match the reference exactly
+        for (int b = 0; b < nBlocks; b++) {
+            int n = stuffBytes(input + b * BLOCK_SIZE, sizes[b], output);
+            stuffReference(input + b * BLOCK_SIZE, sizes[b], expected);
+            if (n != stuffedSizes[b] || memcmp(output, expected, n) != 0) {
+                printf("Error: %s stuffing differs in block %d\n", stuffingKernelName(), b);
+                failures++;
+                break;
+            }
+            n = destuffBytes(stuffed + b * 2 * BLOCK_SIZE, stuffedSizes[b], output);
+            if (n != sizes[b] || memcmp(output, input + b * BLOCK_SIZE, n) != 0) {
+                printf("Error: %s destuffing differs in block %d\n", stuffingKernelName(), b);
+                failures++;
+                break;
+            }
+        }
+
+        printf("%-10s %12.1f %12.1f\n", stuffingKernelName(),
+               measure(stuffBytes, input, sizes, nBlocks, BLOCK_SIZE, output, iterations),
+               measure(destuffBytes, stuffed, stuffedSizes, nBlocks, 2 * BLOCK_SIZE, output, iterations));
+    }
+
+    free(input);
+    free(sizes);
+    free(stuffedSizes);
+    free(stuffed);
+    free(expected);
+    free(output);
+    return failures == 0 ? 0 : 1;
+}
@@ -1,27 +1,41 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates a pair of virtual Tx / Rx serial ports using "socat", or one pair
+// per link with --links <n> to test multilink striping.
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 // Modified by: Rui Prior [rcprior@fc.up.pt]
 
+#define _GNU_SOURCE // ppoll
+
 #include <fcntl.h>
 #include <math.h>
+#include <poll.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "capture.h"
+
 #define TXDEV "/dev/ttyS10"
 #define RXDEV "/dev/ttyS11"
 #define TX_EMULATOR "/dev/emulatorTx"
 #define RX_EMULATOR "/dev/emulatorRx"
 
+// With --links <n>, link k (from 0) joins /dev/ttyS(10+2k) to /dev/ttyS(11+2k)
+// through /dev/emulatorTx<k> and /dev/emulatorRx<k> (link 0: the names above)
+#define MAX_LINKS CAPTURE_MAX_LINKS
+#define FIRST_PORT 10
+#define PORT_NAME_SIZE 32
+
 // Baudrate settings are defined in <asm/termbits.h>, which is
 // included by <termios.h>
 #define BAUDRATE B9600         // For struct termios
@@ -32,32 +46,115 @@
 
 #define BUF_SIZE 2048
 
+// Bytes a port accepts ahead of the line before the sender is held back, like
+// the transmit buffer of a UART
+#define LINE_BACKLOG 4096
+
+// When a byte is due this soon (ns), stop polling the ports and sleep until
+// its exact release time
+#define SLEEP_MARGIN 200000
+
+// Release deviation histogram: bucket 0 counts bytes released less than 1 usec
+// late, bucket k (1-20) from 2^(k-1) to 2^k usec, the last one the rest
+#define JITTER_BUCKETS 22
+
+struct Jitter {
+    long long count;
+    long long sumNs;
+    long long maxNs;
+    long long buckets[JITTER_BUCKETS];
+};
+
+// Channel errors in one direction, drawn from a seeded xorshift64* generator
+// so the same traffic meets the same errors on every run. Rather than a draw
+// per bit or byte, each model draws the (geometric) distance to its next
+// event, so a clean line costs nothing.
+#define MODEL_BER 0   // independent bit errors at "ber"
+#define MODEL_BURST 1 // Gilbert-Elliott: "ber" in the good state, "badBer" in the bad one
+
+struct ErrorModel {
+    int kind;
+    double ber;
+    double badBer;
+    double toBad;       // per-bit probability of leaving the good state
+    double toGood;      // per-bit probability of leaving the bad state
+    double dropRate;    // per-byte probability of losing a byte
+    double insertRate;  // per-byte probability of adding a random byte after it
+    uint64_t seed;
+    uint64_t rng;
+    int bad;                 // in the bad state
+    long long untilError;    // bits before the next flipped one, -1 = never
+    long long untilSwitch;   // bits before the state changes, -1 = never
+    long long untilDrop;     // bytes before the next dropped one, -1 = never
+    long long untilInsert;   // bytes before the next one followed by an extra one, -1 = never
+};
+
+// Capture records buffered before they are written to the file
+#define CAPTURE_BUFFER 4096
+
+struct Capture {
+    int fd;           // -1 when not capturing
+    long long start;  // CLOCK_MONOTONIC ns
+    int used;
+    struct CaptureRecord records[CAPTURE_BUFFER];
+};
+
+// Bytes travelling in one direction: read from "fdIn" as soon as they are
+// available, each stamped with the time it leaves the cable, and written to
+// "fdOut" at that time. A ring of "capacity" bytes from "head".
+struct Direction {
+    char name[16];
+    int id;               // CAPTURE_TX2RX or CAPTURE_RX2TX, plus 2 per link
+    int link;
+    int fdIn;
+    int fdOut;
+    unsigned char *bytes;
+    long long *release;   // CLOCK_MONOTONIC ns at which each byte is written
+    uint32_t *index;      // of each byte, for the capture
+    uint32_t entered;     // bytes read from "fdIn" so far
+    struct ErrorModel errors;
+    long capacity;
+    long head;
+    long count;
+    long long lineFreeAt; // when the last byte read has been clocked onto the line
+};
+
+// One port pair
+struct Link {
+    char txDev[PORT_NAME_SIZE];
+    char rxDev[PORT_NAME_SIZE];
+    char txEmulator[PORT_NAME_SIZE];
+    char rxEmulator[PORT_NAME_SIZE];
+    int fdTx;
+    int fdRx;
+    struct termios oldtioTx;
+    struct termios oldtioRx;
+};
+
 // Current running parameters
 struct Parameters {
-    int cableOn;
-    double byteER;   // Byte error rate
-    struct timespec byteDelay;
+    int nLinks;
+    int cableOn[MAX_LINKS];
+    unsigned long baud;
+    long long byteDelay;       // ns per byte at the current baud rate
     unsigned long propDelay;   // Desired propagation delay in usec
-    int bufSize;  // Dimensioned to enforce the propagation delay
-    char *tx2rx;
-    char *tx2rxValid;  // TRUE if corresponding entry holds a byte
-    long tx2rxIdx;     // Input index for the tx2rx buffer
-    char *rx2tx;
-    char *rx2txValid;  // TRUE if corresponding entry holds a byte
-    long rx2txIdx;     // Input index for the tx2rx buffer
+    struct Direction dirs[2 * MAX_LINKS]; // Tx->Rx and Rx->Tx of each link
+    struct Jitter jitter;      // Since the last baud rate or delay change
     FILE *logfile;
 };
 
 struct Parameters par = {
-    .cableOn = TRUE,
-    .byteER = 0.0,
+    .nLinks = 1,
     .propDelay = 0,
-    .tx2rx = NULL,
-    .tx2rxValid = NULL,
-    .rx2tx = NULL,
-    .rx2txValid = NULL,
     .logfile = NULL};
 
+struct Link links[MAX_LINKS];
+
+struct Capture capture = {.fd = -1};
+
+int unreliableRate = FALSE;
+int cableIdle = TRUE;
+
 // Returns: serial port file descriptor (fd).
 int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
 {
@@ -86,39 +183,65 @@ int openSerialPort(const char *serialPort, struct termios *oldtio, struct termio
 }
 
 
-// Add noise to a buffer, by flipping the byte in the "errorIndex" position.
-void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
+long long now_ns(void)
 {
-    buf[errorIndex] ^= 0xFF;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
 
-// Initialize the ring buffers that implement the propagation delay
-// Returns 0 on success, -1 on failure
-int init_ring_buffers(void)
+// Write the buffered capture records to the file
+void flush_capture(void)
 {
-    long nsecPropDelay = 1000 * par.propDelay;
-    long bytesInFlight = nsecPropDelay / par.byteDelay.tv_nsec;
-    // Round instead of truncating
-    if (nsecPropDelay % par.byteDelay.tv_nsec > par.byteDelay.tv_nsec / 2)
+    if (capture.used > 0)
     {
-        ++bytesInFlight;
+        write(capture.fd, capture.records, capture.used * sizeof(struct CaptureRecord));
+        capture.used = 0;
     }
-    long actualPropDelay = bytesInFlight * par.byteDelay.tv_nsec / 1000; // usec
-    par.bufSize = bytesInFlight + 1;
-    par.tx2rx = realloc(par.tx2rx, par.bufSize);
-    par.tx2rxValid = realloc(par.tx2rxValid, par.bufSize);
-    par.rx2tx = realloc(par.rx2tx, par.bufSize);
-    par.rx2txValid = realloc(par.rx2txValid, par.bufSize);
-    if (par.tx2rx == NULL || par.tx2rxValid == NULL || par.rx2tx == NULL || par.rx2txValid == NULL)
+}
+
+
+// Add one event to the capture, if capturing
+void capture_event(int direction, int event, uint32_t index, unsigned char byte, unsigned char sent)
+{
+    if (capture.fd < 0) return;
+
+    struct CaptureRecord *r = &capture.records[capture.used++];
+    r->timeNs = now_ns() - capture.start;
+    r->index = index;
+    r->direction = direction;
+    r->event = event;
+    r->byte = byte;
+    r->sent = sent;
+    if (capture.used == CAPTURE_BUFFER) flush_capture();
+}
+
+
+// Size the queues for the bytes in flight (propagation delay) plus a full
+// backlog, dropping whatever was travelling.
+// Returns 0 on success, -1 on failure
+int init_ring_buffers(void)
+{
+    long bytesInFlight = (long)(1000LL * par.propDelay / par.byteDelay) + 1;
+    for (int i = 0; i < 2 * par.nLinks; i++)
     {
-        return -1;
+        struct Direction *d = &par.dirs[i];
+        d->capacity = bytesInFlight + LINE_BACKLOG;
+        d->bytes = realloc(d->bytes, d->capacity);
+        d->release = realloc(d->release, d->capacity * sizeof(long long));
+        d->index = realloc(d->index, d->capacity * sizeof(uint32_t));
+        if (d->bytes == NULL || d->release == NULL || d->index == NULL)
+        {
+            return -1;
+        }
+        d->head = 0;
+        d->count = 0;
+        d->lineFreeAt = 0;
     }
-    bzero(par.tx2rxValid, par.bufSize);
-    bzero(par.rx2txValid, par.bufSize);
-    par.tx2rxIdx = 0;
-    par.rx2txIdx = 0;
-    printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", actualPropDelay, par.propDelay);
+    memset(&par.jitter, 0, sizeof(par.jitter));
+    capture_event(CAPTURE_TX2RX, CAPTURE_PROP, par.propDelay, 0, 0);
+    printf("PROPAGATION DELAY SET TO %lu usec\n", par.propDelay);
     return 0;
 }
 
@@ -127,76 +250,352 @@ int init_ring_buffers(void)
 void set_baud_rate(unsigned long baud)
 {
     // 10 bit times per byte; delay in nanoseconds
-    double delay = 1.0e10 / baud;
-    par.byteDelay.tv_sec = 0;
-    par.byteDelay.tv_nsec = (long) delay;
+    par.baud = baud;
+    par.byteDelay = (long long)(1.0e10 / baud);
+    capture_event(CAPTURE_TX2RX, CAPTURE_BAUD, baud, 0, 0);
     printf("BAUD RATE: %lu\n", baud);
     init_ring_buffers();
 }
 
 
-// Make the program use RT priority to improve precision in timing
-void set_rt_priority(void) {
+// Make the program use RT priority to improve precision in timing: FIFO
+// scheduling, memory locked against page faults, no timer slack, and pinned
+// to "cpu" unless it is negative
+void set_rt_priority(int cpu) {
     struct sched_param sp = { .sched_priority = 50 };
-    if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1) {
+    int rt = sched_setscheduler(0, SCHED_FIFO, &sp) == 0;
+    if (!rt) {
       perror("Could not set realtime priority");
     }
+
+    int locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+    if (!locked) {
+      perror("Could not lock memory");
+    }
+
+    // Without RT priority, sleeps may otherwise end up to 50 usec late
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+    if (cpu >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("Could not pin to the CPU");
+        cpu = -1;
+      }
+    }
+
+    printf("TIMING: %s, %s", rt ? "SCHED_FIFO priority 50" : "normal priority",
+           locked ? "memory locked" : "memory not locked");
+    if (cpu >= 0) {
+      printf(", pinned to CPU %d", cpu);
+    }
+    printf("\n");
 }
 
 
-// Compute the difference between two timespecs
-struct timespec timespec_diff(const struct timespec *t2, const struct timespec *t1)
+// Count how late a byte is released
+void record_jitter(long long lateNs)
 {
-    struct timespec diff = { .tv_sec = t2->tv_sec - t1->tv_sec,
-                             .tv_nsec = t2->tv_nsec - t1->tv_nsec };
-    if (diff.tv_nsec < 0) {
-        diff.tv_nsec += 1000000000;
-        --diff.tv_sec;
+    struct Jitter *j = &par.jitter;
+    j->count++;
+    j->sumNs += lateNs;
+    if (lateNs > j->maxNs) j->maxNs = lateNs;
+
+    long long usec = lateNs / 1000;
+    int bucket = 0;
+    while (usec > 0 && bucket < JITTER_BUCKETS - 1)
+    {
+        usec >>= 1;
+        bucket++;
     }
-    return diff;
+    j->buckets[bucket]++;
 }
 
 
-// Compute the sum of two timespecs
-struct timespec timespec_sum(const struct timespec *t1, const struct timespec *t2)
+// Print the release deviation histogram and whether it is small enough
+// compared with a byte time for measurements to be trusted
+void print_jitter(void)
 {
-    struct timespec sum = { .tv_sec = t1->tv_sec + t2->tv_sec,
-                             .tv_nsec = t1->tv_nsec + t2->tv_nsec };
-    if (sum.tv_nsec >= 1000000000) {
-        sum.tv_nsec -= 1000000000;
-        ++sum.tv_sec;
+    const struct Jitter *j = &par.jitter;
+    if (j->count == 0)
+    {
+        printf("NO BYTES RELEASED SINCE THE LAST BAUD RATE OR DELAY CHANGE\n");
+        return;
+    }
+
+    long long peak = 0;
+    for (int i = 0; i < JITTER_BUCKETS; i++)
+    {
+        if (j->buckets[i] > peak) peak = j->buckets[i];
+    }
+
+    printf("RELEASE DEVIATION (actual - scheduled) OF %lld BYTES: mean %.1f usec, max %.1f usec\n",
+           j->count, j->sumNs / 1000.0 / j->count, j->maxNs / 1000.0);
+    long long seen = 0;
+    long p99 = -1; // upper bound of the bucket holding the 99th percentile, usec
+    for (int i = 0; i < JITTER_BUCKETS; i++)
+    {
+        seen += j->buckets[i];
+        long upper = 1L << i;
+        if (p99 < 0 && seen * 100 >= j->count * 99) p99 = upper;
+        if (j->buckets[i] == 0) continue;
+
+        char range[32];
+        if (i == 0) snprintf(range, sizeof(range), "< 1");
+        else if (i == JITTER_BUCKETS - 1) snprintf(range, sizeof(range), ">= %ld", 1L << (i - 1));
+        else snprintf(range, sizeof(range), "%ld-%ld", 1L << (i - 1), upper);
+        char bar[41];
+        int len = (int)(40 * j->buckets[i] / peak);
+        memset(bar, '#', len);
+        bar[len] = '\0';
+        printf("  %12s usec %10lld %s\n", range, j->buckets[i], bar);
+    }
+
+    double byteUsec = par.byteDelay / 1000.0;
+    if (p99 <= byteUsec / 10)
+    {
+        printf("99%% OF BYTES WITHIN %ld usec, UNDER 10%% OF A BYTE TIME (%.1f usec): TIMING CAN BE TRUSTED\n",
+               p99, byteUsec);
+    }
+    else
+    {
+        printf("99%% OF BYTES ONLY WITHIN %ld usec, OVER 10%% OF A BYTE TIME (%.1f usec): TIMING NOT RELIABLE\n",
+               p99, byteUsec);
     }
-    return sum;
 }
 
 
-// Compare two timespecs returning -1, 0 or 1 if t1 is less than, equal or
-// greater than t2, respectively
-int timespec_comp(const struct timespec *t1, const struct timespec *t2)
+// xorshift64*
+uint64_t next_random(struct ErrorModel *m)
 {
-    if (t1->tv_sec < t2->tv_sec) {
-        return -1;
+    uint64_t x = m->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    m->rng = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+
+// Trials before the next success, each with probability "p"; -1 if never
+long long geometric(struct ErrorModel *m, double p)
+{
+    if (p <= 0.0) return -1;
+    if (p >= 1.0) return 0;
+    double u = (next_random(m) >> 11) * 0x1.0p-53; // [0, 1)
+    return (long long)(log1p(-u) / log1p(-p));
+}
+
+
+// Start the model over from its seed, in the good state
+void reset_errors(struct ErrorModel *m)
+{
+    // splitmix64 of the seed: xorshift needs a well-mixed, non-zero state
+    uint64_t z = m->seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    m->rng = (z ^ (z >> 31)) | 1;
+
+    m->bad = FALSE;
+    m->untilError = geometric(m, m->ber);
+    m->untilSwitch = m->kind == MODEL_BURST ? geometric(m, m->toBad) : -1;
+    m->untilDrop = geometric(m, m->dropRate);
+    m->untilInsert = geometric(m, m->insertRate);
+}
+
+
+// Flip the bits of "byte" that the model hits
+unsigned char corrupt_byte(struct ErrorModel *m, unsigned char byte)
+{
+    int bit = 0;
+    while (TRUE)
+    {
+        long long left = 8 - bit;
+        long long error = m->untilError < 0 ? left : m->untilError;
+        long long change = m->untilSwitch < 0 ? left : m->untilSwitch;
+        if (error >= left && change >= left)
+        {
+            if (m->untilError >= 0) m->untilError -= left;
+            if (m->untilSwitch >= 0) m->untilSwitch -= left;
+            return byte;
+        }
+
+        if (error < change)
+        {
+            bit += error;
+            byte ^= (unsigned char) 1 << bit;
+            bit++;
+            if (m->untilSwitch >= 0) m->untilSwitch -= error + 1;
+            m->untilError = geometric(m, m->bad ? m->badBer : m->ber);
+        }
+        else
+        {
+            // Errors are memoryless: draw the next one at the new state's rate
+            bit += change;
+            m->bad = !m->bad;
+            m->untilSwitch = geometric(m, m->bad ? m->toGood : m->toBad);
+            m->untilError = geometric(m, m->bad ? m->badBer : m->ber);
+        }
     }
-    else if (t1->tv_sec > t2->tv_sec) {
-        return 1;
+}
+
+
+// Count one byte against a per-byte event. Returns TRUE if it happens to this byte.
+int byte_event(struct ErrorModel *m, long long *until, double rate)
+{
+    if (*until < 0) return FALSE;
+    if ((*until)-- > 0) return FALSE;
+    *until = geometric(m, rate);
+    return TRUE;
+}
+
+
+void print_errors(const struct Direction *d)
+{
+    const struct ErrorModel *m = &d->errors;
+    if (m->kind == MODEL_BER)
+    {
+        printf("%s: BER %g", d->name, m->ber);
     }
-    else if (t1->tv_nsec < t2->tv_nsec) {
-        return -1;
+    else
+    {
+        double badShare = m->toBad / (m->toBad + m->toGood);
+        printf("%s: BURSTS, BER %g good / %g bad, mean %.0f good / %.0f bad bits (average BER %g)",
+               d->name, m->ber, m->badBer, 1.0 / m->toBad, 1.0 / m->toGood,
+               (1.0 - badShare) * m->ber + badShare * m->badBer);
     }
-    else if (t1->tv_nsec > t2->tv_nsec) {
-        return 1;
+    printf(", DROP %g, INSERT %g, SEED %llu\n", m->dropRate, m->insertRate, (unsigned long long) m->seed);
+}
+
+
+// Write one byte event to the log: "in" when it enters the cable, otherwise
+// when it leaves (possibly corrupted)
+void log_byte(const struct Direction *d, unsigned char byte, int in)
+{
+    char cells[4][3] = {"  ", "  ", "  ", "  "};
+    int column = (d->id % 2 == CAPTURE_TX2RX ? 0 : 2) + (in ? 0 : 1);
+    sprintf(cells[column], "%02hhX", byte);
+    if (par.nLinks > 1)
+    {
+        fprintf(par.logfile, "%d: ", d->link);
     }
-    return 0;
+    fprintf(par.logfile, "%s  %s | %s  %s\n", cells[0], cells[1], cells[2], cells[3]);
+    cableIdle = FALSE;
+}
+
+
+// Bytes still waiting to be clocked onto the line (the sender's backlog)
+long backlog(const struct Direction *d, long long now)
+{
+    if (d->lineFreeAt <= now) return 0;
+    return (d->lineFreeAt - now + par.byteDelay - 1) / par.byteDelay;
 }
 
 
-int timespec_is_negative(const struct timespec *t)
+// Read everything the port has, up to a full backlog, and schedule it: each
+// byte takes a byte time on the line after the one before it (or from now, if
+// the line is idle) and leaves the cable a propagation delay later
+void receive_bytes(struct Direction *d, long long now)
 {
-    if (t->tv_sec < 0 || t->tv_nsec < 0)
+    long room = LINE_BACKLOG - backlog(d, now);
+    if (room > d->capacity - d->count) room = d->capacity - d->count;
+    if (room <= 0) return;
+
+    unsigned char buf[LINE_BACKLOG];
+    int n = read(d->fdIn, buf, room);
+    for (int i = 0; i < n; i++)
     {
-        return TRUE;
+        uint32_t index = d->entered++;
+        capture_event(d->id, CAPTURE_IN, index, buf[i], buf[i]);
+
+        // Unplugged: the bytes still take their time on the line but go nowhere
+        if (d->lineFreeAt < now) d->lineFreeAt = now;
+        d->lineFreeAt += par.byteDelay;
+        if (!par.cableOn[d->link])
+        {
+            capture_event(d->id, CAPTURE_DROP, index, buf[i], buf[i]);
+            continue;
+        }
+
+        long slot = (d->head + d->count++) % d->capacity;
+        d->bytes[slot] = buf[i];
+        d->release[slot] = d->lineFreeAt + 1000LL * par.propDelay;
+        d->index[slot] = index;
+        if (par.logfile != NULL) log_byte(d, buf[i], TRUE);
     }
-    return FALSE;
+}
+
+
+// Write every byte that is due, in as few write() calls as possible
+void release_bytes(struct Direction *d, long long now)
+{
+    unsigned char out[BUF_SIZE];
+    int n = 0;
+
+    if (d->count > 0 && now - d->release[d->head] >= 1000000000 && unreliableRate == FALSE)
+    {
+        printf("UNRELIABLE RATE: Could not keep up, a byte was released over 1s late\n"
+               "No further warnings will be issued\n");
+        unreliableRate = TRUE;
+    }
+
+    while (d->count > 0 && d->release[d->head] <= now)
+    {
+        unsigned char sent = d->bytes[d->head];
+        uint32_t index = d->index[d->head];
+        record_jitter(now - d->release[d->head]);
+        d->head = (d->head + 1) % d->capacity;
+        d->count--;
+        if (!par.cableOn[d->link])
+        {
+            capture_event(d->id, CAPTURE_DROP, index, sent, sent);
+            continue;
+        }
+
+        // Add errors, if applicable
+        struct ErrorModel *m = &d->errors;
+        if (byte_event(m, &m->untilDrop, m->dropRate))
+        {
+            capture_event(d->id, CAPTURE_DROP, index, sent, sent);
+            continue;
+        }
+        unsigned char byte = corrupt_byte(m, sent);
+        capture_event(d->id, byte == sent ? CAPTURE_OUT : CAPTURE_CORRUPT, index, byte, sent);
+        if (par.logfile != NULL) log_byte(d, byte, FALSE);
+        out[n++] = byte;
+
+        if (byte_event(m, &m->untilInsert, m->insertRate))
+        {
+            unsigned char extra = next_random(m) & 0xFF;
+            capture_event(d->id, CAPTURE_INSERT, index, extra, extra);
+            if (par.logfile != NULL) log_byte(d, extra, FALSE);
+            out[n++] = extra;
+        }
+
+        if (n >= BUF_SIZE - 1)
+        {
+            write(d->fdOut, out, n);
+            n = 0;
+        }
+    }
+    if (n > 0) write(d->fdOut, out, n);
+}
+
+
+// Earliest time this direction needs attention: its next byte to release, or
+// when a full backlog has drained by half so the port can be read again.
+// Returns -1 if there is nothing to wait for.
+long long next_wakeup(const struct Direction *d, long long now)
+{
+    long long wake = (d->count > 0) ? d->release[d->head] : -1;
+    if (LINE_BACKLOG - backlog(d, now) <= 0)
+    {
+        long long drained = d->lineFreeAt - (LINE_BACKLOG / 2) * par.byteDelay;
+        if (wake < 0 || drained < wake) wake = drained;
+    }
+    return wake;
 }
 
 
@@ -216,7 +615,7 @@ void startlog(const char *filename)
     par.logfile = fopen(filename, "w");
     if (par.logfile != NULL)
     {
-        fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
+        fprintf(par.logfile, "%sTx->Rx | Rx->Tx\n", par.nLinks > 1 ? "L  " : "");
         printf("LOGGING TO FILE %s\n", filename);
     }
     else
@@ -226,67 +625,296 @@ void startlog(const char *filename)
 }
 
 
+void endcapture(void)
+{
+    if (capture.fd >= 0)
+    {
+        flush_capture();
+        close(capture.fd);
+        capture.fd = -1;
+    }
+}
+
+
+void startcapture(const char *filename)
+{
+    endcapture();
+    capture.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    struct CaptureHeader header = {.magic = CAPTURE_MAGIC, .baud = par.baud, .propUs = par.propDelay};
+    if (capture.fd >= 0 && write(capture.fd, &header, sizeof(header)) == sizeof(header))
+    {
+        capture.start = now_ns();
+        capture.used = 0;
+        printf("CAPTURING TO FILE %s\n", filename);
+    }
+    else
+    {
+        if (capture.fd >= 0) close(capture.fd);
+        capture.fd = -1;
+        printf("ERROR OPENING FILE %s, NOT CAPTURING\n", filename);
+    }
+}
+
+
+// Error model commands, as parsed by set_errors
+#define SET_MODEL 0  // ber or burst
+#define SET_DROP 1
+#define SET_INSERT 2
+#define SET_SEED 3
+
+// Handle an error model command, "[tx|rx] <command> <values>", for one
+// direction or both of links "firstLink" to "lastLink". Returns FALSE if it is not one.
+int set_errors(const char *command, int firstLink, int lastLink)
+{
+    int first = 0, last = 1;
+    if (strncmp(command, "tx ", 3) == 0)
+    {
+        last = 0;
+        command += 3;
+    }
+    else if (strncmp(command, "rx ", 3) == 0)
+    {
+        first = 1;
+        command += 3;
+    }
+
+    double v[4];
+    unsigned long long seed;
+    struct ErrorModel change = {0};
+    int setting;
+    int ok;
+    if (strcmp(command, "errors") == 0 && first == 0 && last == 1)
+    {
+        for (int i = 2 * firstLink; i < 2 * (lastLink + 1); i++)
+        {
+            print_errors(&par.dirs[i]);
+        }
+        return TRUE;
+    }
+    else if (sscanf(command, "ber %lf", &v[0]) == 1)
+    {
+        setting = SET_MODEL;
+        ok = v[0] >= 0.0 && v[0] < 1.0;
+        change = (struct ErrorModel) {.kind = MODEL_BER, .ber = v[0]};
+    }
+    else if (sscanf(command, "burst %lf %lf %lf %lf", &v[0], &v[1], &v[2], &v[3]) == 4)
+    {
+        setting = SET_MODEL;
+        ok = v[0] >= 0.0 && v[0] < 1.0 && v[1] >= 0.0 && v[1] < 1.0 && v[2] >= 1.0 && v[3] >= 1.0;
+        change = (struct ErrorModel) {.kind = MODEL_BURST, .ber = v[0], .badBer = v[1],
+                                      .toBad = 1.0 / v[2], .toGood = 1.0 / v[3]};
+    }
+    else if (sscanf(command, "drop %lf", &v[0]) == 1)
+    {
+        setting = SET_DROP;
+        ok = v[0] >= 0.0 && v[0] < 1.0;
+    }
+    else if (sscanf(command, "insert %lf", &v[0]) == 1)
+    {
+        setting = SET_INSERT;
+        ok = v[0] >= 0.0 && v[0] < 1.0;
+    }
+    else if (sscanf(command, "seed %llu", &seed) == 1)
+    {
+        setting = SET_SEED;
+        ok = TRUE;
+    }
+    else
+    {
+        return FALSE;
+    }
+    if (!ok)
+    {
+        printf("BAD ERROR SETTINGS: rates and BERs must be between 0 and 1, mean state lengths at least 1 bit\n");
+        return TRUE;
+    }
+
+    for (int link = firstLink; link <= lastLink; link++)
+    for (int i = 2 * link + first; i <= 2 * link + last; i++)
+    {
+        struct ErrorModel *m = &par.dirs[i].errors;
+        if (setting == SET_MODEL)
+        {
+            m->kind = change.kind;
+            m->ber = change.ber;
+            m->badBer = change.badBer;
+            m->toBad = change.toBad;
+            m->toGood = change.toGood;
+        }
+        else if (setting == SET_DROP) m->dropRate = v[0];
+        else if (setting == SET_INSERT) m->insertRate = v[0];
+        else m->seed = seed;
+        reset_errors(m);
+        print_errors(&par.dirs[i]);
+    }
+    return TRUE;
+}
+
+
 // Show help
 void help()
 {
-    printf("\n\n"
-           "Transmitter must open " TXDEV "\n"
-           "Receiver must open " RXDEV "\n"
+    printf("\n\n");
+    for (int k = 0; k < par.nLinks; k++)
+    {
+        if (par.nLinks > 1)
+        {
+            printf("Link %d:\n", k);
+        }
+        printf("Transmitter must open %s\n"
+               "Receiver must open %s\n", links[k].txDev, links[k].rxDev);
+    }
+    printf("\n"
+           "Start with --cpu <n> to pin the cable to CPU n (best kept free of other work)\n"
+           "Start with --links <n> to emulate n independent port pairs (1-%d)\n"
            "\n"
            "The cable program is sensible to the following interactive commands:\n"
            "--- help         : show this help\n"
            "--- on           : connect the cable and data is exchanged (default state)\n"
            "--- off          : disconnect the cable disabling data to be exchanged\n"
-           "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
-           "--- baud <rate>  : set baud rate, between 1200 and 115200 (default=9600)\n"
+           "--- ber <ber>    : flip data bits independently at a specified BER (default=0)\n"
+           "--- burst <good ber> <bad ber> <good bits> <bad bits> : Gilbert-Elliott\n"
+           "                   burst errors: the line alternates between a good and a bad\n"
+           "                   state lasting the given mean numbers of bits\n"
+           "--- drop <rate>  : lose bytes with the given probability (default=0)\n"
+           "--- insert <rate> : add a random byte after bytes with the given probability\n"
+           "--- seed <n>     : seed the error generator (defaults 1 for Tx->Rx, 2 for Rx->Tx)\n"
+           "--- errors       : show the error settings\n"
+           "                   Prefix ber, burst, drop, insert or seed with \"tx\" (Tx->Rx)\n"
+           "                   or \"rx\" (Rx->Tx) for one direction only. Every change\n"
+           "                   restarts the generator from its seed, so runs repeat exactly.\n"
+           "--- link <k> <command> : with several links, apply on, off or an error\n"
+           "                   model command to link k only (all links otherwise)\n"
+           "--- baud <rate>  : set baud rate, between 300 and 10000000 (default=9600)\n"
            "                   note that 10 bits are sent per byte (8-N-1)\n"
            "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
-           "                   will be approximated to an integer multiple of the byte\n"
-           "                   delay (10 / baud_rate)\n"
            "--- log <file>   : log transmitted data to file\n"
            "--- endlog       : stop logging transmitted data\n"
+           "--- capture <file> : record every byte with its timestamps in a compact\n"
+           "                   binary file, to be analysed with bin/cable_decode\n"
+           "--- endcapture   : stop capturing\n"
+           "--- stats        : show how late bytes are released compared with their\n"
+           "                   schedule, and whether that is small enough to trust\n"
+           "--- stats reset  : start counting again\n"
            "--- quit         : terminate the program\n"
            "\n"
            "IMPORTANT: Changing the baud rate or propagation delay while a transmission is\n"
            "           ongoing will result in losses.\n"
-           "\n");
+           "\n", MAX_LINKS);
 }
 
-int main(int argc, char *argv[])
+// Set up the names and directions of link "k"
+void init_link(int k)
 {
-    printf("\n");
+    struct Link *l = &links[k];
+    if (k == 0)
+    {
+        snprintf(l->txDev, PORT_NAME_SIZE, TXDEV);
+        snprintf(l->rxDev, PORT_NAME_SIZE, RXDEV);
+        snprintf(l->txEmulator, PORT_NAME_SIZE, TX_EMULATOR);
+        snprintf(l->rxEmulator, PORT_NAME_SIZE, RX_EMULATOR);
+    }
+    else
+    {
+        snprintf(l->txDev, PORT_NAME_SIZE, "/dev/ttyS%d", FIRST_PORT + 2 * k);
+        snprintf(l->rxDev, PORT_NAME_SIZE, "/dev/ttyS%d", FIRST_PORT + 2 * k + 1);
+        snprintf(l->txEmulator, PORT_NAME_SIZE, TX_EMULATOR "%d", k);
+        snprintf(l->rxEmulator, PORT_NAME_SIZE, RX_EMULATOR "%d", k);
+    }
 
-    system("socat -dd PTY,link=" TXDEV ",mode=777,raw,echo=0 PTY,link=" TX_EMULATOR ",mode=777,raw,echo=0 &");
+    par.cableOn[k] = TRUE;
+    for (int i = 0; i < 2; i++)
+    {
+        struct Direction *d = &par.dirs[2 * k + i];
+        d->id = 2 * k + i;
+        d->link = k;
+        d->errors.seed = 2 * k + i + 1;
+        snprintf(d->name, sizeof(d->name), i == CAPTURE_TX2RX ? "Tx->Rx" : "Rx->Tx");
+        if (par.nLinks > 1)
+        {
+            snprintf(d->name, sizeof(d->name), i == CAPTURE_TX2RX ? "%d Tx->Rx" : "%d Rx->Tx", k);
+        }
+    }
+}
+
+// Create the port pair of link "k" and open the cable's ends.
+// Returns 0 on success, -1 on failure
+int open_link(int k)
+{
+    struct Link *l = &links[k];
+    char command[256];
+
+    snprintf(command, sizeof(command),
+             "socat -dd PTY,link=%s,mode=777,raw,echo=0 PTY,link=%s,mode=777,raw,echo=0 &",
+             l->txDev, l->txEmulator);
+    system(command);
     sleep(1);
     printf("\n");
 
-    system("socat -dd PTY,link=" RXDEV ",mode=777,raw,echo=0 PTY,link=" RX_EMULATOR ",mode=777,raw,echo=0 &");
+    snprintf(command, sizeof(command),
+             "socat -dd PTY,link=%s,mode=777,raw,echo=0 PTY,link=%s,mode=777,raw,echo=0 &",
+             l->rxDev, l->rxEmulator);
+    system(command);
     sleep(1);
 
-    help();
-
     // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
-
-    int fdTx = openSerialPort(TX_EMULATOR, &oldtioTx, &newtioTx);
-
-    if (fdTx < 0)
+    struct termios newtio;
+    l->fdTx = openSerialPort(l->txEmulator, &l->oldtioTx, &newtio);
+    if (l->fdTx < 0)
     {
         perror("Opening Tx emulator serial port");
-        exit(-1);
+        return -1;
+    }
+    l->fdRx = openSerialPort(l->rxEmulator, &l->oldtioRx, &newtio);
+    if (l->fdRx < 0)
+    {
+        perror("Opening Rx emulator serial port");
+        return -1;
     }
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
+    par.dirs[2 * k].fdIn = l->fdTx;
+    par.dirs[2 * k].fdOut = l->fdRx;
+    par.dirs[2 * k + 1].fdIn = l->fdRx;
+    par.dirs[2 * k + 1].fdOut = l->fdTx;
+    return 0;
+}
 
-    int fdRx = openSerialPort(RX_EMULATOR, &oldtioRx, &newtioRx);
+int main(int argc, char *argv[])
+{
+    // Status lines reach a pipe or file (e.g. make bench) as they are printed
+    setvbuf(stdout, NULL, _IOLBF, 0);
 
-    if (fdRx < 0)
+    int cpu = -1;
+    for (int i = 1; i < argc; i++)
     {
-        perror("Opening Rx emulator serial port");
-        exit(-1);
+        if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc)
+        {
+            cpu = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--links") == 0 && i + 1 < argc &&
+                 atoi(argv[i + 1]) >= 1 && atoi(argv[i + 1]) <= MAX_LINKS)
+        {
+            par.nLinks = atoi(argv[++i]);
+        }
+        else
+        {
+            printf("Usage: %s [--cpu <n>] [--links <1-%d>]\n", argv[0], MAX_LINKS);
+            exit(1);
+        }
     }
+    printf("\n");
+
+    for (int k = 0; k < par.nLinks; k++)
+    {
+        init_link(k);
+        if (open_link(k) < 0)
+        {
+            system("killall socat");
+            exit(-1);
+        }
+    }
+
+    help();
 
     // Configure stdin to receive commands to this program
     int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
@@ -295,208 +923,154 @@ int main(int argc, char *argv[])
     char rxStdin[BUF_SIZE] = {0};
 
     int STOP = FALSE;
+    int stdinOpen = TRUE;
+    int nDirs = 2 * par.nLinks;
 
     set_baud_rate(DEFAULT_BAUDRATE);
+    for (int i = 0; i < nDirs; i++)
+    {
+        reset_errors(&par.dirs[i].errors);
+    }
 
-    set_rt_priority();
-
-    // For logging
-    char tx2rxTx[3], tx2rxRx[3], rx2txTx[3], rx2txRx[3];
-    int cableIdle = FALSE;
+    set_rt_priority(cpu);
 
     printf("\nCable ready\n\n");
 
-    // To compensate for deviations in byte transmission time
-    struct timespec currentTime, nextTxTime, timeDiff, nextWait;
-    int skipWait = FALSE;
-    int unreliableRate = FALSE;
-    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
-
     while (STOP == FALSE)
     {
-        // Check how much waiting time we should have (if any)
-        clock_gettime(CLOCK_MONOTONIC, &currentTime);
-        timeDiff = timespec_diff(&currentTime, &nextTxTime);
-        nextTxTime = timespec_sum(&nextTxTime, &par.byteDelay);
-        if (timeDiff.tv_sec >= 1)
+        long long now = now_ns();
+        int inFlight = 0;
+        for (int i = 0; i < nDirs; i++)
         {
-            if (unreliableRate == FALSE)
-            {
-                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
-                       "No further warnings will be issued\n");
-                unreliableRate = TRUE;
-            }
+            release_bytes(&par.dirs[i], now);
+            inFlight += par.dirs[i].count;
         }
-        nextWait = timespec_diff(&nextTxTime, &currentTime);
-        if (timespec_is_negative(&nextWait))
+
+        if (par.logfile != NULL && cableIdle == FALSE && inFlight == 0)
         {
-            skipWait = TRUE;
+            fputs("---------------\n", par.logfile);
+            cableIdle = TRUE;
         }
-        else
+        // Quiet line: a good time to write the capture out
+        if (capture.used > 0 && inFlight == 0)
         {
-            skipWait = FALSE;
+            flush_capture();
         }
 
-        // Read from Tx
-        int bytesFromTx = read(fdTx, par.tx2rx + par.tx2rxIdx, 1);
-        par.tx2rxValid[par.tx2rxIdx] = bytesFromTx > 0;
+        // Sleep until a port has bytes (unless its backlog is full), a command
+        // arrives or the next byte is due
+        struct pollfd pfds[2 * MAX_LINKS + 1];
+        long long wake = -1;
+        for (int i = 0; i < nDirs; i++)
+        {
+            struct Direction *d = &par.dirs[i];
+            pfds[i].fd = d->fdIn;
+            pfds[i].events = LINE_BACKLOG - backlog(d, now) > 0 ? POLLIN : 0;
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, par.rx2tx + par.rx2txIdx, 1);
-        par.rx2txValid[par.rx2txIdx] = bytesFromRx > 0;
+            long long t = next_wakeup(d, now);
+            if (t >= 0 && (wake < 0 || t < wake)) wake = t;
+        }
+        pfds[nDirs].fd = stdinOpen ? STDIN_FILENO : -1;
+        pfds[nDirs].events = POLLIN;
 
-        if (!par.cableOn)
+        // Poll until shortly before the deadline, then sleep to it exactly: a
+        // relative poll timeout only approximates an absolute time
+        struct timespec timeout = {0, 0};
+        if (wake - SLEEP_MARGIN > now)
         {
-            // Ignore what was read
-            par.tx2rxValid[par.tx2rxIdx] = 0;
-            par.rx2txValid[par.rx2txIdx] = 0;
+            timeout.tv_sec = (wake - SLEEP_MARGIN - now) / 1000000000;
+            timeout.tv_nsec = (wake - SLEEP_MARGIN - now) % 1000000000;
         }
-
-        if (par.logfile != NULL)  // Currently logging
+        int ready = ppoll(pfds, nDirs + 1, wake >= 0 ? &timeout : NULL, NULL);
+        if (ready < 0)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxTx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxTx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                sprintf(rx2txTx, "%02hhX", par.rx2tx[par.rx2txIdx]);
-            }
-            else
-            {
-                memcpy(rx2txTx, "  ", 3);
-            }
+            continue;
         }
-
-        // Advance indices to next position
-        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
-        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
-
-        if (par.cableOn)
+        if (ready == 0 && wake > now_ns())
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.tx2rx[par.tx2rxIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdRx, par.tx2rx + par.tx2rxIdx, 1);
-            }
-
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.rx2tx[par.rx2txIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdTx, par.rx2tx + par.rx2txIdx, 1);
-            }
+            struct timespec deadline = {wake / 1000000000, wake % 1000000000};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+            continue;
         }
 
-        if (par.logfile != NULL)  // Currently logging
+        now = now_ns();
+        for (int i = 0; i < nDirs; i++)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxRx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxRx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                sprintf(rx2txRx, "%02hhX", par.rx2tx[par.rx2txIdx]);
-            }
-            else
-            {
-                memcpy(rx2txRx, "  ", 3);
-            }
-
-            if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
-            {
-                if (cableIdle == FALSE)
-                {
-                    fputs("---------------\n", par.logfile);
-                    cableIdle = TRUE;
-                }
-            }
-            else
-            {
-                fprintf(par.logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
-                cableIdle = FALSE;
-            }
+            if (pfds[i].revents & POLLIN) receive_bytes(&par.dirs[i], now);
+        }
+        if (!(pfds[nDirs].revents & (POLLIN | POLLHUP)))
+        {
+            continue;
         }
 
         // Read commands from STDIN to control the cable mode
         int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
+        if (fromStdin == 0)
+        {
+            stdinOpen = FALSE; // End of input: keep running, stop watching it
+        }
         if (fromStdin > 0)
         {
             rxStdin[fromStdin - 1] = '\0';
 
-            if (strcmp(rxStdin, "off") == 0)
+            // "link <k> ..." applies to one link only
+            char *command = rxStdin;
+            int firstLink = 0, lastLink = par.nLinks - 1;
+            int link, skip;
+            if (sscanf(rxStdin, "link %d %n", &link, &skip) == 1 && skip > 5)
             {
-                printf("CONNECTION OFF\n");
-                if (par.cableOn && par.logfile != NULL)
+                if (link < 0 || link >= par.nLinks)
                 {
-                    fputs("CABLE OFF\n", par.logfile);
+                    printf("NO SUCH LINK: links are 0 to %d\n", par.nLinks - 1);
+                    continue;
                 }
-                par.cableOn = FALSE;
-            }
-            else if (strcmp(rxStdin, "on") == 0)
-            {
-                printf("CONNECTION ON\n");
-                par.cableOn = TRUE;
+                firstLink = lastLink = link;
+                command += skip;
             }
-            else if (strncmp(rxStdin, "ber ", 4) == 0)
+            int allLinks = (command == rxStdin);
+
+            if (strcmp(command, "off") == 0 || strcmp(command, "on") == 0)
             {
-                double ber;
-                sscanf(rxStdin + 4, "%lf", &ber);
-                // Compute pow(1 - ber, 8) without libm
-                double acc = 1 - ber;
-                acc *= acc;   // Squared
-                acc *= acc;   // To the fourth
-                acc *= acc;   // To the eighth
-                par.byteER = 1.0 - acc;
-                //printf("Byte Error Rate is %lf\n", par.byteER);
-                if (ber >= 0.0 && ber < 1.0)
+                int on = (strcmp(command, "on") == 0);
+                for (int k = firstLink; k <= lastLink; k++)
                 {
-                    printf("BER SET TO %lf\n", ber);
-                    if (ber > 0.01)
+                    if (par.cableOn[k] && !on && par.logfile != NULL)
                     {
-                        printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
+                        if (par.nLinks > 1) fprintf(par.logfile, "CABLE %d OFF\n", k);
+                        else fputs("CABLE OFF\n", par.logfile);
                     }
+                    capture_event(2 * k, on ? CAPTURE_CABLE_ON : CAPTURE_CABLE_OFF, 0, 0, 0);
+                    par.cableOn[k] = on;
+                }
+                if (allLinks)
+                {
+                    printf("CONNECTION %s\n", on ? "ON" : "OFF");
                 }
                 else
                 {
-                    printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
+                    printf("LINK %d CONNECTION %s\n", firstLink, on ? "ON" : "OFF");
                 }
             }
+            else if (set_errors(command, firstLink, lastLink) == TRUE)
+            {
+                // Error model command
+            }
+            else if (!allLinks)
+            {
+                printf("ONLY on, off AND ERROR MODEL COMMANDS TAKE A LINK\n");
+            }
             else if (strncmp(rxStdin, "baud ", 5) == 0)
             {
                 unsigned long baud = 0;
                 sscanf(rxStdin + 5, "%lu", &baud);
-                switch (baud) {
-                    case 1200:
-                    case 1800:
-                    case 2400:
-                    case 4800:
-                    case 9600:
-                    case 19200:
-                    case 38400:
-                    case 57600:
-                    case 115200:
-                        set_baud_rate(baud);
-                        break;
-                    default:
-                        printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
+                // Any rate: the ports are pseudo-terminals, only the pacing counts
+                if (baud >= 300 && baud <= 10000000)
+                {
+                    set_baud_rate(baud);
+                }
+                else
+                {
+                    printf("UNSUPPORTED BAUD RATE: must be between 300 and 10000000\n");
                 }
             }
             else if (strncmp(rxStdin, "prop ", 5) == 0)
@@ -521,11 +1095,29 @@ int main(int argc, char *argv[])
                 endlog();
                 printf("NOT LOGGING\n");
             }
+            else if (strncmp(rxStdin, "capture ", 8) == 0)
+            {
+                startcapture(rxStdin + 8);
+            }
+            else if (strcmp(rxStdin, "endcapture") == 0)
+            {
+                endcapture();
+                printf("NOT CAPTURING\n");
+            }
             else if (strcmp(rxStdin, "quit") == 0)
             {
                 printf("END OF THE PROGRAM\n");
                 STOP = TRUE;
             }
+            else if (strcmp(rxStdin, "stats") == 0)
+            {
+                print_jitter();
+            }
+            else if (strcmp(rxStdin, "stats reset") == 0)
+            {
+                memset(&par.jitter, 0, sizeof(par.jitter));
+                printf("TIMING STATISTICS RESET\n");
+            }
             else if (strcmp(rxStdin, "help") == 0) {
                 help();
             }
@@ -533,28 +1125,25 @@ int main(int argc, char *argv[])
                 printf("BAD COMMAND OR MISSING PARAMETERS\n");
             }
         }
-
-        if (skipWait == FALSE) {
-            nanosleep(&nextWait, NULL);
-        }
     }
 
+    endlog();
+    endcapture();
+
     // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
+    for (int k = 0; k < par.nLinks; k++)
     {
-        perror("tcsetattr");
-        exit(-1);
-    }
+        if (tcsetattr(links[k].fdRx, TCSANOW, &links[k].oldtioRx) == -1 ||
+            tcsetattr(links[k].fdTx, TCSANOW, &links[k].oldtioTx) == -1)
+        {
+            perror("tcsetattr");
+            exit(-1);
+        }
 
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
-    {
-        perror("tcsetattr");
-        exit(-1);
+        close(links[k].fdTx);
+        close(links[k].fdRx);
     }
 
-    close(fdTx);
-    close(fdRx);
-
     system("killall socat");
 
     return 0;
@@ -0,0 +1,472 @@
+// Offline decoder for cable captures.
+// Rebuilds the link-layer frames in a capture written by the cable's
+// "capture <file>" command (see capture.h) from the bytes as they were sent,
+// and pairs each frame with what happened to its bytes on the line: when its
+// last byte was delivered (latency from its first byte entering the cable),
+// and whether any of them was corrupted or lost. I-frames, SET and DISC that
+// repeat an earlier frame are marked as retransmissions and summarised as
+// timelines at the end. A capture of several links (cable --links) names the
+// directions of link k "Tx<k>->Rx<k>" and "Rx<k>->Tx<k>".
+//
+// Usage: ./bin/cable_decode <capture file>
+
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Link-layer framing (as src/link_layer.c)
+#define FLAG 0x7E
+#define ESC 0x7D
+#define ESC_XOR 0x20
+#define C_SET 0x03
+#define C_UA 0x07
+#define C_DISC 0x0B
+#define C_RATE 0x0F
+#define LP_ARQ_MODE 0x00
+#define LP_DUPLEX 0x05
+#define LP_BAUD_RATE 0x07
+#define MAX_BODY 16384
+
+#define MAX_DIRECTIONS (2 * CAPTURE_MAX_LINKS)
+
+#define FATE_UNKNOWN 0xFF
+#define FATE_DISCARDED 0xFE // still queued when the baud rate or delay changed
+
+typedef struct
+{
+    long long inNs;  // -1 if not captured
+    long long outNs; // when it was delivered or lost, -1 if never
+    unsigned char byte;
+    unsigned char fate; // CAPTURE_OUT, CAPTURE_CORRUPT, CAPTURE_DROP or FATE_*
+} Byte;
+
+// Bytes of one direction, by index from the first one captured entering
+typedef struct
+{
+    Byte *bytes;
+    long count;
+    long size;
+    uint32_t base;
+    int started;
+} Stream;
+
+typedef struct
+{
+    long long timeNs;
+    int direction;  // -1 for cable events
+    int link;       // cable on / off events: which link
+    char what[48];  // frame type and sequence number, or the cable event
+    unsigned char control;
+    int headerOk;
+    int arqWindowed; // UA with parameters: the ARQ mode they settle (see windowedMode); else -1
+    long rate;       // RATE: the line rate it switches to; else -1
+    uint32_t hash;  // of the destuffed body after the header
+    long bytes;     // on the line, stuffed, with flags
+    long long latencyNs; // -1 if not delivered
+    const char *fate;
+    int send;       // 1 for the first transmission, 2 for the first retransmission...
+    long long firstNs;
+    long nextSend;  // index of the retransmission of this frame, -1 if none
+} Frame;
+
+static Frame *frames = NULL;
+static long nFrames = 0;
+static long framesSize = 0;
+
+static char directionNames[MAX_DIRECTIONS][16];
+static int nLinks = 1;
+
+// With several links, number the directions by link
+static void nameDirections(void)
+{
+    for (int d = 0; d < MAX_DIRECTIONS; d++)
+    {
+        int k = d / 2;
+        if (nLinks == 1) snprintf(directionNames[d], sizeof(directionNames[d]), d % 2 ? "Rx->Tx" : "Tx->Rx");
+        else if (d % 2) snprintf(directionNames[d], sizeof(directionNames[d]), "Rx%d->Tx%d", k, k);
+        else snprintf(directionNames[d], sizeof(directionNames[d]), "Tx%d->Rx%d", k, k);
+    }
+}
+
+static Frame *addFrame(void)
+{
+    if (nFrames == framesSize) {
+        framesSize = framesSize > 0 ? 2 * framesSize : 1024;
+        frames = realloc(frames, framesSize * sizeof(Frame));
+        if (frames == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    Frame *f = &frames[nFrames++];
+    memset(f, 0, sizeof(*f));
+    f->direction = -1;
+    f->latencyNs = -1;
+    f->fate = "";
+    f->nextSend = -1;
+    return f;
+}
+
+// The byte of "stream" with "index", or NULL if it was not captured entering.
+// With "enter" set, a byte entering the cable: grows the stream.
+static Byte *streamByte(Stream *stream, uint32_t index, int enter)
+{
+    if (!stream->started) {
+        if (!enter) return NULL;
+        stream->base = index;
+        stream->started = 1;
+    }
+    long at = (long)(uint32_t)(index - stream->base);
+    if (at < stream->count) return &stream->bytes[at];
+    if (!enter || at != stream->count) return NULL;
+
+    if (stream->count == stream->size) {
+        stream->size = stream->size > 0 ? 2 * stream->size : 65536;
+        stream->bytes = realloc(stream->bytes, stream->size * sizeof(Byte));
+        if (stream->bytes == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    Byte *b = &stream->bytes[stream->count++];
+    b->inNs = -1;
+    b->outNs = -1;
+    b->fate = FATE_UNKNOWN;
+    return b;
+}
+
+// Read the records into a stream per direction, and the cable events as frames.
+// Returns 0 on success or -1 if the file is not a capture.
+static int readCapture(FILE *file, Stream streams[MAX_DIRECTIONS], struct CaptureHeader *header)
+{
+    if (fread(header, sizeof(*header), 1, file) != 1 || memcmp(header->magic, CAPTURE_MAGIC, 8) != 0) {
+        return -1;
+    }
+
+    struct CaptureRecord r;
+    while (fread(&r, sizeof(r), 1, file) == 1)
+    {
+        if (r.direction >= MAX_DIRECTIONS) return -1;
+        Stream *stream = &streams[r.direction];
+        if (r.direction / 2 + 1 > nLinks) nLinks = r.direction / 2 + 1;
+
+        if (r.event == CAPTURE_IN) {
+            Byte *b = streamByte(stream, r.index, 1);
+            if (b == NULL) return -1;
+            b->inNs = r.timeNs;
+            b->byte = r.byte;
+        }
+        else if (r.event == CAPTURE_OUT || r.event == CAPTURE_CORRUPT || r.event == CAPTURE_DROP) {
+            Byte *b = streamByte(stream, r.index, 0);
+            if (b == NULL) continue; // entered before the capture started
+            b->outNs = r.timeNs;
+            b->fate = r.event;
+        }
+        else if (r.event == CAPTURE_INSERT) {
+            // Garbage after the byte: the receiver's copy of its frame is damaged
+            Byte *b = streamByte(stream, r.index, 0);
+            if (b != NULL && b->fate == CAPTURE_OUT) b->fate = CAPTURE_CORRUPT;
+        }
+        else {
+            Frame *f = addFrame();
+            f->timeNs = r.timeNs;
+            f->link = r.direction / 2;
+            if (r.event == CAPTURE_CABLE_OFF) snprintf(f->what, sizeof(f->what), "CABLE OFF");
+            else if (r.event == CAPTURE_CABLE_ON) snprintf(f->what, sizeof(f->what), "CABLE ON");
+            else if (r.event == CAPTURE_BAUD) snprintf(f->what, sizeof(f->what), "BAUD RATE %u", r.index);
+            else if (r.event == CAPTURE_PROP) snprintf(f->what, sizeof(f->what), "PROPAGATION DELAY %u usec", r.index);
+
+            // The cable emptied its queues
+            if (r.event == CAPTURE_BAUD || r.event == CAPTURE_PROP) {
+                for (int d = 0; d < MAX_DIRECTIONS; d++)
+                for (long i = 0; i < streams[d].count; i++)
+                {
+                    Byte *b = &streams[d].bytes[i];
+                    if (b->fate == FATE_UNKNOWN) {
+                        b->fate = FATE_DISCARDED;
+                        b->outNs = r.timeNs;
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// ARQ mode from the parameters of an extended SET/UA (body without the BCC2):
+// 1 if windowed (Go-Back-N or Selective Repeat), 2 if windowed in full duplex
+// (I-frames carry N(R) too), 0 if stop-and-wait
+static int windowedMode(const unsigned char *params, int size)
+{
+    int windowed = 0, duplex = 0;
+    for (int idx = 0; idx + 2 <= size; )
+    {
+        unsigned char type = params[idx];
+        unsigned char length = params[idx + 1];
+        if (idx + 2 + length > size || length < 1) break;
+        if (type == LP_ARQ_MODE) windowed = params[idx + 2] != 0;
+        if (type == LP_DUPLEX) duplex = params[idx + 2] != 0;
+        idx += 2 + length;
+    }
+    return windowed ? 1 + duplex : 0;
+}
+
+// Line rate in the parameters of a RATE frame (body without the BCC2), or -1
+static long rateParam(const unsigned char *params, int size)
+{
+    for (int idx = 0; idx + 2 <= size; )
+    {
+        unsigned char type = params[idx];
+        unsigned char length = params[idx + 1];
+        if (idx + 2 + length > size || length < 1) break;
+        if (type == LP_BAUD_RATE && length == 4) {
+            return ((long)params[idx + 2] << 24) | (params[idx + 3] << 16) | (params[idx + 4] << 8) | params[idx + 5];
+        }
+        idx += 2 + length;
+    }
+    return -1;
+}
+
+// Name a frame from its control field; sequence numbers depend on whether the
+// last UA settled a windowed ARQ mode
+static void describe(Frame *f, int *windowed)
+{
+    unsigned char c = f->control;
+    char *what = f->what;
+    size_t whatSize = sizeof(f->what);
+    if (!f->headerOk) snprintf(what, whatSize, "? (bad header)");
+    else if (c == C_SET) snprintf(what, whatSize, "SET");
+    else if (c == C_UA) {
+        if (f->arqWindowed >= 0) *windowed = f->arqWindowed;
+        snprintf(what, whatSize, "UA");
+    }
+    else if (c == C_DISC) snprintf(what, whatSize, "DISC");
+    else if (c == C_RATE) {
+        if (f->rate >= 0) snprintf(what, whatSize, "RATE %ld", f->rate);
+        else snprintf(what, whatSize, "RATE (no rate)");
+    }
+    else if ((c & 0x01) == 0) {
+        int ns = *windowed ? (c >> 1) & 0x07 : (c & 0x40) != 0;
+        if (*windowed == 2) snprintf(what, whatSize, "I ns=%d nr=%d", ns, (c >> 5) & 0x07);
+        else snprintf(what, whatSize, "I ns=%d", ns);
+    }
+    else {
+        int nr = *windowed ? (c >> 5) & 0x07 : (c & 0x80) != 0;
+        const char *type = (c & 0x1F) == 0x05 ? "RR" : (c & 0x1F) == 0x01 ? "REJ"
+                         : (c & 0x1F) == 0x0D ? "SREJ" : NULL;
+        if (type != NULL) snprintf(what, whatSize, "%s nr=%d", type, nr);
+        else snprintf(what, whatSize, "? C=0x%02X", c);
+    }
+}
+
+// FNV-1a, to recognise a frame sent again
+static uint32_t hashBody(const unsigned char *body, int size)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < size; i++) h = (h ^ body[i]) * 16777619u;
+    return h;
+}
+
+// Add the frame made of the stream's bytes "first" to "last" (its flags)
+static void addDataFrame(int direction, const Stream *stream, long first, long last,
+                         const unsigned char *body, int size)
+{
+    Frame *f = addFrame();
+    f->direction = direction;
+    f->timeNs = stream->bytes[first].inNs;
+    f->bytes = last - first + 1;
+    f->control = body[1];
+    f->headerOk = (body[0] ^ body[1]) == body[2];
+    f->arqWindowed = (body[1] == C_UA && size > 4) ? windowedMode(body + 3, size - 4) : -1;
+    f->rate = (body[1] == C_RATE && size > 4) ? rateParam(body + 3, size - 4) : -1;
+    f->hash = hashBody(body + 3, size - 3);
+
+    int lost = 0, corrupted = 0, unknown = 0, discarded = 0;
+    for (long i = first; i <= last; i++)
+    {
+        unsigned char fate = stream->bytes[i].fate;
+        if (fate == CAPTURE_DROP) lost = 1;
+        else if (fate == CAPTURE_CORRUPT) corrupted = 1;
+        else if (fate == FATE_DISCARDED) discarded = 1;
+        else if (fate == FATE_UNKNOWN) unknown = 1;
+    }
+    f->fate = lost ? "lost" : discarded ? "discarded" : corrupted ? "corrupted" : unknown ? "in flight" : "ok";
+    if (!lost && !discarded && !unknown) f->latencyNs = stream->bytes[last].outNs - f->timeNs;
+}
+
+// With the frames in time order: name them, and link each I-frame, SET or DISC
+// that repeats the last one with its control field (in its direction) as its
+// retransmission. In full duplex an I-frame may go again with a newer N(R).
+static void analyseFrames(void)
+{
+    static long lastSend[MAX_DIRECTIONS][256];
+    for (int d = 0; d < MAX_DIRECTIONS; d++)
+    for (int c = 0; c < 256; c++) lastSend[d][c] = -1;
+    int windowed[CAPTURE_MAX_LINKS] = {0}; // each link settles its own ARQ mode
+
+    for (long i = 0; i < nFrames; i++)
+    {
+        Frame *f = &frames[i];
+        if (f->direction < 0) continue;
+        describe(f, &windowed[f->direction / 2]);
+
+        unsigned char c = f->control;
+        f->send = 1;
+        f->firstNs = f->timeNs;
+        if (!f->headerOk || !((c & 0x01) == 0 || c == C_SET || c == C_DISC)) continue;
+
+        if ((c & 0x01) == 0 && windowed[f->direction / 2] == 2) c &= 0x1F;
+        long previous = lastSend[f->direction][c];
+        if (previous >= 0 && frames[previous].hash == f->hash) {
+            f->send = frames[previous].send + 1;
+            f->firstNs = frames[previous].firstNs;
+            frames[previous].nextSend = i;
+        }
+        lastSend[f->direction][c] = i;
+    }
+}
+
+// Split a stream into frames at its flags and destuff them
+static void findFrames(int direction, const Stream *stream)
+{
+    static unsigned char body[MAX_BODY];
+
+    long start = -1; // opening flag
+    int size = 0;
+    int escaped = 0;
+    for (long i = 0; i < stream->count; i++)
+    {
+        unsigned char b = stream->bytes[i].byte;
+        if (b == FLAG) {
+            if (start >= 0 && size >= 3) {
+                addDataFrame(direction, stream, start, i, body, size);
+            }
+            start = i;
+            size = 0;
+            escaped = 0;
+        }
+        else if (start >= 0) {
+            if (escaped) {
+                body[size++] = b ^ ESC_XOR;
+                escaped = 0;
+            }
+            else if (b == ESC) escaped = 1;
+            else body[size++] = b;
+            if (size == MAX_BODY) start = -1; // not a frame: hunt for the next flag
+        }
+    }
+}
+
+static int byTime(const void *a, const void *b)
+{
+    const Frame *x = a, *y = b;
+    return (x->timeNs > y->timeNs) - (x->timeNs < y->timeNs);
+}
+
+static void printSummary(void)
+{
+    for (int d = 0; d < 2 * nLinks; d++)
+    {
+        long count = 0, delivered = 0, corrupted = 0, lost = 0, resent = 0;
+        long long latencySum = 0, latencyMax = 0;
+        for (long i = 0; i < nFrames; i++)
+        {
+            const Frame *f = &frames[i];
+            if (f->direction != d) continue;
+            count++;
+            if (strcmp(f->fate, "corrupted") == 0) corrupted++;
+            if (strcmp(f->fate, "lost") == 0) lost++;
+            if (f->send > 1) resent++;
+            if (f->latencyNs >= 0) {
+                delivered++;
+                latencySum += f->latencyNs;
+                if (f->latencyNs > latencyMax) latencyMax = f->latencyNs;
+            }
+        }
+        printf("%s: %ld frames, %ld corrupted, %ld lost, %ld retransmissions", directionNames[d],
+               count, corrupted, lost, resent);
+        if (delivered > 0) {
+            printf("; latency mean %.3f ms, max %.3f ms", latencySum / 1e6 / delivered, latencyMax / 1e6);
+        }
+        printf("\n");
+    }
+}
+
+static void printRetransmissions(void)
+{
+    int any = 0;
+    for (long i = 0; i < nFrames; i++)
+    {
+        const Frame *f = &frames[i];
+        if (f->send != 1 || f->nextSend < 0) continue;
+        if (!any) printf("\nRetransmissions (ms, +since first sent):\n");
+        any = 1;
+
+        printf("  %-8s %-8s %10.3f %s", directionNames[f->direction], f->what, f->timeNs / 1e6, f->fate);
+        for (long next = f->nextSend; next >= 0; next = frames[next].nextSend)
+        {
+            const Frame *r = &frames[next];
+            printf(", %.3f (+%.3f) %s", r->timeNs / 1e6, (r->timeNs - f->timeNs) / 1e6, r->fate);
+        }
+        printf("\n");
+    }
+    if (!any) printf("\nNo retransmissions\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        printf("Usage: %s <capture file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    static Stream streams[MAX_DIRECTIONS];
+    memset(streams, 0, sizeof(streams));
+    struct CaptureHeader header;
+    int result = readCapture(file, streams, &header);
+    fclose(file);
+    if (result < 0) {
+        fprintf(stderr, "Error: %s is not a cable capture\n", argv[1]);
+        return 1;
+    }
+
+    nameDirections();
+    for (int d = 0; d < 2 * nLinks; d++) findFrames(d, &streams[d]);
+    qsort(frames, nFrames, sizeof(Frame), byTime);
+    analyseFrames();
+
+    printf("Capture at %u baud, propagation delay %u usec\n\n", header.baud, header.propUs);
+    printf("%10s  %-8s  %-12s %6s %11s  %s\n", "time ms", "dir", "frame", "bytes", "latency ms", "fate");
+    for (long i = 0; i < nFrames; i++)
+    {
+        const Frame *f = &frames[i];
+        if (f->direction < 0) {
+            if (nLinks > 1 && strncmp(f->what, "CABLE", 5) == 0) {
+                printf("%10.3f  --- %s (link %d) ---\n", f->timeNs / 1e6, f->what, f->link);
+            }
+            else printf("%10.3f  --- %s ---\n", f->timeNs / 1e6, f->what);
+            continue;
+        }
+        printf("%10.3f  %-8s  %-12s %6ld ", f->timeNs / 1e6, directionNames[f->direction], f->what, f->bytes);
+        if (f->latencyNs >= 0) printf("%11.3f", f->latencyNs / 1e6);
+        else printf("%11s", "-");
+        printf("  %s", f->fate);
+        if (f->send > 1) printf("  (retransmission %d, first sent at %.3f)", f->send - 1, f->firstNs / 1e6);
+        printf("\n");
+    }
+
+    printf("\n");
+    printSummary();
+    printRetransmissions();
+
+    free(frames);
+    for (int d = 0; d < MAX_DIRECTIONS; d++) free(streams[d].bytes);
+    return 0;
+}
@@ -0,0 +1,48 @@
+// Cable capture format.
+// Written by the cable's "capture <file>" command and read by cable_decode.
+// A CaptureHeader followed by one 16-byte CaptureRecord per event, in the
+// order the cable saw them, all in host byte order. Every byte entering the
+// cable gets an IN record and, once it leaves, one OUT, CORRUPT or DROP record
+// with the same direction and index, so the decoder can pair them up even
+// when a capture starts with bytes already in flight.
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "CBLCAP1"
+
+// Record events
+#define CAPTURE_IN 0        // byte read from the sending port
+#define CAPTURE_OUT 1       // byte written to the receiving port
+#define CAPTURE_CORRUPT 2   // written with bits flipped; "sent" holds the original
+#define CAPTURE_DROP 3      // lost: the cable was off, or dropped by the error model
+#define CAPTURE_CABLE_OFF 4
+#define CAPTURE_CABLE_ON 5
+#define CAPTURE_BAUD 6      // new baud rate in "index" (queues emptied)
+#define CAPTURE_PROP 7      // new propagation delay (usec) in "index" (queues emptied)
+#define CAPTURE_INSERT 8    // random byte written after byte "index" by the error model
+
+// Directions. With several links (cable --links), link k's are
+// 2k + CAPTURE_TX2RX and 2k + CAPTURE_RX2TX.
+#define CAPTURE_TX2RX 0
+#define CAPTURE_RX2TX 1
+#define CAPTURE_MAX_LINKS 4
+
+struct CaptureHeader {
+    char magic[8];
+    uint32_t baud;
+    uint32_t propUs;
+};
+
+struct CaptureRecord {
+    uint64_t timeNs;  // CLOCK_MONOTONIC since the capture started
+    uint32_t index;   // of the byte in its direction, counted since the cable started
+    uint8_t direction;
+    uint8_t event;
+    uint8_t byte;     // as written (IN: as read)
+    uint8_t sent;     // CORRUPT: as read
+};
+
+#endif // _CAPTURE_H_
@@ -1,35 +1,96 @@
 // Application layer protocol implementation
 #include "application_layer.h"
 #include "link_layer.h"
+#include "multilink.h"
+#include "file_pipeline.h"
+#include "lz.h"
+#include "checkpoint.h"
+#include "trace.h"
+#include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <sys/mman.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 
 // Control field values
 #define CTRL_DATA 0x01
 #define CTRL_START 0x02
 #define CTRL_END 0x03
+#define CTRL_DATA_LZ 0x04 // Data packet whose data field is LZ-compressed
 
 // TLV Types
 #define TLV_FILE_SIZE 0x00
 #define TLV_FILE_NAME 0x01
-
-#define MAX_PAYLOAD_SIZE 256
+#define TLV_COMPRESSION 0x02
+#define TLV_FILE_HASH 0x03     // XXH64 of the file: with the size, identifies it for resuming
+#define TLV_RESUME_OFFSET 0x04 // Data packets start at this byte (0 if absent)
+#define TLV_FILES_LEFT 0x05    // Files of the batch still to come after this one (0 if absent)
+#define TLV_DATA_PACKETS 0x06  // END: data packets sent since START (so a multilink receiver
+                               // knows when it has them all)
+#define TLV_RESUME_HASH 0x07   // START: block hash of the data before the resume offset
+#define TLV_DATA_HASH 0x08     // END: block hash of the whole file (see checkpoint.h)
+
+// TLV_COMPRESSION values
+#define COMPRESSION_NONE 0x00
+#define COMPRESSION_LZ 0x01 // Some data packets may be CTRL_DATA_LZ
+
+#define DATA_HEADER_SIZE 4 // C, N, L2, L1
+
+#define RESUME_ATTEMPTS 5         // Sessions in a row that may fail without progress
+#define CHECKPOINT_INTERVAL 16384 // Bytes of progress between checkpoint saves
+#define PACKET_HISTORY 8          // Recent packets kept: more than a window can hold
+#define TRANSFER_LINK_LOST -2     // The connection was dropped and could not be reopened
+
+// Contents of a START or END control packet
+typedef struct
+{
+    long fileSize;
+    char filename[256];
+    unsigned char compression; // COMPRESSION_* used for data packets
+    int resumable;             // The file hash is sent, so the transfer can be resumed
+    Checkpoint resume;         // File size, hash, resume offset and block hash up to it
+    int resumeHashed;          // START: the block hash up to the resume offset is sent
+    int filesLeft;             // Files of the batch still to come after this one
+    long dataPackets;          // END: data packets sent since START (-1 if absent)
+    int dataHashed;            // END: the block hash of the file is sent
+    uint64_t dataHash;
+} ControlInfo;
 
 // -------------------- HELPER FUNCTIONS --------------------
 
+/**
+ * Writes a TLV holding a big-endian number
+ * @param minLength Smallest number of value bytes to use
+ * @return Size of the TLV
+ */
+static int putNumberTlv(unsigned char *tlv, unsigned char type, uint64_t value, int minLength)
+{
+    int length = minLength;
+    while (length < 8 && (value >> (8 * length)) != 0) length++;
+
+    tlv[0] = type;
+    tlv[1] = length;
+    for (int i = 0; i < length; i++) {
+        tlv[2 + i] = value >> (8 * (length - 1 - i));
+    }
+    return 2 + length;
+}
+
 /**
  * Creates a control packet (START or END)
  * @param controlField CTRL_START or CTRL_END
- * @param filename Name of the file
- * @param fileSize Size of the file in bytes
+ * @param info File name and size, plus the optional fields to advertise
  * @param packet Output buffer for the packet
  * @return Size of the control packet
  */
-int buildControlPacket(unsigned char controlField, const char *filename,
-                       long fileSize, unsigned char *packet)
+int buildControlPacket(unsigned char controlField, const ControlInfo *info, unsigned char *packet)
 {
     int idx = 0;
 
@@ -42,7 +103,7 @@ int buildControlPacket(unsigned char controlField, const char *filename,
     // Calculate number of bytes needed for file size
     unsigned char sizeBytes[8];
     int numSizeBytes = 0;
-    long tempSize = fileSize;
+    long tempSize = info->fileSize;
 
     do {
         sizeBytes[numSizeBytes++] = tempSize & 0xFF;
@@ -58,12 +119,32 @@ int buildControlPacket(unsigned char controlField, const char *filename,
 
     // TLV for filename
     packet[idx++] = TLV_FILE_NAME;
-    int nameLen = strlen(filename);
+    int nameLen = strlen(info->filename);
     if (nameLen > 255) nameLen = 255; // Limit filename length
     packet[idx++] = nameLen;
-    memcpy(&packet[idx], filename, nameLen);
+    memcpy(&packet[idx], info->filename, nameLen);
     idx += nameLen;
 
+    // TLV for compression, left out when there is none so older receivers
+    // see the same packet as before
+    if (info->compression != COMPRESSION_NONE) {
+        packet[idx++] = TLV_COMPRESSION;
+        packet[idx++] = 1;
+        packet[idx++] = info->compression;
+    }
+
+    // TLVs for resuming and batches, also left out when not used
+    if (info->resumable) {
+        idx += putNumberTlv(&packet[idx], TLV_FILE_HASH, info->resume.fileHash, 8);
+        if (info->resume.offset > 0) {
+            idx += putNumberTlv(&packet[idx], TLV_RESUME_OFFSET, info->resume.offset, 1);
+            if (info->resumeHashed) idx += putNumberTlv(&packet[idx], TLV_RESUME_HASH, info->resume.dataHash, 8);
+        }
+    }
+    if (info->filesLeft > 0) idx += putNumberTlv(&packet[idx], TLV_FILES_LEFT, info->filesLeft, 1);
+    if (controlField == CTRL_END) idx += putNumberTlv(&packet[idx], TLV_DATA_PACKETS, info->dataPackets, 1);
+    if (info->dataHashed) idx += putNumberTlv(&packet[idx], TLV_DATA_HASH, info->dataHash, 8);
+
     return idx;
 }
 
@@ -71,16 +152,15 @@ int buildControlPacket(unsigned char controlField, const char *filename,
  * Parses a control packet to extract file information
  * @param packet The received control packet
  * @param packetSize Size of the packet
- * @param fileSize Output: extracted file size
- * @param filename Output: extracted filename
+ * @param info Output: the fields found (optional ones absent: none, 0)
  * @return 0 on success, -1 on error
  */
-int parseControlPacket(const unsigned char *packet, int packetSize,
-                       long *fileSize, char *filename)
+int parseControlPacket(const unsigned char *packet, int packetSize, ControlInfo *info)
 {
     int idx = 1; // Skip control field
-    *fileSize = 0;
-    filename[0] = '\0';
+    memset(info, 0, sizeof(*info));
+    info->compression = COMPRESSION_NONE;
+    info->dataPackets = -1;
 
     while (idx < packetSize) {
         unsigned char type = packet[idx++];
@@ -94,53 +174,435 @@ int parseControlPacket(const unsigned char *packet, int packetSize,
         if (type == TLV_FILE_SIZE) {
             // Parse file size (big-endian)
             for (int i = 0; i < length; i++) {
-                *fileSize = (*fileSize << 8) | packet[idx++];
+                info->fileSize = (info->fileSize << 8) | packet[idx++];
             }
         }
         else if (type == TLV_FILE_NAME) {
-            memcpy(filename, &packet[idx], length);
-            filename[length] = '\0';
+            memcpy(info->filename, &packet[idx], length);
+            info->filename[length] = '\0';
             idx += length;
         }
+        else if (type == TLV_COMPRESSION && length == 1) {
+            info->compression = packet[idx++];
+        }
+        else if ((type == TLV_FILE_HASH || type == TLV_RESUME_OFFSET || type == TLV_FILES_LEFT ||
+                  type == TLV_DATA_PACKETS || type == TLV_RESUME_HASH || type == TLV_DATA_HASH) && length <= 8) {
+            uint64_t value = 0;
+            for (int i = 0; i < length; i++) {
+                value = (value << 8) | packet[idx++];
+            }
+            if (type == TLV_FILE_HASH) {
+                info->resume.fileHash = value;
+                info->resumable = TRUE;
+            }
+            else if (type == TLV_RESUME_OFFSET) {
+                info->resume.offset = value;
+            }
+            else if (type == TLV_DATA_PACKETS) {
+                info->dataPackets = value;
+            }
+            else if (type == TLV_RESUME_HASH) {
+                info->resume.dataHash = value;
+                info->resumeHashed = TRUE;
+            }
+            else if (type == TLV_DATA_HASH) {
+                info->dataHash = value;
+                info->dataHashed = TRUE;
+            }
+            else {
+                info->filesLeft = value;
+            }
+        }
         else {
             // Unknown TLV, skip it
             idx += length;
         }
     }
 
+    info->resume.fileSize = info->fileSize;
+    if (info->resume.offset < 0 || info->resume.offset > info->fileSize || info->filesLeft < 0) {
+        printf("Error: Invalid resume offset or batch size\n");
+        return -1;
+    }
     return 0;
 }
 
 /**
- * Creates a data packet
+ * Creates the header of a data packet, to be sent followed by the data
+ * @param controlField CTRL_DATA or CTRL_DATA_LZ
  * @param sequenceNum Sequence number (0-255, wraps around)
- * @param data Data to send
- * @param dataSize Size of data
- * @param packet Output buffer for the packet
- * @return Size of the data packet
+ * @param dataSize Size of the data field
+ * @param header Output buffer (DATA_HEADER_SIZE bytes)
+ * @return DATA_HEADER_SIZE
  */
-int buildDataPacket(unsigned char sequenceNum, const unsigned char *data,
-                    int dataSize, unsigned char *packet)
+int buildDataHeader(unsigned char controlField, unsigned char sequenceNum, int dataSize,
+                    unsigned char *header)
 {
     int idx = 0;
 
-    packet[idx++] = CTRL_DATA;
-    packet[idx++] = sequenceNum;
-    packet[idx++] = (dataSize >> 8) & 0xFF; // L2 (high byte)
-    packet[idx++] = dataSize & 0xFF;        // L1 (low byte)
-
-    memcpy(&packet[idx], data, dataSize);
-    idx += dataSize;
+    header[idx++] = controlField;
+    header[idx++] = sequenceNum;
+    header[idx++] = (dataSize >> 8) & 0xFF; // L2 (high byte)
+    header[idx++] = dataSize & 0xFF;        // L1 (low byte)
 
     return idx;
 }
 
+// -------------------- LINK --------------------
+// Several ports separated by commas are one multilink connection: packets are
+// striped over them by multilink.c instead of going to the link layer directly.
+
+static int multilink = FALSE;
+
+// Full duplex (--duplex): the peer's packets are taken in after every write
+// (see FULL DUPLEX below)
+static int duplex = FALSE;
+static int pumpIncoming();
+
+/**
+ * Where a received packet goes in the multilink order: data packets by
+ * sequence number, END after the data packets it counts, and data that
+ * follows END waits for the next START
+ */
+static void classifyPacket(const unsigned char *packet, int packetSize, MlOrder *order)
+{
+    ControlInfo info;
+
+    order->isData = (packet[0] == CTRL_DATA || packet[0] == CTRL_DATA_LZ) && packetSize > 1;
+    order->sequence = order->isData ? packet[1] : 0;
+    order->after = 0;
+    order->closes = FALSE;
+    if (packet[0] == CTRL_END) {
+        order->after = (parseControlPacket(packet, packetSize, &info) == 0) ? info.dataPackets : -1;
+        order->closes = TRUE;
+    }
+}
+
+static int linkOpen(const char *ports, LinkLayer ll)
+{
+    return multilink ? mlopen(ports, ll, classifyPacket) : llopen(ll);
+}
+
+static int linkWritev(const struct iovec *parts, int nParts)
+{
+    int written = multilink ? mlwritev(parts, nParts) : llwritev(parts, nParts);
+    if (written >= 0 && duplex && pumpIncoming() < 0) return -1;
+    return written;
+}
+
+static int linkWrite(const unsigned char *buf, int bufSize)
+{
+    struct iovec part = {(void *)buf, bufSize};
+    return linkWritev(&part, 1);
+}
+
+static int linkPayloadSize()
+{
+    return multilink ? mlpayloadSize() : llpayloadSize();
+}
+
+static int linkFlush()
+{
+    int flushed = multilink ? mlflush() : llflush();
+    if (flushed >= 0 && duplex && pumpIncoming() < 0) return -1;
+    return flushed;
+}
+
+static int linkRead(unsigned char *packet)
+{
+    return multilink ? mlread(packet) : llread(packet);
+}
+
+// Multilink links close through their own packet (see multilink.h)
+static int linkDisconnected()
+{
+    return multilink ? FALSE : lldisconnected();
+}
+
+static int linkClose(LinkLayerRole role)
+{
+    return multilink ? mlclose() : llclose(role);
+}
+
 // -------------------- TRANSMITTER --------------------
 
+typedef struct
+{
+    unsigned char sequenceNum;
+    int packetCount;
+    int compressedCount;
+    int linkLost;     // A packet could not be delivered (as opposed to a file error)
+    long fileBytes;   // Offset in the file of the next data packet
+    long sentBytes;   // File data sent, repeats after a reconnection included
+    long packetBytes; // Data field bytes after compression
+    DataHash hash;    // Block hash of the file up to fileBytes
+
+    // Resuming (checkpointPath is NULL when disabled)
+    const char *checkpointPath;
+    Checkpoint checkpoint;           // Offset: file data the receiver has acknowledged, down
+                                     // to a block boundary
+    long sessionStart;               // Offset the current session started at
+    int sessionPackets;              // Data packets sent in the current session
+    long packetEnds[PACKET_HISTORY]; // File offset after each recent data packet
+} SendState;
+
+static void printProgress(int packetCount, long done, long fileSize)
+{
+    if (packetCount % 10 == 0 || done == fileSize) {
+        long permille = (fileSize > 0) ? done * 1000 / fileSize : 1000;
+        TRACE(TRACE_INFO, "Progress: %ld/%ld bytes (%ld.%ld%%)\n", done, fileSize, permille / 10, permille % 10);
+    }
+}
+
+// File offset up to which the receiver has acknowledged every data packet.
+// The frames still pending in the link layer are the session's latest packets.
+static long acknowledgedOffset(const SendState *state)
+{
+    int acked = state->sessionPackets - llpending();
+    if (acked <= 0) return state->sessionStart;
+    return state->packetEnds[(acked - 1) % PACKET_HISTORY];
+}
+
+// Save the acknowledged offset, down to a block boundary: always if "force",
+// otherwise every CHECKPOINT_INTERVAL bytes.
+static void saveProgress(SendState *state, int force)
+{
+    long offset = acknowledgedOffset(state) / HASH_BLOCK_SIZE * HASH_BLOCK_SIZE;
+    if (!force && offset - state->checkpoint.offset < CHECKPOINT_INTERVAL) return;
+    if (dataHashAt(&state->hash, offset, &state->checkpoint.dataHash) < 0) return;
+
+    state->checkpoint.offset = offset;
+    if (checkpointSave(state->checkpointPath, &state->checkpoint) < 0) {
+        printf("Warning: Cannot save checkpoint '%s'\n", state->checkpointPath);
+    }
+}
+
+/**
+ * Sends one data packet: its header followed by the data, compressed first
+ * if "compress" is set and the data gets smaller
+ * @return 0 on success, -1 on error
+ */
+static int sendDataPacket(SendState *state, const unsigned char *data, int dataSize,
+                          int compress, long fileSize)
+{
+    unsigned char header[DATA_HEADER_SIZE];
+    unsigned char packed[MAX_PAYLOAD_SIZE];
+    unsigned char controlField = CTRL_DATA;
+    int fieldSize = dataSize;
+    const unsigned char *field = data;
+
+    if (compress) {
+        int packedSize = lzCompress(data, dataSize, packed, dataSize - 1);
+        if (packedSize > 0) {
+            controlField = CTRL_DATA_LZ;
+            field = packed;
+            fieldSize = packedSize;
+            state->compressedCount++;
+        }
+    }
+
+    struct iovec packet[2] = {
+        {header, buildDataHeader(controlField, state->sequenceNum, fieldSize, header)},
+        {(void *)field, fieldSize},
+    };
+    if (linkWritev(packet, 2) < 0) {
+        printf("Error: Failed to send data packet %d\n", state->sequenceNum);
+        state->linkLost = TRUE;
+        return -1;
+    }
+
+    dataHashUpdate(&state->hash, data, dataSize);
+    state->fileBytes += dataSize;
+    state->sentBytes += dataSize;
+    state->packetBytes += fieldSize;
+    state->packetCount++;
+    state->sequenceNum = (state->sequenceNum + 1) % 256; // Wrap around at 256
+    printProgress(state->packetCount, state->fileBytes, fileSize);
+
+    state->packetEnds[state->sessionPackets % PACKET_HISTORY] = state->fileBytes;
+    state->sessionPackets++;
+    if (state->checkpointPath != NULL) saveProgress(state, FALSE);
+    return 0;
+}
+
+/**
+ * Sends the file data from a read-only mapping, starting at state->fileBytes:
+ * each packet is a slice of the mapping, handed to the link layer as is unless
+ * it is compressed
+ * @return 0 on success, -1 on error
+ */
+static int sendMappedData(FILE *file, long fileSize, int compress, SendState *state)
+{
+    if (state->fileBytes == fileSize) return 0;
+
+    unsigned char *map = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    madvise(map, fileSize, MADV_SEQUENTIAL);
+
+    int result = 0;
+    while (state->fileBytes < fileSize) {
+        int dataSize = linkPayloadSize() - DATA_HEADER_SIZE;
+        if (dataSize > fileSize - state->fileBytes) dataSize = fileSize - state->fileBytes;
+
+        if (sendDataPacket(state, map + state->fileBytes, dataSize, compress, fileSize) < 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    munmap(map, fileSize);
+    return result;
+}
+
+/**
+ * Sends the file data through the prefetching reader pipeline, starting at
+ * state->fileBytes
+ * @return 0 on success, -1 on error
+ */
+static int sendStreamedData(FILE *file, const char *filename, long fileSize, int compress,
+                            SendState *state)
+{
+    // File chunks are prefetched by a reader thread while frames go out
+    FilePipeline *reader = NULL;
+    if (fseek(file, state->fileBytes, SEEK_SET) == 0) reader = pipelineOpenReader(file);
+    if (reader == NULL) {
+        printf("Error: Cannot start file reader\n");
+        return -1;
+    }
+
+    // Each packet fills the payload the link layer currently recommends
+    // (it shrinks on a noisy line)
+    unsigned char buffer[MAX_PAYLOAD_SIZE];
+    int bytesRead;
+
+    while ((bytesRead = pipelineRead(reader, buffer, linkPayloadSize() - DATA_HEADER_SIZE)) > 0) {
+        if (sendDataPacket(state, buffer, bytesRead, compress, fileSize) < 0) {
+            pipelineClose(reader);
+            return -1;
+        }
+    }
+
+    pipelineClose(reader);
+    if (bytesRead < 0) {
+        printf("Error: Failed to read file '%s'\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sends a control packet, noting a link failure in the state
+ * @return 0 on success, -1 on error
+ */
+static int sendControlPacket(SendState *state, unsigned char controlField, ControlInfo *info)
+{
+    unsigned char controlPacket[512];
+    info->resumable = (state->checkpointPath != NULL);
+    info->resume = state->checkpoint;
+    info->resumeHashed = TRUE;
+    info->dataPackets = state->sessionPackets;
+    info->dataHashed = (controlField == CTRL_END);
+    info->dataHash = dataHashDigest(&state->hash);
+    int controlSize = buildControlPacket(controlField, info, controlPacket);
+
+    printf("Sending %s control packet...\n", controlField == CTRL_START ? "START" : "END");
+    if (linkWrite(controlPacket, controlSize) < 0) {
+        printf("Error: Failed to send %s packet\n", controlField == CTRL_START ? "START" : "END");
+        state->linkLost = TRUE;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sends START, the file data from the checkpoint offset (0 if not resuming)
+ * and END over an open connection
+ * @param info START/END fields other than the resume ones
+ * @return 0 on success, -1 on error (state->linkLost tells if the link failed)
+ */
+static int sendSession(FILE *file, const char *filename, ControlInfo *info,
+                       const ApplicationOptions *options, SendState *state)
+{
+    long fileSize = info->fileSize;
+    state->linkLost = FALSE;
+    state->sequenceNum = 0;
+    state->sessionPackets = 0;
+    state->sessionStart = state->fileBytes = state->checkpoint.offset;
+    dataHashInit(&state->hash, state->checkpoint.offset, state->checkpoint.dataHash);
+
+    if (sendControlPacket(state, CTRL_START, info) < 0) return -1;
+
+    // Send data packets
+    if (state->fileBytes > 0) printf("Resuming at byte %ld of %ld\n", state->fileBytes, fileSize);
+    printf("Sending data packets...\n");
+    int result = options->useMmap ? sendMappedData(file, fileSize, options->compress, state)
+                                  : sendStreamedData(file, filename, fileSize, options->compress, state);
+    if (result < 0) return -1;
+    traceFlush();
+    printf("Data transmission complete: %d packets, %ld bytes\n", state->packetCount, state->fileBytes);
+
+    if (sendControlPacket(state, CTRL_END, info) < 0) return -1;
+
+    // Nothing counts as delivered until it is acknowledged
+    if (linkFlush() < 0) {
+        printf("Error: Outstanding frames were not acknowledged\n");
+        state->linkLost = TRUE;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Identifies the file and picks up the checkpoint of an earlier attempt, if
+ * it is for the same file
+ * @return 0 on success, -1 on error
+ */
+static int prepareResume(FILE *file, const char *checkpointPath, long fileSize, SendState *state)
+{
+    state->checkpointPath = checkpointPath;
+    state->checkpoint.fileSize = fileSize;
+    if (checkpointHashFile(file, &state->checkpoint.fileHash) < 0) {
+        printf("Error: Cannot read file to hash it\n");
+        return -1;
+    }
+
+    Checkpoint saved;
+    if (checkpointLoad(checkpointPath, &saved) == 0 && saved.fileSize == fileSize &&
+        saved.fileHash == state->checkpoint.fileHash) {
+        state->checkpoint = saved;
+        printf("Checkpoint found: %ld/%ld bytes already delivered\n", saved.offset, fileSize);
+    }
+    return 0;
+}
+
+/**
+ * Reopens the connection after a failure, as long as the attempts without
+ * progress allow it
+ * @param attempts Sessions in a row that failed without progress (updated)
+ * @return 0 on success, -1 if giving up (the connection is closed)
+ */
+static int reconnect(LinkLayer *ll, int *attempts)
+{
+    llabort();
+    while (*attempts < RESUME_ATTEMPTS) {
+        printf("Reconnecting (attempt %d/%d)...\n", *attempts + 1, RESUME_ATTEMPTS);
+        if (llopen(*ll) >= 0) return 0;
+        (*attempts)++;
+    }
+    printf("Error: Giving up after %d attempts without progress\n", RESUME_ATTEMPTS);
+    return -1;
+}
+
 /**
  * Transmits a file over the serial port
+ * @param filesLeft Files of the batch to be sent after this one
+ * @return 0 on success, TRANSFER_LINK_LOST if resuming gave up with the
+ * connection closed, -1 on other errors
  */
-int transmitFile(LinkLayer *ll, const char *filename)
+int transmitFile(LinkLayer *ll, const char *filename, const ApplicationOptions *options, int filesLeft)
 {
     // Open file
     FILE *file = fopen(filename, "rb");
@@ -156,202 +618,758 @@ int transmitFile(LinkLayer *ll, const char *filename)
 
     printf("File to send: %s (%ld bytes)\n", filename, fileSize);
 
+    SendState state;
+    memset(&state, 0, sizeof(state));
+    char checkpointPath[PATH_MAX];
+    if (options->resume) {
+        snprintf(checkpointPath, sizeof(checkpointPath), "%s" CHECKPOINT_SUFFIX, filename);
+        if (prepareResume(file, checkpointPath, fileSize, &state) < 0) {
+            fclose(file);
+            return -1;
+        }
+    }
+
+    ControlInfo info;
+    memset(&info, 0, sizeof(info));
+    info.fileSize = fileSize;
+    info.compression = options->compress ? COMPRESSION_LZ : COMPRESSION_NONE;
+    info.filesLeft = filesLeft;
+
     // Extract just the filename (without path)
-    char *baseFilename = basename((char *)filename);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", filename);
+    snprintf(info.filename, sizeof(info.filename), "%s", basename(path));
+
+    // One session per connection; with resuming, reconnect after the link fails.
+    // Sessions restart at a block boundary, so progress counts past the
+    // furthest point acknowledged so far
+    int attempts = 0;
+    long furthest = state.checkpoint.offset;
+    int result;
+    while ((result = sendSession(file, filename, &info, options, &state)) < 0)
+    {
+        if (!state.linkLost || state.checkpointPath == NULL) break;
+
+        long acknowledged = acknowledgedOffset(&state);
+        saveProgress(&state, TRUE);
+        printf("Link lost with %ld/%ld bytes acknowledged, resuming at %ld\n", acknowledged, fileSize,
+               state.checkpoint.offset);
+        attempts = (acknowledged > furthest) ? 0 : attempts + 1;
+        if (acknowledged > furthest) furthest = acknowledged;
+        if (reconnect(ll, &attempts) < 0) {
+            result = TRANSFER_LINK_LOST;
+            break;
+        }
+    }
+    fclose(file);
+    if (result < 0) return result;
+    if (state.checkpointPath != NULL) checkpointRemove(state.checkpointPath);
+
+    if (options->compress) {
+        printf("Compression: %ld bytes sent as %ld (ratio %.2f), %d/%d packets compressed\n",
+               state.sentBytes, state.packetBytes,
+               state.packetBytes > 0 ? (double)state.sentBytes / state.packetBytes : 1.0,
+               state.compressedCount, state.packetCount);
+    }
+    printf("File transfer successful!\n");
+    return 0;
+}
 
-    // Build and send START control packet
-    unsigned char controlPacket[512];
-    int controlSize = buildControlPacket(CTRL_START, baseFilename, fileSize, controlPacket);
+// -------------------- RECEIVER --------------------
+
+static double nowSeconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Preallocates the output file to the advertised size and maps it
+ * @param map Output: shared writable mapping (NULL for an empty file)
+ * @return 0 on success, -1 on error
+ */
+static int mapOutputFile(FILE *file, long fileSize, unsigned char **map)
+{
+    *map = NULL;
+    if (fileSize == 0) return 0;
+
+    // Reserve the blocks up front; ftruncate still sets the size where
+    // fallocate is not supported
+    int fd = fileno(file);
+    if (posix_fallocate(fd, 0, fileSize) != 0 && ftruncate(fd, fileSize) != 0) {
+        perror("ftruncate");
+        return -1;
+    }
 
-    printf("Sending START control packet...\n");
-    if (llwrite(controlPacket, controlSize) < 0) {
-        printf("Error: Failed to send START packet\n");
-        fclose(file);
+    unsigned char *mapped = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        perror("mmap");
         return -1;
     }
+    *map = mapped;
+    return 0;
+}
 
-    // Send data packets
-    unsigned char buffer[MAX_PAYLOAD_SIZE];
-    unsigned char dataPacket[MAX_PAYLOAD_SIZE + 4];
-    unsigned char sequenceNum = 0;
-    int bytesRead;
-    long totalSent = 0;
-    int packetCount = 0;
+/**
+ * Stores received data at "offset": copied into the mapping if there is
+ * one, otherwise queued on the writer pipeline
+ * @return 0 on success, -1 on error
+ */
+static int storeData(FilePipeline *writer, unsigned char *map, long fileSize, long offset,
+                     const unsigned char *data, int dataSize)
+{
+    if (writer != NULL) return pipelineWrite(writer, data, dataSize) < 0 ? -1 : 0;
 
-    printf("Sending data packets...\n");
-    while ((bytesRead = fread(buffer, 1, MAX_PAYLOAD_SIZE, file)) > 0) {
-        int packetSize = buildDataPacket(sequenceNum, buffer, bytesRead, dataPacket);
+    if (offset + dataSize > fileSize) {
+        printf("Error: Data beyond the advertised file size\n");
+        return -1;
+    }
+    memcpy(map + offset, data, dataSize);
+    return 0;
+}
 
-        if (llwrite(dataPacket, packetSize) < 0) {
-            printf("Error: Failed to send data packet %d\n", sequenceNum);
-            fclose(file);
-            return -1;
-        }
+typedef struct
+{
+    const char *target;   // Output file or directory given on the command line
+    int targetIsDir;
+    int first;            // First file of the session
+    char filename[PATH_MAX]; // Output file, chosen at the first START packet
+    int useMmap;
+    FILE *file;           // Output file, NULL until a START packet arrives
+    FilePipeline *writer; // Streamed mode
+    unsigned char *map;   // Mmap mode (NULL for an empty file)
+    long fileSize;
+    long received;        // Offset in the file of the next data packet
+    DataHash hash;        // Block hash of the file up to "received"
+    int hashKnown;        // FALSE if the hash of the data before the resume offset is unknown
+    int hashChecked;      // END carried the file's block hash, and it was compared
+    int hashMismatch;
+    uint64_t expectedHash;
+    long writerStart;     // Offset at which the writer pipeline started
+    int writeFailed;
+    int filesLeft;        // Files of the batch still to come after this one
+
+    // Data packets, from the first START on
+    unsigned char expectedSeq;
+    int packetCount;
+    int compressedCount;
+    long dataBytes;       // File data received, repeats after a reconnection included
+    long packetBytes;     // Data field bytes before decompression
+    double start;
+
+    // Resuming (only if the transmitter sent the file hash)
+    int resumable;
+    char checkpointPath[PATH_MAX];
+    Checkpoint checkpoint; // Offset: as of the last save, down to a block boundary
+} ReceiveState;
+
+static int sameFile(const Checkpoint *a, const Checkpoint *b)
+{
+    return a->fileSize == b->fileSize && a->fileHash == b->fileHash;
+}
 
-        totalSent += bytesRead;
-        packetCount++;
-        sequenceNum = (sequenceNum + 1) % 256; // Wrap around at 256
+// Bytes of the file that are stored, not only queued for the writer thread.
+static long storedBytes(const ReceiveState *rx)
+{
+    if (rx->writer != NULL) return rx->writerStart + pipelineWritten(rx->writer);
+    return rx->received;
+}
 
-        // Progress indicator
-        if (packetCount % 10 == 0 || totalSent == fileSize) {
-            printf("Progress: %ld/%ld bytes (%.1f%%)\n",
-                   totalSent, fileSize, (totalSent * 100.0) / fileSize);
-        }
+// Save the stored offset, down to a block boundary: always if "force",
+// otherwise every CHECKPOINT_INTERVAL bytes.
+static void saveCheckpoint(ReceiveState *rx, int force)
+{
+    if (!rx->resumable || rx->writeFailed) return;
+    long offset = storedBytes(rx) / HASH_BLOCK_SIZE * HASH_BLOCK_SIZE;
+    if (!force && offset - rx->checkpoint.offset < CHECKPOINT_INTERVAL) return;
+    if (dataHashAt(&rx->hash, offset, &rx->checkpoint.dataHash) < 0) return;
+
+    rx->checkpoint.offset = offset;
+    if (checkpointSave(rx->checkpointPath, &rx->checkpoint) < 0) {
+        printf("Warning: Cannot save checkpoint '%s'\n", rx->checkpointPath);
+    }
+}
+
+// Bytes of the file identified by "resume" that are already stored: those of
+// the current session, or of an earlier run as recorded in its checkpoint.
+// Returns -1 if there are none.
+static long availableBytes(const ReceiveState *rx, const Checkpoint *resume)
+{
+    if (rx->file != NULL) {
+        return (rx->resumable && sameFile(&rx->checkpoint, resume)) ? rx->received : -1;
+    }
+
+    Checkpoint saved;
+    if (checkpointLoad(rx->checkpointPath, &saved) == 0 && sameFile(&saved, resume)) {
+        return saved.offset;
     }
+    return -1;
+}
+
+// Block hash of the stored data before resume->offset, which must be available:
+// kept from the current session, or read back from the file of an earlier run.
+// Returns -1 if it is not known.
+static int storedHash(const ReceiveState *rx, const Checkpoint *resume, uint64_t *chain)
+{
+    if (rx->file != NULL) return dataHashAt(&rx->hash, resume->offset, chain);
 
+    FILE *file = fopen(rx->filename, "rb");
+    if (file == NULL) return -1;
+    int result = dataHashFile(file, resume->offset, chain);
     fclose(file);
-    printf("Data transmission complete: %d packets, %ld bytes\n", packetCount, totalSent);
+    return result;
+}
 
-    // Build and send END control packet
-    controlSize = buildControlPacket(CTRL_END, baseFilename, fileSize, controlPacket);
+/**
+ * Picks where a received file is written. Into a directory target, under the
+ * name from the START packet; otherwise the first file goes to the target and
+ * the rest of a batch next to it, each under its own name
+ * @param path Output: the file to write (PATH_MAX bytes)
+ * @return 0 on success, -1 if the name cannot be used
+ */
+static int outputPath(const ReceiveState *rx, const char *name, char *path)
+{
+    if (!rx->targetIsDir && rx->first) {
+        snprintf(path, PATH_MAX, "%s", rx->target);
+        return 0;
+    }
 
-    printf("Sending END control packet...\n");
-    if (llwrite(controlPacket, controlSize) < 0) {
-        printf("Error: Failed to send END packet\n");
+    // Only the last component of the name is used, so nothing lands outside the directory
+    const char *base = strrchr(name, '/');
+    base = (base != NULL) ? base + 1 : name;
+    if (base[0] == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+        printf("Error: Invalid file name '%s'\n", name);
         return -1;
     }
 
-    printf("File transfer successful!\n");
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", rx->target);
+    if (snprintf(path, PATH_MAX, "%s/%s", rx->targetIsDir ? dir : dirname(dir), base) >= PATH_MAX) {
+        printf("Error: File name too long '%s'\n", name);
+        return -1;
+    }
     return 0;
 }
 
-// -------------------- RECEIVER --------------------
+/**
+ * Opens the output file to receive data from "offset" on: created empty for
+ * offset 0, otherwise kept and cut back to "offset"
+ * @return 0 on success, -1 on error
+ */
+static int openOutput(ReceiveState *rx, long offset)
+{
+    // Read access is needed to map the file
+    const char *mode = (offset > 0) ? "r+b" : (rx->useMmap ? "w+b" : "wb");
+    rx->file = fopen(rx->filename, mode);
+    if (!rx->file) {
+        printf("Error: Cannot create file '%s'\n", rx->filename);
+        return -1;
+    }
+    rx->received = offset;
+
+    // Received data is either placed straight into a mapping of the
+    // preallocated file or stored by a writer thread in large writes
+    if (rx->useMmap) {
+        if (mapOutputFile(rx->file, rx->fileSize, &rx->map) < 0) {
+            printf("Error: Cannot map file '%s'\n", rx->filename);
+            fclose(rx->file);
+            rx->file = NULL;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (offset > 0 && (ftruncate(fileno(rx->file), offset) != 0 || fseek(rx->file, offset, SEEK_SET) != 0)) {
+        perror("ftruncate");
+        fclose(rx->file);
+        rx->file = NULL;
+        return -1;
+    }
+    rx->writerStart = offset;
+    rx->writer = pipelineOpenWriter(rx->file);
+    if (rx->writer == NULL) {
+        printf("Error: Cannot start file writer\n");
+        fclose(rx->file);
+        rx->file = NULL;
+        return -1;
+    }
+    return 0;
+}
 
 /**
- * Receives a file over the serial port
+ * Writes out everything received and closes the output file, if open
+ * @return 0 on success, -1 if the file could not be written
  */
-int receiveFile(LinkLayer *ll, const char *filename)
+static int closeOutput(ReceiveState *rx)
 {
-    unsigned char packet[MAX_PAYLOAD_SIZE * 2];
-    int packetSize;
-    long expectedFileSize = 0;
-    long totalReceived = 0;
-    int packetCount = 0;
-    char receivedFilename[256];
-    FILE *file = NULL;
+    if (rx->file == NULL) return rx->writeFailed ? -1 : 0;
 
-    printf("Waiting for START control packet...\n");
+    if (rx->writer != NULL && pipelineClose(rx->writer) < 0) rx->writeFailed = TRUE;
+    rx->writer = NULL;
+    if (rx->map != NULL) {
+        munmap(rx->map, rx->fileSize);
+        rx->map = NULL;
+    }
+    // Do not leave a zero-filled tail after a short transfer
+    if (rx->useMmap && rx->received < rx->fileSize && ftruncate(fileno(rx->file), rx->received) != 0) {
+        rx->writeFailed = TRUE;
+    }
+    if (fclose(rx->file) != 0) rx->writeFailed = TRUE;
+    rx->file = NULL;
+    return rx->writeFailed ? -1 : 0;
+}
 
-    // Wait for START control packet
-    while (1) {
-        packetSize = llread(packet);
+/**
+ * Handles a START packet. The first one opens the output file; a later one
+ * means the transmitter reconnected, and reception restarts at the offset it
+ * asks for, as long as the data before it is here
+ * @return 0 on success, -1 on error
+ */
+static int beginSession(ReceiveState *rx, const unsigned char *packet, int packetSize)
+{
+    ControlInfo info;
+    uint64_t chain = 0;
+    int hashKnown = TRUE;
 
-        if (packetSize < 0) {
-            continue; // Error reading, retry
+    printf("START packet received\n");
+    if (parseControlPacket(packet, packetSize, &info) < 0) {
+        printf("Error: Failed to parse START packet\n");
+        return -1;
+    }
+    printf("File info - Name: %s, Size: %ld bytes%s\n", info.filename, info.fileSize,
+           info.compression == COMPRESSION_LZ ? ", LZ compressed" : "");
+    if (info.filesLeft > 0) printf("Batch: %d more file(s) after this one\n", info.filesLeft);
+
+    if (rx->filename[0] == '\0') {
+        if (outputPath(rx, info.filename, rx->filename) < 0) return -1;
+        if (snprintf(rx->checkpointPath, sizeof(rx->checkpointPath), "%s" CHECKPOINT_SUFFIX,
+                     rx->filename) >= (int)sizeof(rx->checkpointPath)) {
+            printf("Error: File name too long '%s'\n", rx->filename);
+            return -1;
         }
+        printf("Writing to %s\n", rx->filename);
+    }
 
-        if (packetSize > 0 && packet[0] == CTRL_START) {
-            printf("START packet received\n");
-
-            if (parseControlPacket(packet, packetSize, &expectedFileSize, receivedFilename) < 0) {
-                printf("Error: Failed to parse START packet\n");
-                return -1;
-            }
+    if (info.resume.offset > 0) {
+        long available = availableBytes(rx, &info.resume);
+        if (available < info.resume.offset) {
+            printf("Error: Cannot resume at byte %ld, only %ld bytes of this file are stored\n",
+                   info.resume.offset, available > 0 ? available : 0);
+            return -1;
+        }
 
-            printf("File info - Name: %s, Size: %ld bytes\n", receivedFilename, expectedFileSize);
-            break;
+        // The data kept must be the data the transmitter has before the offset
+        int known = (storedHash(rx, &info.resume, &chain) == 0);
+        if (!known && rx->file == NULL) {
+            printf("Error: Cannot read the %ld bytes stored in '%s'\n", info.resume.offset, rx->filename);
+            return -1;
+        }
+        if (known && info.resumeHashed && chain != info.resume.dataHash) {
+            printf("Error: The %ld bytes stored do not match the transmitter's file\n", info.resume.offset);
+            return -1;
+        }
+        if (!known && info.resumeHashed) {
+            printf("Warning: The %ld bytes stored cannot be verified\n", info.resume.offset);
+            chain = info.resume.dataHash;
+            known = TRUE;
         }
+        hashKnown = known;
+        printf("Resuming at byte %ld of %ld\n", info.resume.offset, info.fileSize);
+    }
+    else if (rx->file != NULL) {
+        printf("Transmitter started over\n");
     }
 
-    // Open output file
-    file = fopen(filename, "wb");
-    if (!file) {
-        printf("Error: Cannot create file '%s'\n", filename);
+    if (closeOutput(rx) < 0) {
+        printf("Error: File '%s' could not be written\n", rx->filename);
         return -1;
     }
+    rx->fileSize = info.fileSize;
+    rx->filesLeft = info.filesLeft;
+    rx->resumable = info.resumable;
+    rx->checkpoint = info.resume;
+    dataHashInit(&rx->hash, info.resume.offset, chain);
+    rx->hashKnown = hashKnown;
+    if (openOutput(rx, info.resume.offset) < 0) return -1;
+    saveCheckpoint(rx, TRUE);
+    return 0;
+}
 
-    printf("Receiving data packets...\n");
+/**
+ * Prepares to receive a file: packets before its first START are ignored
+ * @param target Output file, or directory to write files into under their own names
+ * @param first TRUE for the first file of the session
+ */
+static void startReceive(ReceiveState *rx, const char *target, int targetIsDir, int first, int useMmap)
+{
+    memset(rx, 0, sizeof(*rx));
+    rx->target = target;
+    rx->targetIsDir = targetIsDir;
+    rx->first = first;
+    rx->useMmap = useMmap;
 
-    // Receive data packets
-    unsigned char expectedSeq = 0;
-    while (1) {
-        packetSize = llread(packet);
+    printf("Waiting for START control packet...\n");
+}
 
-        if (packetSize < 0) {
-            continue; // Error reading, retry
-        }
+/**
+ * Handles a received data packet
+ */
+static void receiveData(ReceiveState *rx, const unsigned char *packet, int packetSize)
+{
+    unsigned char unpacked[MAX_PAYLOAD_SIZE]; // Data of a CTRL_DATA_LZ packet
+    unsigned char controlField = packet[0];
 
-        if (packetSize == 0) {
-            continue; // Empty packet
-        }
+    // Parse data packet
+    unsigned char sequenceNum = packet[1];
+    int dataLength = (packet[2] << 8) | packet[3];
 
-        unsigned char controlField = packet[0];
+    // Check sequence number (optional - for debugging)
+    if (sequenceNum != rx->expectedSeq) {
+        printf("Warning: Sequence mismatch (expected: %d, got: %d)\n",
+               rx->expectedSeq, sequenceNum);
+    }
+    rx->expectedSeq = (rx->expectedSeq + 1) % 256;
 
-        if (controlField == CTRL_END) {
-            printf("END packet received\n");
+    // Validate data length
+    if (DATA_HEADER_SIZE + dataLength > packetSize) {
+        printf("Error: Invalid data packet length\n");
+        return;
+    }
 
-            // Verify file size
-            long receivedFileSize = 0;
-            char endFilename[256];
-            parseControlPacket(packet, packetSize, &receivedFileSize, endFilename);
+    const unsigned char *data = &packet[DATA_HEADER_SIZE];
+    rx->packetBytes += dataLength;
+    if (controlField == CTRL_DATA_LZ) {
+        dataLength = lzDecompress(data, dataLength, unpacked, sizeof(unpacked));
+        if (dataLength < 0) {
+            printf("Error: Corrupt compressed data packet\n");
+            return;
+        }
+        data = unpacked;
+        rx->compressedCount++;
+    }
 
-            if (receivedFileSize != expectedFileSize) {
-                printf("Warning: File size mismatch (expected: %ld, received: %ld)\n",
-                       expectedFileSize, receivedFileSize);
-            }
+    // Write data to file
+    if (!rx->writeFailed && storeData(rx->writer, rx->map, rx->fileSize, rx->received,
+                                      data, dataLength) < 0) {
+        printf("Error: Failed to write file '%s'\n", rx->filename);
+        rx->writeFailed = TRUE;
+    }
+    dataHashUpdate(&rx->hash, data, dataLength);
+    rx->received += dataLength;
+    rx->dataBytes += dataLength;
+    rx->packetCount++;
+    saveCheckpoint(rx, FALSE);
+
+    // Progress indicator
+    printProgress(rx->packetCount, rx->received, rx->fileSize);
+}
 
-            if (totalReceived != expectedFileSize) {
-                printf("Warning: Data size mismatch (expected: %ld, got: %ld)\n",
-                       expectedFileSize, totalReceived);
-            }
+/**
+ * Handles a received packet
+ * @return 1 once END has arrived, 0 while more packets are expected, -1 on error
+ */
+static int receivePacket(ReceiveState *rx, const unsigned char *packet, int packetSize)
+{
+    unsigned char controlField = packet[0];
+    int started = (rx->file != NULL);
 
-            break;
+    if (controlField == CTRL_START) {
+        // A START after the first means the transmitter reconnected
+        if (beginSession(rx, packet, packetSize) < 0) {
+            closeOutput(rx);
+            return -1;
         }
-        else if (controlField == CTRL_DATA) {
-            // Parse data packet
-            unsigned char sequenceNum = packet[1];
-            int dataLength = (packet[2] << 8) | packet[3];
-
-            // Check sequence number (optional - for debugging)
-            if (sequenceNum != expectedSeq) {
-                printf("Warning: Sequence mismatch (expected: %d, got: %d)\n",
-                       expectedSeq, sequenceNum);
-            }
-            expectedSeq = (expectedSeq + 1) % 256;
+        rx->expectedSeq = 0;
+        if (!started) {
+            printf("Receiving data packets...\n");
+            rx->start = nowSeconds();
+        }
+    }
+    else if (!started) {
+        return 0; // Wait for START control packet
+    }
+    else if (controlField == CTRL_END) {
+        printf("END packet received\n");
 
-            // Validate data length
-            if (4 + dataLength > packetSize) {
-                printf("Error: Invalid data packet length\n");
-                continue;
-            }
+        // Verify file size
+        ControlInfo endInfo;
+        parseControlPacket(packet, packetSize, &endInfo);
 
-            // Write data to file
-            fwrite(&packet[4], 1, dataLength, file);
-            totalReceived += dataLength;
-            packetCount++;
+        if (endInfo.fileSize != rx->fileSize) {
+            printf("Warning: File size mismatch (expected: %ld, received: %ld)\n",
+                   rx->fileSize, endInfo.fileSize);
+        }
 
-            // Progress indicator
-            if (packetCount % 10 == 0 || totalReceived >= expectedFileSize) {
-                printf("Progress: %ld/%ld bytes (%.1f%%)\n",
-                       totalReceived, expectedFileSize,
-                       (totalReceived * 100.0) / expectedFileSize);
-            }
+        if (rx->received != rx->fileSize) {
+            printf("Warning: Data size mismatch (expected: %ld, got: %ld)\n",
+                   rx->fileSize, rx->received);
         }
-        else {
-            printf("Warning: Unknown control field: 0x%02X\n", controlField);
+        else if (endInfo.dataHashed && rx->hashKnown) {
+            rx->hashChecked = TRUE;
+            rx->expectedHash = endInfo.dataHash;
+            rx->hashMismatch = (dataHashDigest(&rx->hash) != endInfo.dataHash);
         }
+        return 1;
+    }
+    else if (controlField == CTRL_DATA || controlField == CTRL_DATA_LZ) {
+        receiveData(rx, packet, packetSize);
     }
+    else {
+        printf("Warning: Unknown control field: 0x%02X\n", controlField);
+    }
+    return 0;
+}
 
-    fclose(file);
-    printf("File reception complete: %d packets, %ld bytes\n", packetCount, totalReceived);
+/**
+ * Closes the output file once END has arrived and reports on the file
+ * @param filesLeft Output: files of the batch still to come
+ * @return 0 if the whole file was stored, -1 otherwise
+ */
+static int finishReceive(ReceiveState *rx, int *filesLeft)
+{
+    closeOutput(rx);
+    traceFlush();
+    printf("File reception complete: %d packets, %ld bytes\n", rx->packetCount, rx->received);
+    if (rx->compressedCount > 0) {
+        printf("Compression: %ld bytes received as %ld (ratio %.2f), %d/%d packets compressed\n",
+               rx->dataBytes, rx->packetBytes, (double)rx->dataBytes / rx->packetBytes,
+               rx->compressedCount, rx->packetCount);
+    }
+    // Measured here: in windowed modes llwrite returns before frames are acknowledged
+    printf("Effective throughput: %.0f bytes/s of file data\n", rx->dataBytes / (nowSeconds() - rx->start));
 
-    if (totalReceived == expectedFileSize) {
+    // Even a file that failed leaves the rest of the batch to receive
+    *filesLeft = rx->filesLeft;
+    if (rx->writeFailed) {
+        printf("Error: File '%s' could not be written\n", rx->filename);
+        return -1;
+    }
+    if (rx->hashMismatch) {
+        // Nothing of it can be trusted, so do not resume from its checkpoint either
+        if (rx->resumable) checkpointRemove(rx->checkpointPath);
+        printf("Error: File data corrupt (block hash %016" PRIx64 ", expected %016" PRIx64 ")\n",
+               dataHashDigest(&rx->hash), rx->expectedHash);
+        return -1;
+    }
+    if (rx->received == rx->fileSize) {
+        if (rx->resumable) checkpointRemove(rx->checkpointPath);
+        if (rx->hashChecked) printf("File data verified (block hash %016" PRIx64 ")\n", rx->expectedHash);
         printf("File transfer successful!\n");
         return 0;
     }
     else {
+        saveCheckpoint(rx, TRUE);
         printf("Warning: File size mismatch!\n");
         return -1;
     }
 }
 
+/**
+ * Receives a file over the serial port
+ * @param target Output file, or directory to write files into under their own names
+ * @param first TRUE for the first file of the session
+ * @param filesLeft Output: files of the batch still to come
+ */
+int receiveFile(const char *target, int targetIsDir, int first, int useMmap, int *filesLeft)
+{
+    unsigned char packet[MAX_PAYLOAD_SIZE]; // llread writes up to the link-layer maximum
+    ReceiveState rx;
+    startReceive(&rx, target, targetIsDir, first, useMmap);
+    *filesLeft = 0;
+
+    int result = 0;
+    while (result == 0) {
+        int packetSize = linkRead(packet);
+        if (packetSize <= 0) {
+            if (linkDisconnected()) {
+                printf("Error: The transmitter disconnected before the end of the file\n");
+                result = -1;
+                break;
+            }
+            continue; // Error reading or empty packet, retry
+        }
+        result = receivePacket(&rx, packet, packetSize);
+    }
+    if (result < 0) return -1;
+    return finishReceive(&rx, filesLeft);
+}
+
+// -------------------- FILE LIST --------------------
+
+typedef struct
+{
+    char **paths;
+    int count;
+    int capacity;
+} FileList;
+
+static int addFile(FileList *list, const char *path)
+{
+    if (list->count == list->capacity) {
+        int capacity = list->capacity > 0 ? 2 * list->capacity : 16;
+        char **paths = realloc(list->paths, capacity * sizeof(char *));
+        if (paths == NULL) return -1;
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    list->paths[list->count] = strdup(path);
+    if (list->paths[list->count] == NULL) return -1;
+    list->count++;
+    return 0;
+}
+
+/**
+ * Adds a file to the list, or for a directory the regular files in it (in
+ * name order, leaving out hidden files and checkpoints)
+ * @return 0 on success, -1 on error
+ */
+static int addPath(FileList *list, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        printf("Error: Cannot open file '%s'\n", path);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) return addFile(list, path);
+
+    struct dirent **entries;
+    int n = scandir(path, &entries, NULL, alphasort);
+    if (n < 0) {
+        printf("Error: Cannot read directory '%s'\n", path);
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < n; i++) {
+        const char *name = entries[i]->d_name;
+        int nameLen = strlen(name);
+        int suffixLen = strlen(CHECKPOINT_SUFFIX);
+        int skip = name[0] == '.' ||
+                   (nameLen > suffixLen && strcmp(name + nameLen - suffixLen, CHECKPOINT_SUFFIX) == 0);
+
+        char filePath[PATH_MAX];
+        if (!skip && result == 0 && snprintf(filePath, sizeof(filePath), "%s/%s", path, name) < (int)sizeof(filePath) &&
+            stat(filePath, &st) == 0 && S_ISREG(st.st_mode)) {
+            result = addFile(list, filePath);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return result;
+}
+
+static void freeFileList(FileList *list)
+{
+    for (int i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+}
+
+// -------------------- FULL DUPLEX --------------------
+// Both ends send their files over one connection at the same time (--duplex).
+// The link layer acknowledges each direction in the I-frames of the other;
+// here, the packets from the peer are taken after every write and stored as
+// the receiver would, and once this side has sent everything, the rest of the
+// peer's files is waited for.
+
+typedef struct
+{
+    ReceiveState rx;
+    int targetIsDir;
+    int useMmap;
+    int transferred;
+    int failed;
+    int done; // The peer's last file ended (or failed)
+} Incoming;
+
+static Incoming incoming;
+
+/**
+ * Handles a packet from the peer, moving on to the next file of its batch after END
+ */
+static void incomingPacket(const unsigned char *packet, int packetSize)
+{
+    if (incoming.done || packetSize <= 0) return;
+    int result = receivePacket(&incoming.rx, packet, packetSize);
+    if (result == 0) return;
+
+    int filesLeft = 0;
+    if (result > 0 && finishReceive(&incoming.rx, &filesLeft) == 0) incoming.transferred++;
+    else incoming.failed++;
+
+    if (filesLeft > 0) {
+        startReceive(&incoming.rx, incoming.rx.target, incoming.targetIsDir, FALSE, incoming.useMmap);
+    }
+    else {
+        incoming.done = TRUE;
+    }
+}
+
+/**
+ * Takes every packet from the peer that is already here
+ * @return 0 on success, -1 if the link failed
+ */
+static int pumpIncoming()
+{
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    while (llreceived() > 0) {
+        int packetSize = llread(packet);
+        if (packetSize < 0) return -1;
+        incomingPacket(packet, packetSize);
+    }
+    return 0;
+}
+
+/**
+ * Sends "files" while receiving the peer's into "target", then waits for the
+ * rest of the peer's files
+ * @param sent Output: files sent
+ * @return 0 if every file went through in both directions, -1 otherwise
+ */
+static int duplexTransfer(LinkLayer *ll, const FileList *files, const char *target,
+                          const ApplicationOptions *options, int *sent)
+{
+    struct stat st;
+    memset(&incoming, 0, sizeof(incoming));
+    incoming.targetIsDir = stat(target, &st) == 0 && S_ISDIR(st.st_mode);
+    incoming.useMmap = options->useMmap;
+    startReceive(&incoming.rx, target, incoming.targetIsDir, TRUE, options->useMmap);
+    duplex = TRUE;
+
+    int result = 0;
+    for (int i = 0; i < files->count && result == 0; i++) {
+        result = transmitFile(ll, files->paths[i], options, files->count - 1 - i);
+        if (result == 0) (*sent)++;
+    }
+
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    if (result == 0 && !incoming.done) printf("All files sent, waiting for the peer's\n");
+    while (result == 0 && !incoming.done) {
+        int packetSize = llread(packet);
+        if (packetSize < 0) {
+            printf("Error: Link failed while receiving\n");
+            result = -1;
+            break;
+        }
+        incomingPacket(packet, packetSize);
+    }
+
+    duplex = FALSE;
+    if (!incoming.done) closeOutput(&incoming.rx);
+    return (result == 0 && incoming.failed == 0) ? 0 : -1;
+}
+
 // -------------------- MAIN APPLICATION LAYER FUNCTION --------------------
 
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
-                      int nTries, int timeout, const char *filename)
+                      int nTries, int timeout, const char *filename,
+                      const ApplicationOptions *options)
 {
     // Setup link layer parameters
     LinkLayer ll;
+    memset(&ll, 0, sizeof(ll));
     strncpy(ll.serialPort, serialPort, sizeof(ll.serialPort) - 1);
     ll.serialPort[sizeof(ll.serialPort) - 1] = '\0';
 
@@ -369,6 +1387,38 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     ll.baudRate = baudRate;
     ll.nRetransmissions = nTries;
     ll.timeout = timeout;
+    ll.arqMode = options->arqMode;
+    ll.windowSize = options->windowSize;
+    ll.frameCheck = options->frameCheck;
+    ll.maxPayload = options->maxPayload;
+    ll.fixedPayload = options->fixedPayload;
+    ll.fecParity = options->fecParity;
+    ll.statsFile = options->statsFile;
+    ll.statsFormat = options->statsFormat;
+    ll.fullDuplex = (options->duplexFile != NULL);
+    ll.fastOpen = options->fastOpen;
+    ll.maxBaudRate = options->maxBaudRate;
+
+    multilink = strchr(serialPort, ',') != NULL;
+    if (multilink && (options->resume || options->statsFile != NULL)) {
+        // One checkpoint and one report per connection: not defined across links
+        printf("Error: --resume and --stats take a single port\n");
+        return;
+    }
+    if (ll.fullDuplex && (multilink || options->resume)) {
+        // The peer's file has no checkpoint, and multilink workers send one way
+        printf("Error: --duplex takes a single port and no --resume\n");
+        return;
+    }
+    if (ll.fastOpen && (multilink || ll.fullDuplex)) {
+        // Both open every link before anything is sent on it
+        printf("Error: --fast-open takes a single port and no --duplex\n");
+        return;
+    }
+    if (ll.fullDuplex && ll.role == LlTx && ll.arqMode == LlStopAndWait) {
+        printf("Error: --duplex needs a windowed ARQ mode (--arq gbn or sr)\n");
+        return;
+    }
 
     printf("=== Application Layer ===\n");
     printf("Role: %s\n", role);
@@ -378,26 +1428,89 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     printf("Timeout: %d seconds\n", timeout);
     printf("=========================\n\n");
 
+    // Files to send, all in one session (in full duplex, from both ends)
+    FileList files;
+    memset(&files, 0, sizeof(files));
+    if (ll.role == LlTx) {
+        int listed = addPath(&files, filename);
+        for (int i = 0; listed == 0 && i < options->nExtraFiles; i++) {
+            listed = addPath(&files, options->extraFiles[i]);
+        }
+        if (listed < 0 || files.count == 0) {
+            printf("Error: No files to send\n");
+            freeFileList(&files);
+            return;
+        }
+        if (files.count > 1) printf("Batch of %d files\n", files.count);
+    }
+    else if (ll.fullDuplex) {
+        if (addPath(&files, options->duplexFile) < 0 || files.count == 0) {
+            printf("Error: No files to send\n");
+            freeFileList(&files);
+            return;
+        }
+        if (files.count > 1) printf("Batch of %d files\n", files.count);
+    }
+
     // Open connection
     printf("Opening connection...\n");
-    if (llopen(ll) < 0) {
+    if (linkOpen(serialPort, ll) < 0) {
         printf("Error: Failed to establish connection\n");
+        freeFileList(&files);
         return;
     }
-    printf("Connection established!\n\n");
+    if (!ll.fastOpen || ll.role == LlRx) printf("Connection established!\n");
+    printf("\n");
+
+    // A peer that does not take part in full duplex gets a one-way transfer
+    LinkLayerStatistics linkStats;
+    if (ll.fullDuplex && llstatistics(&linkStats) == 0 && !linkStats.fullDuplex) {
+        if (ll.role == LlTx) {
+            printf("Warning: The receiver did not agree to full duplex, nothing is received into '%s'\n",
+                   options->duplexFile);
+        }
+        else {
+            printf("Warning: The transmitter did not ask for full duplex, '%s' is not sent\n",
+                   options->duplexFile);
+        }
+        ll.fullDuplex = FALSE;
+    }
 
-    // Perform file transfer
+    // Perform file transfers: one START/DATA/END sequence per file
     int result = -1;
-    if (ll.role == LlTx) {
-        result = transmitFile(&ll, filename);
+    int transferred = 0;
+    int failed = 0;
+    if (ll.fullDuplex) {
+        const char *target = (ll.role == LlTx) ? options->duplexFile : filename;
+        result = duplexTransfer(&ll, &files, target, options, &transferred);
+    }
+    else if (ll.role == LlTx) {
+        for (int i = 0; i < files.count; i++) {
+            result = transmitFile(&ll, files.paths[i], options, files.count - 1 - i);
+            if (result < 0) break;
+            transferred++;
+        }
     }
     else {
-        result = receiveFile(&ll, filename);
+        // A directory receives each file under the name it was sent with
+        struct stat st;
+        int targetIsDir = stat(filename, &st) == 0 && S_ISDIR(st.st_mode);
+        int filesLeft = 0;
+        do {
+            int fileResult = receiveFile(filename, targetIsDir, transferred + failed == 0, options->useMmap,
+                                         &filesLeft);
+            if (fileResult == 0) transferred++;
+            else failed++;
+        } while (filesLeft > 0);
+        result = (failed == 0) ? 0 : -1;
     }
 
     // Close connection
     printf("\nClosing connection...\n");
-    if (llclose(ll.role) < 0) {
+    if (result == TRANSFER_LINK_LOST) {
+        printf("Connection already closed\n");
+    }
+    else if (linkClose(ll.role) < 0) {
         printf("Warning: Error during connection closure\n");
     }
     else {
@@ -408,10 +1521,23 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     printf("\n=== Transfer Summary ===\n");
     if (result == 0) {
         printf("Status: SUCCESS ✓\n");
-        printf("File: %s\n", filename);
     }
     else {
         printf("Status: FAILED ✗\n");
     }
+    if (ll.fullDuplex) {
+        printf("Files: %d/%d sent, %d/%d received\n", transferred, files.count,
+               incoming.transferred, incoming.transferred + incoming.failed);
+    }
+    else if (ll.role == LlTx && files.count > 1) {
+        printf("Files: %d/%d sent\n", transferred, files.count);
+    }
+    else if (ll.role == LlRx && transferred + failed > 1) {
+        printf("Files: %d/%d received\n", transferred, transferred + failed);
+    }
+    else if (result == 0) {
+        printf("File: %s\n", filename);
+    }
     printf("========================\n");
+    freeFileList(&files);
 }
\ No newline at end of file
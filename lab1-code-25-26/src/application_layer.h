@@ -1,18 +1,50 @@
 // Application layer protocol header.
 // DO NOT CHANGE THIS FILE
+// (Changed on purpose since: ApplicationOptions, which carries the link and
+// transfer options from main to applicationLayer as a last argument.)
 
 #ifndef _APPLICATION_LAYER_H_
 #define _APPLICATION_LAYER_H_
 
+#include "link_layer.h"
+
+// Optional settings given after the positional command line arguments.
+typedef struct
+{
+    LinkLayerArqMode arqMode; // Tx: mode to propose. Rx: most capable mode to accept.
+    int windowSize;           // Window size for windowed ARQ modes (0 = mode maximum)
+    LinkLayerFrameCheck frameCheck; // Tx: I-frame check to propose
+    int maxPayload;           // Largest payload to propose/accept (0 = MAX_PAYLOAD_SIZE)
+    int fixedPayload;         // Tx: always send packets of the negotiated maximum size
+    int fecParity;            // Tx: Reed-Solomon parity bytes per block to propose (0 = ARQ only)
+    int useMmap;              // Send from / receive into a memory mapping of the file
+    int compress;             // Tx: LZ-compress data packets that get smaller
+    int resume;               // Tx: reconnect after a link failure and continue from a checkpoint
+    int fastOpen;             // Tx: the START packet rides in the SET (single port, no full duplex)
+    int maxBaudRate;          // Highest line rate to switch up to after connecting (0 = keep the baud rate)
+    const char *statsFile;    // Link statistics report written on close (NULL = none, "-" = stdout)
+    LinkLayerStatsFormat statsFormat;
+    int logLevel;             // Most verbose trace level printed (TRACE_ERROR to TRACE_DEBUG)
+    const char **extraFiles;  // Tx: more files (or directories) to send in the same session
+    int nExtraFiles;
+    const char *duplexFile;   // Full duplex (NULL = off): the other direction's file or directory.
+                              // Tx: where the receiver's files go. Rx: what to send back.
+} ApplicationOptions;
+
 // Application layer main function.
 // Arguments:
-//   serialPort: Serial port name (e.g., /dev/ttyS0).
+//   serialPort: Serial port name (e.g., /dev/ttyS0), or several separated by
+//               commas to stripe the packets over them (multilink.h).
 //   role: Application role {"tx", "rx"}.
 //   baudrate: Baudrate of the serial port.
 //   nTries: Maximum number of frame retries.
 //   timeout: Frame timeout.
-//   filename: Name of the file to send / receive.
+//   filename: Name of the file to send / receive. Tx: a directory sends every
+//             regular file in it. Rx: a directory receives each file of a
+//             batch under the name it was sent with.
+//   options: Optional settings (see ApplicationOptions).
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
-                      int nTries, int timeout, const char *filename);
+                      int nTries, int timeout, const char *filename,
+                      const ApplicationOptions *options);
 
 #endif // _APPLICATION_LAYER_H_
@@ -0,0 +1,133 @@
+// Transfer checkpoint implementation
+#include "checkpoint.h"
+#include "xxhash.h"
+
+#include <inttypes.h>
+#include <limits.h>
+
+#define CHECKPOINT_MAGIC "RCOM-RESUME 2"
+#define HASH_CHUNK_SIZE 65536
+
+int checkpointHashFile(FILE *file, uint64_t *hash)
+{
+    static unsigned char chunk[HASH_CHUNK_SIZE];
+    Xxh64State state;
+    xxh64Init(&state, 0);
+
+    rewind(file);
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        xxh64Update(&state, chunk, n);
+    }
+    int failed = ferror(file);
+    rewind(file);
+    if (failed) return -1;
+
+    *hash = xxh64Digest(&state);
+    return 0;
+}
+
+void dataHashInit(DataHash *hash, long offset, uint64_t chain)
+{
+    hash->offset = offset;
+    hash->chain = chain;
+    xxh64Init(&hash->block, chain);
+    for (int i = 0; i < HASH_HISTORY; i++) hash->boundaries[i] = -1;
+    int slot = (offset / HASH_BLOCK_SIZE) % HASH_HISTORY;
+    hash->boundaries[slot] = offset;
+    hash->chains[slot] = chain;
+}
+
+void dataHashUpdate(DataHash *hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    while (size > 0) {
+        size_t left = HASH_BLOCK_SIZE - hash->offset % HASH_BLOCK_SIZE;
+        size_t n = (size < left) ? size : left;
+        xxh64Update(&hash->block, bytes, n);
+        hash->offset += n;
+        bytes += n;
+        size -= n;
+
+        // A block is complete: it seeds the next one
+        if (hash->offset % HASH_BLOCK_SIZE == 0) {
+            hash->chain = xxh64Digest(&hash->block);
+            xxh64Init(&hash->block, hash->chain);
+            int slot = (hash->offset / HASH_BLOCK_SIZE) % HASH_HISTORY;
+            hash->boundaries[slot] = hash->offset;
+            hash->chains[slot] = hash->chain;
+        }
+    }
+}
+
+uint64_t dataHashDigest(const DataHash *hash)
+{
+    return (hash->offset % HASH_BLOCK_SIZE == 0) ? hash->chain : xxh64Digest(&hash->block);
+}
+
+int dataHashAt(const DataHash *hash, long boundary, uint64_t *chain)
+{
+    for (int i = 0; i < HASH_HISTORY; i++) {
+        if (hash->boundaries[i] == boundary) {
+            *chain = hash->chains[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int dataHashFile(FILE *file, long length, uint64_t *chain)
+{
+    static unsigned char chunk[HASH_CHUNK_SIZE];
+    DataHash hash;
+    dataHashInit(&hash, 0, 0);
+
+    rewind(file);
+    while (hash.offset < length) {
+        size_t want = (length - hash.offset < HASH_CHUNK_SIZE) ? (size_t)(length - hash.offset) : HASH_CHUNK_SIZE;
+        size_t n = fread(chunk, 1, want, file);
+        if (n == 0) break;
+        dataHashUpdate(&hash, chunk, n);
+    }
+    int ok = (hash.offset == length && !ferror(file));
+    rewind(file);
+    if (!ok) return -1;
+    *chain = dataHashDigest(&hash);
+    return 0;
+}
+
+int checkpointLoad(const char *path, Checkpoint *checkpoint)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return -1;
+
+    Checkpoint c;
+    int fields = fscanf(file, CHECKPOINT_MAGIC " size=%ld hash=%" SCNx64 " offset=%ld data=%" SCNx64,
+                        &c.fileSize, &c.fileHash, &c.offset, &c.dataHash);
+    fclose(file);
+    if (fields != 4 || c.fileSize < 0 || c.offset < 0 || c.offset > c.fileSize) return -1;
+
+    *checkpoint = c;
+    return 0;
+}
+
+int checkpointSave(const char *path, const Checkpoint *checkpoint)
+{
+    char tmpPath[PATH_MAX];
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path) >= (int)sizeof(tmpPath)) return -1;
+
+    FILE *file = fopen(tmpPath, "w");
+    if (file == NULL) return -1;
+    fprintf(file, CHECKPOINT_MAGIC " size=%ld hash=%016" PRIx64 " offset=%ld data=%016" PRIx64 "\n",
+            checkpoint->fileSize, checkpoint->fileHash, checkpoint->offset, checkpoint->dataHash);
+    if (fclose(file) != 0 || rename(tmpPath, path) != 0) {
+        remove(tmpPath);
+        return -1;
+    }
+    return 0;
+}
+
+void checkpointRemove(const char *path)
+{
+    remove(path);
+}
@@ -0,0 +1,78 @@
+// Transfer checkpoint header.
+// A checkpoint records how far a transfer got, so that a new session (or a new
+// process) can continue it instead of starting over. The file is identified by
+// its size and content hash; a checkpoint for any other file is ignored.
+// Checkpoints are small text files written next to the file they describe.
+//
+// The data itself is covered by a block hash: XXH64 over blocks of
+// HASH_BLOCK_SIZE bytes, each block seeded with the hash of the blocks before
+// it. Both ends compute it as the data passes, so the END packet can carry it
+// for the receiver to check, and a checkpoint at a block boundary records the
+// hash there, so a resumed transfer continues it without reading the file
+// again. The receiver only rehashes the data it has stored when it resumes a
+// transfer of an earlier run, to check it against the transmitter's.
+
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "xxhash.h"
+
+#define CHECKPOINT_SUFFIX ".resume"
+#define HASH_BLOCK_SIZE 16384 // Checkpoints and resumed transfers start at multiples of this
+#define HASH_HISTORY 32       // Block boundaries whose hash is kept
+
+typedef struct
+{
+    long fileSize;
+    uint64_t fileHash; // XXH64 of the whole file
+    long offset;       // Bytes known to be safe at the receiver (a block boundary)
+    uint64_t dataHash; // Block hash of the first "offset" bytes
+} Checkpoint;
+
+typedef struct
+{
+    long offset;      // Bytes hashed, counted from the start of the file
+    uint64_t chain;   // Hash of the whole blocks before the current one
+    Xxh64State block; // The current block, seeded with "chain"
+    long boundaries[HASH_HISTORY]; // Recent block boundaries (-1 = none) ...
+    uint64_t chains[HASH_HISTORY]; // ... and the hash up to each
+} DataHash;
+
+// Start a block hash at "offset" (a block boundary), where the hash of the
+// data before is "chain" (0 at the start of the file).
+void dataHashInit(DataHash *hash, long offset, uint64_t chain);
+
+// Add the next "size" bytes of the file.
+void dataHashUpdate(DataHash *hash, const void *data, size_t size);
+
+// Return the block hash of the data added so far.
+uint64_t dataHashDigest(const DataHash *hash);
+
+// Block hash of the data up to "boundary", if it is a recent block boundary.
+// Return 0 on success or -1 if it is not known.
+int dataHashAt(const DataHash *hash, long boundary, uint64_t *chain);
+
+// Block hash of the first "length" bytes of "file" (which is left at its start).
+// Return 0 on success or -1 on a read error.
+int dataHashFile(FILE *file, long length, uint64_t *chain);
+
+// Hash the whole of "file" (which is left at its start).
+// Return 0 on success or -1 on a read error.
+int checkpointHashFile(FILE *file, uint64_t *hash);
+
+// Read the checkpoint at "path".
+// Return 0 on success, or -1 if there is none or it is not valid.
+int checkpointLoad(const char *path, Checkpoint *checkpoint);
+
+// Replace the checkpoint at "path" (written to a temporary file and renamed,
+// so a crash leaves either the old or the new checkpoint).
+// Return 0 on success or -1 on error.
+int checkpointSave(const char *path, const Checkpoint *checkpoint);
+
+// Delete the checkpoint at "path", if any.
+void checkpointRemove(const char *path);
+
+#endif // _CHECKPOINT_H_
@@ -0,0 +1,75 @@
+// CRC implementation (slice-by-8, reflected polynomials)
+#include "crc.h"
+
+#define CRC16_POLY 0x8408     // x^16 + x^12 + x^5 + 1, reflected
+#define CRC32_POLY 0xEDB88320 // IEEE 802.3, reflected
+
+static uint16_t crc16Table[8][256];
+static uint32_t crc32Table[8][256];
+static int tablesReady = 0;
+
+void crcInit()
+{
+    if (tablesReady) return;
+
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t c16 = i;
+        uint32_t c32 = i;
+        for (int bit = 0; bit < 8; bit++) {
+            c16 = (c16 & 1) ? (c16 >> 1) ^ CRC16_POLY : c16 >> 1;
+            c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32_POLY : c32 >> 1;
+        }
+        crc16Table[0][i] = c16;
+        crc32Table[0][i] = c32;
+    }
+
+    // Table k gives the contribution of a byte followed by k zero bytes
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            crc16Table[k][i] = (crc16Table[k - 1][i] >> 8) ^ crc16Table[0][crc16Table[k - 1][i] & 0xFF];
+            crc32Table[k][i] = (crc32Table[k - 1][i] >> 8) ^ crc32Table[0][crc32Table[k - 1][i] & 0xFF];
+        }
+    }
+    tablesReady = 1;
+}
+
+uint16_t crc16Update8(uint16_t crc, const unsigned char *d)
+{
+    uint16_t one = crc ^ (d[0] | (d[1] << 8));
+    return crc16Table[7][one & 0xFF] ^ crc16Table[6][one >> 8] ^
+           crc16Table[5][d[2]] ^ crc16Table[4][d[3]] ^
+           crc16Table[3][d[4]] ^ crc16Table[2][d[5]] ^
+           crc16Table[1][d[6]] ^ crc16Table[0][d[7]];
+}
+
+uint32_t crc32Update8(uint32_t crc, const unsigned char *d)
+{
+    uint32_t one = crc ^ (d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24));
+    return crc32Table[7][one & 0xFF] ^ crc32Table[6][(one >> 8) & 0xFF] ^
+           crc32Table[5][(one >> 16) & 0xFF] ^ crc32Table[4][one >> 24] ^
+           crc32Table[3][d[4]] ^ crc32Table[2][d[5]] ^
+           crc32Table[1][d[6]] ^ crc32Table[0][d[7]];
+}
+
+uint16_t crc16Update(uint16_t crc, const unsigned char *data, size_t size)
+{
+    for (; size >= 8; size -= 8, data += 8) {
+        crc = crc16Update8(crc, data);
+    }
+    while (size--) {
+        crc = (crc >> 8) ^ crc16Table[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+uint32_t crc32Update(uint32_t crc, const unsigned char *data, size_t size)
+{
+    for (; size >= 8; size -= 8, data += 8) {
+        crc = crc32Update8(crc, data);
+    }
+    while (size--) {
+        crc = (crc >> 8) ^ crc32Table[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
@@ -0,0 +1,29 @@
+// CRC header.
+// CRC-16 as used by the HDLC/X.25 frame check sequence and CRC-32 (IEEE 802.3),
+// both computed with slice-by-8 lookup tables.
+
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC16_INIT 0xFFFF
+#define CRC16_RESIDUE 0xF0B8 // Register after a frame followed by its own FCS
+#define CRC32_INIT 0xFFFFFFFF
+#define CRC32_RESIDUE 0xDEBB20E3
+
+// Build the lookup tables. Must be called before the update functions.
+void crcInit();
+
+// Feed "size" bytes into a running CRC register (start from CRCxx_INIT).
+// The transmitted FCS is the one's complement of the final register, least
+// significant byte first.
+uint16_t crc16Update(uint16_t crc, const unsigned char *data, size_t size);
+uint32_t crc32Update(uint32_t crc, const unsigned char *data, size_t size);
+
+// Same as above for exactly 8 bytes (one slice-by-8 step).
+uint16_t crc16Update8(uint16_t crc, const unsigned char *data);
+uint32_t crc32Update8(uint32_t crc, const unsigned char *data);
+
+#endif // _CRC_H_
@@ -0,0 +1,176 @@
+// Event loop implementation
+#include "event_loop.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+
+static long long nowUs(const EventLoop *loop)
+{
+    if (loop->virtualClock != NULL) return loop->virtualClock->clockUs();
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void eventLoopInit(EventLoop *loop)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->timerFd = -1;
+}
+
+int eventLoopOpen(EventLoop *loop, const Transport *transport, TransportPort *port)
+{
+    loop->port = port;
+    loop->virtualClock = (transport != NULL && transport->wait != NULL) ? transport : NULL;
+    memset(loop->timers, 0, sizeof(loop->timers));
+    if (loop->virtualClock != NULL) return 0;
+
+    if (loop->timerFd < 0) {
+        loop->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+    if (loop->timerFd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    return 0;
+}
+
+void eventLoopClose(EventLoop *loop)
+{
+    memset(loop->timers, 0, sizeof(loop->timers));
+    if (loop->timerFd >= 0) {
+        close(loop->timerFd);
+        loop->timerFd = -1;
+    }
+    // clockMs() stays on the transport's clock, so statistics taken after
+    // closing still compare with the times recorded while open
+    loop->port = NULL;
+}
+
+void timerStart(EventLoop *loop, int id, long ms)
+{
+    loop->timers[id].deadlineUs = nowUs(loop) + ms * 1000LL;
+    loop->timers[id].running = 1;
+}
+
+void timerStop(EventLoop *loop, int id)
+{
+    loop->timers[id].running = 0;
+}
+
+int timerExpired(EventLoop *loop, int id)
+{
+    if (!loop->timers[id].running) return 0;
+    return nowUs(loop) >= loop->timers[id].deadlineUs;
+}
+
+long long clockMs(const EventLoop *loop)
+{
+    return nowUs(loop) / 1000;
+}
+
+int eventInputReady(EventLoop *loop)
+{
+    if (loop->virtualClock != NULL) return loop->virtualClock->wait(loop->port, nowUs(loop), 1) > 0;
+
+    struct pollfd pfd = {.fd = loop->port->fd, .events = POLLIN};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+void eventSleep(EventLoop *loop, long ms)
+{
+    if (loop->virtualClock != NULL) {
+        loop->virtualClock->wait(loop->port, nowUs(loop) + ms * 1000LL, 0);
+        return;
+    }
+
+    struct timespec t = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    while (nanosleep(&t, &t) < 0) { }
+}
+
+// Earliest running deadline, or -1 if no timer is running
+static long long earliestDeadline(const EventLoop *loop)
+{
+    long long earliest = -1;
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        const Timer *timer = &loop->timers[i];
+        if (timer->running && (earliest < 0 || timer->deadlineUs < earliest)) {
+            earliest = timer->deadlineUs;
+        }
+    }
+    return earliest;
+}
+
+// Arm the timerfd to the earliest running deadline.
+// Returns 1 if a timer already expired, 0 otherwise.
+static int armEarliest(EventLoop *loop)
+{
+    long long earliest = earliestDeadline(loop);
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (earliest >= 0)
+    {
+        if (nowUs(loop) >= earliest) return 1;
+        spec.it_value.tv_sec = earliest / 1000000;
+        spec.it_value.tv_nsec = (earliest % 1000000) * 1000;
+    }
+    timerfd_settime(loop->timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+    return 0;
+}
+
+// eventWait on a transport's own clock
+static int waitVirtual(EventLoop *loop)
+{
+    long long earliest = earliestDeadline(loop);
+    if (earliest >= 0 && nowUs(loop) >= earliest) return EVENT_TIMER;
+
+    int result = loop->virtualClock->wait(loop->port, earliest, 1);
+    if (result < 0) return -1;
+    return result > 0 ? EVENT_INPUT : EVENT_TIMER;
+}
+
+int eventWait(EventLoop *loop)
+{
+    if (loop->virtualClock != NULL) return waitVirtual(loop);
+
+    while (1)
+    {
+        if (armEarliest(loop)) return EVENT_TIMER;
+
+        struct pollfd pfds[2] = {
+            {.fd = loop->port->fd, .events = POLLIN},
+            {.fd = loop->timerFd, .events = POLLIN},
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            perror("poll");
+            return -1;
+        }
+
+        int events = 0;
+        if (pfds[0].revents & (POLLIN | POLLERR | POLLHUP)) events |= EVENT_INPUT;
+        uint64_t expirations;
+        if ((pfds[1].revents & POLLIN) && read(loop->timerFd, &expirations, sizeof(expirations)) > 0) {
+            events |= EVENT_TIMER;
+        }
+        if (events != 0) return events;
+    }
+}
+
+int eventWaitInput(EventLoop *loop)
+{
+    if (loop->virtualClock != NULL) return loop->virtualClock->wait(loop->port, -1, 1) > 0 ? EVENT_INPUT : -1;
+
+    struct pollfd pfd = {.fd = loop->port->fd, .events = POLLIN};
+    if (poll(&pfd, 1, -1) < 0) {
+        perror("poll");
+        return -1;
+    }
+    return EVENT_INPUT;
+}
@@ -0,0 +1,69 @@
+// Event loop header.
+// Waits for serial port input and millisecond timers with poll() and a single
+// timerfd armed to the earliest pending deadline, so waiting uses no CPU.
+// Transports with a clock of their own (the simulated channel) do the waiting
+// instead, and the timers and clockMs() follow that clock.
+
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include "transport.h"
+
+#define EVENT_INPUT 0x01
+#define EVENT_TIMER 0x02
+
+#define MAX_TIMERS 16
+
+typedef struct
+{
+    int running;
+    long long deadlineUs;
+} Timer;
+
+// The input and timers of one connection
+typedef struct
+{
+    TransportPort *port;           // NULL while closed
+    int timerFd;
+    const Transport *virtualClock; // transport with its own clock and wait
+    Timer timers[MAX_TIMERS];
+} EventLoop;
+
+// Set up "loop" with nothing open, before its first eventLoopOpen.
+void eventLoopInit(EventLoop *loop);
+
+// Start watching "port", open on "transport", and create the timer descriptor.
+// Returns 0 on success or -1 on error.
+int eventLoopOpen(EventLoop *loop, const Transport *transport, TransportPort *port);
+
+// Stop all timers and release the timer descriptor.
+void eventLoopClose(EventLoop *loop);
+
+// (Re)start timer "id" to expire "ms" milliseconds from now.
+void timerStart(EventLoop *loop, int id, long ms);
+
+// Stop timer "id". Stopped timers never expire.
+void timerStop(EventLoop *loop, int id);
+
+// Returns 1 if timer "id" is running and its deadline has passed, 0 otherwise.
+int timerExpired(EventLoop *loop, int id);
+
+// Milliseconds on the monotonic clock used by the timers.
+long long clockMs(const EventLoop *loop);
+
+// Sleep for "ms" milliseconds on that clock, ignoring input.
+void eventSleep(EventLoop *loop, long ms);
+
+// Returns 1 if input can be read without blocking, 0 otherwise.
+int eventInputReady(EventLoop *loop);
+
+// Block until there is input or a running timer expires.
+// Returns a combination of EVENT_INPUT and EVENT_TIMER, or -1 on error.
+int eventWait(EventLoop *loop);
+
+// Block until there is input, whatever the timers (e.g. for the rest of a
+// frame that has started arriving).
+// Returns EVENT_INPUT, or -1 on error or if input can never arrive.
+int eventWaitInput(EventLoop *loop);
+
+#endif // _EVENT_LOOP_H_
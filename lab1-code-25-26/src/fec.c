@@ -0,0 +1,218 @@
+// Forward error correction implementation
+#include "fec.h"
+
+#include <string.h>
+
+#define GF_POLY 0x11D // x^8 + x^4 + x^3 + x^2 + 1, generator alpha = 2
+
+static unsigned char gfExp[2 * FEC_CODEWORD_SIZE]; // alpha^i, doubled to skip a modulo
+static unsigned char gfLog[256];
+static unsigned char generators[FEC_MAX_PARITY + 1][FEC_MAX_PARITY + 1]; // g(x) for each parity size
+
+// -------------------- GALOIS FIELD --------------------
+
+static unsigned char gfMul(unsigned char a, unsigned char b)
+{
+    if (a == 0 || b == 0) return 0;
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static unsigned char gfDiv(unsigned char a, unsigned char b)
+{
+    if (a == 0) return 0;
+    return gfExp[(gfLog[a] + FEC_CODEWORD_SIZE - gfLog[b]) % FEC_CODEWORD_SIZE];
+}
+
+// alpha^power for any power >= 0
+static unsigned char gfPow(int power)
+{
+    return gfExp[power % FEC_CODEWORD_SIZE];
+}
+
+void fecInit()
+{
+    int x = 1;
+    for (int i = 0; i < FEC_CODEWORD_SIZE; i++) {
+        gfExp[i] = gfExp[i + FEC_CODEWORD_SIZE] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= GF_POLY;
+    }
+
+    // g(x) = (x - alpha^0)(x - alpha^1)...(x - alpha^(n-1)), highest degree first
+    for (int n = 2; n <= FEC_MAX_PARITY; n += 2) {
+        unsigned char *g = generators[n];
+        memset(g, 0, FEC_MAX_PARITY + 1);
+        g[0] = 1;
+        for (int i = 0; i < n; i++) {
+            for (int j = i + 1; j > 0; j--) {
+                g[j] ^= gfMul(g[j - 1], gfPow(i));
+            }
+        }
+    }
+}
+
+// -------------------- ENCODING --------------------
+
+static int maxBlockData(int nParity)
+{
+    return FEC_CODEWORD_SIZE - nParity;
+}
+
+int fecEncodedSize(int size, int nParity)
+{
+    int blocks = (size + maxBlockData(nParity) - 1) / maxBlockData(nParity);
+    return size + blocks * nParity;
+}
+
+// Parity of one block: the remainder of data(x) * x^nParity divided by g(x).
+static void encodeBlock(const unsigned char *data, int size, int nParity, unsigned char *parity)
+{
+    const unsigned char *g = generators[nParity];
+    memset(parity, 0, nParity);
+    for (int i = 0; i < size; i++) {
+        unsigned char feedback = data[i] ^ parity[0];
+        memmove(parity, parity + 1, nParity - 1);
+        parity[nParity - 1] = 0;
+        if (feedback != 0) {
+            for (int j = 0; j < nParity; j++) {
+                parity[j] ^= gfMul(g[j + 1], feedback);
+            }
+        }
+    }
+}
+
+int fecEncode(const unsigned char *data, int size, int nParity, unsigned char *dest)
+{
+    int out = 0;
+    for (int done = 0; done < size; ) {
+        int n = (size - done < maxBlockData(nParity)) ? size - done : maxBlockData(nParity);
+        memcpy(dest + out, data + done, n);
+        encodeBlock(data + done, n, nParity, dest + out + n);
+        done += n;
+        out += n + nParity;
+    }
+    return out;
+}
+
+// -------------------- DECODING --------------------
+
+// Repair one codeword of "n" bytes in place (Berlekamp-Massey, Chien search,
+// Forney). Returns the number of bytes repaired or -1 if it cannot be.
+static int decodeBlock(unsigned char *codeword, int n, int nParity)
+{
+    // Syndromes: the codeword evaluated at the roots of g(x)
+    unsigned char syndromes[FEC_MAX_PARITY];
+    int clean = 1;
+    for (int i = 0; i < nParity; i++) {
+        unsigned char s = 0;
+        unsigned char root = gfPow(i);
+        for (int j = 0; j < n; j++) {
+            s = gfMul(s, root) ^ codeword[j];
+        }
+        syndromes[i] = s;
+        if (s != 0) clean = 0;
+    }
+    if (clean) return 0;
+
+    // Error locator polynomial lambda(x), lowest degree first
+    unsigned char lambda[FEC_MAX_PARITY + 1] = {1};
+    unsigned char prev[FEC_MAX_PARITY + 1] = {1};
+    int errors = 0;
+    int shift = 1;
+    unsigned char prevDiscrepancy = 1;
+    for (int r = 0; r < nParity; r++) {
+        unsigned char d = syndromes[r];
+        for (int i = 1; i <= errors; i++) {
+            d ^= gfMul(lambda[i], syndromes[r - i]);
+        }
+        if (d == 0) {
+            shift++;
+            continue;
+        }
+
+        unsigned char saved[FEC_MAX_PARITY + 1];
+        memcpy(saved, lambda, sizeof(saved));
+        unsigned char scale = gfDiv(d, prevDiscrepancy);
+        for (int i = 0; i + shift <= nParity; i++) {
+            lambda[i + shift] ^= gfMul(scale, prev[i]);
+        }
+        if (2 * errors <= r) {
+            errors = r + 1 - errors;
+            memcpy(prev, saved, sizeof(prev));
+            prevDiscrepancy = d;
+            shift = 1;
+        }
+        else {
+            shift++;
+        }
+    }
+    if (errors > nParity / 2) return -1;
+
+    // Error evaluator omega(x) = S(x) lambda(x) mod x^nParity
+    unsigned char omega[FEC_MAX_PARITY];
+    for (int i = 0; i < nParity; i++) {
+        unsigned char v = 0;
+        for (int j = 0; j <= i && j <= errors; j++) {
+            v ^= gfMul(lambda[j], syndromes[i - j]);
+        }
+        omega[i] = v;
+    }
+
+    // Chien search over the positions of this (possibly shortened) codeword:
+    // byte j is the coefficient of x^(n-1-j), located by X = alpha^(n-1-j)
+    int found = 0;
+    for (int j = 0; j < n; j++) {
+        int power = n - 1 - j;
+        unsigned char xInv = gfPow(FEC_CODEWORD_SIZE - power);
+
+        unsigned char value = 0;
+        unsigned char xPow = 1;
+        for (int i = 0; i <= errors; i++) {
+            value ^= gfMul(lambda[i], xPow);
+            xPow = gfMul(xPow, xInv);
+        }
+        if (value != 0) continue;
+
+        // Forney: e = X * omega(X^-1) / lambda'(X^-1)
+        unsigned char num = 0;
+        xPow = 1;
+        for (int i = 0; i < nParity; i++) {
+            num ^= gfMul(omega[i], xPow);
+            xPow = gfMul(xPow, xInv);
+        }
+        unsigned char den = 0;
+        unsigned char xInv2 = gfMul(xInv, xInv);
+        xPow = 1;
+        for (int i = 1; i <= errors; i += 2) {
+            den ^= gfMul(lambda[i], xPow);
+            xPow = gfMul(xPow, xInv2);
+        }
+        if (den == 0) return -1;
+
+        codeword[j] ^= gfMul(gfPow(power), gfDiv(num, den));
+        found++;
+    }
+    return (found == errors) ? found : -1;
+}
+
+int fecDecode(unsigned char *buf, int size, int nParity, int *corrected)
+{
+    *corrected = 0;
+    int in = 0;
+    int out = 0;
+    while (in < size)
+    {
+        int n = (size - in < FEC_CODEWORD_SIZE) ? size - in : FEC_CODEWORD_SIZE;
+        if (n <= nParity) return -1;
+
+        int repaired = decodeBlock(buf + in, n, nParity);
+        if (repaired < 0) return -1;
+        *corrected += repaired;
+
+        memmove(buf + out, buf + in, n - nParity);
+        out += n - nParity;
+        in += n;
+    }
+    return out;
+}
@@ -0,0 +1,34 @@
+// Forward error correction header.
+// Reed-Solomon codes over GF(256): data is cut into blocks of up to
+// 255 - nParity bytes and each block is followed by "nParity" parity bytes,
+// forming one (shortened) RS codeword that can repair up to nParity / 2
+// corrupted bytes anywhere in it.
+
+#ifndef _FEC_H_
+#define _FEC_H_
+
+#define FEC_CODEWORD_SIZE 255
+#define FEC_MAX_PARITY 32
+
+// Largest encoding of "size" bytes with any supported parity.
+#define FEC_MAX_ENCODED_SIZE(size) \
+    ((size) + (((size) + FEC_CODEWORD_SIZE - FEC_MAX_PARITY - 1) / (FEC_CODEWORD_SIZE - FEC_MAX_PARITY)) * FEC_MAX_PARITY)
+
+// Build the Galois field tables. Must be called before the other functions.
+void fecInit();
+
+// Size of "size" bytes of data once encoded with "nParity" parity bytes per block.
+int fecEncodedSize(int size, int nParity);
+
+// Encode "size" bytes of "data" into "dest" (fecEncodedSize bytes), each
+// block followed by its parity. "nParity" must be even, 2 to FEC_MAX_PARITY.
+// Returns the encoded size.
+int fecEncode(const unsigned char *data, int size, int nParity, unsigned char *dest);
+
+// Repair and strip the parity of "size" encoded bytes in place, leaving the
+// data at the start of "buf". "*corrected" is set to the bytes repaired.
+// Returns the data size, or -1 if "size" is not a valid encoding or a block
+// has more errors than it can repair.
+int fecDecode(unsigned char *buf, int size, int nParity, int *corrected);
+
+#endif // _FEC_H_
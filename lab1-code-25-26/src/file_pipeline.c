@@ -0,0 +1,279 @@
+// File pipeline implementation
+#include "file_pipeline.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The producer fills slots and advances "head"; the consumer drains them and
+// advances "tail". Both counters only grow, so head - tail is the number of
+// slots in use. Each side owns its counter; the other only reads it.
+// A side that finds the ring empty (consumer) or full (producer) sleeps on
+// "changed"; the other side only takes the lock to wake it when the ring
+// leaves that state, and whenever one of the flags below is set.
+struct FilePipeline
+{
+    FILE *file;
+    int writer;
+    pthread_t thread;
+    unsigned char chunks[PIPE_SLOTS][PIPE_CHUNK_SIZE];
+    int sizes[PIPE_SLOTS];
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_int finished; // Producer is done: end of file (reader) or pipelineClose (writer)
+    atomic_int failed;   // A read or write error happened in the thread
+    atomic_int stop;     // Reader: pipelineClose called before end of file
+    atomic_long written; // Writer: bytes handed to the kernel so far
+    int offset;          // Bytes of the current slot used by the protocol thread
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+static unsigned slotsInUse(FilePipeline *p)
+{
+    return atomic_load(&p->head) - atomic_load(&p->tail);
+}
+
+static int ringFull(FilePipeline *p)
+{
+    return slotsInUse(p) == PIPE_SLOTS;
+}
+
+static int readerBlocked(FilePipeline *p)
+{
+    return ringFull(p) && !atomic_load(&p->stop);
+}
+
+static int consumerBlocked(FilePipeline *p)
+{
+    return slotsInUse(p) == 0 && !atomic_load(&p->finished);
+}
+
+// Sleep until "blocked" no longer holds
+static void pipelineWait(FilePipeline *p, int (*blocked)(FilePipeline *))
+{
+    pthread_mutex_lock(&p->lock);
+    while (blocked(p)) pthread_cond_wait(&p->changed, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void pipelineWake(FilePipeline *p)
+{
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Advance "head" past a filled slot. Both counters are stored and then the
+// other one loaded sequentially consistent, so either this side sees that the
+// ring was empty and wakes the consumer, or the consumer sees the new slot
+// before it sleeps.
+static void advanceHead(FilePipeline *p, unsigned head)
+{
+    atomic_store(&p->head, head + 1);
+    if (atomic_load(&p->tail) == head) pipelineWake(p);
+}
+
+// Advance "tail" past "n" drained slots, waking the producer if the ring was full
+static void advanceTail(FilePipeline *p, unsigned tail, unsigned n)
+{
+    atomic_store(&p->tail, tail + n);
+    if (atomic_load(&p->head) - tail >= PIPE_SLOTS) pipelineWake(p);
+}
+
+static FilePipeline *pipelineStart(FILE *file, int writer, void *(*thread)(void *))
+{
+    FilePipeline *p = calloc(1, sizeof(FilePipeline));
+    if (p == NULL) return NULL;
+    p->file = file;
+    p->writer = writer;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+    if (pthread_create(&p->thread, NULL, thread, p) != 0) {
+        pthread_cond_destroy(&p->changed);
+        pthread_mutex_destroy(&p->lock);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+// -------------------- READER --------------------
+
+// Prefetch chunks until the ring is full, then top it up as chunks are taken.
+static void *readerThread(void *arg)
+{
+    FilePipeline *p = arg;
+    unsigned head = atomic_load_explicit(&p->head, memory_order_relaxed);
+
+    while (!atomic_load(&p->stop))
+    {
+        if (ringFull(p)) {
+            pipelineWait(p, readerBlocked);
+            continue;
+        }
+
+        int slot = head % PIPE_SLOTS;
+        size_t n = fread(p->chunks[slot], 1, PIPE_CHUNK_SIZE, p->file);
+        p->sizes[slot] = n;
+        if (n > 0) advanceHead(p, head++);
+        if (n < PIPE_CHUNK_SIZE) {
+            if (ferror(p->file)) atomic_store(&p->failed, 1);
+            break;
+        }
+    }
+
+    atomic_store_explicit(&p->finished, 1, memory_order_release);
+    pipelineWake(p);
+    return NULL;
+}
+
+FilePipeline *pipelineOpenReader(FILE *file)
+{
+    return pipelineStart(file, 0, readerThread);
+}
+
+int pipelineRead(FilePipeline *p, unsigned char *dest, int size)
+{
+    int copied = 0;
+    while (copied < size)
+    {
+        unsigned tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+        if (atomic_load_explicit(&p->head, memory_order_acquire) == tail)
+        {
+            // Hand over what is ready rather than wait for the disk
+            if (copied > 0) break;
+
+            if (atomic_load_explicit(&p->finished, memory_order_acquire)) {
+                // The last chunk may have been published just before finishing
+                if (atomic_load_explicit(&p->head, memory_order_acquire) != tail) continue;
+                return atomic_load(&p->failed) ? -1 : 0;
+            }
+            pipelineWait(p, consumerBlocked);
+            continue;
+        }
+
+        int slot = tail % PIPE_SLOTS;
+        int n = p->sizes[slot] - p->offset;
+        if (n > size - copied) n = size - copied;
+        memcpy(dest + copied, p->chunks[slot] + p->offset, n);
+        copied += n;
+        p->offset += n;
+
+        if (p->offset == p->sizes[slot]) {
+            p->offset = 0;
+            advanceTail(p, tail, 1);
+        }
+    }
+    return copied;
+}
+
+// -------------------- WRITER --------------------
+
+// Write every ready slot, joining slots that are adjacent in the ring into a
+// single write.
+static void *writerThread(void *arg)
+{
+    FilePipeline *p = arg;
+    unsigned tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+
+    while (1)
+    {
+        unsigned head = atomic_load_explicit(&p->head, memory_order_acquire);
+        if (head == tail) {
+            if (atomic_load_explicit(&p->finished, memory_order_acquire)) {
+                if (atomic_load_explicit(&p->head, memory_order_acquire) == tail) break;
+                continue;
+            }
+            pipelineWait(p, consumerBlocked);
+            continue;
+        }
+
+        // Only the slot flushed by pipelineClose can be partly filled
+        int slot = tail % PIPE_SLOTS;
+        unsigned n = head - tail;
+        if (slot + n > PIPE_SLOTS) n = PIPE_SLOTS - slot;
+        size_t bytes = (n - 1) * PIPE_CHUNK_SIZE + p->sizes[slot + n - 1];
+
+        if (!atomic_load(&p->failed)) {
+            if (fwrite(p->chunks[slot], 1, bytes, p->file) != bytes || fflush(p->file) != 0) {
+                perror("fwrite");
+                atomic_store(&p->failed, 1);
+            }
+            else {
+                atomic_fetch_add(&p->written, (long)bytes);
+            }
+        }
+        advanceTail(p, tail, n);
+        tail += n;
+    }
+
+    return NULL;
+}
+
+FilePipeline *pipelineOpenWriter(FILE *file)
+{
+    return pipelineStart(file, 1, writerThread);
+}
+
+long pipelineWritten(FilePipeline *p)
+{
+    return atomic_load(&p->written);
+}
+
+// Hand the slot being filled to the writer thread.
+static void publishSlot(FilePipeline *p)
+{
+    unsigned head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    p->sizes[head % PIPE_SLOTS] = p->offset;
+    p->offset = 0;
+    advanceHead(p, head);
+}
+
+int pipelineWrite(FilePipeline *p, const unsigned char *data, int size)
+{
+    int queued = 0;
+    while (queued < size)
+    {
+        if (atomic_load(&p->failed)) return -1;
+        if (ringFull(p)) {
+            pipelineWait(p, ringFull);
+            continue;
+        }
+
+        unsigned head = atomic_load_explicit(&p->head, memory_order_relaxed);
+        int n = PIPE_CHUNK_SIZE - p->offset;
+        if (n > size - queued) n = size - queued;
+        memcpy(p->chunks[head % PIPE_SLOTS] + p->offset, data + queued, n);
+        queued += n;
+        p->offset += n;
+        if (p->offset == PIPE_CHUNK_SIZE) publishSlot(p);
+    }
+    return size;
+}
+
+// -------------------- CLOSE --------------------
+
+int pipelineClose(FilePipeline *p)
+{
+    if (p->writer) {
+        // Queue the partly filled slot, then let the thread drain the ring
+        if (p->offset > 0) {
+            pipelineWait(p, ringFull);
+            publishSlot(p);
+        }
+        atomic_store_explicit(&p->finished, 1, memory_order_release);
+    }
+    else {
+        atomic_store(&p->stop, 1);
+    }
+    pipelineWake(p);
+
+    pthread_join(p->thread, NULL);
+    int result = atomic_load(&p->failed) ? -1 : 0;
+    pthread_cond_destroy(&p->changed);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+    return result;
+}
@@ -0,0 +1,44 @@
+// File pipeline header.
+// Moves file I/O off the protocol thread: a reader thread prefetches chunks of
+// the file being sent, and a writer thread stores received data in large
+// writes. Each side hands chunks over through a lock-free single-producer /
+// single-consumer ring, so the link layer only waits on the disk when the
+// ring runs empty (reading) or full (writing). A side with nothing to do
+// sleeps until the other one hands it a chunk or room for one.
+
+#ifndef _FILE_PIPELINE_H_
+#define _FILE_PIPELINE_H_
+
+#include <stdio.h>
+
+#define PIPE_CHUNK_SIZE 4096 // Bytes per ring slot
+#define PIPE_SLOTS 16        // Chunks prefetched / waiting to be written
+
+typedef struct FilePipeline FilePipeline;
+
+// Start a reader thread prefetching "file" from its current position.
+// Returns NULL on error.
+FilePipeline *pipelineOpenReader(FILE *file);
+
+// Start a writer thread appending to "file".
+// Returns NULL on error.
+FilePipeline *pipelineOpenWriter(FILE *file);
+
+// Take up to "size" bytes of the file from a reader pipeline.
+// Returns the number of bytes copied to "dest", 0 at end of file, -1 on a read error.
+int pipelineRead(FilePipeline *pipeline, unsigned char *dest, int size);
+
+// Queue "size" bytes to be written by a writer pipeline.
+// Returns "size", or -1 if an earlier write failed.
+int pipelineWrite(FilePipeline *pipeline, const unsigned char *data, int size);
+
+// Bytes of a writer pipeline that have reached the file (not only the ring),
+// counted from when it was opened.
+long pipelineWritten(FilePipeline *pipeline);
+
+// Stop the thread (after writing everything queued, for a writer) and free
+// the pipeline. The file is left open.
+// Returns 0 on success or -1 if a read or write failed.
+int pipelineClose(FilePipeline *pipeline);
+
+#endif // _FILE_PIPELINE_H_
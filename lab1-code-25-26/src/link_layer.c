@@ -1,11 +1,19 @@
 // link_layer.c - Corrected reliable version with RR/REJ acknowledgments
 #include "link_layer.h"
 #include "serial_port.h"
+#include "crc.h"
+#include "stuffing.h"
+#include "fec.h"
+#include "link_stats.h"
+#include "event_loop.h"
+#include "trace.h"
 #include <stdio.h>
 #include <string.h>
-#include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
 
 #define FLAG 0x7E
 #define A_SENDER 0x03
@@ -13,426 +21,2716 @@
 #define C_SET 0x03
 #define C_UA 0x07
 #define C_DISC 0x0B
+#define C_RATE 0x0F // line rate change: a parameter block with LP_BAUD_RATE
 #define C_RR0 0x05
 #define C_RR1 0x85
 #define C_REJ0 0x01
 #define C_REJ1 0x81
 
+// Windowed modes: N(S) in bits 1-3 of I-frames, N(R) in bits 5-7 of S-frames
+// (and, in full duplex, of I-frames as well, as in HDLC)
+#define C_I_WIN(ns) ((unsigned char)(((ns) & 0x07) << 1))
+#define C_I_ACK(ns, nr) ((unsigned char)(C_I_WIN(ns) | (((nr) & 0x07) << 5)))
+#define C_RR_WIN(nr) ((unsigned char)(0x05 | (((nr) & 0x07) << 5)))
+#define C_REJ_WIN(nr) ((unsigned char)(0x01 | (((nr) & 0x07) << 5)))
+#define C_SREJ_WIN(nr) ((unsigned char)(0x0D | (((nr) & 0x07) << 5)))
+#define IS_I_FRAME(c) (((c) & 0x01) == 0)
+#define FRAME_NS(c) (((c) >> 1) & 0x07)
+#define FRAME_NR(c) (((c) >> 5) & 0x07)
+#define S_TYPE(c) ((c) & 0x1F)
+
+// Link parameters carried (TLV encoded) in extended SET/UA frames
+#define LP_ARQ_MODE 0x00
+#define LP_WINDOW_SIZE 0x01
+#define LP_FRAME_CHECK 0x02
+#define LP_MAX_PAYLOAD 0x03
+#define LP_FEC 0x04 // Reed-Solomon parity bytes per block (0 = off)
+#define LP_DUPLEX 0x05 // 1 = full duplex (windowed modes only)
+#define LP_OPEN_DATA 0x06 // SET: first packet and its CRC-16 (fast open). UA: 1 = packet taken
+#define LP_BAUD_RATE 0x07 // SET: highest line rate the transmitter may switch to. UA: highest for both.
+                          // RATE: the rate to switch to (all 4 bytes, big-endian)
+#define MAX_OPEN_DATA (255 - 2) // largest packet a SET carries (one TLV with its CRC-16)
+#define MAX_PARAMS_SIZE (64 + 2 + 255)
+#define MAX_PARAM_FRAME_SIZE (2 * (MAX_PARAMS_SIZE + 1) + 5)
+
+// Used when LinkLayer leaves timeout/nRetransmissions unset
 #define MAX_RETRIES 3
 #define TIMEOUT 3 // seconds
 
-static int fd = -1;
-static volatile sig_atomic_t alarmFlag = 0;
-static int sequenceNumber = 0; // sequence of next I-frame to send
+// Retransmission timeout bounds (milliseconds / doublings)
+#define MIN_RTO_MS 50
+#define MAX_BACKOFF 6
+
+#define S_FRAME_SIZE 5
+
+#define SEQ_MODULUS 8
+#define MAX_WINDOW_GBN (SEQ_MODULUS - 1)
+#define MAX_WINDOW_SR (SEQ_MODULUS / 2)
+
+#define MAX_CHECK_SIZE 4 // CRC-32
+
+// Payload limit of peers that do not negotiate one: the receive buffer of the
+// original application layer
+#define LEGACY_PAYLOAD_SIZE 512
+
+// Payload and check of the largest I-frame, and with the most FEC parity added
+#define MAX_PLAIN_SIZE (MAX_PAYLOAD_SIZE + MAX_CHECK_SIZE)
+#define MAX_CODED_SIZE FEC_MAX_ENCODED_SIZE(MAX_PLAIN_SIZE)
+
+// Worst case I-frame: header, every coded byte escaped, closing flag
+#define MAX_BODY_SIZE (2 * MAX_CODED_SIZE)
+#define MAX_FRAME_SIZE (MAX_BODY_SIZE + 5)
+
+#define RX_HUNT_SIZE 4096 // bytes scanned per call while hunting for a flag
+
+// Transmit frame pool, indexed by sequence number: each I-frame is encoded
+// once and its bytes are reused until it is acknowledged
+typedef struct
+{
+    unsigned char header[4];            // F A C BCC1
+    unsigned char body[MAX_BODY_SIZE];  // stuffed data and check (FEC coded if negotiated)
+    int bodySize;
+    int dataSize;  // payload
+    int fieldSize; // data field before stuffing: payload, check and FEC parity
+    int retries;
+    int sends; // times written, to tell retransmissions apart
+    long long sentAt; // last transmission, for RTT samples
+    int wireMs;       // serialization time included in that RTT
+} TxSlot;
+
+// Receiver window: Selective Repeat buffers frames that arrive out of order
+typedef struct
+{
+    unsigned char data[MAX_PAYLOAD_SIZE];
+    int size;
+    int valid;
+    int nakSent; // SREJ already requested this frame
+} RxSlot;
+
+// Full duplex: frames accepted in order wait in a queue for llread, so the
+// receive window keeps moving (and acknowledging) while the application is in
+// llwrite. The ring grows when full: refusing frames while both ends sit in
+// llwrite, each waiting for the other to take its frames, would deadlock the link.
+#define RX_QUEUE_SIZE (2 * SEQ_MODULUS) // initial entries
+
+// Values agreed in the SET/UA exchange
+typedef struct
+{
+    LinkLayerArqMode arqMode;
+    int windowSize;
+    LinkLayerFrameCheck frameCheck;
+    int maxPayload;
+    int fecParity;
+    int fullDuplex;
+    int maxBaudRate; // 0 = no rate changes
+} LinkParams;
+
+// Decoder states
+#define DECODE_HUNT 0    // looking for a flag
+#define DECODE_ADDRESS 1 // after a flag
+#define DECODE_CONTROL 2
+#define DECODE_BCC1 3
+#define DECODE_TRAILER 4 // header read, closing flag next
+#define DECODE_PARAMS 5  // header read, parameters up to the closing flag
+
+// Everything one connection keeps between calls. The ll* functions act on the
+// calling thread's connection (see lluse).
+struct LinkConnection
+{
+    int initialized; // defaults set (see connectionInit)
+    SerialPort port;
+    EventLoop loop;
+    int fd;
+    int sequenceNumber; // sequence of next I-frame to send
+
+    // Negotiated in llopen
+    LinkLayerArqMode arqMode;
+    int windowSize;
+    LinkLayerFrameCheck frameCheck;
+    int maxPayloadSize; // largest I-frame payload either side accepts
+    int fecParity;      // Reed-Solomon parity bytes per block of I-frame data (0 = off)
+    int fullDuplex;     // both ends send I-frames, each carrying N(R) for the other
+
+    TxSlot txSlots[SEQ_MODULUS];
+    int txBase; // oldest unacknowledged frame
+    int txNext; // sequence of next I-frame to send
+    int linkFailed;
+
+    RxSlot rxSlots[SEQ_MODULUS];
+    int rxDeliver;  // next frame to hand to the application
+    int rxExpected; // next frame not yet received
+    int rxNextSeen; // after the last I-frame whose header arrived intact
+    int expectedSeq; // Stop-and-wait: sequence number of the next I-frame
+
+    RxSlot *rxQueue; // Full duplex (see RX_QUEUE_SIZE)
+    int rxQueueSize;
+    int rxQueueHead;
+    int rxQueueCount;
+    int rejSent;      // Go-Back-N and stop-and-wait: REJ sent for the I-frame expected next
+    int ackPending;   // Full duplex: rxExpected not yet acknowledged
+    int discReceived; // the transmitter's DISC came before llclose
+
+    // Each end stamps its own address on the frames it sends (the receiver's
+    // answers have always carried A_RECEIVER; in full duplex so do its I-frames)
+    unsigned char localAddress;
+    unsigned char peerAddress;
+
+    // Statistics printed by llclose and read with llstatistics
+    LinkLayerStatistics stats;
+    int statsStarted; // llopen was called at least once
+    int sessionOpen;  // from llopen to llclose; reconnecting after llabort keeps counting
+    long long statsStartMs;
+    long long statsEndMs; // 0 until llclose or llabort
+    double rttTotalMs;
+    double rateTotal;      // baud rate x milliseconds at earlier line rates
+    long long rateSinceMs; // when the line switched to stats.baudRate
+    const char *statsFile;
+    LinkLayerStatsFormat statsFormat;
+
+    // Configured in llopen: the timeout caps the adaptive RTO
+    int timeoutMs;
+    int maxRetries;
+    int lineBaudRate;
+
+    // Jacobson/Karels estimator, kept scaled as in BSD TCP:
+    // srtt8 = 8 * SRTT, rttvar4 = 4 * RTTVAR (both in milliseconds)
+    int srtt8;   // -1 until the first sample
+    int rttvar4;
+    int backoff; // consecutive timeouts since the last valid sample
+    long long lineFreeAt; // when the bytes written so far have left the line
+
+    // Frame error rate and payload size (see PAYLOAD SIZING)
+    double outcomes;     // I-frame transmissions with a known outcome
+    double outcomeBits;  // bits in those frames
+    double failedFrames; // the ones that failed
+    int ackedInARow;     // acknowledged since the last failure
+    int payloadSize;     // recommended payload
+    int fixedPayload;    // keep payloadSize at the negotiated limit
+
+    // Frame decoder, kept across calls so a frame can arrive in pieces between timer events
+    int decodeState;
+    unsigned char decodeHeader[3];
+    unsigned char decodeParams[MAX_PARAM_FRAME_SIZE];
+    int nDecodeParams;
+
+    // Line rate (see LINE RATE)
+    int startRate;    // rate llopen opened the port at, never stepped below
+    int topRate;      // highest rate both ends agreed on (startRate if none)
+    int rateUpFrames; // doubles each time a rate proves too fast
+    int rateClimbed;  // Tx: the agreed top rate was tried
+    long rateHeard;   // Rx: I-frames received when the line last proved alive
+
+    // Rx: what the UA says, kept to repeat it if the SET is retransmitted
+    LinkParams uaParams;
+    int uaExtended; // the SET carried parameters, so the UA does too
+
+    // Fast open (see LLOPEN)
+    LinkParams proposedParams;  // Tx: proposed in the SET
+    int openDeferred;           // Tx: the SET waits for the first llwrite
+    unsigned char openPacket[MAX_OPEN_DATA]; // Rx: the packet the SET carried
+    int openPacketSize;         // 0 if it carried none
+    int openPacketReady;        // not yet returned by llread
+};
+
+// The connection of threads that did not pick one with lluse
+static LinkConnection defaultConnection;
+static __thread LinkConnection *current = NULL;
+
+static void connectionInit(LinkConnection *conn)
+{
+    memset(conn, 0, sizeof(*conn));
+    conn->initialized = TRUE;
+    eventLoopInit(&conn->loop);
+    conn->fd = -1;
+    conn->arqMode = LlStopAndWait;
+    conn->windowSize = 1;
+    conn->frameCheck = LlCheckXor;
+    conn->maxPayloadSize = LEGACY_PAYLOAD_SIZE;
+    conn->localAddress = A_SENDER;
+    conn->peerAddress = A_RECEIVER;
+    conn->statsFormat = LlStatsJson;
+    conn->timeoutMs = TIMEOUT * 1000;
+    conn->maxRetries = MAX_RETRIES;
+    conn->lineBaudRate = 9600;
+    conn->srtt8 = -1;
+}
+
+static LinkConnection *connection()
+{
+    LinkConnection *conn = (current != NULL) ? current : &defaultConnection;
+    if (!conn->initialized) connectionInit(conn);
+    return conn;
+}
+
+LinkConnection *llcreate()
+{
+    LinkConnection *conn = malloc(sizeof(LinkConnection));
+    if (conn != NULL) connectionInit(conn);
+    return conn;
+}
+
+void lldestroy(LinkConnection *conn)
+{
+    if (conn == NULL) return;
+    if (current == conn) current = NULL;
+    // Whatever is still open goes as with llabort, without its message
+    eventLoopClose(&conn->loop);
+    closeSerialPort(&conn->port);
+    free(conn->rxQueue);
+    free(conn);
+}
+
+void lluse(LinkConnection *conn)
+{
+    current = conn;
+}
+
+// -------------------- FRAME CHECK --------------------
+
+// Running check over an I-frame data field: XOR BCC2, CRC-16 or CRC-32.
+typedef struct
+{
+    LinkLayerFrameCheck type;
+    uint32_t reg;
+} FrameCheck;
+
+static int checkSize(LinkLayerFrameCheck type)
+{
+    switch (type)
+    {
+    case LlCheckCrc16: return 2;
+    case LlCheckCrc32: return 4;
+    default: return 1;
+    }
+}
+
+static void checkInit(FrameCheck *check, LinkLayerFrameCheck type)
+{
+    check->type = type;
+    check->reg = (type == LlCheckCrc16) ? CRC16_INIT : (type == LlCheckCrc32) ? CRC32_INIT : 0;
+}
+
+static void checkUpdate(FrameCheck *check, const unsigned char *data, int size)
+{
+    switch (check->type)
+    {
+    case LlCheckCrc16:
+        check->reg = crc16Update(check->reg, data, size);
+        break;
+    case LlCheckCrc32:
+        check->reg = crc32Update(check->reg, data, size);
+        break;
+    default:
+        for (int i = 0; i < size; i++) {
+            check->reg ^= data[i];
+        }
+        break;
+    }
+}
+
+// Write the check bytes that close the data field. Returns how many were written.
+static int checkTrailer(const FrameCheck *check, unsigned char *trailer)
+{
+    int n = checkSize(check->type);
+    uint32_t value = (check->type == LlCheckXor) ? check->reg : ~check->reg;
+    for (int i = 0; i < n; i++) {
+        trailer[i] = (value >> (8 * i)) & 0xFF;
+    }
+    return n;
+}
+
+// After feeding data and trailer, the register holds a fixed residue if the field is intact.
+static int checkValid(const FrameCheck *check)
+{
+    switch (check->type)
+    {
+    case LlCheckCrc16: return (check->reg & 0xFFFF) == CRC16_RESIDUE;
+    case LlCheckCrc32: return check->reg == CRC32_RESIDUE;
+    default: return check->reg == 0;
+    }
+}
+
+// -------------------- BYTE-STUFFING --------------------
+
+// Stuff "data" into "dest", updating "check" (if given) over the unstuffed bytes.
+// Both passes run over the field while it is hot in cache; stuffing itself uses
+// the vector kernels from stuffing.c.
+void stuffData(const unsigned char *data, int size, unsigned char *dest, int *destSize, FrameCheck *check)
+{
+    if (check != NULL) checkUpdate(check, data, size);
+    *destSize = stuffBytes(data, size, dest);
+}
+
+// Destuff "data" into "dest", updating "check" (if given) over the destuffed bytes.
+void destuffData(const unsigned char *data, int size, unsigned char *dest, int *destSize, FrameCheck *check)
+{
+    *destSize = destuffBytes(data, size, dest);
+    if (check != NULL) checkUpdate(check, dest, *destSize);
+}
+
+// -------------------- FRAMING HELPERS --------------------
+
+// FEC: gather the data and its check, add "nParity" Reed-Solomon parity bytes
+// per block and stuff the result into "dest". The check stays inside the coded
+// data, so a block the receiver repairs wrongly is still caught.
+// Returns the stuffed size.
+static int encodeCodedField(const struct iovec *parts, int nParts, LinkLayerFrameCheck type,
+                            int nParity, unsigned char *dest)
+{
+    unsigned char plain[MAX_PLAIN_SIZE];
+    unsigned char coded[MAX_CODED_SIZE];
+    FrameCheck check;
+    checkInit(&check, type);
+
+    int size = 0;
+    for (int i = 0; i < nParts; i++) {
+        memcpy(plain + size, parts[i].iov_base, parts[i].iov_len);
+        size += parts[i].iov_len;
+    }
+    checkUpdate(&check, plain, size);
+    size += checkTrailer(&check, plain + size);
+
+    int codedSize = fecEncode(plain, size, nParity, coded);
+    int stuffedSize;
+    stuffData(coded, codedSize, dest, &stuffedSize, NULL);
+    return stuffedSize;
+}
+
+// Stuff the data gathered from "parts" followed by its check into "dest",
+// FEC coded when "nParity" is not 0.
+// Returns the stuffed size.
+static int encodeDataField(const struct iovec *parts, int nParts, LinkLayerFrameCheck type,
+                           int nParity, unsigned char *dest)
+{
+    if (nParity > 0) return encodeCodedField(parts, nParts, type, nParity, dest);
+
+    FrameCheck check;
+    checkInit(&check, type);
+
+    // Stuff data while computing the check, then stuff the check itself
+    int stuffedSize = 0;
+    for (int i = 0; i < nParts; i++) {
+        int partSize;
+        stuffData(parts[i].iov_base, parts[i].iov_len, dest + stuffedSize, &partSize, &check);
+        stuffedSize += partSize;
+    }
+
+    unsigned char trailer[MAX_CHECK_SIZE];
+    int trailerSize = checkTrailer(&check, trailer);
+    int stuffedTrailerSize;
+    stuffData(trailer, trailerSize, dest + stuffedSize, &stuffedTrailerSize, NULL);
+    return stuffedSize + stuffedTrailerSize;
+}
+
+// Build a complete I-frame (header, stuffed data + check, flag) in "frame".
+// Returns the frame size.
+static int buildIFrame(unsigned char control, const unsigned char *buf, int bufSize,
+                       LinkLayerFrameCheck type, unsigned char *frame)
+{
+    struct iovec part = {(void *)buf, bufSize};
+    int stuffedSize = encodeDataField(&part, 1, type, 0, frame + 4);
+
+    // Build frame header
+    frame[0] = FLAG;
+    frame[1] = A_SENDER;
+    frame[2] = control;
+    frame[3] = frame[1] ^ frame[2];
+    frame[4 + stuffedSize] = FLAG;
+    return 5 + stuffedSize;
+}
+
+// Destuff the data field of a received frame and verify its check. "data" must
+// have room for the check bytes as well.
+// Returns the payload size (without check) or -1 if the frame is corrupted.
+static int decodeDataField(const unsigned char *field, int fieldSize, LinkLayerFrameCheck type,
+                           unsigned char *data)
+{
+    FrameCheck check;
+    checkInit(&check, type);
+
+    int dataSize;
+    destuffData(field, fieldSize, data, &dataSize, &check);
+
+    if (dataSize < checkSize(type)) {
+        TRACE(TRACE_WARN, "No data in frame\n");
+        return -1;
+    }
+
+    if (!checkValid(&check)) {
+        TRACE(TRACE_WARN, "BCC2 error detected\n");
+        return -1;
+    }
+    return dataSize - checkSize(type);
+}
+
+static void sendSupervisory(LinkConnection *conn, unsigned char address, unsigned char control)
+{
+    unsigned char frame[5] = {FLAG, address, control, address ^ control, FLAG};
+    writeBytesSerialPort(&conn->port, frame, 5);
+}
+
+// Reading failed, e.g. the socket or simulated peer went away: nothing more
+// will arrive, so the link has failed. Returns -1.
+static int portFailed(LinkConnection *conn)
+{
+    conn->linkFailed = TRUE;
+    return -1;
+}
+
+// Wait until received bytes are buffered or can be read. Timers are left for
+// later: a frame that started arriving is read to its end first.
+// Returns 1 when there is input, -1 on error.
+static int waitInput(LinkConnection *conn)
+{
+    if (bufferedSerialPort(&conn->port) > 0) return 1;
+    return eventWaitInput(&conn->loop) < 0 ? portFailed(conn) : 1;
+}
+
+// Drop the rest of the current frame, up to and including its closing flag.
+static void discardFrame(LinkConnection *conn)
+{
+    int found = 0;
+    while (!found) {
+        if (waitInput(conn) < 0) return;
+        if (readUntilSerialPort(&conn->port, FLAG, NULL, RX_HUNT_SIZE, &found) < 0) {
+            portFailed(conn);
+            return;
+        }
+    }
+}
+
+// Account for an accepted I-frame: "size" payload bytes in a data field of
+// "fieldSize" bytes, "stuffedSize" on the line.
+static void recordFrameReceived(LinkConnection *conn, int size, int fieldSize, int stuffedSize)
+{
+    conn->stats.framesReceived++;
+    conn->stats.payloadBytes += size;
+    conn->stats.unstuffedBytes += fieldSize;
+    conn->stats.stuffedBytes += stuffedSize;
+}
+
+// FEC: destuff the whole coded field, let the Reed-Solomon decoder repair it,
+// then verify the check over the repaired data before copying it to "data".
+// Returns the payload size or -1 if the field cannot be repaired or is too large.
+static int receiveCodedField(LinkConnection *conn, unsigned char *data, int maxData, LinkLayerFrameCheck type)
+{
+    unsigned char coded[MAX_CODED_SIZE];
+    int limit = fecEncodedSize(maxData + checkSize(type), conn->fecParity);
+    int got = 0;
+    int stuffed = 0;
+    int escaped = 0;
+    int tooLarge = FALSE;
+
+    while (1)
+    {
+        if (waitInput(conn) < 0) return -1;
+        const unsigned char *bytes;
+        int n = peekBufferSerialPort(&conn->port, &bytes);
+        if (n < 0) return portFailed(conn);
+        if (n == 0) continue;
+
+        const unsigned char *flag = memchr(bytes, FLAG, n);
+        int len = (flag != NULL) ? flag - bytes : n;
+
+        // Destuffing never grows the data, so "take" input bytes fit in "take" bytes
+        int take = (len < limit - got) ? len : limit - got;
+        if (take < len) tooLarge = TRUE;
+        if (!tooLarge) got += destuffChunk(bytes, take, coded + got, &escaped);
+        stuffed += len;
+
+        consumeSerialPort(&conn->port, flag != NULL ? len + 1 : len);
+        if (flag != NULL) break;
+    }
+
+    if (tooLarge) {
+        TRACE(TRACE_WARN, "Frame too large, discarding\n");
+        conn->stats.bcc2Errors++;
+        return -1;
+    }
+
+    int fieldSize = got;
+    int corrected;
+    int size = escaped ? -1 : fecDecode(coded, got, conn->fecParity, &corrected);
+    if (size < 0) {
+        TRACE(TRACE_WARN, "FEC could not repair frame\n");
+        conn->stats.framesUncorrectable++;
+        conn->stats.bcc2Errors++;
+        return -1;
+    }
+
+    FrameCheck check;
+    checkInit(&check, type);
+    checkUpdate(&check, coded, size);
+    size -= checkSize(type);
+    if (size < 0) {
+        TRACE(TRACE_WARN, "No data in frame\n");
+        conn->stats.bcc2Errors++;
+        return -1;
+    }
+    if (!checkValid(&check)) {
+        TRACE(TRACE_WARN, "BCC2 error detected after FEC\n");
+        conn->stats.framesUncorrectable++;
+        conn->stats.bcc2Errors++;
+        return -1;
+    }
+
+    if (corrected > 0) {
+        TRACE(TRACE_INFO, "FEC repaired %ld bytes\n", corrected);
+        conn->stats.framesCorrected++;
+        conn->stats.bytesCorrected += corrected;
+    }
+    recordFrameReceived(conn, size, fieldSize, stuffed);
+    memcpy(data, coded, size);
+    return size;
+}
+
+// Read the data field of the current frame up to its closing flag, destuffing
+// each chunk from the serial receive buffer straight into "data" while the
+// frame check runs over it. "data" only needs room for "maxData" bytes: check
+// bytes that would land past it go to a small overflow area.
+// Returns the payload size or -1 if the field is corrupted or too large.
+static int receivePlainField(LinkConnection *conn, unsigned char *data, int maxData, LinkLayerFrameCheck type)
+{
+    FrameCheck check;
+    checkInit(&check, type);
+
+    unsigned char overflow[2 * MAX_CHECK_SIZE];
+    int got = 0;
+    int nOverflow = 0;
+    int stuffed = 0;
+    int escaped = 0;
+    int tooLarge = FALSE;
+
+    while (1)
+    {
+        if (waitInput(conn) < 0) return -1;
+        const unsigned char *bytes;
+        int n = peekBufferSerialPort(&conn->port, &bytes);
+        if (n < 0) return portFailed(conn);
+        if (n == 0) continue;
+
+        const unsigned char *flag = memchr(bytes, FLAG, n);
+        int len = (flag != NULL) ? flag - bytes : n;
+
+        // Destuffing never grows the data, so "take" input bytes fit in "take" bytes
+        const unsigned char *p = bytes;
+        int left = len;
+        while (!tooLarge && left > 0)
+        {
+            int take;
+            unsigned char *dest;
+            if (got < maxData) {
+                take = (left < maxData - got) ? left : maxData - got;
+                dest = data + got;
+            }
+            else {
+                take = (left < (int)sizeof(overflow) - nOverflow) ? left : (int)sizeof(overflow) - nOverflow;
+                dest = overflow + nOverflow;
+            }
+
+            int out = destuffChunk(p, take, dest, &escaped);
+            checkUpdate(&check, dest, out);
+            if (got < maxData) got += out;
+            else nOverflow += out;
+            p += take;
+            left -= take;
+
+            // Only the check may extend past the payload limit
+            if (nOverflow > checkSize(type)) tooLarge = TRUE;
+        }
+        stuffed += len;
+
+        consumeSerialPort(&conn->port, flag != NULL ? len + 1 : len);
+        if (flag != NULL) break;
+    }
+
+    if (tooLarge) {
+        TRACE(TRACE_WARN, "Frame too large, discarding\n");
+        conn->stats.bcc2Errors++;
+        return -1;
+    }
+
+    int size = got + nOverflow - checkSize(type);
+    if (size < 0) {
+        TRACE(TRACE_WARN, "No data in frame\n");
+        conn->stats.bcc2Errors++;
+        return -1;
+    }
+    if (escaped || !checkValid(&check)) {
+        TRACE(TRACE_WARN, "BCC2 error detected\n");
+        conn->stats.bcc2Errors++;
+        return -1;
+    }
+    recordFrameReceived(conn, size, got + nOverflow, stuffed);
+    return size;
+}
+
+// Read the data field of the current frame, coded or not.
+// Returns the payload size or -1 if the field is corrupted or too large.
+static int receiveDataField(LinkConnection *conn, unsigned char *data, int maxData, LinkLayerFrameCheck type)
+{
+    int size = (conn->fecParity > 0) ? receiveCodedField(conn, data, maxData, type)
+                                     : receivePlainField(conn, data, maxData, type);
+    // A bit error may have turned a data byte into the flag that ended the
+    // field: skip whatever is left up to the real closing flag, or it would be
+    // read as another (corrupted) frame
+    if (size < 0) conn->decodeState = DECODE_HUNT;
+    return size;
+}
+
+// -------------------- PARAMETER NEGOTIATION --------------------
+
+static const LinkParams defaultParams = {LlStopAndWait, 1, LlCheckXor, LEGACY_PAYLOAD_SIZE, 0, FALSE, 0};
+
+static int putRate(unsigned char *params, int rate)
+{
+    params[0] = LP_BAUD_RATE;
+    params[1] = 4;
+    for (int i = 0; i < 4; i++) params[2 + i] = (rate >> (8 * (3 - i))) & 0xFF;
+    return 6;
+}
+
+static int buildParams(const LinkParams *p, unsigned char *params)
+{
+    int idx = 0;
+    params[idx++] = LP_ARQ_MODE;
+    params[idx++] = 1;
+    params[idx++] = (unsigned char)p->arqMode;
+    params[idx++] = LP_WINDOW_SIZE;
+    params[idx++] = 1;
+    params[idx++] = (unsigned char)p->windowSize;
+    params[idx++] = LP_FRAME_CHECK;
+    params[idx++] = 1;
+    params[idx++] = (unsigned char)p->frameCheck;
+    params[idx++] = LP_MAX_PAYLOAD;
+    params[idx++] = 2;
+    params[idx++] = (p->maxPayload >> 8) & 0xFF;
+    params[idx++] = p->maxPayload & 0xFF;
+    params[idx++] = LP_FEC;
+    params[idx++] = 1;
+    params[idx++] = (unsigned char)p->fecParity;
+    if (p->fullDuplex) {
+        params[idx++] = LP_DUPLEX;
+        params[idx++] = 1;
+        params[idx++] = 1;
+    }
+    if (p->maxBaudRate > 0) idx += putRate(params + idx, p->maxBaudRate);
+    return idx;
+}
+
+// Parse the TLV parameters of an extended SET/UA. Unknown types are skipped and
+// missing ones keep their stop-and-wait defaults.
+// Returns 0 on success, -1 on a malformed block.
+static int parseParams(const unsigned char *params, int size, LinkParams *p)
+{
+    *p = defaultParams;
+    int idx = 0;
+    while (idx + 2 <= size)
+    {
+        unsigned char type = params[idx++];
+        unsigned char length = params[idx++];
+        if (idx + length > size || length < 1) return -1;
+
+        if (type == LP_ARQ_MODE) p->arqMode = (LinkLayerArqMode)params[idx];
+        else if (type == LP_WINDOW_SIZE) p->windowSize = params[idx];
+        else if (type == LP_FRAME_CHECK) p->frameCheck = (LinkLayerFrameCheck)params[idx];
+        else if (type == LP_MAX_PAYLOAD && length == 2) p->maxPayload = (params[idx] << 8) | params[idx + 1];
+        else if (type == LP_FEC) p->fecParity = params[idx];
+        else if (type == LP_DUPLEX) p->fullDuplex = (params[idx] != 0);
+        else if (type == LP_BAUD_RATE && length == 4) {
+            p->maxBaudRate = (params[idx] << 24) | (params[idx + 1] << 16) | (params[idx + 2] << 8) | params[idx + 3];
+        }
+        idx += length;
+    }
+    return idx == size ? 0 : -1;
+}
+
+// Value of the first "type" TLV in a parameter block, in "*value".
+// Returns its length, or -1 if there is none.
+static int findParam(const unsigned char *params, int size, unsigned char type, const unsigned char **value)
+{
+    for (int idx = 0; idx + 2 <= size; idx += 2 + params[idx + 1])
+    {
+        if (params[idx] != type || idx + 2 + params[idx + 1] > size) continue;
+        *value = params + idx + 2;
+        return params[idx + 1];
+    }
+    return -1;
+}
+
+// Build a frame carrying a parameter block: F A C BCC1 stuffed(params BCC2) F.
+// Parameters are always protected by the XOR BCC2, which every peer understands.
+static int buildTlvFrame(unsigned char address, unsigned char control,
+                         const unsigned char *params, int nParams, unsigned char *frame)
+{
+    int size = buildIFrame(control, params, nParams, LlCheckXor, frame);
+    frame[1] = address;
+    frame[3] = address ^ control;
+    return size;
+}
+
+// Build a SET/UA carrying parameters, followed by the TLVs in "extra".
+static int buildParamFrame(unsigned char address, unsigned char control, const LinkParams *p,
+                           const unsigned char *extra, int nExtra, unsigned char *frame)
+{
+    unsigned char params[MAX_PARAMS_SIZE];
+    int nParams = buildParams(p, params);
+    if (nExtra > 0) memcpy(params + nParams, extra, nExtra);
+    nParams += nExtra;
+    return buildTlvFrame(address, control, params, nParams, frame);
+}
+
+static int maxWindow(LinkLayerArqMode mode)
+{
+    switch (mode)
+    {
+    case LlGoBackN: return MAX_WINDOW_GBN;
+    case LlSelectiveRepeat: return MAX_WINDOW_SR;
+    default: return 1;
+    }
+}
+
+// Clamp requested parameters to what this side supports. A window or payload
+// limit of 0 means the maximum supported.
+static void limitParams(LinkParams *p, LinkLayerArqMode maxMode, int maxWindowSize, int maxPayload)
+{
+    if (p->arqMode > maxMode) p->arqMode = maxMode;
+    if (p->arqMode < LlStopAndWait) p->arqMode = LlStopAndWait;
+    int limit = maxWindow(p->arqMode);
+    if (maxWindowSize > 0 && maxWindowSize < limit) limit = maxWindowSize;
+    if (p->windowSize <= 0 || p->windowSize > limit) p->windowSize = limit;
+    if (p->frameCheck < LlCheckXor || p->frameCheck > LlCheckCrc32) p->frameCheck = LlCheckXor;
+    if (maxPayload <= 0 || maxPayload > MAX_PAYLOAD_SIZE) maxPayload = MAX_PAYLOAD_SIZE;
+    if (p->maxPayload <= 0 || p->maxPayload > maxPayload) p->maxPayload = maxPayload;
+    if (p->maxPayload < MIN_PAYLOAD_SIZE) p->maxPayload = MIN_PAYLOAD_SIZE;
+    if (p->fecParity < 0 || p->fecParity > FEC_MAX_PARITY || p->fecParity % 2 != 0) p->fecParity = 0;
+    if (p->arqMode == LlStopAndWait) p->fullDuplex = FALSE; // no N(R) in stop-and-wait I-frames
+}
+
+static void resetWindows(LinkConnection *conn)
+{
+    for (int seq = 0; seq < SEQ_MODULUS; seq++) {
+        timerStop(&conn->loop, seq);
+    }
+    conn->sequenceNumber = 0;
+    conn->txBase = conn->txNext = 0;
+    conn->rxDeliver = conn->rxExpected = conn->rxNextSeen = 0;
+    free(conn->rxQueue);
+    conn->rxQueue = NULL;
+    conn->rxQueueSize = conn->rxQueueHead = conn->rxQueueCount = 0;
+    conn->expectedSeq = 0;
+    conn->rejSent = FALSE;
+    conn->ackPending = FALSE;
+    conn->discReceived = FALSE;
+    conn->linkFailed = FALSE;
+    memset(conn->rxSlots, 0, sizeof(conn->rxSlots));
+}
+
+// Adopt the agreed parameters and start with empty windows.
+static void applyParams(LinkConnection *conn, const LinkParams *p)
+{
+    conn->arqMode = p->arqMode;
+    conn->windowSize = p->windowSize;
+    conn->frameCheck = p->frameCheck;
+    conn->maxPayloadSize = p->maxPayload;
+    conn->fecParity = p->fecParity;
+    conn->fullDuplex = p->fullDuplex;
+    resetWindows(conn);
+
+    conn->stats.sessions++;
+    conn->stats.arqMode = conn->arqMode;
+    conn->stats.windowSize = conn->windowSize;
+    conn->stats.frameCheck = conn->frameCheck;
+    conn->stats.maxPayload = conn->maxPayloadSize;
+    conn->stats.fecParity = conn->fecParity;
+    conn->stats.fullDuplex = conn->fullDuplex;
+}
+
+static const char *arqModeName(LinkLayerArqMode mode)
+{
+    switch (mode)
+    {
+    case LlGoBackN: return "Go-Back-N";
+    case LlSelectiveRepeat: return "Selective Repeat";
+    default: return "Stop-and-Wait";
+    }
+}
+
+static const char *frameCheckName(LinkLayerFrameCheck type)
+{
+    switch (type)
+    {
+    case LlCheckCrc16: return "CRC-16";
+    case LlCheckCrc32: return "CRC-32";
+    default: return "XOR";
+    }
+}
+
+// -------------------- RETRANSMISSION TIMEOUT --------------------
+
+static void resetRtt(LinkConnection *conn)
+{
+    conn->srtt8 = -1;
+    conn->rttvar4 = 0;
+    conn->backoff = 0;
+    conn->lineFreeAt = 0;
+}
+
+// Time the line needs to clock out "nBytes" (start + 8 data + stop bits)
+static int wireTimeMs(LinkConnection *conn, int nBytes)
+{
+    return (int)((long long)nBytes * 10 * 1000 / conn->lineBaudRate);
+}
+
+// Time the answer to a frame spends on the line. In full duplex it rides on
+// the peer's next I-frame, which may leave behind a window of others.
+static int replyTimeMs(LinkConnection *conn)
+{
+    if (!conn->fullDuplex) return wireTimeMs(conn, S_FRAME_SIZE);
+    return wireTimeMs(conn, conn->windowSize * (conn->maxPayloadSize + 6 + checkSize(conn->frameCheck)));
+}
+
+// Account for "nBytes" just written. Returns the time the exchange spends on
+// the line: waiting behind earlier output, clocking out, and the reply.
+static int queueOnLine(LinkConnection *conn, int nBytes)
+{
+    long long now = clockMs(&conn->loop);
+    if (conn->lineFreeAt < now) conn->lineFreeAt = now;
+    conn->lineFreeAt += wireTimeMs(conn, nBytes);
+    return (int)(conn->lineFreeAt - now) + replyTimeMs(conn);
+}
+
+// Timeout for a frame whose exchange spends "wireMs" on the line. The wait for
+// the answer is the configured timeout before the first sample; afterwards
+// SRTT + 4*RTTVAR, doubled for each consecutive timeout and never above the
+// configured value. Serialization time comes on top, as large frames at low
+// baud rates can take longer than the timeout just to clock out.
+static int retransmitTimeout(LinkConnection *conn, int wireMs)
+{
+    if (conn->srtt8 < 0) return conn->timeoutMs + wireMs;
+
+    long long rto = (conn->srtt8 >> 3) + conn->rttvar4;
+    if (rto < MIN_RTO_MS) rto = MIN_RTO_MS;
+    rto <<= conn->backoff;
+    if (rto > conn->timeoutMs) rto = conn->timeoutMs;
+    return (int)rto + wireMs;
+}
+
+// Feed the round trip of a frame sent at "sentAt". Only frames that were not
+// retransmitted may be sampled (Karn), as the answer could belong to either copy.
+static void sampleRtt(LinkConnection *conn, long long sentAt, int wireMs)
+{
+    int rtt = (int)(clockMs(&conn->loop) - sentAt) - wireMs;
+    if (rtt < 0) rtt = 0;
+
+    if (conn->srtt8 < 0) {
+        conn->srtt8 = rtt << 3;
+        conn->rttvar4 = rtt << 1;
+    }
+    else {
+        int delta = rtt - (conn->srtt8 >> 3);
+        conn->srtt8 += delta; // SRTT += delta / 8
+        if (delta < 0) delta = -delta;
+        conn->rttvar4 += delta - (conn->rttvar4 >> 2); // RTTVAR += (|delta| - RTTVAR) / 4
+    }
+    conn->backoff = 0;
+
+    if (conn->stats.rttSamples == 0 || rtt < conn->stats.rttMinMs) conn->stats.rttMinMs = rtt;
+    if (conn->stats.rttSamples == 0 || rtt > conn->stats.rttMaxMs) conn->stats.rttMaxMs = rtt;
+    conn->stats.rttSamples++;
+    conn->rttTotalMs += rtt;
+}
+
+static void backOff(LinkConnection *conn)
+{
+    if (conn->backoff < MAX_BACKOFF) conn->backoff++;
+}
+
+// -------------------- PAYLOAD SIZING --------------------
+
+// Frame error rate seen by the transmitter: each transmission ends either
+// acknowledged or failed (REJ, SREJ or timeout). Counts decay per outcome so
+// the estimate follows changes on the line. Frames a Go-Back-N receiver drops
+// after a loss have no outcome of their own and are not counted.
+#define ERROR_DECAY (63.0 / 64.0)
+#define MAX_FRAME_ERROR_RATE 0.9
+#define MIN_ADAPTIVE_PAYLOAD 64
+#define PAYLOAD_STEP 32
+#define INITIAL_PAYLOAD 1000 // the original MAX_PAYLOAD_SIZE
+
+// llpayloadSize of "conn"
+static int currentPayloadSize(LinkConnection *conn)
+{
+    if (conn->fixedPayload) return conn->maxPayloadSize;
+    return (conn->payloadSize < conn->maxPayloadSize) ? conn->payloadSize : conn->maxPayloadSize;
+}
+
+// Start the estimate over, keeping the payload size (the line rate changed).
+static void forgetErrorRate(LinkConnection *conn)
+{
+    conn->outcomes = 0;
+    conn->outcomeBits = 0;
+    conn->failedFrames = 0;
+    conn->ackedInARow = 0;
+}
+
+static void resetErrorRate(LinkConnection *conn)
+{
+    forgetErrorRate(conn);
+    conn->payloadSize = INITIAL_PAYLOAD;
+}
+
+// Pick the payload that maximises goodput for the estimated bit error rate.
+// A frame error rate f on frames of n bits means (1 - p)^n = 1 - f, so
+// a = -ln(1 - p) = -ln(1 - f) / n. A frame of L payload and H overhead bytes
+// then has efficiency L / (L + H) * exp(-8a(L + H)), which peaks where
+// L^2 + H L = H / (8a). Stop-and-wait also idles for a round trip per frame,
+// which counts as overhead. Growth is limited to a quarter per acknowledged
+// frame, starting from the original 1000 bytes, so a noisy line is found
+// before frames get large.
+static void updatePayloadSize(LinkConnection *conn, int mayGrow)
+{
+    if (conn->outcomes <= 0 || conn->fixedPayload) return;
+
+    double overhead = 6 + checkSize(conn->frameCheck) + S_FRAME_SIZE;
+    if (conn->arqMode == LlStopAndWait && conn->srtt8 >= 0) {
+        overhead += (conn->srtt8 >> 3) * conn->lineBaudRate / 10000.0;
+    }
+
+    double best = conn->maxPayloadSize;
+    double fer = conn->failedFrames / conn->outcomes;
+    if (fer > MAX_FRAME_ERROR_RATE) fer = MAX_FRAME_ERROR_RATE;
+    double a = -log1p(-fer) / (conn->outcomeBits / conn->outcomes);
+    if (a > 0) {
+        best = (sqrt(overhead * overhead + 4 * overhead / (8 * a)) - overhead) / 2;
+    }
+
+    int size = conn->maxPayloadSize;
+    if (best < conn->maxPayloadSize) size = ((int)best / PAYLOAD_STEP) * PAYLOAD_STEP;
+    if (size > currentPayloadSize(conn) && !mayGrow) size = currentPayloadSize(conn);
+    int grown = (currentPayloadSize(conn) * 5 / 4 / PAYLOAD_STEP) * PAYLOAD_STEP;
+    if (size > grown) size = grown;
+    if (size < MIN_ADAPTIVE_PAYLOAD) size = MIN_ADAPTIVE_PAYLOAD;
+    if (size != currentPayloadSize(conn)) {
+        // Mantissa and exponent of the BER, as trace arguments are integers
+        double ber = -expm1(-a);
+        long exponent = (ber > 0) ? (long)floor(log10(ber)) : 0;
+        long mantissa = lround(ber / pow(10, exponent) * 10);
+        TRACE(TRACE_INFO, "Payload size adapted to %ld bytes (estimated BER %ld.%lde%ld)\n",
+              size, mantissa / 10, mantissa % 10, exponent);
+    }
+    conn->payloadSize = size;
+}
+
+static void recordOutcome(LinkConnection *conn, int frameBytes, int failed)
+{
+    conn->outcomes = conn->outcomes * ERROR_DECAY + 1;
+    conn->outcomeBits = conn->outcomeBits * ERROR_DECAY + 8.0 * frameBytes;
+    conn->failedFrames = conn->failedFrames * ERROR_DECAY + failed;
+    conn->ackedInARow = failed ? 0 : conn->ackedInARow + 1;
+}
+
+// Account for an I-frame of "frameBytes" that was acknowledged.
+static void recordFrameAcked(LinkConnection *conn, int frameBytes)
+{
+    recordOutcome(conn, frameBytes, 0);
+    updatePayloadSize(conn, TRUE);
+}
+
+// Account for an I-frame of "frameBytes" that was rejected or timed out.
+static void recordFrameFailed(LinkConnection *conn, int frameBytes)
+{
+    recordOutcome(conn, frameBytes, 1);
+    updatePayloadSize(conn, FALSE);
+}
+
+int llpayloadSize()
+{
+    return currentPayloadSize(connection());
+}
+
+// -------------------- WAITING --------------------
+
+// Timer ids: window slots use their sequence number, everything else this one
+#define TIMER_CONTROL SEQ_MODULUS
+
+// How long readFrame waits for bytes
+#define WAIT_POLL 0  // not at all: only bytes already there
+#define WAIT_TIMER 1 // until bytes arrive or a timer expires
+#define WAIT_INPUT 2 // until bytes arrive, leaving timers for later
+
+// Point "*bytes" at received bytes, waiting for them as "wait" says.
+// Returns how many there are, 0 if none (or a timer expired first), -1 on error.
+static int peekInput(LinkConnection *conn, const unsigned char **bytes, int wait)
+{
+    if (bufferedSerialPort(&conn->port) == 0)
+    {
+        if (wait == WAIT_POLL) {
+            if (!eventInputReady(&conn->loop)) return 0;
+        }
+        else if (wait == WAIT_TIMER) {
+            int events = eventWait(&conn->loop);
+            if (events < 0) return portFailed(conn);
+            if (!(events & EVENT_INPUT)) return 0;
+        }
+        else if (eventWaitInput(&conn->loop) < 0) {
+            return portFailed(conn);
+        }
+    }
+    int n = peekBufferSerialPort(&conn->port, bytes);
+    return (n < 0) ? portFailed(conn) : n;
+}
+
+// -------------------- FRAME DECODER --------------------
+
+// Every frame from the peer goes through readFrame, which tells its kind from
+// the control field alone, so whatever the protocol is waiting for, other
+// frames can be answered at once rather than skipped until a timeout.
+typedef enum
+{
+    FrameUnknown,
+    FrameBad, // BCC1 does not match
+    FrameI,
+    FrameRR,
+    FrameREJ,
+    FrameSREJ,
+    FrameSET,
+    FrameUA,
+    FrameDISC,
+    FrameRATE,
+    FRAME_KINDS
+} FrameKind;
+
+// What follows the header
+typedef enum
+{
+    BodyNone,   // the closing flag
+    BodyParams, // an optional parameter block (extended SET/UA, RATE), read by readFrame
+    BodyData    // the data field, left to the caller to receive or discard
+} FrameBody;
+
+static const FrameBody frameBodies[FRAME_KINDS] = {
+    [FrameI] = BodyData,
+    [FrameSET] = BodyParams,
+    [FrameUA] = BodyParams,
+    [FrameRATE] = BodyParams,
+};
+
+// Kind of every control field. Sequence numbers sit in the bits S_TYPE leaves
+// out, in stop-and-wait (C_RR1, C_REJ1) as in the windowed modes.
+static unsigned char frameKinds[256];
+
+typedef struct
+{
+    FrameKind kind;
+    unsigned char address;
+    unsigned char control;
+    unsigned char params[MAX_PARAM_FRAME_SIZE]; // SET/UA/RATE: destuffed parameter block
+    int nParams;                                // 0 for a plain SET/UA
+} DecodedFrame;
+
+static void buildFrameKinds(void)
+{
+    for (int c = 0; c < 256; c++) {
+        if (IS_I_FRAME(c)) frameKinds[c] = FrameI;
+        else if (S_TYPE(c) == C_RR_WIN(0)) frameKinds[c] = FrameRR;
+        else if (S_TYPE(c) == C_REJ_WIN(0)) frameKinds[c] = FrameREJ;
+        else if (S_TYPE(c) == C_SREJ_WIN(0)) frameKinds[c] = FrameSREJ;
+        else frameKinds[c] = FrameUnknown;
+    }
+    frameKinds[C_SET] = FrameSET;
+    frameKinds[C_UA] = FrameUA;
+    frameKinds[C_DISC] = FrameDISC;
+    frameKinds[C_RATE] = FrameRATE;
+}
+
+// Fill "f" from the header just read. Returns TRUE if the frame is complete
+// (I-frames: up to their data field), FALSE if more bytes are needed.
+static int decodeHeaderRead(LinkConnection *conn, DecodedFrame *f)
+{
+    f->address = conn->decodeHeader[0];
+    f->control = conn->decodeHeader[1];
+    f->nParams = 0;
+    if ((conn->decodeHeader[0] ^ conn->decodeHeader[1]) != conn->decodeHeader[2]) {
+        TRACE(TRACE_WARN, "Frame header error, discarding\n");
+        conn->stats.bcc1Errors++;
+        f->kind = FrameBad;
+        conn->decodeState = DECODE_HUNT;
+        return TRUE;
+    }
+
+    f->kind = frameKinds[f->control];
+    if (f->kind == FrameUnknown) {
+        conn->decodeState = DECODE_HUNT;
+        return FALSE;
+    }
+    switch (frameBodies[f->kind])
+    {
+    case BodyData:
+        conn->decodeState = DECODE_ADDRESS; // the caller reads up to the closing flag
+        return TRUE;
+    case BodyParams:
+        conn->nDecodeParams = 0;
+        conn->decodeState = DECODE_PARAMS;
+        return FALSE;
+    default:
+        conn->decodeState = DECODE_TRAILER;
+        return FALSE;
+    }
+}
+
+// The closing flag of a SET/UA/RATE: check its parameter block, if any.
+// Returns TRUE if the frame is good.
+static int decodeParamsRead(LinkConnection *conn, DecodedFrame *f)
+{
+    if (conn->nDecodeParams == 0) return TRUE;
+    f->nParams = decodeDataField(conn->decodeParams, conn->nDecodeParams, LlCheckXor, f->params);
+    return f->nParams > 0;
+}
+
+// Read the next frame from the peer, waiting for it as "wait" says.
+// Frames with a bad BCC1 come back as FrameBad. An I-frame comes back once its
+// header is read: the caller must take in its data field (receiveDataField) or
+// drop it (discardFrame). Other frames are read to their closing flag, which is
+// left to open the next frame.
+// Returns 1 with the frame in "f", 0 if none is complete, -1 on error.
+static int readFrame(LinkConnection *conn, DecodedFrame *f, int wait)
+{
+    while (1)
+    {
+        const unsigned char *bytes;
+        int n = peekInput(conn, &bytes, wait);
+        if (n <= 0) return n;
+
+        int used = 0;
+        int done = FALSE;
+        while (used < n && !done)
+        {
+            if (conn->decodeState == DECODE_HUNT) {
+                const unsigned char *flag = memchr(bytes + used, FLAG, n - used);
+                used = (flag != NULL) ? flag - bytes + 1 : n;
+                if (flag != NULL) conn->decodeState = DECODE_ADDRESS;
+                continue;
+            }
+
+            unsigned char byte = bytes[used];
+            if (byte == FLAG) {
+                // Ends a SET/UA or S-frame, restarts anything else
+                if (conn->decodeState == DECODE_TRAILER) done = TRUE;
+                else if (conn->decodeState == DECODE_PARAMS) done = decodeParamsRead(conn, f);
+                conn->decodeState = DECODE_ADDRESS;
+                if (done) break; // the flag may open the next frame
+                used++;
+                continue;
+            }
+
+            used++;
+            switch (conn->decodeState)
+            {
+            case DECODE_ADDRESS:
+                conn->decodeHeader[0] = byte;
+                conn->decodeState = DECODE_CONTROL;
+                break;
+            case DECODE_CONTROL:
+                conn->decodeHeader[1] = byte;
+                conn->decodeState = DECODE_BCC1;
+                break;
+            case DECODE_BCC1:
+                conn->decodeHeader[2] = byte;
+                done = decodeHeaderRead(conn, f);
+                break;
+            case DECODE_PARAMS:
+                if (conn->nDecodeParams < (int)sizeof(conn->decodeParams)) conn->decodeParams[conn->nDecodeParams++] = byte;
+                else conn->decodeState = DECODE_HUNT;
+                break;
+            default: // DECODE_TRAILER: not a frame after all
+                conn->decodeState = DECODE_HUNT;
+                break;
+            }
+        }
+        consumeSerialPort(&conn->port, used);
+        if (done) return 1;
+        if (wait == WAIT_POLL && bufferedSerialPort(&conn->port) == 0) return 0;
+    }
+}
+
+// -------------------- STATISTICS --------------------
+
+static void resetStatistics(LinkConnection *conn, LinkLayerRole role, int baudRate)
+{
+    memset(&conn->stats, 0, sizeof(conn->stats));
+    conn->stats.role = role;
+    conn->stats.baudRate = baudRate;
+    conn->rttTotalMs = 0;
+    conn->rateTotal = 0;
+    conn->statsStartMs = conn->rateSinceMs = clockMs(&conn->loop);
+    conn->statsEndMs = 0;
+    conn->statsStarted = TRUE;
+}
+
+// llstatistics of "conn"
+static int readStatistics(LinkConnection *conn, LinkLayerStatistics *out)
+{
+    if (!conn->statsStarted) return -1;
+    *out = conn->stats;
+
+    long long endMs = (conn->statsEndMs > 0) ? conn->statsEndMs : clockMs(&conn->loop);
+    out->elapsedSeconds = (endMs - conn->statsStartMs) / 1000.0;
+    out->rttAvgMs = (conn->stats.rttSamples > 0) ? conn->rttTotalMs / conn->stats.rttSamples : 0;
+    // Against the average line rate, weighted by the time spent at each
+    double baudRate = conn->stats.baudRate;
+    if (endMs > conn->statsStartMs) {
+        long long sinceMs = (conn->rateSinceMs < endMs) ? conn->rateSinceMs : endMs;
+        baudRate = (conn->rateTotal + (double)conn->stats.baudRate * (endMs - sinceMs)) / (endMs - conn->statsStartMs);
+    }
+    if (out->elapsedSeconds > 0) {
+        out->goodputBps = 8.0 * conn->stats.payloadBytes / out->elapsedSeconds;
+        out->efficiency = out->goodputBps / baudRate;
+    }
+
+    // a = Tprop / Tframe, with the measured round trip as 2 * Tprop and the
+    // average I-frame (stuffed field, header and flags) as Tframe
+    long frames = (conn->stats.role == LlTx) ? conn->stats.framesSent : conn->stats.framesReceived;
+    out->sawEfficiency = 1;
+    if (frames > 0 && conn->stats.rttSamples > 0) {
+        double frameMs = ((double)conn->stats.stuffedBytes / frames + 6) * 10 * 1000 / baudRate;
+        out->sawEfficiency = frameMs / (frameMs + out->rttAvgMs);
+    }
+    return 0;
+}
+
+int llstatistics(LinkLayerStatistics *out)
+{
+    return readStatistics(connection(), out);
+}
+
+static void printStatistics(LinkConnection *conn)
+{
+    LinkLayerStatistics s;
+    readStatistics(conn, &s);
+
+    printf("\n===== Link statistics =====\n");
+    if (s.role == LlTx || s.fullDuplex) {
+        printf("I-frames sent: %ld (%ld retransmissions, %ld timeouts, %ld REJ/SREJ received)\n",
+               s.framesSent, s.retransmissions, s.timeouts, s.rejReceived);
+    }
+    if (s.role == LlRx || s.fullDuplex) {
+        printf("I-frames received: %ld (%ld duplicates, %ld REJ/SREJ sent)\n",
+               s.framesReceived, s.duplicates, s.rejSent);
+        printf("Errors: %ld BCC1, %ld BCC2\n", s.bcc1Errors, s.bcc2Errors);
+    }
+    if (s.fullDuplex) printf("Payload acknowledged and received (full duplex): %lld bytes\n", s.payloadBytes);
+    else if (s.role == LlTx) printf("Payload acknowledged: %lld bytes\n", s.payloadBytes);
+    else printf("Payload received: %lld bytes\n", s.payloadBytes);
+    if (s.fecParity > 0 && (s.role == LlRx || s.fullDuplex)) {
+        printf("FEC (%d parity bytes per block): %ld frames repaired (%ld bytes), %ld beyond repair\n",
+               s.fecParity, s.framesCorrected, s.bytesCorrected, s.framesUncorrectable);
+    }
+    if (s.unstuffedBytes > 0) {
+        printf("Data fields: %lld bytes, %lld after stuffing (+%.1f%%)\n", s.unstuffedBytes, s.stuffedBytes,
+               100.0 * (s.stuffedBytes - s.unstuffedBytes) / s.unstuffedBytes);
+    }
+    if (s.rttSamples > 0) {
+        printf("RTT: min %.0f / avg %.1f / max %.0f ms (%ld samples)\n",
+               s.rttMinMs, s.rttAvgMs, s.rttMaxMs, s.rttSamples);
+    }
+    if (s.rateChanges > 0) printf("Line rate: %d baud at the end after %d rate changes\n", s.baudRate, s.rateChanges);
+    printf("Time: %.2f s, goodput %.0f bit/s, efficiency %.3f (stop-and-wait bound %.3f)\n",
+           s.elapsedSeconds, s.goodputBps, s.efficiency, s.sawEfficiency);
+    printf("===========================\n\n");
+
+    if (conn->statsFile != NULL && statsWriteReport(&s, conn->statsFormat, conn->statsFile) < 0) {
+        printf("Warning: Could not write statistics to %s\n", conn->statsFile);
+    }
+}
+
+// The line now runs at "rate": count earlier time at the old one.
+static void noteLineRate(LinkConnection *conn, int rate)
+{
+    long long now = clockMs(&conn->loop);
+    conn->rateTotal += (double)conn->stats.baudRate * (now - conn->rateSinceMs);
+    conn->rateSinceMs = now;
+    conn->stats.baudRate = rate;
+}
+
+// End of the data phase: the counters stop here and are reported.
+static void finishStatistics(LinkConnection *conn)
+{
+    conn->statsEndMs = clockMs(&conn->loop);
+    traceFlush();
+    conn->sessionOpen = FALSE;
+    printStatistics(conn);
+}
+
+// -------------------- LINE RATE --------------------
+
+// llopen runs at the configured rate, which both ends can rely on. If the SET/UA
+// exchange agreed on a higher limit, the transmitter moves both ends up with
+// RATE commands before its next frame: the receiver answers at the old rate
+// and switches, then the transmitter switches and repeats the command at the
+// new rate. Only an answer to that confirms the new rate. Afterwards the
+// transmitter steps down one rate when so many frames fail that a clean line
+// at the rate below would carry more, and back up after a clean run. A cable
+// that cannot carry a rate settles on one that can.
+//
+// When the ends lose each other (an answer lost around a switch, or a rate
+// that carries nothing), the receiver falls back to the starting rate after a
+// silence, and the transmitter goes back there and waits that silence out.
+
+// Rates termios knows, lowest first
+static const int lineRates[] = {1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200,
+                                230400, 460800, 500000, 921600, 1000000, 2000000, 4000000};
+#define N_LINE_RATES (int)(sizeof(lineRates) / sizeof(lineRates[0]))
+
+#define TIMER_RATE (SEQ_MODULUS + 1)
+#define RATE_MIN_OUTCOMES 8      // frames with an outcome at a rate before judging it
+#define RATE_UP_FRAMES 64        // acknowledged in a row before trying the next rate up
+#define MAX_RATE_UP_FRAMES 4096
+
+static int rateIndex(int rate)
+{
+    for (int i = 0; i < N_LINE_RATES; i++) {
+        if (lineRates[i] == rate) return i;
+    }
+    return -1;
+}
+
+// Highest rate in the table up to "rate" (0 if there is none)
+static int tableRate(int rate)
+{
+    int found = 0;
+    for (int i = 0; i < N_LINE_RATES && lineRates[i] <= rate; i++) found = lineRates[i];
+    return found;
+}
+
+// Rx: how long a switched rate may stay silent before falling back. Longer
+// than the transmitter spends on a frame that gets no answer.
+static int rateSilenceMs(LinkConnection *conn)
+{
+    return (conn->maxRetries + 1) * conn->timeoutMs;
+}
+
+// Switch this end of the line to "rate", after what was written has left.
+static int setLineRate(LinkConnection *conn, int rate)
+{
+    if (setRateSerialPort(&conn->port, rate) < 0) return -1;
+    noteLineRate(conn, rate);
+    conn->stats.rateChanges++;
+    conn->lineBaudRate = rate;
+    conn->lineFreeAt = 0;
+    return 0;
+}
+
+// Returns the number of bytes written.
+static int sendRate(LinkConnection *conn, unsigned char address, int rate)
+{
+    unsigned char params[6];
+    unsigned char frame[MAX_PARAM_FRAME_SIZE];
+    int size = buildTlvFrame(address, C_RATE, params, putRate(params, rate), frame);
+    writeBytesSerialPort(&conn->port, frame, size);
+    return size;
+}
+
+// Rate a RATE frame carries, or -1 if it has none.
+static int frameRate(const DecodedFrame *f)
+{
+    LinkParams p;
+    if (parseParams(f->params, f->nParams, &p) < 0 || p.maxBaudRate <= 0) return -1;
+    return p.maxBaudRate;
+}
+
+// Tx: send RATE for "rate" until it is answered.
+// Returns 0 if the receiver answered with that rate, 1 if it answered with
+// another (refused), -1 if it never answered.
+static int commandRate(LinkConnection *conn, int rate)
+{
+    for (int retries = 0; retries < conn->maxRetries; retries++)
+    {
+        int size = sendRate(conn, A_SENDER, rate);
+        timerStart(&conn->loop, TIMER_CONTROL, retransmitTimeout(conn, queueOnLine(conn, size)));
+
+        DecodedFrame answer;
+        while (!timerExpired(&conn->loop, TIMER_CONTROL))
+        {
+            if (readFrame(conn, &answer, WAIT_TIMER) <= 0) continue;
+            if (answer.kind == FrameI) discardFrame(conn);
+            if (answer.kind != FrameRATE || answer.address != A_RECEIVER) continue;
+            timerStop(&conn->loop, TIMER_CONTROL);
+            return (frameRate(&answer) == rate) ? 0 : 1;
+        }
+        backOff(conn);
+    }
+    timerStop(&conn->loop, TIMER_CONTROL);
+    return -1;
+}
+
+// Tx: the receiver is out of reach at this rate. Go back to the starting rate
+// and stay silent until the receiver has fallen back there too.
+static void fallBackRate(LinkConnection *conn)
+{
+    setLineRate(conn, conn->startRate);
+    eventSleep(&conn->loop, rateSilenceMs(conn));
+}
+
+// Tx: move both ends to "rate".
+// Returns 0 if the line now runs at "rate", -1 if the receiver refused it (the
+// rate is unchanged) or the switch was not confirmed (back at startRate).
+static int changeRate(LinkConnection *conn, int rate)
+{
+    int from = conn->lineBaudRate;
+    int answer = commandRate(conn, rate);
+    if (answer == 1) {
+        TRACE(TRACE_WARN, "Line rate %ld baud refused, staying at %ld\n", rate, from);
+        return -1;
+    }
+    if (answer == 0 && setLineRate(conn, rate) == 0 && commandRate(conn, rate) == 0) {
+        TRACE(TRACE_INFO, "Line rate switched from %ld to %ld baud\n", from, rate);
+        return 0;
+    }
+    TRACE(TRACE_WARN, "Line rate %ld baud not confirmed, falling back to %ld\n", rate, conn->startRate);
+    fallBackRate(conn);
+    return -1;
+}
+
+// Tx: a frame ran out of retries at a switched rate. Rather than failing the
+// link, fall back to the starting rate; the rate that failed is not tried
+// again this session.
+// Returns 0 if the frame gets a new retry budget, -1 if the link has failed.
+static int rescueRate(LinkConnection *conn)
+{
+    int i = rateIndex(conn->lineBaudRate);
+    if (conn->lineBaudRate == conn->startRate || i <= 0) return -1;
+    TRACE(TRACE_WARN, "Frames fail at %ld baud, falling back to %ld\n", conn->lineBaudRate, conn->startRate);
+    conn->topRate = lineRates[i - 1];
+    fallBackRate(conn);
+    return 0;
+}
+
+// Tx: rate for the next frame. The agreed top rate at first; then one step
+// down when the share of frames getting through (at the adapted payload) is
+// below the ratio to the rate below, one step up after a clean run (a longer
+// one each time a rate proved too fast).
+static int nextRate(LinkConnection *conn)
+{
+    int i = rateIndex(conn->lineBaudRate);
+    if (conn->topRate <= conn->startRate || i < 0) return conn->lineBaudRate;
+    if (!conn->rateClimbed) return conn->topRate;
+    if (conn->lineBaudRate > conn->startRate && conn->outcomes >= RATE_MIN_OUTCOMES &&
+        1 - conn->failedFrames / conn->outcomes < (double)lineRates[i - 1] / conn->lineBaudRate) {
+        return lineRates[i - 1];
+    }
+    if (conn->lineBaudRate < conn->topRate && conn->ackedInARow >= conn->rateUpFrames) return lineRates[i + 1];
+    return conn->lineBaudRate;
+}
+
+// Rx: answer a RATE command, switching to its rate if it is new and within the
+// agreed limit. The answer leaves at the old rate.
+static void answerRate(LinkConnection *conn, const DecodedFrame *f)
+{
+    int rate = frameRate(f);
+    int allowed = rateIndex(rate) >= 0 && rate <= conn->topRate;
+    sendRate(conn, A_RECEIVER, allowed ? rate : conn->lineBaudRate);
+    if (!allowed || rate == conn->lineBaudRate) return;
+
+    int from = conn->lineBaudRate;
+    if (setLineRate(conn, rate) < 0) return;
+    timerStart(&conn->loop, TIMER_RATE, rateSilenceMs(conn));
+    TRACE(TRACE_INFO, "Line rate switched from %ld to %ld baud (RATE received)\n", from, rate);
+}
+
+// Rx: back to the starting rate, which the transmitter falls back to as well
+// (and sends its SET at when it reconnects).
+static void resetLineRate(LinkConnection *conn)
+{
+    timerStop(&conn->loop, TIMER_RATE);
+    if (conn->lineBaudRate != conn->startRate) setLineRate(conn, conn->startRate);
+}
+
+// Rx: wait for the next frame, falling back when a switched rate stays silent.
+// Garbage from a mismatched rate can pass for a frame header, so I-frames only
+// count once their check passed.
+static int waitFrame(LinkConnection *conn, DecodedFrame *f)
+{
+    if (conn->stats.framesReceived != conn->rateHeard) {
+        conn->rateHeard = conn->stats.framesReceived;
+        if (conn->lineBaudRate != conn->startRate) timerStart(&conn->loop, TIMER_RATE, rateSilenceMs(conn));
+    }
+
+    int r;
+    while ((r = readFrame(conn, f, (conn->lineBaudRate != conn->startRate) ? WAIT_TIMER : WAIT_INPUT)) == 0) {
+        if (!timerExpired(&conn->loop, TIMER_RATE)) continue;
+        TRACE(TRACE_WARN, "No frames at %ld baud, falling back to %ld\n", conn->lineBaudRate, conn->startRate);
+        resetLineRate(conn);
+    }
+    if (r > 0 && f->kind != FrameBad && f->kind != FrameI && conn->lineBaudRate != conn->startRate) {
+        timerStart(&conn->loop, TIMER_RATE, rateSilenceMs(conn));
+    }
+    return r;
+}
+
+// Adopt the agreed rate limit; 0 if there is none.
+static void agreeLineRate(LinkConnection *conn, int maxRate)
+{
+    conn->topRate = tableRate(maxRate);
+    if (conn->topRate <= conn->lineBaudRate) conn->topRate = conn->lineBaudRate;
+    else printf("Line rate: up to %d baud agreed\n", conn->topRate);
+}
+
+// -------------------- LLOPEN --------------------
+
+// Lookup tables shared by every connection, built by the first llopen
+static pthread_once_t tablesBuilt = PTHREAD_ONCE_INIT;
+
+static void buildTables(void)
+{
+    crcInit();
+    stuffingInit();
+    fecInit();
+    buildFrameKinds();
+}
+
+// Fast open: the transmitter's first packet (the START control packet) rides in
+// the SET, so the round trip that opens the connection also delivers it. A
+// CRC-16 in the TLV covers the packet beyond the XOR BCC2 of the parameters.
+
+// Rx: answer a SET, telling a fast-open transmitter whether its packet was taken.
+static void sendUa(LinkConnection *conn, int openTaken)
+{
+    unsigned char frame[MAX_PARAM_FRAME_SIZE];
+    int size = 5;
+
+    if (conn->uaExtended) {
+        static const unsigned char taken[] = {LP_OPEN_DATA, 1, 1};
+        size = buildParamFrame(A_RECEIVER, C_UA, &conn->uaParams, taken, openTaken ? sizeof(taken) : 0, frame);
+    }
+    else {
+        frame[0] = FLAG;
+        frame[1] = A_RECEIVER;
+        frame[2] = C_UA;
+        frame[3] = frame[1] ^ frame[2];
+        frame[4] = FLAG;
+    }
+    writeBytesSerialPort(&conn->port, frame, size);
+}
+
+// Rx: keep the packet of a fast-open SET for llread.
+// Returns TRUE if the SET carried one and it arrived intact.
+static int takeOpenPacket(LinkConnection *conn, const DecodedFrame *set)
+{
+    conn->openPacketSize = 0;
+    conn->openPacketReady = FALSE;
+
+    const unsigned char *value;
+    int length = findParam(set->params, set->nParams, LP_OPEN_DATA, &value);
+    if (length <= 2) return FALSE;
+    FrameCheck check;
+    checkInit(&check, LlCheckCrc16);
+    checkUpdate(&check, value, length);
+    if (!checkValid(&check)) return FALSE;
+
+    conn->openPacketSize = length - 2;
+    memcpy(conn->openPacket, value, conn->openPacketSize);
+    conn->openPacketReady = TRUE;
+    return TRUE;
+}
+
+// Receiver side of the SET/UA exchange: reply with UA, agreeing on parameters
+// if the SET carried any and taking its packet if it carried one.
+static int acceptConnection(LinkConnection *conn, LinkLayer *connectionParameters, const DecodedFrame *set)
+{
+    LinkParams agreed = defaultParams;
+
+    conn->uaExtended = (set->nParams > 0);
+    if (conn->uaExtended)
+    {
+        parseParams(set->params, set->nParams, &agreed);
+        limitParams(&agreed, connectionParameters->arqMode, connectionParameters->windowSize,
+                    connectionParameters->maxPayload);
+        if (!connectionParameters->fullDuplex) agreed.fullDuplex = FALSE;
+
+        // Rate changes only where this end can switch, and not in full duplex
+        int maxRate = connectionParameters->maxBaudRate;
+        if (agreed.fullDuplex || transportSerialPort(&conn->port)->setRate == NULL || maxRate <= conn->lineBaudRate) {
+            agreed.maxBaudRate = 0;
+        }
+        else if (agreed.maxBaudRate > maxRate) agreed.maxBaudRate = maxRate;
+    }
+    conn->uaParams = agreed;
+
+    applyParams(conn, &agreed);
+    int taken = takeOpenPacket(conn, set);
+    sendUa(conn, taken);
+    printf("Connection established (UA sent, %s, window=%d, %s, payload=%d, fec=%d%s%s)\n",
+           arqModeName(conn->arqMode), conn->windowSize, frameCheckName(conn->frameCheck), conn->maxPayloadSize, conn->fecParity,
+           conn->fullDuplex ? ", full duplex" : "", taken ? ", fast open" : "");
+    agreeLineRate(conn, agreed.maxBaudRate);
+    return conn->fd;
+}
+
+// Transmitter side of the SET/UA exchange, the SET carrying "openData" unless it
+// is NULL (fast open).
+// Returns 1 if the receiver took the packet, 0 if it connected without it, -1 if no UA came.
+static int connectReceiver(LinkConnection *conn, const unsigned char *openData, int openSize)
+{
+    const LinkParams *proposed = &conn->proposedParams;
+    unsigned char frame[5];
+    frame[0] = FLAG;
+    frame[1] = A_SENDER;
+    frame[2] = C_SET;
+    frame[3] = frame[1] ^ frame[2];
+    frame[4] = FLAG;
+
+    // The packet, if any, follows the parameters with its CRC-16
+    unsigned char open[2 + MAX_OPEN_DATA + MAX_CHECK_SIZE];
+    int nOpen = 0;
+    if (openData != NULL) {
+        FrameCheck check;
+        checkInit(&check, LlCheckCrc16);
+        checkUpdate(&check, openData, openSize);
+        open[0] = LP_OPEN_DATA;
+        memcpy(open + 2, openData, openSize);
+        nOpen = 2 + openSize + checkTrailer(&check, open + 2 + openSize);
+        open[1] = nOpen - 2;
+    }
+
+    // Anything beyond the original protocol is proposed in an extended SET
+    unsigned char setFrame[MAX_PARAM_FRAME_SIZE];
+    int setFrameSize = 0;
+    if (proposed->arqMode != LlStopAndWait || proposed->frameCheck != LlCheckXor ||
+        proposed->maxPayload != LEGACY_PAYLOAD_SIZE || proposed->fecParity != 0 || proposed->fullDuplex ||
+        proposed->maxBaudRate > 0 || nOpen > 0) {
+        setFrameSize = buildParamFrame(A_SENDER, C_SET, proposed, open, nOpen, setFrame);
+    }
+
+    int retries = 0;
+    while (retries < conn->maxRetries)
+    {
+        // Alternate with a plain SET so peers that don't negotiate still answer
+        int sentSize = 5;
+        if (setFrameSize > 0 && retries % 2 == 0) {
+            printf("Sending SET frame (%s, window=%d, %s, payload=%d, fec=%d%s%s, attempt %d/%d)...\n",
+                   arqModeName(proposed->arqMode), proposed->windowSize, frameCheckName(proposed->frameCheck),
+                   proposed->maxPayload, proposed->fecParity, proposed->fullDuplex ? ", full duplex" : "",
+                   nOpen > 0 ? ", first packet" : "", retries + 1, conn->maxRetries);
+            writeBytesSerialPort(&conn->port, setFrame, setFrameSize);
+            sentSize = setFrameSize;
+        }
+        else {
+            printf("Sending SET frame (attempt %d/%d)...\n", retries + 1, conn->maxRetries);
+            writeBytesSerialPort(&conn->port, frame, 5);
+        }
+        long long sentAt = clockMs(&conn->loop);
+        int wireMs = queueOnLine(conn, sentSize);
+        timerStart(&conn->loop, TIMER_CONTROL, conn->timeoutMs);
+
+        DecodedFrame reply;
+        while (!timerExpired(&conn->loop, TIMER_CONTROL))
+        {
+            if (readFrame(conn, &reply, WAIT_TIMER) <= 0) continue;
+            if (reply.kind == FrameI) discardFrame(conn); // full duplex: UA lost, peer already sending
+            if (reply.kind != FrameUA || reply.address != A_RECEIVER) continue;
+
+            LinkParams agreed;
+            if (reply.nParams > 0 && parseParams(reply.params, reply.nParams, &agreed) < 0) continue;
+            timerStop(&conn->loop, TIMER_CONTROL);
+            if (retries == 0) sampleRtt(conn, sentAt, wireMs);
+            if (reply.nParams == 0) {
+                // Plain UA: peer does not negotiate
+                applyParams(conn, &defaultParams);
+                agreeLineRate(conn, 0);
+                printf("Connection established (UA received)\n");
+                return 0;
+            }
+            limitParams(&agreed, proposed->arqMode, proposed->windowSize, proposed->maxPayload);
+            if (agreed.fecParity > proposed->fecParity) agreed.fecParity = proposed->fecParity;
+            if (!proposed->fullDuplex) agreed.fullDuplex = FALSE;
+            if (agreed.maxBaudRate > proposed->maxBaudRate || agreed.fullDuplex) {
+                agreed.maxBaudRate = agreed.fullDuplex ? 0 : proposed->maxBaudRate;
+            }
+            applyParams(conn, &agreed);
+
+            // A receiver that took the packet from an earlier SET (whose UA
+            // was lost) says so in the answer to a plain one as well
+            const unsigned char *value;
+            int taken = openData != NULL && findParam(reply.params, reply.nParams, LP_OPEN_DATA, &value) == 1 &&
+                        value[0] == 1;
+            printf("Connection established (UA received, %s, window=%d, %s, payload=%d, fec=%d%s%s)\n",
+                   arqModeName(conn->arqMode), conn->windowSize, frameCheckName(conn->frameCheck), conn->maxPayloadSize,
+                   conn->fecParity, conn->fullDuplex ? ", full duplex" : "", taken ? ", fast open" : "");
+            agreeLineRate(conn, agreed.maxBaudRate);
+            return taken;
+        }
+        retries++;
+        printf("Timeout! No UA received.\n");
+    }
+
+    printf("Error: Failed to establish connection after %d retries\n", conn->maxRetries);
+    timerStop(&conn->loop, TIMER_CONTROL);
+    return -1;
+}
+
+int llopen(LinkLayer connectionParameters)
+{
+    LinkConnection *conn = connection();
+    conn->linkFailed = FALSE;
+    conn->fd = openSerialPort(&conn->port, connectionParameters.serialPort, connectionParameters.baudRate);
+    if (conn->fd < 0) {
+        printf("Error: Failed to open serial port\n");
+        return -1;
+    }
+
+    if (eventLoopOpen(&conn->loop, transportSerialPort(&conn->port), &conn->port.handle) < 0) {
+        closeSerialPort(&conn->port);
+        return -1;
+    }
+
+    pthread_once(&tablesBuilt, buildTables);
+    conn->decodeState = DECODE_HUNT;
+    conn->timeoutMs = (connectionParameters.timeout > 0 ? connectionParameters.timeout : TIMEOUT) * 1000;
+    conn->maxRetries = connectionParameters.nRetransmissions > 0 ? connectionParameters.nRetransmissions : MAX_RETRIES;
+    conn->fixedPayload = connectionParameters.fixedPayload;
+    conn->lineBaudRate = connectionParameters.baudRate > 0 ? connectionParameters.baudRate : 9600;
+    resetRtt(conn);
+    resetErrorRate(conn);
+    if (!conn->sessionOpen) resetStatistics(conn, connectionParameters.role, conn->lineBaudRate);
+    else if (conn->stats.baudRate != conn->lineBaudRate) noteLineRate(conn, conn->lineBaudRate); // reopened after a rate change
+    conn->startRate = conn->topRate = conn->lineBaudRate;
+    conn->rateUpFrames = RATE_UP_FRAMES;
+    conn->rateClimbed = FALSE;
+    conn->sessionOpen = TRUE;
+    conn->statsEndMs = 0;
+    conn->statsFile = connectionParameters.statsFile;
+    conn->statsFormat = connectionParameters.statsFormat;
+    conn->localAddress = (connectionParameters.role == LlTx) ? A_SENDER : A_RECEIVER;
+    conn->peerAddress = (connectionParameters.role == LlTx) ? A_RECEIVER : A_SENDER;
+
+    if (connectionParameters.role == LlTx)
+    {
+        LinkParams proposed = {connectionParameters.arqMode, connectionParameters.windowSize,
+                               connectionParameters.frameCheck, connectionParameters.maxPayload,
+                               connectionParameters.fecParity, connectionParameters.fullDuplex, 0};
+        limitParams(&proposed, LlSelectiveRepeat, 0, 0);
+
+        // Offer a higher rate where the line can switch, except in full duplex
+        // (both ends send whenever they like, so no moment suits a switch)
+        if (transportSerialPort(&conn->port)->setRate != NULL && !proposed.fullDuplex &&
+            connectionParameters.maxBaudRate > conn->lineBaudRate) {
+            proposed.maxBaudRate = tableRate(connectionParameters.maxBaudRate);
+        }
+        conn->proposedParams = proposed;
+
+        // Fast open: the SET leaves with the first packet (see openConnection)
+        conn->openDeferred = connectionParameters.fastOpen && !proposed.fullDuplex;
+        if (conn->openDeferred) {
+            printf("Connection deferred to the first packet (fast open)\n");
+            return conn->fd;
+        }
+        if (connectReceiver(conn, NULL, 0) < 0) {
+            eventLoopClose(&conn->loop);
+            closeSerialPort(&conn->port);
+            return -1;
+        }
+        return conn->fd;
+    }
+    else // RECEIVER
+    {
+        printf("Waiting for SET frame...\n");
+        while (1)
+        {
+            DecodedFrame request;
+            int got = readFrame(conn, &request, WAIT_TIMER);
+            if (got < 0) {
+                // The transport failed (e.g. the socket or simulated peer went away)
+                printf("Error: Failed to receive SET frame\n");
+                eventLoopClose(&conn->loop);
+                closeSerialPort(&conn->port);
+                return -1;
+            }
+            if (got == 0) continue;
+            if (request.kind == FrameI) discardFrame(conn); // left over from an earlier connection
+            if (request.kind == FrameSET && request.address == A_SENDER) {
+                return acceptConnection(conn, &connectionParameters, &request);
+            }
+        }
+    }
+}
+
+// Fast open: send the SET llopen deferred, carrying this packet if it fits.
+// Returns 1 if the receiver took the packet, 0 if llwrite still has to send
+// it, -1 if no UA came.
+static int openConnection(LinkConnection *conn, const struct iovec *parts, int nParts, int bufSize)
+{
+    unsigned char packet[MAX_OPEN_DATA];
+    int fits = bufSize <= MAX_OPEN_DATA;
+    for (int i = 0, n = 0; fits && i < nParts; n += parts[i].iov_len, i++) {
+        memcpy(packet + n, parts[i].iov_base, parts[i].iov_len);
+    }
+
+    int taken = connectReceiver(conn, fits ? packet : NULL, bufSize);
+    if (taken < 0) return -1;
+    conn->openDeferred = FALSE;
+    if (taken) conn->stats.payloadBytes += bufSize;
+    return taken;
+}
+
+// -------------------- LLWRITE --------------------
+
+// Encode an I-frame into its pool slot. Retransmissions reuse these bytes.
+static void encodeSlot(LinkConnection *conn, int seq, unsigned char control, const struct iovec *parts, int nParts)
+{
+    TxSlot *slot = &conn->txSlots[seq];
+    slot->header[0] = FLAG;
+    slot->header[1] = conn->localAddress;
+    slot->header[2] = control;
+    slot->header[3] = conn->localAddress ^ control;
+    slot->bodySize = encodeDataField(parts, nParts, conn->frameCheck, conn->fecParity, slot->body);
+    slot->dataSize = 0;
+    for (int i = 0; i < nParts; i++) slot->dataSize += parts[i].iov_len;
+    slot->fieldSize = slot->dataSize + checkSize(conn->frameCheck);
+    if (conn->fecParity > 0) slot->fieldSize = fecEncodedSize(slot->fieldSize, conn->fecParity);
+    slot->retries = 0;
+    slot->sends = 0;
+}
+
+static int slotFrameSize(LinkConnection *conn, int seq)
+{
+    return conn->txSlots[seq].bodySize + 5;
+}
+
+// Write the frames in "seqs" with a single gathered write: header, body and
+// closing flag of each, straight from the pool.
+// Returns -1 on error.
+static int writeSlots(LinkConnection *conn, const int *seqs, int n)
+{
+    static unsigned char closingFlag = FLAG;
+    struct iovec iov[3 * SEQ_MODULUS];
+
+    for (int i = 0; i < n; i++) {
+        TxSlot *slot = &conn->txSlots[seqs[i]];
+        if (conn->fullDuplex) {
+            // Piggyback the latest N(R), so no copy carries a stale one
+            slot->header[2] = C_I_ACK(seqs[i], conn->rxExpected);
+            slot->header[3] = slot->header[1] ^ slot->header[2];
+        }
+        if (slot->sends++ > 0) conn->stats.retransmissions++;
+        conn->stats.framesSent++;
+        conn->stats.unstuffedBytes += slot->fieldSize;
+        conn->stats.stuffedBytes += slot->bodySize;
+        iov[3 * i] = (struct iovec){slot->header, sizeof(slot->header)};
+        iov[3 * i + 1] = (struct iovec){slot->body, slot->bodySize};
+        iov[3 * i + 2] = (struct iovec){&closingFlag, 1};
+    }
+    if (writevSerialPort(&conn->port, iov, 3 * n) < 0) {
+        perror("writev");
+        return -1;
+    }
+    if (conn->fullDuplex) conn->ackPending = FALSE;
+    return 0;
+}
+
+// Send (or resend) window frames and start their retransmission timers.
+static int transmitSlots(LinkConnection *conn, const int *seqs, int n)
+{
+    for (int i = 0; i < n; i++) {
+        TRACE(TRACE_DEBUG, "Sending I-frame (seq=%ld, attempt %ld/%ld)...\n",
+              seqs[i], conn->txSlots[seqs[i]].retries + 1, conn->maxRetries);
+    }
+    if (writeSlots(conn, seqs, n) < 0) {
+        conn->linkFailed = TRUE;
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        TxSlot *slot = &conn->txSlots[seqs[i]];
+        slot->sentAt = clockMs(&conn->loop);
+        slot->wireMs = queueOnLine(conn, slotFrameSize(conn, seqs[i]));
+        timerStart(&conn->loop, seqs[i], retransmitTimeout(conn, slot->wireMs));
+    }
+    return 0;
+}
+
+// Count a retransmission of "seq" against its retry budget.
+static int chargeRetry(LinkConnection *conn, int seq)
+{
+    if (++conn->txSlots[seq].retries >= conn->maxRetries) {
+        if (rescueRate(conn) == 0) {
+            for (int s = conn->txBase; s != conn->txNext; s = (s + 1) % SEQ_MODULUS) conn->txSlots[s].retries = 0;
+            return 0;
+        }
+        TRACE(TRACE_ERROR, "Error: Failed to send frame %ld after %ld retries\n", seq, conn->maxRetries);
+        traceDump(stderr, TRACE_ERROR_HISTORY);
+        conn->linkFailed = TRUE;
+        return -1;
+    }
+    return 0;
+}
+
+// Retransmit an outstanding frame, counting it against its retry budget.
+static int retransmitSlot(LinkConnection *conn, int seq)
+{
+    if (chargeRetry(conn, seq) < 0) return -1;
+    return transmitSlots(conn, &seq, 1);
+}
+
+// Go-Back-N: resend every outstanding frame in one write, charging the retry
+// to the oldest one.
+static int goBack(LinkConnection *conn)
+{
+    if (chargeRetry(conn, conn->txBase) < 0) return -1;
+
+    int seqs[SEQ_MODULUS];
+    int n = 0;
+    for (int seq = conn->txBase; seq != conn->txNext; seq = (seq + 1) % SEQ_MODULUS) {
+        seqs[n++] = seq;
+    }
+    return transmitSlots(conn, seqs, n);
+}
+
+static int outstandingFrames(LinkConnection *conn)
+{
+    return (conn->txNext - conn->txBase + SEQ_MODULUS) % SEQ_MODULUS;
+}
+
+int llpending()
+{
+    LinkConnection *conn = connection();
+    return (conn->arqMode == LlStopAndWait) ? 0 : outstandingFrames(conn);
+}
+
+// N(R) acknowledges every frame before it; ignore values outside the window.
+static void acknowledgeUpTo(LinkConnection *conn, int nr)
+{
+    int acked = (nr - conn->txBase + SEQ_MODULUS) % SEQ_MODULUS;
+    if (acked > 0 && acked <= outstandingFrames(conn)) {
+        // The newest acknowledged frame is the one that triggered this RR
+        TxSlot *newest = &conn->txSlots[(nr - 1 + SEQ_MODULUS) % SEQ_MODULUS];
+        if (newest->retries == 0) sampleRtt(conn, newest->sentAt, newest->wireMs);
 
-void handleAlarm(int sig) {
-    (void)sig; // Suppress unused parameter warning
-    alarmFlag = 1;
+        for (; conn->txBase != nr; conn->txBase = (conn->txBase + 1) % SEQ_MODULUS) {
+            timerStop(&conn->loop, conn->txBase);
+            recordFrameAcked(conn, slotFrameSize(conn, conn->txBase));
+            conn->stats.payloadBytes += conn->txSlots[conn->txBase].dataSize;
+        }
+    }
 }
 
-// -------------------- BYTE-STUFFING --------------------
-void stuffData(const unsigned char *data, int size, unsigned char *dest, int *destSize)
+static int handleSupervisory(LinkConnection *conn, unsigned char control)
 {
-    int j = 0;
-    for (int i = 0; i < size; i++)
+    int nr = FRAME_NR(control);
+    switch (S_TYPE(control))
     {
-        if (data[i] == FLAG) {
-            dest[j++] = 0x7D;
-            dest[j++] = 0x5E;
-        }
-        else if (data[i] == 0x7D) {
-            dest[j++] = 0x7D;
-            dest[j++] = 0x5D;
+    case C_RR_WIN(0):
+        TRACE(TRACE_DEBUG, "RR%ld received\n", nr);
+        acknowledgeUpTo(conn, nr);
+        return 0;
+    case C_REJ_WIN(0):
+        TRACE(TRACE_INFO, "REJ%ld received, going back...\n", nr);
+        conn->stats.rejReceived++;
+        acknowledgeUpTo(conn, nr);
+        if (nr == conn->txBase && outstandingFrames(conn) > 0) {
+            recordFrameFailed(conn, slotFrameSize(conn, nr));
+            return goBack(conn);
         }
-        else {
-            dest[j++] = data[i];
+        return 0;
+    case C_SREJ_WIN(0):
+        TRACE(TRACE_INFO, "SREJ%ld received, retransmitting frame...\n", nr);
+        conn->stats.rejReceived++;
+        if ((nr - conn->txBase + SEQ_MODULUS) % SEQ_MODULUS < outstandingFrames(conn)) {
+            recordFrameFailed(conn, slotFrameSize(conn, nr));
+            return retransmitSlot(conn, nr);
         }
+        return 0;
+    default:
+        return 0;
     }
-    *destSize = j;
 }
 
-void destuffData(const unsigned char *data, int size, unsigned char *dest, int *destSize)
+// Retransmit frames whose timer expired: the whole window for Go-Back-N,
+// only the expired frames for Selective Repeat.
+static int handleTimeouts(LinkConnection *conn)
 {
-    int j = 0;
-    for (int i = 0; i < size; i++)
-    {
-        if (data[i] == 0x7D)
-        {
-            i++;
-            if (i < size) {
-                dest[j++] = (data[i] == 0x5E) ? FLAG : 0x7D;
+    int backedOff = FALSE;
+    for (int seq = conn->txBase; seq != conn->txNext; seq = (seq + 1) % SEQ_MODULUS) {
+        if (timerExpired(&conn->loop, seq)) {
+            TRACE(TRACE_INFO, "Timeout! No acknowledgment for frame %ld.\n", seq);
+            conn->stats.timeouts++;
+            recordFrameFailed(conn, slotFrameSize(conn, seq));
+            if (!backedOff) {
+                backOff(conn);
+                backedOff = TRUE;
             }
-        }
-        else {
-            dest[j++] = data[i];
+            if (conn->arqMode == LlGoBackN) return goBack(conn);
+            if (retransmitSlot(conn, seq) < 0) return -1;
         }
     }
-    *destSize = j;
+    return 0;
 }
 
-// -------------------- LLOPEN --------------------
-int llopen(LinkLayer connectionParameters)
+// The peer sent DISC while frames were still going out: it is closing the
+// link, so stop at once instead of retrying until the timeouts run out.
+static int peerDisconnected(LinkConnection *conn)
 {
-    fd = openSerialPort(connectionParameters.serialPort, connectionParameters.baudRate);
-    if (fd < 0) {
-        printf("Error: Failed to open serial port\n");
-        return -1;
+    TRACE(TRACE_ERROR, "Error: Peer disconnected while frames were outstanding\n");
+    conn->linkFailed = TRUE;
+    return -1;
+}
+
+// Windowed modes: handle a frame from the receiver.
+// Returns 0, or -1 if the link failed.
+static int handleAnswer(LinkConnection *conn, const DecodedFrame *f)
+{
+    if (f->kind == FrameI) discardFrame(conn);
+    if (f->address != conn->peerAddress) return 0;
+    switch (f->kind)
+    {
+    case FrameRR:
+    case FrameREJ:
+    case FrameSREJ:
+        return handleSupervisory(conn, f->control);
+    case FrameDISC:
+        return peerDisconnected(conn);
+    default:
+        return 0;
     }
+}
 
-    signal(SIGALRM, handleAlarm);
-    unsigned char frame[5];
-    unsigned char recvByte;
-    int retries = 0;
+// Full duplex: acknowledgements and I-frames from the peer are both handled by
+// serviceDuplex, which lives with the receive side below
+static int serviceDuplex(LinkConnection *conn, int block);
 
-    if (connectionParameters.role == LlTx)
+// Process acknowledgements and timeouts until fewer than "limit" frames are outstanding.
+static int serviceWindow(LinkConnection *conn, int limit)
+{
+    while (!conn->linkFailed && outstandingFrames(conn) >= limit)
     {
-        // Build SET frame
-        frame[0] = FLAG;
-        frame[1] = A_SENDER;
-        frame[2] = C_SET;
-        frame[3] = frame[1] ^ frame[2];
-        frame[4] = FLAG;
-
-        while (retries < MAX_RETRIES)
-        {
-            printf("Sending SET frame (attempt %d/%d)...\n", retries + 1, MAX_RETRIES);
-            writeBytesSerialPort(frame, 5);
-            alarm(TIMEOUT);
-            alarmFlag = 0;
+        if (conn->fullDuplex) {
+            if (serviceDuplex(conn, TRUE) < 0) return -1;
+            continue;
+        }
 
-            unsigned char state = 0;
-            while (!alarmFlag)
-            {
-                if (readByteSerialPort(&recvByte) <= 0) continue;
-                switch (state)
-                {
-                case 0:
-                    if (recvByte == FLAG) state = 1;
-                    break;
-                case 1:
-                    if (recvByte == A_RECEIVER) state = 2;
-                    else if (recvByte != FLAG) state = 0;
-                    break;
-                case 2:
-                    if (recvByte == C_UA) state = 3;
-                    else if (recvByte == FLAG) state = 1;
-                    else state = 0;
-                    break;
-                case 3:
-                    if (recvByte == (A_RECEIVER ^ C_UA)) state = 4;
-                    else if (recvByte == FLAG) state = 1;
-                    else state = 0;
-                    break;
-                case 4:
-                    if (recvByte == FLAG) {
-                        alarm(0);
-                        printf("Connection established (UA received)\n");
-                        return fd;
-                    }
-                    else state = 0;
-                    break;
-                }
-            }
-            retries++;
-            printf("Timeout! No UA received.\n");
+        DecodedFrame answer;
+        int r = readFrame(conn, &answer, WAIT_TIMER);
+        if (r > 0) {
+            if (handleAnswer(conn, &answer) < 0) return -1;
+        }
+        else if (r == 0) {
+            if (handleTimeouts(conn) < 0) return -1;
+        }
+        else {
+            return -1;
         }
+    }
+    return conn->linkFailed ? -1 : 0;
+}
 
-        printf("Error: Failed to establish connection after %d retries\n", MAX_RETRIES);
-        alarm(0);
-        closeSerialPort();
-        return -1;
+static int llwriteWindowed(LinkConnection *conn, const struct iovec *parts, int nParts, int bufSize)
+{
+    if (serviceWindow(conn, conn->windowSize) < 0) return -1;
+
+    int seq = conn->txNext;
+    encodeSlot(conn, seq, C_I_WIN(seq), parts, nParts); // full duplex: N(R) is added by writeSlots
+    conn->txNext = (conn->txNext + 1) % SEQ_MODULUS;
+    if (transmitSlots(conn, &seq, 1) < 0) return -1;
+
+    // Pick up acknowledgements (and, in full duplex, I-frames) that are already waiting
+    if (conn->fullDuplex) {
+        int r;
+        while ((r = serviceDuplex(conn, FALSE)) > 0) { }
+        return (r < 0) ? -1 : bufSize;
     }
-    else // RECEIVER
-    {
-        printf("Waiting for SET frame...\n");
-        unsigned char state = 0;
-        while (1)
-        {
-            if (readByteSerialPort(&recvByte) <= 0) continue;
-            switch (state)
-            {
-            case 0:
-                if (recvByte == FLAG) state = 1;
-                break;
-            case 1:
-                if (recvByte == A_SENDER) state = 2;
-                else if (recvByte != FLAG) state = 0;
-                break;
-            case 2:
-                if (recvByte == C_SET) state = 3;
-                else if (recvByte == FLAG) state = 1;
-                else state = 0;
-                break;
-            case 3:
-                if (recvByte == (A_SENDER ^ C_SET)) state = 4;
-                else if (recvByte == FLAG) state = 1;
-                else state = 0;
-                break;
-            case 4:
-                if (recvByte == FLAG)
-                {
-                    // Send UA
-                    frame[0] = FLAG;
-                    frame[1] = A_RECEIVER;
-                    frame[2] = C_UA;
-                    frame[3] = frame[1] ^ frame[2];
-                    frame[4] = FLAG;
-                    writeBytesSerialPort(frame, 5);
-                    printf("Connection established (UA sent)\n");
-                    return fd;
-                }
-                else state = 0;
-                break;
-            }
-        }
+    DecodedFrame answer;
+    while (readFrame(conn, &answer, WAIT_POLL) > 0) {
+        if (handleAnswer(conn, &answer) < 0) return -1;
     }
+    return bufSize;
+}
+
+// llflush of "conn"
+static int flushWindow(LinkConnection *conn)
+{
+    return (conn->arqMode == LlStopAndWait) ? 0 : serviceWindow(conn, 1);
+}
+
+int llflush()
+{
+    return flushWindow(connection());
 }
 
-// -------------------- LLWRITE --------------------
 int llwrite(const unsigned char *buf, int bufSize)
 {
-    unsigned char frame[2 * bufSize + 6];
-    int retries = 0;
+    struct iovec part = {(void *)buf, bufSize};
+    return llwritev(&part, 1);
+}
 
-    while (retries < MAX_RETRIES)
-    {
-        // Build I-frame
-        unsigned char control = (sequenceNumber == 0) ? 0x00 : 0x40;
-        unsigned char dataWithBCC[bufSize + 1];
-        memcpy(dataWithBCC, buf, bufSize);
+// Tx: change the line rate before the next frame if nextRate says so. Both
+// ends switch between frames, so the window is emptied first.
+// Returns 0 on success, -1 if the link failed.
+static int adaptRate(LinkConnection *conn)
+{
+    int rate = nextRate(conn);
+    if (rate == conn->lineBaudRate) return 0;
+    if (flushWindow(conn) < 0) return -1;
 
-        // Calculate BCC2
-        unsigned char bcc2 = 0;
-        for (int i = 0; i < bufSize; i++) {
-            bcc2 ^= buf[i];
-        }
-        dataWithBCC[bufSize] = bcc2;
+    int up = rate > conn->lineBaudRate;
+    if (changeRate(conn, rate) < 0) {
+        // Not tried again this session: each failure may cost a fallback wait
+        if (up) conn->topRate = lineRates[rateIndex(rate) - 1];
+    }
+    else if (!up && conn->rateUpFrames < MAX_RATE_UP_FRAMES) {
+        conn->rateUpFrames *= 2;
+    }
+    conn->rateClimbed = TRUE;
+    forgetErrorRate(conn);
+    return 0;
+}
 
-        // Stuff data + BCC2
-        int stuffedSize;
-        stuffData(dataWithBCC, bufSize + 1, frame + 4, &stuffedSize);
+int llwritev(const struct iovec *parts, int nParts)
+{
+    LinkConnection *conn = connection();
+    int bufSize = 0;
+    for (int i = 0; i < nParts; i++) bufSize += parts[i].iov_len;
+    if (conn->openDeferred) {
+        int taken = openConnection(conn, parts, nParts, bufSize);
+        if (taken != 0) return (taken < 0) ? -1 : bufSize;
+    }
+    if (adaptRate(conn) < 0) return -1;
+    if (bufSize > conn->maxPayloadSize) {
+        printf("Error: Payload of %d bytes exceeds the negotiated maximum of %d\n", bufSize, conn->maxPayloadSize);
+        return -1;
+    }
+    if (conn->arqMode != LlStopAndWait) {
+        return llwriteWindowed(conn, parts, nParts, bufSize);
+    }
 
-        // Build frame header
-        frame[0] = FLAG;
-        frame[1] = A_SENDER;
-        frame[2] = control;
-        frame[3] = frame[1] ^ frame[2];
-        frame[4 + stuffedSize] = FLAG;
-        int totalSize = 5 + stuffedSize;
+    // Build the I-frame once; every attempt sends the same pool slot
+    int seq = conn->sequenceNumber;
+    encodeSlot(conn, seq, (conn->sequenceNumber == 0) ? 0x00 : 0x40, parts, nParts);
+    int retries = 0;
 
+    while (retries < conn->maxRetries)
+    {
         // Send frame
-        printf("Sending I-frame (seq=%d, attempt %d/%d)...\n", sequenceNumber, retries + 1, MAX_RETRIES);
-        writeBytesSerialPort(frame, totalSize);
+        TRACE(TRACE_DEBUG, "Sending I-frame (seq=%ld, attempt %ld/%ld)...\n", conn->sequenceNumber, retries + 1, conn->maxRetries);
+        if (writeSlots(conn, &seq, 1) < 0) return -1;
 
         // Wait for RR/REJ
-        alarm(TIMEOUT);
-        alarmFlag = 0;
+        long long sentAt = clockMs(&conn->loop);
+        int wireMs = queueOnLine(conn, slotFrameSize(conn, seq));
+        timerStart(&conn->loop, TIMER_CONTROL, retransmitTimeout(conn, wireMs));
 
-        unsigned char byte;
-        unsigned char state = 0;
+        // Expecting RR for the NEXT sequence (if sent seq=0, expect RR1), or REJ for this one
+        unsigned char rr = (conn->sequenceNumber == 0) ? C_RR1 : C_RR0;
+        unsigned char rej = (conn->sequenceNumber == 0) ? C_REJ0 : C_REJ1;
         unsigned char receivedControl = 0;
         int ackReceived = 0;
 
-        while (!alarmFlag && !ackReceived)
+        while (!timerExpired(&conn->loop, TIMER_CONTROL) && !ackReceived)
         {
-            if (readByteSerialPort(&byte) <= 0) continue;
+            DecodedFrame answer;
+            if (readFrame(conn, &answer, WAIT_TIMER) <= 0) continue;
+            if (answer.kind == FrameI) discardFrame(conn);
+            if (answer.address != A_RECEIVER) continue;
 
-            switch (state)
-            {
-            case 0:
-                if (byte == FLAG) state = 1;
-                break;
-            case 1:
-                if (byte == A_RECEIVER) state = 2;
-                else if (byte != FLAG) state = 0;
-                break;
-            case 2:
-                receivedControl = byte;
-                // Expecting RR for NEXT sequence (if sent seq=0, expect RR1)
-                if (byte == ((sequenceNumber == 0) ? C_RR1 : C_RR0)) {
-                    state = 3;
-                }
-                else if (byte == ((sequenceNumber == 0) ? C_REJ0 : C_REJ1)) {
-                    state = 3;
-                }
-                else if (byte == FLAG) {
-                    state = 1;
-                }
-                else {
-                    state = 0;
-                }
-                break;
-            case 3:
-                if (byte == (A_RECEIVER ^ receivedControl)) {
-                    state = 4;
-                }
-                else if (byte == FLAG) {
-                    state = 1;
-                }
-                else {
-                    state = 0;
-                }
-                break;
-            case 4:
-                if (byte == FLAG) {
-                    ackReceived = 1;
-                }
-                else {
-                    state = 0;
-                }
-                break;
+            if (answer.control == rr || answer.control == rej) {
+                receivedControl = answer.control;
+                ackReceived = 1;
+            }
+            else if (answer.kind == FrameDISC) {
+                timerStop(&conn->loop, TIMER_CONTROL);
+                peerDisconnected(conn);
+                return -1;
             }
         }
 
-        alarm(0); // Cancel alarm
+        timerStop(&conn->loop, TIMER_CONTROL);
 
         if (ackReceived)
         {
+            if (retries == 0) sampleRtt(conn, sentAt, wireMs);
+
             // Check if it was RR or REJ
-            if (receivedControl == ((sequenceNumber == 0) ? C_RR1 : C_RR0))
+            if (receivedControl == rr)
             {
-                printf("RR received, frame accepted\n");
-                sequenceNumber ^= 1; // Toggle sequence number
+                TRACE(TRACE_DEBUG, "RR received, frame accepted\n");
+                recordFrameAcked(conn, slotFrameSize(conn, seq));
+                conn->stats.payloadBytes += bufSize;
+                conn->sequenceNumber ^= 1; // Toggle sequence number
                 return bufSize;
             }
             else // REJ received
             {
-                printf("REJ received, retransmitting frame...\n");
+                TRACE(TRACE_INFO, "REJ received, retransmitting frame...\n");
+                conn->stats.rejReceived++;
+                recordFrameFailed(conn, slotFrameSize(conn, seq));
                 retries++;
             }
         }
         else
         {
-            printf("Timeout! No acknowledgment received.\n");
+            TRACE(TRACE_INFO, "Timeout! No acknowledgment received.\n");
+            conn->stats.timeouts++;
+            recordFrameFailed(conn, slotFrameSize(conn, seq));
+            backOff(conn);
             retries++;
         }
+        if (retries == conn->maxRetries && rescueRate(conn) == 0) retries = 0;
     }
 
-    printf("Error: Failed to send frame after %d retries\n", MAX_RETRIES);
+    TRACE(TRACE_ERROR, "Error: Failed to send frame after %ld retries\n", conn->maxRetries);
+    traceDump(stderr, TRACE_ERROR_HISTORY);
+    conn->linkFailed = TRUE;
     return -1;
 }
 
+
 // -------------------- LLREAD --------------------
-int llread(unsigned char *packet)
+
+// TRUE once an I-frame was accepted since the SET
+static int receptionStarted(LinkConnection *conn)
 {
-    unsigned char byte;
-    unsigned char frame[2048];
-    int idx = 0;
-    int inFrame = 0;
-    static int expectedSeq = 0; // Track expected sequence number
+    return conn->expectedSeq != 0 || conn->rxExpected != 0 || conn->rxDeliver != 0;
+}
 
-    while (1)
+// A new SET means the transmitter started over with empty windows.
+static void restartReception(LinkConnection *conn)
+{
+    if (receptionStarted(conn)) {
+        printf("SET received, transmitter reconnected: resetting sequence numbers\n");
+    }
+    resetWindows(conn);
+    resetLineRate(conn);
+}
+
+// Fast open: a SET repeated because the UA was lost, with the packet already
+// taken (or a plain SET alternating with it). Answered without delivering the
+// packet twice.
+static int repeatedOpen(LinkConnection *conn, const DecodedFrame *set)
+{
+    if (conn->openPacketSize == 0 || receptionStarted(conn)) return FALSE;
+    const unsigned char *value;
+    int length = findParam(set->params, set->nParams, LP_OPEN_DATA, &value);
+    return length < 0 || (length - 2 == conn->openPacketSize && memcmp(value, conn->openPacket, conn->openPacketSize) == 0);
+}
+
+// Selective Repeat: request a missing frame once; a corrupted copy asks again.
+static void requestFrame(LinkConnection *conn, int seq, int force)
+{
+    if (conn->rxSlots[seq].nakSent && !force) return;
+    conn->rxSlots[seq].nakSent = TRUE;
+    sendSupervisory(conn, conn->localAddress, C_SREJ_WIN(seq));
+    conn->stats.rejSent++;
+    TRACE(TRACE_INFO, "SREJ%ld sent\n", seq);
+}
+
+// Go-Back-N: ask for everything from rxExpected on, once until it arrives.
+static void rejectFrames(LinkConnection *conn)
+{
+    if (conn->rejSent) return;
+    sendSupervisory(conn, conn->localAddress, C_REJ_WIN(conn->rxExpected));
+    conn->rejSent = TRUE;
+    conn->stats.rejSent++;
+    TRACE(TRACE_INFO, "REJ%ld sent\n", conn->rxExpected);
+}
+
+// Windowed modes: a frame header arrived corrupted. Frames go out in sequence
+// order, so it most likely belonged to the one after the last intact header:
+// if that frame is still missing, ask for it now instead of when the next
+// frame (or the sender's timeout) shows the gap.
+static void rejectCorruptedHeader(LinkConnection *conn)
+{
+    int seq = conn->rxNextSeen;
+    if ((seq - conn->rxExpected + SEQ_MODULUS) % SEQ_MODULUS >= conn->windowSize) return; // already accepted
+    if (conn->arqMode == LlGoBackN) rejectFrames(conn);
+    else if (!conn->rxSlots[seq].valid) requestFrame(conn, seq, FALSE);
+}
+
+// Full duplex: make room in the queue for "frames" more, growing the ring
+// (oldest frame moved to index 0) if needed. Returns 0, or -1 if out of memory.
+static int queueReserve(LinkConnection *conn, int frames)
+{
+    if (conn->rxQueueCount + frames <= conn->rxQueueSize) return 0;
+
+    int size = (conn->rxQueueSize > 0) ? conn->rxQueueSize : RX_QUEUE_SIZE;
+    while (size < conn->rxQueueCount + frames) size *= 2;
+    RxSlot *grown = malloc(size * sizeof(RxSlot));
+    if (grown == NULL) return -1;
+    for (int i = 0; i < conn->rxQueueCount; i++) {
+        RxSlot *queued = &conn->rxQueue[(conn->rxQueueHead + i) % conn->rxQueueSize];
+        memcpy(grown[i].data, queued->data, queued->size);
+        grown[i].size = queued->size;
+    }
+    free(conn->rxQueue);
+    conn->rxQueue = grown;
+    conn->rxQueueSize = size;
+    conn->rxQueueHead = 0;
+    TRACE(TRACE_DEBUG, "Receive queue holds %ld frames\n", size);
+    return 0;
+}
+
+// Full duplex: queue the frame just accepted in order, whose "size" bytes
+// were received straight into the queue's tail entry.
+static void queueReceived(LinkConnection *conn, int size)
+{
+    conn->rxQueue[(conn->rxQueueHead + conn->rxQueueCount) % conn->rxQueueSize].size = size;
+    conn->rxQueueCount++;
+}
+
+// Full duplex: move a Selective Repeat frame buffered out of order to the queue.
+static void queueBuffered(LinkConnection *conn, RxSlot *slot)
+{
+    RxSlot *tail = &conn->rxQueue[(conn->rxQueueHead + conn->rxQueueCount) % conn->rxQueueSize];
+    memcpy(tail->data, slot->data, slot->size);
+    queueReceived(conn, slot->size);
+    slot->valid = FALSE;
+}
+
+// Accept the frame expected next and everything buffered behind it, then
+// acknowledge. In full duplex the acknowledgement waits for an I-frame to
+// carry it (see sendPendingAck).
+static void advanceReceiveWindow(LinkConnection *conn)
+{
+    conn->rxSlots[conn->rxExpected].nakSent = FALSE;
+    conn->rxExpected = (conn->rxExpected + 1) % SEQ_MODULUS;
+    conn->rejSent = FALSE;
+    while (conn->arqMode == LlSelectiveRepeat && conn->rxSlots[conn->rxExpected].valid) {
+        if (conn->fullDuplex) queueBuffered(conn, &conn->rxSlots[conn->rxExpected]);
+        conn->rxSlots[conn->rxExpected].nakSent = FALSE;
+        conn->rxExpected = (conn->rxExpected + 1) % SEQ_MODULUS;
+    }
+    if (conn->fullDuplex) {
+        conn->rxDeliver = conn->rxExpected; // everything accepted is queued
+        conn->ackPending = TRUE;
+    }
+    else {
+        sendSupervisory(conn, conn->localAddress, C_RR_WIN(conn->rxExpected));
+    }
+
+    // Frames still buffered past a new gap: ask for the missing one right away
+    for (int d = 1; conn->arqMode == LlSelectiveRepeat && d < conn->windowSize; d++) {
+        if (conn->rxSlots[(conn->rxExpected + d) % SEQ_MODULUS].valid) {
+            requestFrame(conn, conn->rxExpected, FALSE);
+            break;
+        }
+    }
+}
+
+// Full duplex: send the acknowledgement no I-frame has carried yet. Called
+// when none can go out soon: before waiting for the peer, and on close.
+static void sendPendingAck(LinkConnection *conn)
+{
+    if (!conn->ackPending) return;
+    conn->ackPending = FALSE;
+    sendSupervisory(conn, conn->localAddress, C_RR_WIN(conn->rxExpected));
+}
+
+// An I-frame came again after the last one was accepted: the acknowledgement
+// was lost, so repeat it.
+static void repeatAcknowledgement(LinkConnection *conn)
+{
+    if (conn->arqMode == LlStopAndWait) sendSupervisory(conn, conn->localAddress, (conn->expectedSeq == 0) ? C_RR0 : C_RR1);
+    else sendSupervisory(conn, conn->localAddress, C_RR_WIN(conn->rxExpected));
+}
+
+// Windowed modes: take in the I-frame whose header was just read. The frame
+// expected next goes to "packet", later ones (Selective Repeat) to their slot.
+// With "packet" NULL (full duplex) the frame expected next is queued for llread.
+// Returns the payload size if the frame went to "packet", -1 otherwise.
+static int receiveIFrame(LinkConnection *conn, unsigned char control, unsigned char *packet)
+{
+    int ns = FRAME_NS(control);
+    int distance = (ns - conn->rxExpected + SEQ_MODULUS) % SEQ_MODULUS;
+    conn->rxNextSeen = (ns + 1) % SEQ_MODULUS;
+    if (distance >= conn->windowSize) {
+        discardFrame(conn);
+        TRACE(TRACE_INFO, "Duplicate frame detected (seq=%ld, expected=%ld), sending RR\n", ns, conn->rxExpected);
+        conn->stats.duplicates++;
+        sendSupervisory(conn, conn->localAddress, C_RR_WIN(conn->rxExpected));
+        return -1;
+    }
+
+    // Full duplex: the queue needs room for a whole window, which accepting
+    // this frame may release. Out of memory, the frame is dropped and comes
+    // again when its timer expires.
+    if (packet == NULL && queueReserve(conn, conn->windowSize) < 0) {
+        discardFrame(conn);
+        TRACE(TRACE_INFO, "Receive queue full, frame %ld dropped\n", ns);
+        return -1;
+    }
+    unsigned char *next = (packet != NULL) ? packet : conn->rxQueue[(conn->rxQueueHead + conn->rxQueueCount) % conn->rxQueueSize].data;
+
+    if (conn->arqMode == LlGoBackN)
     {
-        if (readByteSerialPort(&byte) <= 0) continue;
+        int size = -1;
+        if (distance == 0) size = receiveDataField(conn, next, conn->maxPayloadSize, conn->frameCheck);
+        else discardFrame(conn);
 
-        if (byte == FLAG)
-        {
-            if (!inFrame) {
-                // Start of new frame
-                inFrame = 1;
-                idx = 0;
-                frame[idx++] = byte;
-            }
-            else {
-                // End of frame
-                frame[idx++] = byte;
-                break;
-            }
+        if (size < 0) {
+            rejectFrames(conn);
+            return -1;
         }
-        else if (inFrame) {
-            if (idx < 2048) {
-                frame[idx++] = byte;
-            }
-            else {
-                // Frame too large, reset
-                inFrame = 0;
-                idx = 0;
-            }
+        if (packet == NULL) queueReceived(conn, size);
+        else conn->rxDeliver = (conn->rxDeliver + 1) % SEQ_MODULUS;
+        advanceReceiveWindow(conn);
+        TRACE(TRACE_DEBUG, "Frame accepted (seq=%ld), acknowledging up to %ld\n", ns, conn->rxExpected);
+        return (packet != NULL) ? size : -1;
+    }
+
+    // Selective Repeat: the expected frame goes straight to the caller,
+    // later ones are buffered in their slot
+    RxSlot *slot = &conn->rxSlots[ns];
+    if (slot->valid) {
+        discardFrame(conn); // Already buffered
+        conn->stats.duplicates++;
+        return -1;
+    }
+
+    unsigned char *dest = (distance == 0) ? next : slot->data;
+    int size = receiveDataField(conn, dest, conn->maxPayloadSize, conn->frameCheck);
+    if (size < 0) {
+        requestFrame(conn, ns, TRUE);
+        return -1;
+    }
+
+    if (distance > 0) {
+        slot->size = size;
+        slot->valid = TRUE;
+        TRACE(TRACE_DEBUG, "Frame %ld buffered (expecting %ld)\n", ns, conn->rxExpected);
+        requestFrame(conn, conn->rxExpected, FALSE);
+        return -1;
+    }
+
+    if (packet == NULL) queueReceived(conn, size);
+    else conn->rxDeliver = (conn->rxDeliver + 1) % SEQ_MODULUS;
+    advanceReceiveWindow(conn);
+    TRACE(TRACE_DEBUG, "Frame accepted (seq=%ld), acknowledging up to %ld\n", ns, conn->rxExpected);
+    return (packet != NULL) ? size : -1;
+}
+
+// A frame other than an I-frame reached llread: SET means the UA was lost or
+// the transmitter reconnected, so start over and repeat the UA; RATE asks for
+// another line rate; DISC that the transmitter is done, which llclose answers
+// without waiting for another.
+static void receiveControlFrame(LinkConnection *conn, const DecodedFrame *f)
+{
+    if (f->address != conn->peerAddress) return;
+    if (f->kind == FrameSET) {
+        if (repeatedOpen(conn, f)) {
+            sendUa(conn, TRUE);
+            return;
         }
+        restartReception(conn);
+        sendUa(conn, takeOpenPacket(conn, f));
+    }
+    else if (f->kind == FrameRATE) {
+        answerRate(conn, f);
+    }
+    else if (f->kind == FrameDISC) {
+        conn->discReceived = TRUE;
     }
+}
 
-    // Validate frame length (minimum 5 bytes)
-    if (idx < 5) {
-        printf("Frame too short\n");
-        goto send_rej;
+// Full duplex: retransmit what timed out, then handle one frame from the peer
+// if there is one (waiting for it if "block" is set). Its N(R) acknowledges
+// frames sent here; I-frames are queued for llread.
+// Returns 1 if a frame was handled, 0 if none was complete, -1 if the link failed.
+static int serviceDuplex(LinkConnection *conn, int block)
+{
+    if (handleTimeouts(conn) < 0) return -1;
+    if (block) sendPendingAck(conn);
+
+    DecodedFrame f;
+    int r = readFrame(conn, &f, block ? WAIT_TIMER : WAIT_POLL);
+    if (r <= 0) return r;
+
+    if (f.kind == FrameI && f.address == conn->peerAddress) {
+        acknowledgeUpTo(conn, FRAME_NR(f.control));
+        receiveIFrame(conn, f.control, NULL);
+        return 1;
+    }
+    if (f.kind == FrameI) {
+        discardFrame(conn);
+        return 1;
     }
+    if (f.kind == FrameBad) {
+        rejectCorruptedHeader(conn);
+        return 1;
+    }
+    if (f.address != conn->peerAddress) return 1;
 
-    // Check BCC1
-    if ((frame[1] ^ frame[2]) != frame[3])
+    switch (f.kind)
     {
-        printf("BCC1 error detected\n");
-        goto send_rej;
+    case FrameSET:
+        // UA was lost: repeat it. Frames sent here meanwhile stay in the window
+        // (reconnecting is not supported in full duplex)
+        sendUa(conn, FALSE);
+        return 1;
+    case FrameDISC:
+        // The transmitter is done; llclose answers once frames sent here are acknowledged
+        conn->discReceived = TRUE;
+        return 1;
+    default:
+        return (handleAnswer(conn, &f) < 0) ? -1 : 1;
     }
+}
 
-    // Extract control byte and check sequence
-    unsigned char control = frame[2];
-    int receivedSeq = (control & 0x40) ? 1 : 0;
+int lldisconnected()
+{
+    LinkConnection *conn = connection();
+    return conn->discReceived;
+}
 
-    // Check if this is a duplicate frame
-    if (receivedSeq != expectedSeq)
-    {
-        printf("Duplicate frame detected (seq=%d, expected=%d), sending RR\n", receivedSeq, expectedSeq);
-        // Send RR for next expected frame (don't change expectedSeq)
-        unsigned char rr = (expectedSeq == 0) ? C_RR1 : C_RR0;
-        unsigned char rrFrame[5] = {FLAG, A_RECEIVER, rr, A_RECEIVER ^ rr, FLAG};
-        writeBytesSerialPort(rrFrame, 5);
-        return -1; // Don't pass duplicate to application
+int llfailed()
+{
+    LinkConnection *conn = connection();
+    return conn->linkFailed;
+}
+
+int llreceived()
+{
+    LinkConnection *conn = connection();
+    if (!conn->fullDuplex) return (conn->rxExpected - conn->rxDeliver + SEQ_MODULUS) % SEQ_MODULUS;
+
+    while (!conn->linkFailed && serviceDuplex(conn, FALSE) > 0) { }
+    return conn->rxQueueCount;
+}
+
+static int llreadWindowed(LinkConnection *conn, unsigned char *packet)
+{
+    // Full duplex: frames also arrive while llwrite waits, and are queued
+    if (conn->fullDuplex) {
+        while (conn->rxQueueCount == 0) {
+            if (conn->discReceived || serviceDuplex(conn, TRUE) < 0) return -1;
+        }
+        RxSlot *queued = &conn->rxQueue[conn->rxQueueHead];
+        memcpy(packet, queued->data, queued->size);
+        conn->rxQueueHead = (conn->rxQueueHead + 1) % conn->rxQueueSize;
+        conn->rxQueueCount--;
+        return queued->size;
     }
 
-    // Destuff data
-    unsigned char data[2048];
-    int dataSize;
-    destuffData(frame + 4, idx - 5, data, &dataSize);
+    // Hand over frames that were accepted out of order first
+    if (conn->rxDeliver != conn->rxExpected) {
+        RxSlot *slot = &conn->rxSlots[conn->rxDeliver];
+        memcpy(packet, slot->data, slot->size);
+        slot->valid = FALSE;
+        conn->rxDeliver = (conn->rxDeliver + 1) % SEQ_MODULUS;
+        return slot->size;
+    }
+    if (conn->discReceived) return -1; // nothing more is coming
 
-    // Validate we have at least BCC2
-    if (dataSize < 1) {
-        printf("No data in frame\n");
-        goto send_rej;
+    DecodedFrame f;
+    if (waitFrame(conn, &f) < 0) return -1;
+    if (f.kind == FrameI && f.address == conn->peerAddress) return receiveIFrame(conn, f.control, packet);
+    if (f.kind == FrameBad) {
+        rejectCorruptedHeader(conn);
+        return -1;
+    }
+    if (f.kind == FrameI) {
+        TRACE(TRACE_WARN, "Frame header error, discarding\n");
+        discardFrame(conn);
+        return -1;
+    }
+    receiveControlFrame(conn, &f);
+    return -1;
+}
+
+int llread(unsigned char *packet)
+{
+    LinkConnection *conn = connection();
+    // Fast open: the packet that came with the SET goes first
+    if (conn->openPacketReady) {
+        conn->openPacketReady = FALSE;
+        memcpy(packet, conn->openPacket, conn->openPacketSize);
+        conn->stats.payloadBytes += conn->openPacketSize;
+        return conn->openPacketSize;
     }
+    if (conn->arqMode != LlStopAndWait) {
+        return llreadWindowed(conn, packet);
+    }
+    if (conn->discReceived) return -1; // nothing more is coming
+
+    DecodedFrame f;
+    if (waitFrame(conn, &f) < 0) return -1;
 
-    // Check BCC2
-    unsigned char bcc2 = 0;
-    for (int i = 0; i < dataSize - 1; i++) {
-        bcc2 ^= data[i];
+    // Check BCC1 (the rest of the frame is skipped by the decoder)
+    if (f.kind == FrameBad) goto send_rej;
+
+    // Check control byte and sequence
+    if (f.kind != FrameI) {
+        receiveControlFrame(conn, &f);
+        return -1;
     }
+    int receivedSeq = (f.control & 0x40) ? 1 : 0;
 
-    if (bcc2 != data[dataSize - 1])
+    // Check if this is a duplicate frame
+    if (receivedSeq != conn->expectedSeq)
     {
-        printf("BCC2 error detected\n");
+        discardFrame(conn);
+        TRACE(TRACE_INFO, "Duplicate frame detected (seq=%ld, expected=%ld), sending RR\n", receivedSeq, conn->expectedSeq);
+        conn->stats.duplicates++;
+        // Send RR for next expected frame (don't change expectedSeq)
+        sendSupervisory(conn, A_RECEIVER, (conn->expectedSeq == 0) ? C_RR0 : C_RR1);
+        return -1; // Don't pass duplicate to application
+    }
+
+    // Destuff data straight into packet and check BCC2
+    int dataSize = receiveDataField(conn, packet, conn->maxPayloadSize, conn->frameCheck);
+    if (dataSize < 0) {
         goto send_rej;
     }
 
     // Frame is valid, send RR for NEXT sequence
-    unsigned char rr = (expectedSeq == 0) ? C_RR1 : C_RR0;
-    unsigned char rrFrame[5] = {FLAG, A_RECEIVER, rr, A_RECEIVER ^ rr, FLAG};
-    writeBytesSerialPort(rrFrame, 5);
-    printf("Frame accepted (seq=%d), RR sent\n", receivedSeq);
+    sendSupervisory(conn, A_RECEIVER, (conn->expectedSeq == 0) ? C_RR1 : C_RR0);
+    TRACE(TRACE_DEBUG, "Frame accepted (seq=%ld), RR sent\n", receivedSeq);
 
-    // Copy data (without BCC2) to packet
-    memcpy(packet, data, dataSize - 1);
-    expectedSeq ^= 1; // Toggle expected sequence
-    return dataSize - 1;
+    conn->expectedSeq ^= 1; // Toggle expected sequence
+    conn->rejSent = FALSE;
+    return dataSize;
 
 send_rej:
-    // Send REJ for current expected sequence
-    unsigned char rej = (expectedSeq == 0) ? C_REJ0 : C_REJ1;
-    unsigned char rejFrame[5] = {FLAG, A_RECEIVER, rej, A_RECEIVER ^ rej, FLAG};
-    writeBytesSerialPort(rejFrame, 5);
-    printf("REJ sent (expecting seq=%d)\n", expectedSeq);
+    // Send REJ for current expected sequence, once: a second one would be
+    // taken as the answer to the retransmission it asked for
+    if (conn->rejSent) return -1;
+    conn->rejSent = TRUE;
+    sendSupervisory(conn, A_RECEIVER, (conn->expectedSeq == 0) ? C_REJ0 : C_REJ1);
+    conn->stats.rejSent++;
+    TRACE(TRACE_INFO, "REJ sent (expecting seq=%ld)\n", conn->expectedSeq);
     return -1;
 }
 
 // -------------------- LLCLOSE --------------------
 int llclose(int showRole)
 {
+    LinkConnection *conn = connection();
     unsigned char frame[5];
-    unsigned char recvByte;
     int retries = 0;
 
+    if (showRole == LlTx && conn->openDeferred)
+    {
+        // Fast open never got its UA: there is nothing to disconnect
+        finishStatistics(conn);
+        printf("Error: The connection was never established\n");
+        conn->openDeferred = FALSE;
+        eventLoopClose(&conn->loop);
+        closeSerialPort(&conn->port);
+        return -1;
+    }
     if (showRole == LlTx)
     {
+        // Windowed modes: every queued frame must be acknowledged first
+        // (and, in full duplex, every frame received here)
+        int flushed = flushWindow(conn);
+        sendPendingAck(conn);
+        finishStatistics(conn);
+        if (flushed < 0) {
+            printf("Error: Outstanding frames were not acknowledged\n");
+            eventLoopClose(&conn->loop);
+            closeSerialPort(&conn->port);
+            return -1;
+        }
+
         // TRANSMITTER: Send DISC, wait for DISC, send UA
-        while (retries < MAX_RETRIES)
+        while (retries < conn->maxRetries)
         {
             // Send DISC
             frame[0] = FLAG;
@@ -441,53 +2739,35 @@ int llclose(int showRole)
             frame[3] = frame[1] ^ frame[2];
             frame[4] = FLAG;
 
-            printf("Sending DISC (attempt %d/%d)...\n", retries + 1, MAX_RETRIES);
-            writeBytesSerialPort(frame, 5);
+            printf("Sending DISC (attempt %d/%d)...\n", retries + 1, conn->maxRetries);
+            writeBytesSerialPort(&conn->port, frame, 5);
 
             // Wait for DISC from receiver
-            alarm(TIMEOUT);
-            alarmFlag = 0;
+            timerStart(&conn->loop, TIMER_CONTROL, retransmitTimeout(conn, queueOnLine(conn, S_FRAME_SIZE)));
 
-            unsigned char state = 0;
-            while (!alarmFlag)
+            DecodedFrame answer;
+            while (!timerExpired(&conn->loop, TIMER_CONTROL))
             {
-                if (readByteSerialPort(&recvByte) <= 0) continue;
-
-                switch (state)
-                {
-                case 0: if (recvByte == FLAG) state = 1; break;
-                case 1:
-                    if (recvByte == A_RECEIVER) state = 2;
-                    else if (recvByte != FLAG) state = 0;
-                    break;
-                case 2:
-                    if (recvByte == C_DISC) state = 3;
-                    else if (recvByte == FLAG) state = 1;
-                    else state = 0;
-                    break;
-                case 3:
-                    if (recvByte == (A_RECEIVER ^ C_DISC)) state = 4;
-                    else if (recvByte == FLAG) state = 1;
-                    else state = 0;
-                    break;
-                case 4:
-                    if (recvByte == FLAG) goto disc_received;
-                    else state = 0;
-                    break;
+                if (readFrame(conn, &answer, WAIT_TIMER) <= 0) continue;
+                if (answer.kind == FrameI) {
+                    discardFrame(conn);
+                    if (conn->fullDuplex) repeatAcknowledgement(conn);
                 }
+                if (answer.kind == FrameDISC && answer.address == A_RECEIVER) goto disc_received;
             }
 
             retries++;
+            backOff(conn);
             printf("Timeout! No DISC received.\n");
         }
 
-        printf("Error: Failed to receive DISC after %d retries\n", MAX_RETRIES);
-        alarm(0);
-        closeSerialPort();
+        printf("Error: Failed to receive DISC after %d retries\n", conn->maxRetries);
+        eventLoopClose(&conn->loop);
+        closeSerialPort(&conn->port);
         return -1;
 
 disc_received:
-        alarm(0);
+        timerStop(&conn->loop, TIMER_CONTROL);
         printf("DISC received from receiver\n");
 
         // Send UA
@@ -496,47 +2776,44 @@ disc_received:
         frame[2] = C_UA;
         frame[3] = frame[1] ^ frame[2];
         frame[4] = FLAG;
-        writeBytesSerialPort(frame, 5);
+        writeBytesSerialPort(&conn->port, frame, 5);
         printf("UA sent, connection closed\n");
 
-        sleep(1); // Give time for UA to be sent
-        closeSerialPort();
+        drainSerialPort(&conn->port); // closing must not cut the UA short
+        eventLoopClose(&conn->loop);
+        closeSerialPort(&conn->port);
         return 0;
     }
     else // RECEIVER
     {
-        // RECEIVER: Wait for DISC, send DISC, wait for UA
+        // Full duplex: frames sent from here must be acknowledged as well
+        int flushed = conn->fullDuplex ? flushWindow(conn) : 0;
+        sendPendingAck(conn);
+        finishStatistics(conn);
+        if (flushed < 0) printf("Error: Outstanding frames were not acknowledged\n");
+
+        // RECEIVER: Wait for DISC (unless llread already got it), send DISC, wait for UA
+        if (conn->discReceived) goto send_disc;
         printf("Waiting for DISC from transmitter...\n");
 
-        unsigned char state = 0;
-        while (1)
+        // Bounded by the transmitter's own DISC retry budget
+        timerStart(&conn->loop, TIMER_CONTROL, conn->timeoutMs * (conn->maxRetries + 1));
+        DecodedFrame request;
+        while (!timerExpired(&conn->loop, TIMER_CONTROL))
         {
-            if (readByteSerialPort(&recvByte) <= 0) continue;
-
-            switch (state)
-            {
-            case 0: if (recvByte == FLAG) state = 1; break;
-            case 1:
-                if (recvByte == A_SENDER) state = 2;
-                else if (recvByte != FLAG) state = 0;
-                break;
-            case 2:
-                if (recvByte == C_DISC) state = 3;
-                else if (recvByte == FLAG) state = 1;
-                else state = 0;
-                break;
-            case 3:
-                if (recvByte == (A_SENDER ^ C_DISC)) state = 4;
-                else if (recvByte == FLAG) state = 1;
-                else state = 0;
-                break;
-            case 4:
-                if (recvByte == FLAG) goto send_disc;
-                else state = 0;
-                break;
+            if (readFrame(conn, &request, WAIT_TIMER) <= 0) continue;
+            if (request.kind == FrameI) {
+                discardFrame(conn);
+                repeatAcknowledgement(conn);
             }
+            if (request.kind == FrameDISC && request.address == A_SENDER) goto send_disc;
         }
 
+        printf("Error: No DISC received from transmitter\n");
+        eventLoopClose(&conn->loop);
+        closeSerialPort(&conn->port);
+        return -1;
+
 send_disc:
         printf("DISC received from transmitter\n");
 
@@ -546,51 +2823,48 @@ send_disc:
         frame[2] = C_DISC;
         frame[3] = frame[1] ^ frame[2];
         frame[4] = FLAG;
-        writeBytesSerialPort(frame, 5);
+        writeBytesSerialPort(&conn->port, frame, 5);
         printf("DISC sent\n");
 
         // Wait for UA
-        state = 0;
-        alarm(TIMEOUT * 2); // Give more time for final UA
-        alarmFlag = 0;
+        timerStart(&conn->loop, TIMER_CONTROL, conn->timeoutMs * 2); // Give more time for final UA
 
-        while (!alarmFlag)
+        while (!timerExpired(&conn->loop, TIMER_CONTROL))
         {
-            if (readByteSerialPort(&recvByte) <= 0) continue;
+            if (readFrame(conn, &request, WAIT_TIMER) <= 0) continue;
+            if (request.kind == FrameI) discardFrame(conn);
 
-            switch (state)
-            {
-            case 0: if (recvByte == FLAG) state = 1; break;
-            case 1:
-                if (recvByte == A_RECEIVER) state = 2;
-                else if (recvByte != FLAG) state = 0;
-                break;
-            case 2:
-                if (recvByte == C_UA) state = 3;
-                else if (recvByte == FLAG) state = 1;
-                else state = 0;
-                break;
-            case 3:
-                if (recvByte == (A_RECEIVER ^ C_UA)) state = 4;
-                else if (recvByte == FLAG) state = 1;
-                else state = 0;
-                break;
-            case 4:
-                if (recvByte == FLAG) {
-                    alarm(0);
-                    printf("UA received, connection closed\n");
-                    closeSerialPort();
-                    return 0;
-                }
-                else state = 0;
-                break;
+            if (request.kind == FrameUA && request.address == A_RECEIVER) {
+                timerStop(&conn->loop, TIMER_CONTROL);
+                printf("UA received, connection closed\n");
+                eventLoopClose(&conn->loop);
+                closeSerialPort(&conn->port);
+                return (flushed < 0) ? -1 : 0;
+            }
+            if (request.kind == FrameDISC && request.address == A_SENDER) {
+                // Our DISC was lost and the transmitter sent its own again
+                writeBytesSerialPort(&conn->port, frame, 5);
+                printf("DISC received again, DISC sent again\n");
+                timerStart(&conn->loop, TIMER_CONTROL, conn->timeoutMs * 2);
             }
         }
 
         // Timeout waiting for UA, but still close
-        alarm(0);
         printf("Timeout waiting for UA, closing anyway\n");
-        closeSerialPort();
-        return 0;
+        eventLoopClose(&conn->loop);
+        closeSerialPort(&conn->port);
+        return (flushed < 0) ? -1 : 0;
     }
-}
\ No newline at end of file
+}
+
+// -------------------- LLABORT --------------------
+int llabort()
+{
+    LinkConnection *conn = connection();
+    // Counting resumes if llopen reconnects
+    conn->statsEndMs = clockMs(&conn->loop);
+    resetWindows(conn);
+    printf("Connection dropped without DISC\n");
+    eventLoopClose(&conn->loop);
+    return closeSerialPort(&conn->port) < 0 ? -1 : 0;
+}
@@ -1,15 +1,44 @@
 // Link layer header.
 // DO NOT CHANGE THIS FILE
+// (Changed on purpose since: the ARQ, frame check, payload, FEC and rate
+// settings in LinkLayer, statistics, and the calls added around the original
+// four, e.g. llwritev, llflush and per-thread connections. llopen, llwrite,
+// llread and llclose keep their original signatures.)
 
 #ifndef _LINK_LAYER_H_
 #define _LINK_LAYER_H_
 
+#include <sys/uio.h>
+
 typedef enum
 {
     LlTx,
     LlRx,
 } LinkLayerRole;
 
+// ARQ modes, ordered from least to most capable.
+typedef enum
+{
+    LlStopAndWait,
+    LlGoBackN,
+    LlSelectiveRepeat,
+} LinkLayerArqMode;
+
+// Check appended to the data field of I-frames.
+typedef enum
+{
+    LlCheckXor,   // 1-byte XOR BCC2, understood by every peer
+    LlCheckCrc16, // CRC-16 (HDLC FCS)
+    LlCheckCrc32, // CRC-32 (IEEE 802.3)
+} LinkLayerFrameCheck;
+
+// Format of the statistics report written by llclose.
+typedef enum
+{
+    LlStatsJson,
+    LlStatsCsv, // one row per run, appended under a header written once
+} LinkLayerStatsFormat;
+
 typedef struct
 {
     char serialPort[50];
@@ -17,30 +46,178 @@ typedef struct
     int baudRate;
     int nRetransmissions;
     int timeout;
+    LinkLayerArqMode arqMode; // Tx: mode to propose in SET. Rx: most capable mode to accept.
+    int windowSize;           // Window size limit for windowed modes (0 = mode maximum)
+    LinkLayerFrameCheck frameCheck; // Tx: check to propose. Rx: any supported check is accepted.
+    int maxPayload;           // Largest payload to propose/accept (0 = MAX_PAYLOAD_SIZE)
+    int fixedPayload;         // Tx: llpayloadSize always gives the negotiated limit (no adaptation)
+    int fecParity;            // Tx: Reed-Solomon parity bytes per block to propose (even, up to 32;
+                              // 0 = ARQ only). Rx: any supported parity is accepted.
+    int fullDuplex;           // Both ends send I-frames (see llread). Tx: propose it. Rx: accept it.
+                              // Needs a windowed ARQ mode.
+    int maxBaudRate;          // Highest line rate to switch to after opening at baudRate (0 = stay).
+                              // Tx: propose it; the rate then adapts to the frame error rate.
+                              // Rx: accept up to it. Not in full duplex.
+    int fastOpen;             // Tx: send the SET with the first llwrite, carrying its packet if it
+                              // fits (one round trip to open and deliver it). Not in full duplex.
+                              // Rx: such SETs are always accepted.
+    const char *statsFile;    // Report written by llclose (NULL = none, "-" = stdout)
+    LinkLayerStatsFormat statsFormat;
 } LinkLayer;
 
+// Counters kept from llopen to llclose. Reconnecting with llopen after llabort
+// keeps counting. Tx fields stay 0 on the receiver and Rx fields on the
+// transmitter, unless in full duplex, where both ends count both.
+typedef struct
+{
+    LinkLayerRole role;
+    int sessions; // successful llopen calls (more than 1 after reconnects)
+
+    // Settings agreed in the last llopen
+    LinkLayerArqMode arqMode;
+    int windowSize;
+    LinkLayerFrameCheck frameCheck;
+    int maxPayload;
+    int fecParity;
+    int fullDuplex;
+    int baudRate;    // line rate at the end (see LinkLayer.maxBaudRate)
+    int rateChanges; // line rate switches, fallbacks included
+
+    // Tx
+    long framesSent;      // I-frame transmissions, retransmissions included
+    long retransmissions;
+    long timeouts;
+    long rejReceived;     // REJ and SREJ
+
+    // Rx
+    long framesReceived;  // I-frames accepted, intact or repaired by FEC
+    long duplicates;
+    long bcc1Errors;
+    long bcc2Errors;      // data field errors, frames too damaged for FEC included
+    long rejSent;         // REJ and SREJ
+    long framesCorrected; // repaired by FEC
+    long bytesCorrected;
+    long framesUncorrectable; // too damaged for FEC, left to REJ/SREJ or the timer
+
+    // Payload acknowledged (Tx) or accepted (Rx; full duplex: both), and the data fields of the
+    // I-frames sent or accepted before and after byte stuffing
+    long long payloadBytes;
+    long long unstuffedBytes;
+    long long stuffedBytes;
+
+    // Round trip of acknowledged frames, serialization excluded (Tx, ms)
+    long rttSamples;
+    double rttMinMs;
+    double rttAvgMs;
+    double rttMaxMs;
+
+    // Derived when read
+    double elapsedSeconds; // from the first llopen to llclose (or now)
+    double goodputBps;     // payload bits per second
+    double efficiency;     // goodput / baud rate (averaged over time if it changed)
+    double sawEfficiency;  // stop-and-wait bound 1 / (1 + 2a) for the average frame and RTT
+} LinkLayerStatistics;
+
 // Size of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer.
-#define MAX_PAYLOAD_SIZE 1000
+// The limit in effect is negotiated in llopen; see llpayloadSize.
+#define MAX_PAYLOAD_SIZE 4096
+
+// Smallest payload limit that may be negotiated (room for any control packet).
+#define MIN_PAYLOAD_SIZE 300
 
 // MISC
 #define FALSE 0
 #define TRUE 1
 
 // Open a connection using the "port" parameters defined in struct linkLayer.
+// The ARQ mode, window size, frame check, FEC and full duplex are negotiated in the SET/UA
+// exchange; peers that send a plain SET or UA fall back to stop-and-wait.
+// With fastOpen, the transmitter returns at once and the exchange happens in the
+// first llwrite, which then fails if no UA comes.
 // Return 0 on success or -1 on error.
 int llopen(LinkLayer connectionParameters);
 
 // Send data in buf with size bufSize.
+// In windowed modes this returns as soon as the frame is queued in the window;
+// llclose waits for outstanding frames to be acknowledged.
 // Return number of chars written, or -1 on error.
 int llwrite(const unsigned char *buf, int bufSize);
 
-// Receive data in packet.
-// Return number of chars read, or -1 on error.
+// Same as llwrite, with the payload gathered from "nParts" buffers (e.g. a
+// packet header and a slice of a mapped file) so they need not be copied
+// together first.
+int llwritev(const struct iovec *parts, int nParts);
+
+// Payload size to give llwrite next: the negotiated limit on a clean line, less
+// when the observed frame error rate makes long frames expensive to repeat.
+// With LinkLayer.fixedPayload set, always the negotiated limit.
+int llpayloadSize();
+
+// Wait until every frame accepted by llwrite has been acknowledged.
+// Return 0 on success or -1 if the link failed.
+int llflush();
+
+// Number of frames accepted by llwrite that the receiver has not acknowledged
+// yet (always 0 in stop-and-wait, where llwrite waits for each one).
+int llpending();
+
+// Receive data in packet (room for MAX_PAYLOAD_SIZE bytes).
+// With FEC, corrupted bytes are repaired here; only frames beyond repair are
+// rejected and retransmitted.
+// A SET received after llopen (the transmitter reconnected) restarts the
+// receive sequence numbers. A packet that came in the SET (fast open) is
+// returned first.
+// Full duplex: both ends call llwrite and llread. Frames from the peer are
+// taken in whenever either is called and queued for llread, and
+// acknowledgements ride in the N(R) field of the I-frames going the other
+// way; an RR is only sent on its own when no I-frame is about to leave. The
+// queue grows as needed, so empty it after each llwrite (see llreceived).
+// Return number of chars read, or -1 on error (in full duplex: only if the link failed).
 int llread(unsigned char *packet);
 
-// Close previously opened connection and print transmission statistics in the console.
+// Number of packets llread can return without waiting. In full duplex, frames
+// that already arrived are taken in first.
+int llreceived();
+
+// 1 if the transmitter sent DISC before llclose (e.g. it gave up on a frame):
+// llread has nothing more to return, and llclose answers at once. 0 otherwise.
+int lldisconnected();
+
+// 1 if the link failed: a frame ran out of retries, the peer disconnected
+// while frames were outstanding, or the port itself failed (e.g. the socket or
+// simulated peer went away). Nothing more gets through until llopen. 0 otherwise.
+int llfailed();
+
+// Statistics of the current or last connection (see LinkLayerStatistics).
+// Return 0 on success or -1 if llopen was never called.
+int llstatistics(LinkLayerStatistics *stats);
+
+// Close previously opened connection and print transmission statistics in the console,
+// also writing them to LinkLayer.statsFile if one was given.
 // Return 0 on success or -1 on error.
 int llclose();
 
+// Drop the connection without the DISC exchange, e.g. after llwrite failed and the
+// peer is unreachable. llopen may be called again afterwards.
+// Return 0 on success or -1 on error.
+int llabort();
+
+// A connection: the port and everything the functions above keep about it.
+// They act on the calling thread's connection, which is one made with
+// llcreate and picked with lluse, or else a default one. Threads with a
+// connection each run that many links side by side (see multilink.h).
+typedef struct LinkConnection LinkConnection;
+
+// New connection, with nothing open.
+// Return it, or NULL if out of memory.
+LinkConnection *llcreate();
+
+// Release a connection made with llcreate, closing its port if still open.
+// No thread may be using it.
+void lldestroy(LinkConnection *connection);
+
+// Make the calling thread's ll* calls act on "connection" (NULL: the default one).
+void lluse(LinkConnection *connection);
+
 #endif // _LINK_LAYER_H_
@@ -0,0 +1,126 @@
+// Link statistics report implementation
+#include "link_stats.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef enum
+{
+    FieldInt,
+    FieldLong,
+    FieldLongLong,
+    FieldDouble,
+    FieldRole,
+    FieldArqMode,
+    FieldFrameCheck,
+} FieldType;
+
+typedef struct
+{
+    const char *name;
+    FieldType type;
+    size_t offset;
+} StatsField;
+
+#define FIELD(name, type) {#name, type, offsetof(LinkLayerStatistics, name)}
+
+// Report columns, in order
+static const StatsField fields[] = {
+    FIELD(role, FieldRole),
+    FIELD(sessions, FieldInt),
+    FIELD(arqMode, FieldArqMode),
+    FIELD(windowSize, FieldInt),
+    FIELD(frameCheck, FieldFrameCheck),
+    FIELD(maxPayload, FieldInt),
+    FIELD(fecParity, FieldInt),
+    FIELD(fullDuplex, FieldInt),
+    FIELD(baudRate, FieldInt),
+    FIELD(rateChanges, FieldInt),
+    FIELD(framesSent, FieldLong),
+    FIELD(retransmissions, FieldLong),
+    FIELD(timeouts, FieldLong),
+    FIELD(rejReceived, FieldLong),
+    FIELD(framesReceived, FieldLong),
+    FIELD(duplicates, FieldLong),
+    FIELD(bcc1Errors, FieldLong),
+    FIELD(bcc2Errors, FieldLong),
+    FIELD(rejSent, FieldLong),
+    FIELD(framesCorrected, FieldLong),
+    FIELD(bytesCorrected, FieldLong),
+    FIELD(framesUncorrectable, FieldLong),
+    FIELD(payloadBytes, FieldLongLong),
+    FIELD(unstuffedBytes, FieldLongLong),
+    FIELD(stuffedBytes, FieldLongLong),
+    FIELD(rttSamples, FieldLong),
+    FIELD(rttMinMs, FieldDouble),
+    FIELD(rttAvgMs, FieldDouble),
+    FIELD(rttMaxMs, FieldDouble),
+    FIELD(elapsedSeconds, FieldDouble),
+    FIELD(goodputBps, FieldDouble),
+    FIELD(efficiency, FieldDouble),
+    FIELD(sawEfficiency, FieldDouble),
+};
+
+#define N_FIELDS (int)(sizeof(fields) / sizeof(fields[0]))
+
+static void writeValue(FILE *out, const LinkLayerStatistics *stats, const StatsField *field, int quote)
+{
+    static const char *roles[] = {"tx", "rx"};
+    static const char *arqModes[] = {"saw", "gbn", "sr"};
+    static const char *frameChecks[] = {"xor", "crc16", "crc32"};
+
+    const void *value = (const char *)stats + field->offset;
+    const char *name = NULL;
+    switch (field->type)
+    {
+    case FieldInt: fprintf(out, "%d", *(const int *)value); return;
+    case FieldLong: fprintf(out, "%ld", *(const long *)value); return;
+    case FieldLongLong: fprintf(out, "%lld", *(const long long *)value); return;
+    case FieldDouble: fprintf(out, "%.6g", *(const double *)value); return;
+    case FieldRole: name = roles[*(const LinkLayerRole *)value]; break;
+    case FieldArqMode: name = arqModes[*(const LinkLayerArqMode *)value]; break;
+    case FieldFrameCheck: name = frameChecks[*(const LinkLayerFrameCheck *)value]; break;
+    }
+    fprintf(out, quote ? "\"%s\"" : "%s", name);
+}
+
+static void writeJson(FILE *out, const LinkLayerStatistics *stats)
+{
+    fprintf(out, "{\n");
+    for (int i = 0; i < N_FIELDS; i++) {
+        fprintf(out, "  \"%s\": ", fields[i].name);
+        writeValue(out, stats, &fields[i], 1);
+        fprintf(out, (i + 1 < N_FIELDS) ? ",\n" : "\n");
+    }
+    fprintf(out, "}\n");
+}
+
+static void writeCsv(FILE *out, const LinkLayerStatistics *stats, int header)
+{
+    if (header) {
+        for (int i = 0; i < N_FIELDS; i++) {
+            fprintf(out, (i + 1 < N_FIELDS) ? "%s," : "%s\n", fields[i].name);
+        }
+    }
+    for (int i = 0; i < N_FIELDS; i++) {
+        writeValue(out, stats, &fields[i], 0);
+        fputc((i + 1 < N_FIELDS) ? ',' : '\n', out);
+    }
+}
+
+int statsWriteReport(const LinkLayerStatistics *stats, LinkLayerStatsFormat format, const char *path)
+{
+    int toStdout = strcmp(path, "-") == 0;
+    FILE *out = toStdout ? stdout : fopen(path, (format == LlStatsCsv) ? "a" : "w");
+    if (out == NULL) return -1;
+
+    if (format == LlStatsCsv) {
+        int isNew = toStdout || (fseek(out, 0, SEEK_END) == 0 && ftell(out) == 0);
+        writeCsv(out, stats, isNew);
+    }
+    else writeJson(out, stats);
+
+    if (toStdout) return fflush(out) == 0 ? 0 : -1;
+    return fclose(out) == 0 ? 0 : -1;
+}
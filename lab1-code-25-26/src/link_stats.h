@@ -0,0 +1,15 @@
+// Link statistics report header.
+// Writes the LinkLayerStatistics of a connection as a JSON object or as a CSV
+// row, so runs can be compared by scripts instead of read off the console.
+
+#ifndef _LINK_STATS_H_
+#define _LINK_STATS_H_
+
+#include "link_layer.h"
+
+// Write "stats" to "path" ("-" for stdout) in "format". JSON replaces the
+// file; CSV appends a row, writing the header first if the file is new or empty.
+// Return 0 on success or -1 on error.
+int statsWriteReport(const LinkLayerStatistics *stats, LinkLayerStatsFormat format, const char *path);
+
+#endif // _LINK_STATS_H_
@@ -0,0 +1,150 @@
+// LZ compression implementation
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_SKIP_SHIFT 5 // After 2^5 misses in a row, start skipping ahead
+
+// -------------------- COMPRESSION --------------------
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash4(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Bytes needed to extend a 4-bit length field holding "length".
+static int extraLengthBytes(int length)
+{
+    return (length < 15) ? 0 : (length - 15) / 255 + 1;
+}
+
+static unsigned char *putExtraLength(unsigned char *op, int length)
+{
+    if (length < 15) return op;
+    for (length -= 15; length >= 255; length -= 255) *op++ = 255;
+    *op++ = length;
+    return op;
+}
+
+// Append one sequence: "literals" bytes from "literal", then a match of
+// "matchLength" bytes "offset" back (matchLength 0: final literals only).
+// Returns the new output position, or NULL if it would pass "end".
+static unsigned char *putSequence(unsigned char *op, unsigned char *end, const unsigned char *literal,
+                                  int literals, int offset, int matchLength)
+{
+    int matchCode = matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0;
+    int needed = 1 + extraLengthBytes(literals) + literals;
+    if (matchLength > 0) needed += 2 + extraLengthBytes(matchCode);
+    if (needed > end - op) return NULL;
+
+    *op++ = ((literals < 15 ? literals : 15) << 4) | (matchCode < 15 ? matchCode : 15);
+    op = putExtraLength(op, literals);
+    memcpy(op, literal, literals);
+    op += literals;
+    if (matchLength > 0) {
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        op = putExtraLength(op, matchCode);
+    }
+    return op;
+}
+
+int lzCompress(const unsigned char *src, int size, unsigned char *dest, int capacity)
+{
+    int table[1 << LZ_HASH_BITS]; // position + 1 of the last 4 bytes with each hash
+    memset(table, 0, sizeof(table));
+
+    unsigned char *op = dest;
+    unsigned char *end = dest + capacity;
+    int anchor = 0;
+    int misses = 0;
+    int i = 0;
+
+    while (i + LZ_MIN_MATCH <= size)
+    {
+        uint32_t v = read32(src + i);
+        int h = hash4(v);
+        int candidate = table[h] - 1;
+        table[h] = i + 1;
+
+        if (candidate < 0 || i - candidate > LZ_MAX_OFFSET || read32(src + candidate) != v) {
+            i += 1 + (misses++ >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        int length = LZ_MIN_MATCH;
+        while (i + length < size && src[candidate + length] == src[i + length]) length++;
+
+        op = putSequence(op, end, src + anchor, i - anchor, i - candidate, length);
+        if (op == NULL) return 0;
+        i += length;
+        anchor = i;
+        misses = 0;
+    }
+
+    op = putSequence(op, end, src + anchor, size - anchor, 0, 0);
+    return (op == NULL) ? 0 : op - dest;
+}
+
+// -------------------- DECOMPRESSION --------------------
+
+// Add the extension bytes of a length field to "*length".
+// Returns -1 if the input ends first or the length exceeds "limit".
+static int getExtraLength(const unsigned char *src, int size, int *ip, int *length, int limit)
+{
+    unsigned char byte;
+    do {
+        if (*ip >= size) return -1;
+        byte = src[(*ip)++];
+        *length += byte;
+        if (*length > limit) return -1;
+    } while (byte == 255);
+    return 0;
+}
+
+int lzDecompress(const unsigned char *src, int size, unsigned char *dest, int capacity)
+{
+    int ip = 0;
+    int op = 0;
+
+    while (ip < size)
+    {
+        int token = src[ip++];
+
+        int literals = token >> 4;
+        if (literals == 15 && getExtraLength(src, size, &ip, &literals, capacity) < 0) return -1;
+        if (literals > size - ip || literals > capacity - op) return -1;
+        memcpy(dest + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+
+        // The last sequence has no match
+        if (ip == size) return op;
+
+        if (size - ip < 2) return -1;
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int length = token & 0x0F;
+        if (length == 15 && getExtraLength(src, size, &ip, &length, capacity) < 0) return -1;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || length > capacity - op) return -1;
+
+        // Byte by byte: the match may overlap the bytes it produces
+        for (int k = 0; k < length; k++) {
+            dest[op + k] = dest[op - offset + k];
+        }
+        op += length;
+    }
+    return op;
+}
@@ -0,0 +1,18 @@
+// LZ compression header.
+// A small LZ77 codec using the LZ4 block layout: each sequence is a token
+// (literal count, match length), the literals, and a 2-byte offset back into
+// the data already decoded. Meant for packet-sized blocks: fast enough to run
+// per frame and skips quickly over data that does not compress.
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+// Compress "size" bytes of "src" into "dest" (room for "capacity" bytes).
+// Returns the compressed size, or 0 if it would not fit in "capacity".
+int lzCompress(const unsigned char *src, int size, unsigned char *dest, int capacity);
+
+// Decompress "size" bytes of "src" into "dest" (room for "capacity" bytes).
+// Returns the decompressed size, or -1 if the input is malformed or too big.
+int lzDecompress(const unsigned char *src, int size, unsigned char *dest, int capacity);
+
+#endif // _LZ_H_
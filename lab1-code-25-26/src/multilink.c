@@ -0,0 +1,741 @@
+// Multilink implementation
+
+#include "multilink.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ML_SPREAD 64        // Packets dispatched past the oldest unacknowledged one (tx)
+#define ML_QUEUE_SIZE ML_SPREAD // Shared queue: never more than ML_SPREAD unacknowledged
+#define ML_QUEUE_FILL 8     // Data packets queued ahead of the links (tx)
+#define ML_HISTORY 256      // Acknowledgements and data sequence numbers kept
+#define ML_IN_FLIGHT 16     // Packets the fastest link may have sent and not had acknowledged: a window and one
+#define ML_SAMPLE_MS 250    // Shortest busy time a throughput sample is taken over (tx)
+#define ML_CONTROLS 8       // Control packets held back until their data arrives (rx)
+#define ML_PACKET_CLOSE 0xFF // 1-byte packet a transmitter link sends before llclose
+
+// Link states
+#define ML_OPENING 0
+#define ML_UP 1
+#define ML_FAILED 2
+#define ML_CLOSED 3
+
+typedef struct
+{
+    unsigned number; // Order in which mlwritev was given the packet (tx)
+    int isControl;
+    int size;        // 0 = empty slot
+    unsigned char bytes[MAX_PAYLOAD_SIZE];
+} MlPacket;
+
+typedef struct
+{
+    MlPacket packets[ML_QUEUE_SIZE];
+    int head;
+    int count;
+} MlQueue;
+
+typedef struct
+{
+    LinkConnection *connection;
+    pthread_t thread;
+    int started;     // "thread" runs the link
+    char port[sizeof(((LinkLayer *)0)->serialPort)];
+    int state;
+    int payloadSize; // llpayloadSize of the link (tx)
+    int result;      // of llclose
+    long packets;    // acknowledged (tx) or received (rx)
+    long long bytes;
+
+    // Tx: payload bytes acknowledged per second while the link had packets
+    // out (0 until measured), over samples of at least ML_SAMPLE_MS
+    double throughput;
+    long long busySince; // ms: start of the current sample, 0 while idle
+    long long sampleBytes;
+} MlLink;
+
+// Shared by the calling thread and the link threads
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // a packet was queued, taken or acknowledged, or a link came or went
+    int nLinks;
+    MlLink links[ML_MAX_LINKS];
+    MlQueue queue; // tx: data packets waiting for a link. rx: packets received, in arrival order
+    int closing;
+
+    // Tx
+    MlPacket control;   // control packet waiting for its link and its acknowledgement
+    int controlPending;
+    int controlLink;    // link chosen to send it (-1 = none yet)
+    int controlTaken;   // that link has it
+    unsigned dispatched; // packets given to the links
+    unsigned oldest;     // first of them not acknowledged
+    unsigned char acked[ML_HISTORY]; // by number
+} Multilink;
+
+static Multilink *shared = NULL;
+static LinkLayer settings;
+
+// Reordering (rx, in the calling thread)
+static MlClassifier classify;
+static MlPacket *slots = NULL;  // ML_HISTORY data packets, by sequence number
+static MlPacket controls[ML_CONTROLS];
+static MlOrder controlOrders[ML_CONTROLS];
+static int controlHead = 0;
+static int nControls = 0;
+static MlPacket lastControl;    // delivered last, to drop repeats
+static unsigned char expected;  // sequence number of the next data packet
+static int sinceControl;        // data packets delivered since the last control packet
+static int holdData;            // no data until the next control packet
+
+// -------------------- QUEUE --------------------
+static void queuePush(MlQueue *q, const MlPacket *packet, int atFront)
+{
+    int slot;
+    if (atFront) {
+        q->head = (q->head + ML_QUEUE_SIZE - 1) % ML_QUEUE_SIZE;
+        slot = q->head;
+    }
+    else slot = (q->head + q->count) % ML_QUEUE_SIZE;
+    q->count++;
+
+    MlPacket *p = &q->packets[slot];
+    p->number = packet->number;
+    p->isControl = packet->isControl;
+    p->size = packet->size;
+    memcpy(p->bytes, packet->bytes, packet->size);
+}
+
+static void queuePop(MlQueue *q, MlPacket *packet)
+{
+    const MlPacket *p = &q->packets[q->head];
+    packet->number = p->number;
+    packet->isControl = p->isControl;
+    packet->size = p->size;
+    memcpy(packet->bytes, p->bytes, p->size);
+    q->head = (q->head + 1) % ML_QUEUE_SIZE;
+    q->count--;
+}
+
+static int linksUp()
+{
+    int up = 0;
+    for (int i = 0; i < shared->nLinks; i++) {
+        if (shared->links[i].state == ML_UP) up++;
+    }
+    return up;
+}
+
+static int firstLinkUp()
+{
+    for (int i = 0; i < shared->nLinks; i++) {
+        if (shared->links[i].state == ML_UP) return i;
+    }
+    return -1;
+}
+
+// -------------------- LINKS --------------------
+static long long nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Packets link "id" may have in flight: ML_IN_FLIGHT for the fastest link up,
+// fewer in proportion to the throughput of slower ones (at least one), so the
+// packets each link holds take about as long to deliver as the others'.
+// Links not measured yet count as the fastest.
+static int linkShare(int id)
+{
+    double fastest = 0;
+    for (int i = 0; i < shared->nLinks; i++) {
+        const MlLink *link = &shared->links[i];
+        if (link->state == ML_UP && link->throughput > fastest) fastest = link->throughput;
+    }
+
+    double throughput = shared->links[id].throughput;
+    if (throughput <= 0 || fastest <= 0) return ML_IN_FLIGHT;
+    int share = (int)(ML_IN_FLIGHT * throughput / fastest + 0.5);
+    return share > 1 ? share : 1;
+}
+
+// Count "bytes" acknowledged on a link, "busy" telling whether packets are
+// still out: a sample ends after ML_SAMPLE_MS, or when the link runs out of
+// packets (if it was busy long enough to count).
+static void measureLink(MlLink *link, int bytes, int busy)
+{
+    long long now = nowMs();
+    link->sampleBytes += bytes;
+    long long elapsed = now - link->busySince;
+    if (elapsed >= ML_SAMPLE_MS)
+    {
+        double sample = 1000.0 * link->sampleBytes / elapsed;
+        if (link->throughput <= 0) link->throughput = sample;
+        else link->throughput += (sample - link->throughput) / 4;
+        link->busySince = now;
+        link->sampleBytes = 0;
+    }
+    if (!busy) link->busySince = 0;
+}
+
+static void markAcked(MlLink *link, const MlPacket *packet)
+{
+    shared->acked[packet->number % ML_HISTORY] = TRUE;
+    while (shared->oldest != shared->dispatched && shared->acked[shared->oldest % ML_HISTORY]) {
+        shared->oldest++;
+    }
+    link->packets++;
+    link->bytes += packet->size;
+}
+
+// Send what the calling thread queues until mlclose, then close the link.
+// A link that fails hands the packets it has not had acknowledged back to the others.
+static void transmitLink(int id)
+{
+    MlLink *link = &shared->links[id];
+    MlPacket *inFlight = malloc(ML_IN_FLIGHT * sizeof(MlPacket));
+    int first = 0, count = 0;
+    int failed = (inFlight == NULL);
+
+    pthread_mutex_lock(&shared->lock);
+    while (!failed)
+    {
+        int result;
+        int control = shared->controlPending && !shared->controlTaken && shared->controlLink == id;
+
+        if (control ? count < ML_IN_FLIGHT : (shared->queue.count > 0 && count < linkShare(id)))
+        {
+            MlPacket *packet = &inFlight[(first + count) % ML_IN_FLIGHT];
+            if (control) {
+                *packet = shared->control;
+                shared->controlTaken = TRUE;
+            }
+            else queuePop(&shared->queue, packet);
+            if (count++ == 0) {
+                link->busySince = nowMs();
+                link->sampleBytes = 0;
+            }
+            pthread_cond_broadcast(&shared->changed); // room in the queue
+            pthread_mutex_unlock(&shared->lock);
+
+            // Control packets are acknowledged before anything else is sent
+            result = llwrite(packet->bytes, packet->size);
+            if (result >= 0 && control) result = llflush();
+            pthread_mutex_lock(&shared->lock);
+        }
+        else if (count > 0)
+        {
+            // Nothing new to send, or the link has its share: collect the acknowledgements
+            pthread_mutex_unlock(&shared->lock);
+            result = llflush();
+            pthread_mutex_lock(&shared->lock);
+        }
+        else if (shared->closing) break;
+        else {
+            pthread_cond_wait(&shared->changed, &shared->lock);
+            continue;
+        }
+
+        if (result < 0) {
+            failed = TRUE;
+            break;
+        }
+        link->payloadSize = llpayloadSize();
+        int ackedBytes = 0;
+        for (int acked = count - llpending(); acked > 0; acked--) {
+            markAcked(link, &inFlight[first]);
+            ackedBytes += inFlight[first].size;
+            first = (first + 1) % ML_IN_FLIGHT;
+            count--;
+        }
+        if (ackedBytes > 0) measureLink(link, ackedBytes, count > 0);
+        pthread_cond_broadcast(&shared->changed);
+    }
+
+    if (failed)
+    {
+        // Latest first, so the queue ends up in the original order
+        for (int i = count - 1; i >= 0; i--) {
+            const MlPacket *packet = &inFlight[(first + i) % ML_IN_FLIGHT];
+            if (packet->isControl) {
+                shared->controlTaken = FALSE;
+                shared->controlLink = -1;
+            }
+            else queuePush(&shared->queue, packet, TRUE);
+        }
+        link->state = ML_FAILED;
+        pthread_cond_broadcast(&shared->changed);
+        pthread_mutex_unlock(&shared->lock);
+        free(inFlight);
+        printf("Error: Link %d (%s) failed, %d packets left to the other links\n", id, link->port, count);
+        llabort();
+        return;
+    }
+    pthread_mutex_unlock(&shared->lock);
+    free(inFlight);
+
+    unsigned char closePacket = ML_PACKET_CLOSE;
+    int result = llwrite(&closePacket, 1) < 0 ? -1 : llclose(LlTx);
+
+    pthread_mutex_lock(&shared->lock);
+    link->state = ML_CLOSED;
+    link->result = result;
+    pthread_cond_broadcast(&shared->changed);
+    pthread_mutex_unlock(&shared->lock);
+}
+
+// Hand every packet received to the calling thread until the transmitter
+// closes the link, or until the link fails: then nothing more comes over it
+// and the packets the transmitter had not had acknowledged go over the others.
+static void receiveLink(int id)
+{
+    MlLink *link = &shared->links[id];
+    MlPacket packet = {0};
+    int failed = FALSE;
+
+    while (1)
+    {
+        // Only waiting for a frame may be cut short by releaseLinks
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        int size = llread(packet.bytes);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (size < 0 && (llfailed() || lldisconnected())) {
+            failed = TRUE;
+            break;
+        }
+        if (size <= 0) continue;
+        if (size == 1 && packet.bytes[0] == ML_PACKET_CLOSE) break;
+
+        packet.size = size;
+        pthread_mutex_lock(&shared->lock);
+        while (shared->queue.count == ML_QUEUE_SIZE) {
+            pthread_cond_wait(&shared->changed, &shared->lock);
+        }
+        queuePush(&shared->queue, &packet, FALSE);
+        link->packets++;
+        link->bytes += size;
+        pthread_cond_broadcast(&shared->changed);
+        pthread_mutex_unlock(&shared->lock);
+    }
+
+    int result;
+    if (failed) {
+        printf("Error: Link %d (%s) failed\n", id, link->port);
+        // A DISC from the transmitter is still answered
+        result = lldisconnected() ? llclose(LlRx) : llabort();
+    }
+    else result = llclose(LlRx);
+
+    pthread_mutex_lock(&shared->lock);
+    link->state = failed ? ML_FAILED : ML_CLOSED;
+    link->result = result;
+    pthread_cond_broadcast(&shared->changed);
+    pthread_mutex_unlock(&shared->lock);
+}
+
+// Thread of one link, on a link-layer connection of its own
+static void *runLink(void *arg)
+{
+    MlLink *link = arg;
+    int id = link - shared->links;
+    LinkLayer ll = settings;
+    snprintf(ll.serialPort, sizeof(ll.serialPort), "%s", link->port);
+    lluse(link->connection);
+
+    // A receiver waits for its SET as long as it takes
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    int opened = llopen(ll);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    pthread_mutex_lock(&shared->lock);
+    link->state = (opened < 0) ? ML_FAILED : ML_UP;
+    link->payloadSize = llpayloadSize();
+    pthread_cond_broadcast(&shared->changed);
+    pthread_mutex_unlock(&shared->lock);
+    if (opened < 0) return NULL;
+
+    if (ll.role == LlTx) transmitLink(id);
+    else receiveLink(id);
+    return NULL;
+}
+
+// Wait for every link thread and release the links. Threads still waiting
+// for the peer are cancelled, and their ports closed with their connections.
+static void releaseLinks(int stopRunning)
+{
+    pthread_mutex_lock(&shared->lock);
+    shared->closing = TRUE; // transmitter links close what they opened
+    pthread_cond_broadcast(&shared->changed);
+    pthread_mutex_unlock(&shared->lock);
+
+    for (int i = 0; i < shared->nLinks; i++)
+    {
+        MlLink *link = &shared->links[i];
+        if (link->started) {
+            if (stopRunning && (link->state == ML_OPENING || link->state == ML_UP)) {
+                printf("Warning: Link %d (%s) did not close, stopping it\n", i, link->port);
+                pthread_cancel(link->thread);
+            }
+            pthread_join(link->thread, NULL);
+        }
+        lldestroy(link->connection);
+    }
+
+    pthread_cond_destroy(&shared->changed);
+    pthread_mutex_destroy(&shared->lock);
+    free(shared);
+    shared = NULL;
+    free(slots);
+    slots = NULL;
+}
+
+// -------------------- OPEN --------------------
+// Split "ports" into the links. Returns 0 on success or -1 on error.
+static int parsePorts(const char *ports)
+{
+    shared->nLinks = 0;
+    const char *start = ports;
+    while (1)
+    {
+        const char *end = strchr(start, ',');
+        int length = (end != NULL) ? end - start : (int)strlen(start);
+
+        if (shared->nLinks == ML_MAX_LINKS) {
+            printf("Error: At most %d ports can be striped\n", ML_MAX_LINKS);
+            return -1;
+        }
+        MlLink *link = &shared->links[shared->nLinks++];
+        if (length == 0 || length >= (int)sizeof(link->port)) {
+            printf("Error: Invalid port '%.*s'\n", length, start);
+            return -1;
+        }
+        memcpy(link->port, start, length);
+        link->port[length] = '\0';
+
+        if (end == NULL) return 0;
+        start = end + 1;
+    }
+}
+
+int mlopen(const char *ports, LinkLayer connectionParameters, MlClassifier classifier)
+{
+    shared = calloc(1, sizeof(Multilink));
+    if (shared == NULL) {
+        printf("Error: Out of memory\n");
+        return -1;
+    }
+    pthread_mutex_init(&shared->lock, NULL);
+    pthread_cond_init(&shared->changed, NULL);
+
+    settings = connectionParameters;
+    classify = classifier;
+    shared->controlLink = -1;
+    if (parsePorts(ports) < 0) {
+        releaseLinks(FALSE);
+        return -1;
+    }
+    if (settings.role == LlRx) {
+        slots = calloc(ML_HISTORY, sizeof(MlPacket));
+        if (slots == NULL) {
+            printf("Error: Out of memory\n");
+            releaseLinks(FALSE);
+            return -1;
+        }
+        controlHead = nControls = 0;
+        lastControl.size = 0;
+        expected = 0;
+        sinceControl = 0;
+        holdData = TRUE; // until START
+    }
+
+    for (int i = 0; i < shared->nLinks; i++)
+    {
+        MlLink *link = &shared->links[i];
+        printf("Opening link %d on %s\n", i, link->port);
+        link->state = ML_OPENING;
+        link->connection = llcreate();
+        int error = (link->connection == NULL) ? ENOMEM : pthread_create(&link->thread, NULL, runLink, link);
+        if (error != 0) {
+            printf("Error: Could not start link %d: %s\n", i, strerror(error));
+            link->state = ML_FAILED;
+        }
+        else link->started = TRUE;
+    }
+
+    pthread_mutex_lock(&shared->lock);
+    int opening;
+    do {
+        opening = 0;
+        for (int i = 0; i < shared->nLinks; i++) {
+            if (shared->links[i].state == ML_OPENING) opening++;
+        }
+        if (opening > 0) pthread_cond_wait(&shared->changed, &shared->lock);
+    } while (opening > 0);
+    int up = linksUp();
+    pthread_mutex_unlock(&shared->lock);
+
+    if (up < shared->nLinks) {
+        printf("Error: %d of %d links failed to open\n", shared->nLinks - up, shared->nLinks);
+        releaseLinks(TRUE);
+        return -1;
+    }
+    printf("Multilink: %d links open\n", up);
+    return 0;
+}
+
+// -------------------- TRANSMIT --------------------
+int mlpayloadSize()
+{
+    pthread_mutex_lock(&shared->lock);
+    int size = MAX_PAYLOAD_SIZE;
+    for (int i = 0; i < shared->nLinks; i++) {
+        const MlLink *link = &shared->links[i];
+        if (link->state == ML_UP && link->payloadSize < size) size = link->payloadSize;
+    }
+    pthread_mutex_unlock(&shared->lock);
+    return size;
+}
+
+static void gather(MlPacket *packet, const struct iovec *parts, int nParts)
+{
+    packet->size = 0;
+    for (int i = 0; i < nParts; i++) {
+        memcpy(packet->bytes + packet->size, parts[i].iov_base, parts[i].iov_len);
+        packet->size += parts[i].iov_len;
+    }
+}
+
+// Send a control packet over one link once every packet before it is
+// acknowledged, and wait for its own acknowledgement
+static int writeControl(const struct iovec *parts, int nParts)
+{
+    while (shared->oldest != shared->dispatched && linksUp() > 0) {
+        pthread_cond_wait(&shared->changed, &shared->lock);
+    }
+
+    MlPacket *packet = &shared->control;
+    gather(packet, parts, nParts);
+    packet->isControl = TRUE;
+    packet->number = shared->dispatched++;
+    shared->acked[packet->number % ML_HISTORY] = FALSE;
+    shared->controlPending = TRUE;
+    shared->controlTaken = FALSE;
+    shared->controlLink = -1;
+
+    while (!shared->acked[packet->number % ML_HISTORY])
+    {
+        if (shared->controlLink < 0) {
+            // First try, or the link it went to failed
+            shared->controlLink = firstLinkUp();
+            if (shared->controlLink < 0) break;
+            pthread_cond_broadcast(&shared->changed);
+        }
+        pthread_cond_wait(&shared->changed, &shared->lock);
+    }
+    shared->controlPending = FALSE;
+    return shared->acked[packet->number % ML_HISTORY] ? packet->size : -1;
+}
+
+int mlwritev(const struct iovec *parts, int nParts)
+{
+    int size = 0;
+    for (int i = 0; i < nParts; i++) size += parts[i].iov_len;
+    if (size > MAX_PAYLOAD_SIZE) {
+        printf("Error: Packet of %d bytes is too large\n", size);
+        return -1;
+    }
+
+    // The classifier only needs the header
+    MlOrder order;
+    classify(parts[0].iov_base, parts[0].iov_len, &order);
+
+    pthread_mutex_lock(&shared->lock);
+    int result;
+    if (!order.isData) result = writeControl(parts, nParts);
+    else
+    {
+        // Bounded so the receiver never sees sequence numbers wrap around
+        while ((shared->queue.count >= ML_QUEUE_FILL || shared->dispatched - shared->oldest >= ML_SPREAD) &&
+               linksUp() > 0) {
+            pthread_cond_wait(&shared->changed, &shared->lock);
+        }
+        if (linksUp() > 0) {
+            MlQueue *q = &shared->queue;
+            MlPacket *packet = &q->packets[(q->head + q->count) % ML_QUEUE_SIZE];
+            gather(packet, parts, nParts);
+            packet->isControl = FALSE;
+            packet->number = shared->dispatched++;
+            shared->acked[packet->number % ML_HISTORY] = FALSE;
+            q->count++;
+            pthread_cond_broadcast(&shared->changed);
+            result = size;
+        }
+        else result = -1;
+    }
+    pthread_mutex_unlock(&shared->lock);
+
+    if (result < 0) printf("Error: Every link failed\n");
+    return result;
+}
+
+int mlflush()
+{
+    pthread_mutex_lock(&shared->lock);
+    while (shared->oldest != shared->dispatched && linksUp() > 0) {
+        pthread_cond_wait(&shared->changed, &shared->lock);
+    }
+    int result = (shared->oldest == shared->dispatched) ? 0 : -1;
+    pthread_mutex_unlock(&shared->lock);
+    return result;
+}
+
+// -------------------- RECEIVE --------------------
+static int sameControl(const MlPacket *a, const MlPacket *b)
+{
+    return a->size == b->size && memcmp(a->bytes, b->bytes, a->size) == 0;
+}
+
+// Move the packets the links received into the reordering buffers
+static void sortArrivals()
+{
+    MlQueue *q = &shared->queue;
+    while (q->count > 0)
+    {
+        const MlPacket *packet = &q->packets[q->head];
+        MlOrder order;
+        classify(packet->bytes, packet->size, &order);
+
+        if (order.isData)
+        {
+            MlPacket *slot = &slots[order.sequence % ML_HISTORY];
+            int distance = (order.sequence - expected + ML_HISTORY) % ML_HISTORY;
+            if (distance < ML_HISTORY / 2 && slot->size == 0) {
+                queuePop(q, slot);
+                continue;
+            }
+            // Delivered twice, by a link that failed before its acknowledgement came back
+            TRACE(TRACE_INFO, "Multilink: repeated data packet %ld dropped\n", order.sequence);
+        }
+        else
+        {
+            int repeat = lastControl.size > 0 && sameControl(packet, &lastControl);
+            for (int i = 0; i < nControls && !repeat; i++) {
+                repeat = sameControl(packet, &controls[(controlHead + i) % ML_CONTROLS]);
+            }
+
+            if (!repeat && nControls < ML_CONTROLS) {
+                int i = (controlHead + nControls++) % ML_CONTROLS;
+                controlOrders[i] = order;
+                queuePop(q, &controls[i]);
+                continue;
+            }
+            if (repeat) TRACE(TRACE_INFO, "Multilink: repeated control packet dropped\n");
+            else printf("Warning: Too many control packets, one dropped\n");
+        }
+        q->head = (q->head + 1) % ML_QUEUE_SIZE;
+        q->count--;
+    }
+    pthread_cond_broadcast(&shared->changed); // room for the links
+}
+
+// Copy the next packet in order to "packet". Returns its size, or 0 if it has not arrived.
+static int nextInOrder(unsigned char *packet)
+{
+    if (nControls > 0)
+    {
+        const MlOrder *order = &controlOrders[controlHead];
+        if (order->after < 0 || sinceControl >= order->after)
+        {
+            MlPacket *control = &controls[controlHead];
+            memcpy(packet, control->bytes, control->size);
+            lastControl = *control;
+            holdData = order->closes;
+            expected = 0;
+            sinceControl = 0;
+            controlHead = (controlHead + 1) % ML_CONTROLS;
+            nControls--;
+            return lastControl.size;
+        }
+    }
+
+    MlPacket *slot = &slots[expected];
+    if (holdData || slot->size == 0) return 0;
+
+    int size = slot->size;
+    memcpy(packet, slot->bytes, size);
+    slot->size = 0;
+    expected = (expected + 1) % ML_HISTORY;
+    sinceControl++;
+    return size;
+}
+
+int mlread(unsigned char *packet)
+{
+    pthread_mutex_lock(&shared->lock);
+    int size;
+    while (1)
+    {
+        sortArrivals();
+        size = nextInOrder(packet);
+        if (size > 0) break;
+
+        int open = 0;
+        for (int i = 0; i < shared->nLinks; i++) {
+            if (shared->links[i].state == ML_UP) open++;
+        }
+        if (open == 0) {
+            size = -1;
+            break;
+        }
+        pthread_cond_wait(&shared->changed, &shared->lock);
+    }
+    pthread_mutex_unlock(&shared->lock);
+    return size;
+}
+
+// -------------------- CLOSE --------------------
+int mlclose()
+{
+    pthread_mutex_lock(&shared->lock);
+    shared->closing = TRUE;
+    pthread_cond_broadcast(&shared->changed);
+
+    // Transmitter links close once their packets are acknowledged. Receiver
+    // links wait for the transmitter to close them, as long as llclose would.
+    struct timespec limit;
+    clock_gettime(CLOCK_REALTIME, &limit);
+    limit.tv_sec += settings.timeout * (settings.nRetransmissions + 1);
+    int error = 0;
+    while (linksUp() > 0 && error != ETIMEDOUT) {
+        if (settings.role == LlTx) pthread_cond_wait(&shared->changed, &shared->lock);
+        else error = pthread_cond_timedwait(&shared->changed, &shared->lock, &limit);
+    }
+    pthread_mutex_unlock(&shared->lock);
+
+    long packets = 0;
+    for (int i = 0; i < shared->nLinks; i++) packets += shared->links[i].packets;
+
+    int result = 0;
+    printf("Multilink: %ld packets over %d links\n", packets, shared->nLinks);
+    for (int i = 0; i < shared->nLinks; i++)
+    {
+        const MlLink *link = &shared->links[i];
+        const char *state = link->state == ML_FAILED ? ", failed"
+                          : (link->state == ML_CLOSED && link->result == 0) ? "" : ", not closed";
+        printf("  Link %d (%s): %ld packets, %lld bytes (%.1f%%)", i, link->port, link->packets,
+               link->bytes, packets > 0 ? 100.0 * link->packets / packets : 0.0);
+        if (link->throughput > 0) printf(", %.0f bytes/s", link->throughput);
+        printf("%s\n", state);
+        if (state[0] != '\0') result = -1;
+    }
+
+    releaseLinks(TRUE);
+    return result;
+}
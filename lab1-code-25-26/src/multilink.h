@@ -0,0 +1,62 @@
+// Multilink header.
+// Stripes application packets over several ports, e.g. one per UART. Each
+// port runs an ordinary link-layer connection of its own (see llcreate) in a
+// thread of its own, and the threads share packet queues with the caller.
+// Transmitter: a link takes the next data packet when its link layer can
+// accept one and it has fewer packets out than its share: ML_IN_FLIGHT for
+// the link with the highest measured throughput, proportionally fewer for
+// slower ones, so faster or cleaner links carry more. Control packets wait
+// until every earlier packet is acknowledged and then go over one link. If a
+// link fails, the packets it had not delivered go over the others.
+// Receiver: packets from all links are put back in order. The caller says
+// how, through a classifier that gives each data packet's sequence number and
+// how many data packets precede each control packet. Data waits for the first
+// control packet.
+
+#ifndef _MULTILINK_H_
+#define _MULTILINK_H_
+
+#include "link_layer.h"
+
+#include <sys/uio.h>
+
+#define ML_MAX_LINKS 4 // As many as the cable emulates (CAPTURE_MAX_LINKS in cable/capture.h)
+
+// Where a packet goes in the received order
+typedef struct
+{
+    int isData;
+    int sequence; // data: 0-255, wrapping
+    int after;    // control: data packets since the previous control packet that come
+                  // before it (-1 = in arrival order). Sequence numbers restart after it.
+    int closes;   // control: data after it waits for the next control packet
+} MlOrder;
+
+typedef void (*MlClassifier)(const unsigned char *packet, int size, MlOrder *order);
+
+// Open one connection per port in "ports", separated by commas, each with the
+// settings in "connectionParameters" (its serialPort is ignored).
+// Returns 0 once every connection is open, -1 if any failed (the rest are dropped).
+int mlopen(const char *ports, LinkLayer connectionParameters, MlClassifier classify);
+
+// As llwritev. Data packets return as soon as a link has room for them;
+// control packets once they are acknowledged.
+// Returns the number of bytes queued, or -1 if every link failed.
+int mlwritev(const struct iovec *parts, int nParts);
+
+// Payload size for the next packet: the smallest the links recommend.
+int mlpayloadSize();
+
+// Wait until every packet given to mlwritev has been acknowledged.
+// Returns 0 on success or -1 if a packet could not be delivered.
+int mlflush();
+
+// As llread: the next packet in order.
+// Returns its size, or -1 if every link has closed.
+int mlread(unsigned char *packet);
+
+// Close every connection and print how the packets were shared among the links.
+// Returns 0 on success or -1 if any link failed.
+int mlclose();
+
+#endif // _MULTILINK_H_
@@ -1,25 +1,87 @@
 // Serial port header.
 // NOTE: This file must not be changed.
+// (Changed on purpose since: buffered receive, transports, per-connection
+// SerialPort.)
 
 #ifndef _SERIAL_PORT_H_
 #define _SERIAL_PORT_H_
 
-// Open and configure the serial port.
+#include <sys/uio.h>
+
+#include "transport.h"
+
+// Receive buffer: holds the bytes of one read() call in [rxStart, rxEnd)
+#define RX_BUFFER_SIZE 4096
+
+// An open port and the bytes received on it but not yet taken. Each link-layer
+// connection has its own.
+typedef struct
+{
+    const Transport *transport; // NULL while closed
+    TransportPort handle;
+    unsigned char rxBuffer[RX_BUFFER_SIZE];
+    int rxStart;
+    int rxEnd;
+} SerialPort;
+
+// Open and configure the serial port, or the transport the name selects (a
+// socket or the simulated channel, see transport.h).
 // Returns a positive number if the port was opened successfully or -1 on error.
-int openSerialPort(const char *serialPort, int baudRate);
+int openSerialPort(SerialPort *port, const char *serialPort, int baudRate);
 
 // Restore original port settings and close the serial port.
 // Returns 0 if the port was closed successfully or -1 on error.
-int closeSerialPort();
+int closeSerialPort(SerialPort *port);
+
+// Wait until every byte written has been transmitted (tcdrain() on serial
+// lines) instead of sleeping for a guessed time.
+// Returns 0 on success or -1 on error.
+int drainSerialPort(SerialPort *port);
+
+// Switch the open port to "baudRate" after the bytes written have left.
+// Returns 0 on success, -1 on error or if the transport has no line rate.
+int setRateSerialPort(SerialPort *port, int baudRate);
+
+// Transport of the open port, or NULL if none is open.
+const Transport *transportSerialPort(const SerialPort *port);
 
 // Wait up to 0.1 second (VTIME) for a byte received from the serial port (must
 // check whether a byte was actually received from the return value).
+// Bytes are taken from the receive buffer, which is refilled with one large
+// read() when empty.
 // Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
-int readByteSerialPort(unsigned char *byte);
+int readByteSerialPort(SerialPort *port, unsigned char *byte);
+
+// Number of received bytes already buffered (readable without a syscall).
+int bufferedSerialPort(const SerialPort *port);
+
+// Look at the next buffered byte without consuming it, refilling the buffer if
+// it is empty.
+// Returns -1 on error, 0 if no byte was received, 1 if a byte is available.
+int peekByteSerialPort(SerialPort *port, unsigned char *byte);
+
+// Point "*bytes" at the buffered bytes without copying them, refilling the
+// buffer if it is empty. Use consumeSerialPort() to drop what was used.
+// Returns -1 on error, otherwise the number of bytes available.
+int peekBufferSerialPort(SerialPort *port, const unsigned char **bytes);
+
+// Drop up to nBytes buffered bytes. Returns the number of bytes dropped.
+int consumeSerialPort(SerialPort *port, int nBytes);
+
+// Copy buffered bytes into "dest" (or drop them if dest is NULL) up to and
+// including the first "delimiter", taking at most maxBytes. Refills the buffer
+// once if it is empty. Sets *found to 1 if the delimiter was copied.
+// Returns -1 on error, otherwise the number of bytes copied.
+int readUntilSerialPort(SerialPort *port, unsigned char delimiter, unsigned char *dest, int maxBytes, int *found);
 
 // Write up to numBytes to the serial port (must check how many were actually
 // written in the return value).
 // Returns -1 on error, otherwise the number of bytes written.
-int writeBytesSerialPort(const unsigned char *bytes, int nBytes);
+int writeBytesSerialPort(SerialPort *port, const unsigned char *bytes, int nBytes);
+
+// Write every buffer in "iov" with gathered writev() calls, continuing after
+// partial writes. The iovec array is consumed (modified) in the process.
+// Returns -1 on error, otherwise the total number of bytes written.
+int writevSerialPort(SerialPort *port, struct iovec *iov, int iovcnt);
 
 #endif // _SERIAL_PORT_H_
@@ -0,0 +1,385 @@
+// Simulated channel implementation
+
+#include "sim_channel.h"
+#include "transport.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+// Bytes in flight per direction: far more than a full window of stuffed frames
+#define SIM_QUEUE_SIZE (1 << 17)
+
+// Real time an end waits for the other to do anything before giving up on it
+// (e.g. it crashed without closing)
+#define SIM_STALL_MS 5000
+
+typedef struct
+{
+    unsigned char bytes[SIM_QUEUE_SIZE];
+    long long arrival[SIM_QUEUE_SIZE]; // virtual ns when each byte is readable
+    unsigned head;                     // next byte to read
+    unsigned tail;                     // next free slot
+    long long lineFreeAt;              // when the bytes written so far have left the line
+    unsigned long long rng;
+    long long untilError; // bits before the next one flipped
+} SimDirection;
+
+typedef struct
+{
+    int present;  // from simChannelCreate or open to close
+    int waiting;  // blocked in wait, for:
+    int wantInput;
+    long long deadline; // ns, -1 = none
+} SimEnd;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // the clock moved, or an end came or went
+    long long now;          // ns
+    unsigned long generation; // bumped on every change, to tell a stuck peer
+    SimChannelConfig config;
+    long long byteNs;
+    long long delayNs;
+    SimEnd ends[2];
+    SimDirection dir[2]; // dir[i]: bytes written by end i
+} SimChannel;
+
+static SimChannel *channel = NULL;
+static __thread int stalled = 0; // the last wait of this thread's end
+
+// -------------------- ERROR MODEL --------------------
+// splitmix64
+static unsigned long long nextRandom(unsigned long long *state)
+{
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Bits until the next error: geometric with p = ber, sampled directly so clean
+// bits cost nothing
+static long long errorGap(SimDirection *d, double ber)
+{
+    if (ber <= 0) return -1;
+    if (ber >= 1) return 0;
+    double u = (nextRandom(&d->rng) >> 11) * 0x1.0p-53; // [0, 1)
+    return (long long)(log1p(-u) / log1p(-ber));
+}
+
+// Flip the bits of "byte" that the error model hits
+static unsigned char corrupt(SimDirection *d, unsigned char byte, double ber)
+{
+    if (d->untilError < 0) return byte;
+
+    int bit = 0;
+    while (bit + d->untilError < 8) {
+        bit += d->untilError;
+        byte ^= 1 << bit;
+        bit++;
+        d->untilError = errorGap(d, ber);
+    }
+    d->untilError -= 8 - bit;
+    return byte;
+}
+
+// -------------------- CLOCK --------------------
+static int inputArrived(int end)
+{
+    const SimDirection *d = &channel->dir[end ^ 1];
+    return d->head != d->tail && d->arrival[d->head % SIM_QUEUE_SIZE] <= channel->now;
+}
+
+// With every present end waiting, move the clock to the earliest thing one of
+// them waits for and wake them.
+// Returns 1 if the clock moved, 0 if an end is busy (or about to wake), -1 if
+// no end can ever wake.
+static int advanceClock()
+{
+    long long next = -1;
+    for (int i = 0; i < 2; i++)
+    {
+        const SimEnd *e = &channel->ends[i];
+        if (!e->present) continue;
+        if (!e->waiting) return 0;
+
+        if (e->deadline >= 0 && (next < 0 || e->deadline < next)) next = e->deadline;
+        const SimDirection *d = &channel->dir[i ^ 1];
+        if (e->wantInput && d->head != d->tail) {
+            long long arrival = d->arrival[d->head % SIM_QUEUE_SIZE];
+            if (next < 0 || arrival < next) next = arrival;
+        }
+    }
+
+    if (next < 0) return -1;
+    if (next <= channel->now) {
+        // An end has something to do already; make sure it is awake
+        channel->generation++;
+        pthread_cond_broadcast(&channel->changed);
+        return 0;
+    }
+    channel->now = next;
+    channel->generation++;
+    pthread_cond_broadcast(&channel->changed);
+    return 1;
+}
+
+// simWait for end "self" with the lock held
+static int waitLocked(int self, long long deadline, int wantInput)
+{
+    SimEnd *me = &channel->ends[self];
+    int result;
+
+    while (1)
+    {
+        if (wantInput && inputArrived(self)) { result = 1; break; }
+        if (deadline >= 0 && channel->now >= deadline) { result = 0; break; }
+
+        me->waiting = 1;
+        me->wantInput = wantInput;
+        me->deadline = deadline;
+
+        int moved = advanceClock();
+        if (moved > 0) continue;
+        if (moved < 0) {
+            stalled = 1;
+            result = -1;
+            break;
+        }
+
+        // The other end is busy: wait for it to wait (or close)
+        unsigned long generation = channel->generation;
+        struct timespec limit;
+        clock_gettime(CLOCK_REALTIME, &limit);
+        limit.tv_sec += SIM_STALL_MS / 1000;
+        int error = 0;
+        while (channel->generation == generation && error != ETIMEDOUT) {
+            error = pthread_cond_timedwait(&channel->changed, &channel->lock, &limit);
+        }
+        if (error == ETIMEDOUT) {
+            fprintf(stderr, "Error: the other end of the simulated channel stopped responding\n");
+            channel->ends[self ^ 1].present = 0;
+        }
+    }
+
+    me->waiting = 0;
+    return result;
+}
+
+// -------------------- TRANSPORT --------------------
+static int openSim(TransportPort *port, const char *address, int baudRate)
+{
+    (void)baudRate; // No line rate to set
+    if (channel == NULL) {
+        fprintf(stderr, "Error: no simulated channel was created\n");
+        return -1;
+    }
+    if (strcmp(address, "0") != 0 && strcmp(address, "1") != 0) {
+        fprintf(stderr, "Error: simulated channel ends are sim:0 and sim:1\n");
+        return -1;
+    }
+
+    int self = address[0] - '0';
+    pthread_mutex_lock(&channel->lock);
+    stalled = 0;
+    channel->ends[self].present = 1;
+    channel->ends[self].waiting = 0;
+    pthread_mutex_unlock(&channel->lock);
+    port->fd = self;
+    return self;
+}
+
+static int closeSim(TransportPort *port)
+{
+    pthread_mutex_lock(&channel->lock);
+    channel->ends[port->fd].present = 0;
+    channel->ends[port->fd].waiting = 0;
+    channel->generation++;
+    pthread_cond_broadcast(&channel->changed);
+    pthread_mutex_unlock(&channel->lock);
+    port->fd = -1;
+    return 0;
+}
+
+// Blocks (in virtual time) until a byte has arrived, like a VMIN = 1 read
+static int readSim(TransportPort *port, unsigned char *buf, int size)
+{
+    pthread_mutex_lock(&channel->lock);
+    int n = 0;
+    if (waitLocked(port->fd, -1, 1) > 0)
+    {
+        SimDirection *d = &channel->dir[port->fd ^ 1];
+        while (n < size && d->head != d->tail && d->arrival[d->head % SIM_QUEUE_SIZE] <= channel->now) {
+            buf[n++] = d->bytes[d->head % SIM_QUEUE_SIZE];
+            d->head++;
+        }
+    }
+    else n = -1;
+    pthread_mutex_unlock(&channel->lock);
+    return n;
+}
+
+// Queue the bytes on the line: each one leaves a byte time after the one
+// before (or now, if the line is idle) and arrives a propagation delay later
+static int writeSim(TransportPort *port, struct iovec *iov, int iovcnt)
+{
+    pthread_mutex_lock(&channel->lock);
+    SimDirection *d = &channel->dir[port->fd];
+    int total = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const unsigned char *bytes = iov[i].iov_base;
+        if (d->tail - d->head + iov[i].iov_len > SIM_QUEUE_SIZE) {
+            fprintf(stderr, "Error: simulated line overflow\n");
+            total = -1;
+            break;
+        }
+        for (size_t j = 0; j < iov[i].iov_len; j++)
+        {
+            if (d->lineFreeAt < channel->now) d->lineFreeAt = channel->now;
+            d->lineFreeAt += channel->byteNs;
+
+            unsigned slot = d->tail++ % SIM_QUEUE_SIZE;
+            d->bytes[slot] = corrupt(d, bytes[j], channel->config.ber);
+            d->arrival[slot] = d->lineFreeAt + channel->delayNs;
+        }
+        total += iov[i].iov_len;
+    }
+
+    channel->generation++;
+    pthread_mutex_unlock(&channel->lock);
+    return total;
+}
+
+// Waits (in virtual time) for the last byte queued to leave the line
+static int drainSim(TransportPort *port)
+{
+    pthread_mutex_lock(&channel->lock);
+    int result = waitLocked(port->fd, channel->dir[port->fd].lineFreeAt, 0) < 0 ? -1 : 0;
+    pthread_mutex_unlock(&channel->lock);
+    return result;
+}
+
+// One rate for both directions, as on a UART; bytes already queued keep theirs
+static int setRateSim(TransportPort *port, int baudRate)
+{
+    (void)port; // One line between both ends
+    if (baudRate <= 0) return -1;
+    pthread_mutex_lock(&channel->lock);
+    channel->byteNs = 10 * 1000000000LL / baudRate;
+    pthread_mutex_unlock(&channel->lock);
+    return 0;
+}
+
+static long long clockSim()
+{
+    return simChannelClockUs();
+}
+
+static int waitSim(TransportPort *port, long long deadlineUs, int wantInput)
+{
+    pthread_mutex_lock(&channel->lock);
+    int result = waitLocked(port->fd, deadlineUs < 0 ? -1 : deadlineUs * 1000, wantInput);
+    pthread_mutex_unlock(&channel->lock);
+    return result;
+}
+
+const Transport simTransport = {
+    .name = "sim",
+    .open = openSim,
+    .read = readSim,
+    .write = writeSim,
+    .close = closeSim,
+    .drain = drainSim,
+    .setRate = setRateSim,
+    .clockUs = clockSim,
+    .wait = waitSim,
+};
+
+// -------------------- CHANNEL --------------------
+int simChannelCreate(const SimChannelConfig *config)
+{
+    if (config->baudRate <= 0 || config->delayUs < 0 || config->ber < 0 || config->ber > 1) {
+        fprintf(stderr, "Error: invalid simulated channel settings\n");
+        return -1;
+    }
+
+    if (channel == NULL)
+    {
+        // Shared, so a forked process can open the other end
+        channel = mmap(NULL, sizeof(SimChannel), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (channel == MAP_FAILED) {
+            perror("mmap");
+            channel = NULL;
+            return -1;
+        }
+    }
+    else
+    {
+        pthread_cond_destroy(&channel->changed);
+        pthread_mutex_destroy(&channel->lock);
+    }
+
+    pthread_mutexattr_t mutexAttr;
+    pthread_mutexattr_init(&mutexAttr);
+    pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&channel->lock, &mutexAttr);
+    pthread_mutexattr_destroy(&mutexAttr);
+
+    pthread_condattr_t condAttr;
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&channel->changed, &condAttr);
+    pthread_condattr_destroy(&condAttr);
+
+    channel->now = 0;
+    channel->generation = 0;
+    channel->config = *config;
+    channel->byteNs = 10 * 1000000000LL / config->baudRate;
+    channel->delayNs = config->delayUs * 1000LL;
+
+    for (int i = 0; i < 2; i++)
+    {
+        channel->ends[i] = (SimEnd){.present = 1, .waiting = 0, .wantInput = 0, .deadline = -1};
+
+        SimDirection *d = &channel->dir[i];
+        d->head = d->tail = 0;
+        d->lineFreeAt = 0;
+        d->rng = config->seed ^ (i + 1) * 0xD1B54A32D192ED03ULL;
+        d->untilError = errorGap(d, config->ber);
+    }
+
+    stalled = 0;
+    return 0;
+}
+
+void simChannelDestroy()
+{
+    if (channel == NULL) return;
+    pthread_cond_destroy(&channel->changed);
+    pthread_mutex_destroy(&channel->lock);
+    munmap(channel, sizeof(SimChannel));
+    channel = NULL;
+}
+
+long long simChannelClockUs()
+{
+    if (channel == NULL) return 0;
+    pthread_mutex_lock(&channel->lock);
+    long long now = channel->now / 1000;
+    pthread_mutex_unlock(&channel->lock);
+    return now;
+}
+
+int simChannelStalled()
+{
+    return stalled;
+}
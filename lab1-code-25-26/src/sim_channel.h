@@ -0,0 +1,39 @@
+// Simulated channel header.
+// A serial line between two link-layer endpoints, "sim:0" and "sim:1", run
+// in virtual time: bytes take 10 bit times each at the channel's baud rate (as
+// 8-N-1 on the cable), arrive a propagation delay later, and have their bits
+// flipped at the given bit error rate by a seeded generator, so every run of a
+// configuration is the same. The clock only moves when both ends are waiting,
+// straight to the next arrival or timer deadline, so a transfer that would
+// take minutes on the cable takes milliseconds.
+// The channel lives in shared memory: create it, then open one end in each of
+// two processes (after a fork) or two threads with a link-layer connection each.
+
+#ifndef _SIM_CHANNEL_H_
+#define _SIM_CHANNEL_H_
+
+typedef struct
+{
+    int baudRate;
+    long delayUs;            // propagation delay, each way
+    double ber;              // bit error rate, each way
+    unsigned long long seed; // of the bit error generator
+} SimChannelConfig;
+
+// Create the channel, or reset it for a new run (with neither end open).
+// Both ends count as present from here on: the clock waits for an end until
+// it is closed, so it does not run ahead of one still starting up.
+// Returns 0 on success or -1 on error.
+int simChannelCreate(const SimChannelConfig *config);
+
+// Release the channel.
+void simChannelDestroy();
+
+// Virtual time in microseconds since the channel was created.
+long long simChannelClockUs();
+
+// 1 if the last wait of this thread's end failed because nothing could ever
+// happen any more (e.g. the other end closed while this one waits for input).
+int simChannelStalled();
+
+#endif // _SIM_CHANNEL_H_
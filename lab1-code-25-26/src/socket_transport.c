@@ -0,0 +1,230 @@
+// Socket transports implementation
+// UDP and TCP stand-ins for the serial line, e.g. to run both ends on
+// different hosts. The link layer still does all framing and error recovery;
+// the baud rate only feeds its timing estimates.
+
+#include "transport.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Bytes per UDP datagram: well under the serial port's receive buffer, so a
+// datagram is never truncated by one read
+#define UDP_DATAGRAM_SIZE 1024
+
+// Resolve "host" and "port" (numeric or a service name) for "type".
+// Returns the first address found, to be released with freeaddrinfo(), or NULL.
+static struct addrinfo *resolve(const char *host, const char *port, int type, int passive)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = type;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    struct addrinfo *found;
+    int error = getaddrinfo(host, port, &hints, &found);
+    if (error != 0) {
+        fprintf(stderr, "%s:%s: %s\n", host != NULL ? host : "*", port, gai_strerror(error));
+        return NULL;
+    }
+    return found;
+}
+
+// Split "a:b" into two strings in "copy". Returns the part after the last
+// colon, or NULL if there is none.
+static char *splitLast(const char *address, char *copy, size_t size)
+{
+    snprintf(copy, size, "%s", address);
+    char *colon = strrchr(copy, ':');
+    if (colon == NULL) return NULL;
+    *colon = '\0';
+    return colon + 1;
+}
+
+static int closeSocket(TransportPort *port)
+{
+    int result = close(port->fd);
+    port->fd = -1;
+    return result;
+}
+
+// -------------------- UDP --------------------
+// "<local port>:<host>:<port>": bound to the local port and connected to the
+// peer, so only its datagrams are received
+static int openUdp(TransportPort *port, const char *address, int baudRate)
+{
+    (void)baudRate; // No line rate to set
+    char copy[256];
+    char *peerPort = splitLast(address, copy, sizeof(copy));
+    char *peerHost = peerPort != NULL ? strchr(copy, ':') : NULL;
+    if (peerHost == NULL) {
+        fprintf(stderr, "Error: UDP port must be udp:<local port>:<host>:<port>\n");
+        return -1;
+    }
+    *peerHost++ = '\0';
+
+    struct addrinfo *peer = resolve(peerHost, peerPort, SOCK_DGRAM, 0);
+    if (peer == NULL) return -1;
+    struct addrinfo *local = resolve(NULL, copy, SOCK_DGRAM, 1);
+    if (local == NULL) {
+        freeaddrinfo(peer);
+        return -1;
+    }
+
+    // Bind to the local address family that matches the peer's
+    struct addrinfo *bindTo = local;
+    while (bindTo != NULL && bindTo->ai_family != peer->ai_family) bindTo = bindTo->ai_next;
+
+    int sock = socket(peer->ai_family, SOCK_DGRAM, 0);
+    int ok = sock >= 0 && bindTo != NULL
+             && bind(sock, bindTo->ai_addr, bindTo->ai_addrlen) == 0
+             && connect(sock, peer->ai_addr, peer->ai_addrlen) == 0;
+    if (!ok) perror("udp");
+    freeaddrinfo(local);
+    freeaddrinfo(peer);
+    if (!ok) {
+        if (sock >= 0) close(sock);
+        return -1;
+    }
+    port->fd = sock;
+    return sock;
+}
+
+static int readUdp(TransportPort *port, unsigned char *buf, int size)
+{
+    int n = recv(port->fd, buf, size, 0);
+    // An ICMP "port unreachable" for an earlier datagram: the peer is not up yet
+    if (n < 0 && (errno == ECONNREFUSED || errno == EINTR)) return 0;
+    return n;
+}
+
+static int sendDatagram(int sock, const unsigned char *datagram, int size)
+{
+    if (send(sock, datagram, size, 0) < 0 && errno != ECONNREFUSED) return -1;
+    return size;
+}
+
+// Gather the buffers into datagrams of up to UDP_DATAGRAM_SIZE bytes
+static int writeUdp(TransportPort *port, struct iovec *iov, int iovcnt)
+{
+    unsigned char datagram[UDP_DATAGRAM_SIZE];
+    int total = 0;
+    int used = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const unsigned char *bytes = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0)
+        {
+            size_t n = UDP_DATAGRAM_SIZE - used;
+            if (n > left) n = left;
+            memcpy(datagram + used, bytes, n);
+            used += n;
+            bytes += n;
+            left -= n;
+
+            if (used == UDP_DATAGRAM_SIZE) {
+                if (sendDatagram(port->fd, datagram, used) < 0) return -1;
+                total += used;
+                used = 0;
+            }
+        }
+    }
+    if (used > 0) {
+        if (sendDatagram(port->fd, datagram, used) < 0) return -1;
+        total += used;
+    }
+    return total;
+}
+
+const Transport udpTransport = {
+    .name = "udp",
+    .open = openUdp,
+    .read = readUdp,
+    .write = writeUdp,
+    .close = closeSocket,
+};
+
+// -------------------- TCP --------------------
+// "<host>:<port>" connects to a peer; "<port>" alone listens for one
+static int openTcp(TransportPort *port, const char *address, int baudRate)
+{
+    (void)baudRate; // No line rate to set
+    char copy[256];
+    char *service = splitLast(address, copy, sizeof(copy));
+    int listening = (service == NULL);
+    if (listening) service = copy;
+
+    struct addrinfo *found = resolve(listening ? NULL : copy, service, SOCK_STREAM, listening);
+    if (found == NULL) return -1;
+
+    int sock = -1;
+    int fd = socket(found->ai_family, SOCK_STREAM, 0);
+    int ok = fd >= 0;
+    if (ok && listening)
+    {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        ok = bind(fd, found->ai_addr, found->ai_addrlen) == 0 && listen(fd, 1) == 0;
+        if (ok) {
+            printf("Waiting for a TCP connection on port %s...\n", service);
+            sock = accept(fd, NULL, NULL);
+            ok = sock >= 0;
+        }
+        if (fd >= 0) close(fd);
+    }
+    else if (ok)
+    {
+        sock = fd;
+        ok = connect(sock, found->ai_addr, found->ai_addrlen) == 0;
+    }
+    if (!ok) perror("tcp");
+    freeaddrinfo(found);
+    if (!ok) {
+        if (sock >= 0) close(sock);
+        return -1;
+    }
+
+    // Frames are written whole; send them without waiting to coalesce
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    // Writing after the peer closed fails with EPIPE instead of killing us
+    signal(SIGPIPE, SIG_IGN);
+    port->fd = sock;
+    return sock;
+}
+
+static int readTcp(TransportPort *port, unsigned char *buf, int size)
+{
+    int n = recv(port->fd, buf, size, 0);
+    if (n < 0 && errno == EINTR) return 0;
+    if (n == 0) {
+        // Unlike a serial line, a closed connection stays readable: stop here
+        fprintf(stderr, "Error: TCP connection closed by the peer\n");
+        return -1;
+    }
+    return n;
+}
+
+static int writeTcp(TransportPort *port, struct iovec *iov, int iovcnt)
+{
+    return transportWriteAll(port->fd, iov, iovcnt);
+}
+
+const Transport tcpTransport = {
+    .name = "tcp",
+    .open = openTcp,
+    .read = readTcp,
+    .write = writeTcp,
+    .close = closeSocket,
+};
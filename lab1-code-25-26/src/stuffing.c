@@ -0,0 +1,206 @@
+// Byte-stuffing implementation
+#include "stuffing.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+// A kernel returns the index of the first byte in "data" equal to "a" or "b",
+// or "size" if there is none.
+typedef int (*ScanKernel)(const unsigned char *data, int size, unsigned char a, unsigned char b);
+
+// -------------------- SCALAR --------------------
+
+static int scanScalar(const unsigned char *data, int size, unsigned char a, unsigned char b)
+{
+    for (int i = 0; i < size; i++) {
+        if (data[i] == a || data[i] == b) return i;
+    }
+    return size;
+}
+
+// -------------------- SSE2 / AVX2 --------------------
+
+#ifdef HAVE_X86
+
+__attribute__((target("sse2")))
+static int scanSse2(const unsigned char *data, int size, unsigned char a, unsigned char b)
+{
+    const __m128i va = _mm_set1_epi8((char)a);
+    const __m128i vb = _mm_set1_epi8((char)b);
+    int i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return i + scanScalar(data + i, size - i, a, b);
+}
+
+__attribute__((target("avx2")))
+static int scanAvx2(const unsigned char *data, int size, unsigned char a, unsigned char b)
+{
+    const __m256i va = _mm256_set1_epi8((char)a);
+    const __m256i vb = _mm256_set1_epi8((char)b);
+    int i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+
+    // 16-byte step kept here (VEX encoded): calling the SSE2 kernel with dirty
+    // upper halves would pay an SSE/AVX transition penalty
+    if (i + 16 <= size)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm256_castsi256_si128(va)),
+                                                  _mm_cmpeq_epi8(v, _mm256_castsi256_si128(vb))));
+        if (mask != 0) return i + __builtin_ctz(mask);
+        i += 16;
+    }
+    return i + scanScalar(data + i, size - i, a, b);
+}
+
+#endif
+
+// -------------------- NEON --------------------
+
+#ifdef HAVE_NEON
+
+static int scanNeon(const unsigned char *data, int size, unsigned char a, unsigned char b)
+{
+    const uint8x16_t va = vdupq_n_u8(a);
+    const uint8x16_t vb = vdupq_n_u8(b);
+    int i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        uint8x16_t v = vld1q_u8(data + i);
+        uint8x16_t hits = vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb));
+
+        // No movemask on NEON: narrow each byte to a nibble, 4 bits per lane
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hits), 4)), 0);
+        if (mask != 0) return i + __builtin_ctzll(mask) / 4;
+    }
+    return i + scanScalar(data + i, size - i, a, b);
+}
+
+#endif
+
+// -------------------- DISPATCH --------------------
+
+static ScanKernel scan = scanScalar;
+static StuffKernel selected = StuffScalar;
+
+int stuffingSelect(StuffKernel kernel)
+{
+    switch (kernel)
+    {
+    case StuffScalar:
+        scan = scanScalar;
+        break;
+#ifdef HAVE_X86
+    case StuffSse2:
+        if (!__builtin_cpu_supports("sse2")) return -1;
+        scan = scanSse2;
+        break;
+    case StuffAvx2:
+        if (!__builtin_cpu_supports("avx2")) return -1;
+        scan = scanAvx2;
+        break;
+#endif
+#ifdef HAVE_NEON
+    case StuffNeon:
+        scan = scanNeon;
+        break;
+#endif
+    default:
+        return -1;
+    }
+    selected = kernel;
+    return 0;
+}
+
+void stuffingInit()
+{
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+#endif
+    if (stuffingSelect(StuffAvx2) == 0) return;
+    if (stuffingSelect(StuffSse2) == 0) return;
+    if (stuffingSelect(StuffNeon) == 0) return;
+    stuffingSelect(StuffScalar);
+}
+
+const char *stuffingKernelName()
+{
+    switch (selected)
+    {
+    case StuffSse2: return "SSE2";
+    case StuffAvx2: return "AVX2";
+    case StuffNeon: return "NEON";
+    default: return "scalar";
+    }
+}
+
+// -------------------- STUFFING --------------------
+
+int stuffBytes(const unsigned char *data, int size, unsigned char *dest)
+{
+    int i = 0;
+    int j = 0;
+    while (1)
+    {
+        // Copy the clean run up to the next FLAG/ESC, then escape that byte
+        int run = scan(data + i, size - i, STUFF_FLAG, STUFF_ESC);
+        if (run > 0) memcpy(dest + j, data + i, run);
+        i += run;
+        j += run;
+        if (i == size) return j;
+
+        dest[j++] = STUFF_ESC;
+        dest[j++] = data[i++] ^ STUFF_XOR;
+    }
+}
+
+int destuffChunk(const unsigned char *data, int size, unsigned char *dest, int *escaped)
+{
+    int i = 0;
+    int j = 0;
+    if (*escaped && size > 0) {
+        dest[j++] = data[i++] ^ STUFF_XOR;
+        *escaped = 0;
+    }
+
+    while (1)
+    {
+        int run = scan(data + i, size - i, STUFF_ESC, STUFF_ESC);
+        if (run > 0) memcpy(dest + j, data + i, run);
+        i += run;
+        j += run;
+        if (i == size) return j;
+        if (i == size - 1) {
+            *escaped = 1; // Escaped byte is in the next chunk
+            return j;
+        }
+
+        dest[j++] = data[i + 1] ^ STUFF_XOR;
+        i += 2;
+    }
+}
+
+int destuffBytes(const unsigned char *data, int size, unsigned char *dest)
+{
+    int escaped = 0;
+    return destuffChunk(data, size, dest, &escaped);
+}
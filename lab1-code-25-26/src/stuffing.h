@@ -0,0 +1,47 @@
+// Byte-stuffing header.
+// FLAG (0x7E) and ESC (0x7D) bytes are found 16 or 32 at a time with vector
+// compares (SSE2/AVX2 on x86, NEON on ARM); clean runs between them are copied
+// in bulk. A scalar kernel is the fallback and the best one is picked at runtime.
+
+#ifndef _STUFFING_H_
+#define _STUFFING_H_
+
+#define STUFF_FLAG 0x7E
+#define STUFF_ESC 0x7D
+#define STUFF_XOR 0x20 // Escaped byte is sent as ESC, byte ^ STUFF_XOR
+
+typedef enum
+{
+    StuffScalar,
+    StuffSse2,
+    StuffAvx2,
+    StuffNeon,
+} StuffKernel;
+
+// Select the fastest kernel the CPU supports. Without this call the scalar
+// kernel is used.
+void stuffingInit();
+
+// Force a specific kernel (for benchmarks and testing).
+// Returns 0 on success or -1 if the CPU does not support it.
+int stuffingSelect(StuffKernel kernel);
+
+// Name of the kernel currently in use.
+const char *stuffingKernelName();
+
+// Stuff "size" bytes of "data" into "dest" (room for 2 * size bytes).
+// Returns the stuffed size.
+int stuffBytes(const unsigned char *data, int size, unsigned char *dest);
+
+// Destuff "size" bytes of "data" into "dest" (room for size bytes). A trailing
+// ESC with nothing after it is dropped.
+// Returns the destuffed size.
+int destuffBytes(const unsigned char *data, int size, unsigned char *dest);
+
+// Streaming form of destuffBytes for a field that arrives in chunks:
+// "*escaped" carries an ESC that ended the previous chunk into the next one
+// (start with 0; it is still set at the end if the field ended on an ESC).
+// Returns the number of bytes written to "dest".
+int destuffChunk(const unsigned char *data, int size, unsigned char *dest, int *escaped);
+
+#endif // _STUFFING_H_
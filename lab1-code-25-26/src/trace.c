@@ -0,0 +1,214 @@
+// Trace log implementation
+#include "trace.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_POLL_NS 20000000 // Logger thread wakes up every 20 ms
+#define TRACE_MASK (TRACE_RING_SIZE - 1)
+
+// Producers reserve a slot by incrementing "head", then publish it by storing
+// its index + 1 in "stamp". A reader copies a record and checks the stamp did
+// not change meanwhile; the ring never waits for readers, so a slow console
+// loses the oldest records instead of stalling the protocol thread.
+typedef struct
+{
+    atomic_ulong stamp; // index + 1 once published, 0 while being written
+    long long us;       // monotonic microseconds
+    const char *fmt;
+    int level;
+    long args[TRACE_MAX_ARGS];
+} TraceRecord;
+
+static TraceRecord ring[TRACE_RING_SIZE];
+static atomic_ulong head;
+static unsigned long tail = 0; // next record to print on the console
+static atomic_int consoleLevel = TRACE_INFO;
+
+static pthread_t logger;
+static pthread_mutex_t consoleLock = PTHREAD_MUTEX_INITIALIZER; // guards "tail"
+static atomic_int running;
+static volatile sig_atomic_t dumpRequested = 0;
+
+static const char *levelNames[] = {"error", "warn", "info", "debug"};
+
+static long long nowUs(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+void traceRecord(int level, const char *fmt, const long *args)
+{
+    unsigned long index = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    TraceRecord *r = &ring[index & TRACE_MASK];
+
+    atomic_store_explicit(&r->stamp, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    r->us = nowUs();
+    r->fmt = fmt;
+    r->level = level;
+    memcpy(r->args, args, sizeof(r->args));
+    atomic_store_explicit(&r->stamp, index + 1, memory_order_release);
+}
+
+// Copy record "index" if it is published and was not overwritten meanwhile.
+// Returns 1 if copied, 0 if not published yet, -1 if it was overwritten.
+static int readRecord(unsigned long index, TraceRecord *copy)
+{
+    TraceRecord *r = &ring[index & TRACE_MASK];
+    unsigned long stamp = atomic_load_explicit(&r->stamp, memory_order_acquire);
+    if (stamp != index + 1) return (stamp > index + 1) ? -1 : 0;
+
+    copy->us = r->us;
+    copy->fmt = r->fmt;
+    copy->level = r->level;
+    memcpy(copy->args, r->args, sizeof(copy->args));
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&r->stamp, memory_order_relaxed) == stamp ? 1 : -1;
+}
+
+static void printRecord(FILE *out, const TraceRecord *r)
+{
+    const long *a = r->args;
+    fprintf(out, r->fmt, a[0], a[1], a[2], a[3]);
+}
+
+static void drainConsole(void)
+{
+    pthread_mutex_lock(&consoleLock);
+    unsigned long end = atomic_load_explicit(&head, memory_order_acquire);
+    if (end - tail > TRACE_RING_SIZE) {
+        printf("[trace] %lu records lost\n", end - tail - TRACE_RING_SIZE);
+        tail = end - TRACE_RING_SIZE;
+    }
+
+    int level = atomic_load(&consoleLevel);
+    TraceRecord r;
+    for (; tail != end; tail++) {
+        int got = readRecord(tail, &r);
+        if (got == 0) break; // still being written, print it next time
+        if (got > 0 && r.level <= level) printRecord(stdout, &r);
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&consoleLock);
+}
+
+void traceFlush()
+{
+    drainConsole();
+}
+
+void traceDump(FILE *out, int count)
+{
+    unsigned long end = atomic_load_explicit(&head, memory_order_acquire);
+    unsigned long first = (end > TRACE_RING_SIZE) ? end - TRACE_RING_SIZE : 0;
+    if (count > 0 && end - first > (unsigned long)count) first = end - count;
+
+    traceFlush();
+    fprintf(out, "----- trace: last %lu events -----\n", end - first);
+    TraceRecord r;
+    for (unsigned long i = first; i != end; i++) {
+        if (readRecord(i, &r) <= 0) continue;
+        fprintf(out, "%lld.%06lld %-5s ", r.us / 1000000, r.us % 1000000, levelNames[r.level]);
+        printRecord(out, &r);
+    }
+    fprintf(out, "----- end of trace -----\n");
+    fflush(out);
+}
+
+static void onDumpSignal(int signal)
+{
+    (void)signal;
+    dumpRequested = 1;
+}
+
+static void *loggerThread(void *arg)
+{
+    (void)arg;
+    struct timespec t = {0, TRACE_POLL_NS};
+    while (atomic_load(&running))
+    {
+        nanosleep(&t, NULL);
+        drainConsole();
+        if (dumpRequested) {
+            dumpRequested = 0;
+            traceDump(stderr, 0);
+        }
+    }
+    return NULL;
+}
+
+// A process forked while the logger runs (multilink workers) gets a logger of
+// its own, and never a console lock held by the parent's
+static void lockConsole(void)
+{
+    pthread_mutex_lock(&consoleLock);
+}
+
+static void unlockConsole(void)
+{
+    pthread_mutex_unlock(&consoleLock);
+}
+
+static void restartInChild(void)
+{
+    pthread_mutex_unlock(&consoleLock);
+    if (atomic_load(&running) && pthread_create(&logger, NULL, loggerThread, NULL) != 0) {
+        atomic_store(&running, 0);
+    }
+}
+
+int traceStart(int level)
+{
+    static int forkHandlers = 0;
+    traceSetLevel(level);
+    if (!forkHandlers) {
+        pthread_atfork(lockConsole, unlockConsole, restartInChild);
+        forkHandlers = 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onDumpSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+
+    atomic_store(&running, 1);
+    if (pthread_create(&logger, NULL, loggerThread, NULL) != 0) {
+        atomic_store(&running, 0);
+        return -1;
+    }
+
+    // Only the logger thread takes the signal, so it never interrupts a wait
+    // on the protocol thread (or threads started from it later)
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    return 0;
+}
+
+void traceStop()
+{
+    if (atomic_exchange(&running, 0)) pthread_join(logger, NULL);
+    drainConsole();
+}
+
+void traceSetLevel(int level)
+{
+    atomic_store(&consoleLevel, level);
+}
+
+int traceParseLevel(const char *name)
+{
+    for (int i = TRACE_ERROR; i <= TRACE_DEBUG; i++) {
+        if (strcmp(name, levelNames[i]) == 0) return i;
+    }
+    return -1;
+}
@@ -0,0 +1,62 @@
+// Trace log header.
+// Hot-path events are stored as fixed-size binary records (a timestamp, a
+// format string and up to TRACE_MAX_ARGS long arguments) in a preallocated
+// ring buffer, so recording one costs a few stores and no system call. A
+// logger thread formats the records at or above the console level a few
+// times per second, off the protocol thread. The ring keeps the latest
+// TRACE_RING_SIZE records of every compiled-in level, so the events leading
+// to an error can be dumped afterwards, or at any time with SIGUSR1.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+
+#define TRACE_ERROR 0
+#define TRACE_WARN 1
+#define TRACE_INFO 2
+#define TRACE_DEBUG 3
+
+// Levels above this one compile to nothing (e.g. -DTRACE_COMPILE_LEVEL=TRACE_INFO)
+#ifndef TRACE_COMPILE_LEVEL
+#define TRACE_COMPILE_LEVEL TRACE_DEBUG
+#endif
+
+#define TRACE_MAX_ARGS 4
+#define TRACE_RING_SIZE 4096    // Records kept (a power of two)
+#define TRACE_ERROR_HISTORY 64  // Records dumped after an error
+
+// Record an event. "fmt" must be a string literal (only its address is kept)
+// and its conversions must all take longs, e.g. "seq=%ld".
+#define TRACE(level, fmt, ...)                                                         \
+    do {                                                                               \
+        if ((level) <= TRACE_COMPILE_LEVEL)                                            \
+            traceRecord((level), (fmt), (const long[TRACE_MAX_ARGS]){__VA_ARGS__});   \
+    } while (0)
+
+// Start the logger thread printing records up to "level" and dump the whole
+// ring to stderr on SIGUSR1. A process forked afterwards starts a logger
+// thread of its own.
+// Returns 0 on success or -1 on error.
+int traceStart(int level);
+
+// Print what is still pending and stop the logger thread.
+void traceStop();
+
+// Change the most verbose level printed on the console.
+void traceSetLevel(int level);
+
+// Parse "error", "warn", "info" or "debug". Returns the level or -1.
+int traceParseLevel(const char *name);
+
+// Append a record to the ring (see TRACE).
+void traceRecord(int level, const char *fmt, const long *args);
+
+// Print the records still waiting for the logger thread now.
+void traceFlush();
+
+// Write the last "count" records in the ring (0 = all), with timestamps and
+// levels, whatever the console level.
+void traceDump(FILE *out, int count);
+
+#endif // _TRACE_H_
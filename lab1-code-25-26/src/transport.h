@@ -0,0 +1,80 @@
+// Transport header.
+// The byte stream under the link layer. serial_port.c picks a backend from the
+// form of the port name and keeps its receive buffer on top of it:
+//   /dev/ttyS10                     termios serial port
+//   udp:<local port>:<host>:<port>  UDP datagrams to and from one peer
+//   tcp:<host>:<port>               TCP connection to a listening peer
+//   tcp:<port>                      TCP, listening for one peer to connect
+//   sim:0, sim:1                    the two ends of the simulated channel (sim_channel.h)
+// Backends keep the state of an open port in its TransportPort, so a process
+// can have several open (one per link-layer connection).
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <sys/uio.h>
+#include <termios.h>
+
+// An open port
+typedef struct
+{
+    int fd;                // serial line or socket descriptor, or the simulated channel's end
+    struct termios oldtio; // serial lines: settings to restore on closing
+} TransportPort;
+
+typedef struct
+{
+    const char *name;
+
+    // Open the port into "port". "baudRate" is only meaningful to serial lines.
+    // Returns a descriptor poll() reports readable when read() has data (any
+    // non-negative value for transports with a wait() of their own), or -1 on error.
+    int (*open)(TransportPort *port, const char *address, int baudRate);
+
+    // Read up to "size" received bytes, waiting for at least one.
+    // Returns -1 on error, otherwise the number of bytes (0 if nothing was read).
+    int (*read)(TransportPort *port, unsigned char *buf, int size);
+
+    // Send every byte in "iov", continuing after partial writes. The iovec array
+    // may be consumed (modified) in the process.
+    // Returns -1 on error, otherwise the total number of bytes written.
+    int (*write)(TransportPort *port, struct iovec *iov, int iovcnt);
+
+    // Returns 0 on success or -1 on error.
+    int (*close)(TransportPort *port);
+
+    // Block until every byte written has left the port, so closing cannot cut
+    // off the last frame. NULL where write() already hands the bytes over.
+    // Returns 0 on success or -1 on error.
+    int (*drain)(TransportPort *port);
+
+    // Change the line rate (both directions) once the bytes written have left.
+    // NULL where there is no line rate to change.
+    // Returns 0 on success or -1 on error (e.g. a rate the line does not support).
+    int (*setRate)(TransportPort *port, int baudRate);
+
+    // Transports that run on a clock of their own (virtual time) set both of
+    // these; the rest leave them NULL and are waited for with poll() on the
+    // monotonic clock.
+    // Microseconds on the transport's clock.
+    long long (*clockUs)();
+    // Block until input arrives (if "wantInput" is set) or the clock reaches
+    // "deadlineUs" (-1 = no deadline).
+    // Returns 1 on input, 0 at the deadline, -1 if neither can ever happen.
+    int (*wait)(TransportPort *port, long long deadlineUs, int wantInput);
+} Transport;
+
+extern const Transport serialTransport;
+extern const Transport udpTransport;
+extern const Transport tcpTransport;
+extern const Transport simTransport;
+
+// Backend for a port name (see above) and, in "*address", the part of the name
+// it opens.
+const Transport *transportFor(const char *port, const char **address);
+
+// write() for descriptors: gathered writev() calls, continuing after partial
+// writes and EINTR. Returns -1 on error, otherwise the total number of bytes.
+int transportWriteAll(int fd, struct iovec *iov, int iovcnt);
+
+#endif // _TRANSPORT_H_
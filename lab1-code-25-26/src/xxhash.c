@@ -0,0 +1,136 @@
+// XXH64 hash implementation
+#include "xxhash.h"
+
+#include <string.h>
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+// Little-endian loads, whatever the host byte order
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t rotl(uint64_t v, int bits)
+{
+    return (v << bits) | (v >> (64 - bits));
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t mergeRound(uint64_t hash, uint64_t acc)
+{
+    hash ^= round64(0, acc);
+    return hash * PRIME1 + PRIME4;
+}
+
+// Consume one 32-byte stripe: 8 bytes per lane.
+static void consumeStripe(Xxh64State *state, const unsigned char *p)
+{
+    for (int lane = 0; lane < 4; lane++) {
+        state->acc[lane] = round64(state->acc[lane], read64(p + 8 * lane));
+    }
+}
+
+// -------------------- STREAMING --------------------
+
+void xxh64Init(Xxh64State *state, uint64_t seed)
+{
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->acc[0] = seed + PRIME1 + PRIME2;
+    state->acc[1] = seed + PRIME2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - PRIME1;
+}
+
+void xxh64Update(Xxh64State *state, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    state->totalSize += size;
+
+    // Complete a stripe left over from the previous call
+    if (state->blockSize > 0) {
+        size_t n = sizeof(state->block) - state->blockSize;
+        if (n > size) n = size;
+        memcpy(state->block + state->blockSize, p, n);
+        state->blockSize += n;
+        p += n;
+        size -= n;
+        if (state->blockSize < (int)sizeof(state->block)) return;
+        consumeStripe(state, state->block);
+        state->blockSize = 0;
+    }
+
+    for (; size >= sizeof(state->block); p += sizeof(state->block), size -= sizeof(state->block)) {
+        consumeStripe(state, p);
+    }
+
+    memcpy(state->block, p, size);
+    state->blockSize = size;
+}
+
+uint64_t xxh64Digest(const Xxh64State *state)
+{
+    uint64_t hash;
+    if (state->totalSize >= sizeof(state->block)) {
+        hash = rotl(state->acc[0], 1) + rotl(state->acc[1], 7) + rotl(state->acc[2], 12) + rotl(state->acc[3], 18);
+        for (int lane = 0; lane < 4; lane++) {
+            hash = mergeRound(hash, state->acc[lane]);
+        }
+    }
+    else {
+        hash = state->seed + PRIME5;
+    }
+    hash += state->totalSize;
+
+    // Fold in the bytes that did not fill a stripe
+    const unsigned char *p = state->block;
+    int size = state->blockSize;
+    for (; size >= 8; p += 8, size -= 8) {
+        hash ^= round64(0, read64(p));
+        hash = rotl(hash, 27) * PRIME1 + PRIME4;
+    }
+    if (size >= 4) {
+        hash ^= (uint64_t)read32(p) * PRIME1;
+        hash = rotl(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+        size -= 4;
+    }
+    for (; size > 0; p++, size--) {
+        hash ^= *p * PRIME5;
+        hash = rotl(hash, 11) * PRIME1;
+    }
+
+    // Avalanche
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t xxh64(const void *data, size_t size, uint64_t seed)
+{
+    Xxh64State state;
+    xxh64Init(&state, seed);
+    xxh64Update(&state, data, size);
+    return xxh64Digest(&state);
+}
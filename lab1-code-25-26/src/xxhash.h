@@ -0,0 +1,33 @@
+// XXH64 hash header.
+// A fast 64-bit non-cryptographic hash (xxHash, XXH64 variant) used to
+// identify a file's contents, e.g. to check that a transfer resumes the same
+// file it started. Data may be hashed in one call or fed in pieces.
+
+#ifndef _XXHASH_H_
+#define _XXHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+    uint64_t acc[4];         // Lane accumulators
+    uint64_t seed;
+    uint64_t totalSize;      // Bytes hashed so far
+    unsigned char block[32]; // Bytes waiting for a full 32-byte stripe
+    int blockSize;
+} Xxh64State;
+
+// Start a hash with the given seed.
+void xxh64Init(Xxh64State *state, uint64_t seed);
+
+// Add "size" bytes of "data" to the hash.
+void xxh64Update(Xxh64State *state, const void *data, size_t size);
+
+// Return the hash of everything added so far (the state may be updated further).
+uint64_t xxh64Digest(const Xxh64State *state);
+
+// Hash "size" bytes of "data" in one call.
+uint64_t xxh64(const void *data, size_t size, uint64_t seed);
+
+#endif // _XXHASH_H_